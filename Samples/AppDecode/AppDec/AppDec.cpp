@@ -12,6 +12,7 @@
 #include <iostream>
 #include <algorithm>
 #include <thread>
+#include <memory>
 #include <cuda.h>
 #include "NvDecoder/NvDecoder.h"
 #include "../Utils/NvCodecUtils.h"
@@ -21,14 +22,28 @@ simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger(
 
 
 void ConvertToPlanar(uint8_t *pHostFrame, int nWidth, int nHeight, int nBitDepth) {
+    // The converters own their scratch memory; keep them across frames of the same size
+    static std::unique_ptr<YuvConverter<uint8_t>> pConverter8;
+    static std::unique_ptr<YuvConverter<uint16_t>> pConverter16;
+    static int nConverterWidth = 0, nConverterHeight = 0;
+    if (nWidth != nConverterWidth || nHeight != nConverterHeight) {
+        pConverter8.reset();
+        pConverter16.reset();
+        nConverterWidth = nWidth;
+        nConverterHeight = nHeight;
+    }
     if (nBitDepth == 8) {
         // nv12->iyuv
-        YuvConverter<uint8_t> converter8(nWidth, nHeight);
-        converter8.UVInterleavedToPlanar(pHostFrame);
+        if (!pConverter8) {
+            pConverter8.reset(new YuvConverter<uint8_t>(nWidth, nHeight));
+        }
+        pConverter8->UVInterleavedToPlanar(pHostFrame);
     } else {
         // p016->yuv420p16
-        YuvConverter<uint16_t> converter16(nWidth, nHeight);
-        converter16.UVInterleavedToPlanar((uint16_t *)pHostFrame);
+        if (!pConverter16) {
+            pConverter16.reset(new YuvConverter<uint16_t>(nWidth, nHeight));
+        }
+        pConverter16->UVInterleavedToPlanar((uint16_t *)pHostFrame);
     }
 }
 
@@ -0,0 +1,655 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <cuda.h>
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#include "NvDecoder/NvDecoder.h"
+#include "../Utils/NvCodecUtils.h"
+#include "../Utils/FFmpegDemuxer.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+/**
+*  @brief Compressed video of one input, demuxed into memory once so that file and
+*  demuxer cost stay out of the measurement.
+*/
+struct BenchInput
+{
+    std::string strPath;
+    cudaVideoCodec eCodec;
+    int nWidth, nHeight;
+    std::vector<std::vector<uint8_t>> vPacket;
+};
+
+/**
+*  @brief One cell of the benchmark matrix.
+*/
+struct BenchConfig
+{
+    const BenchInput *pInput;
+    int nSession;
+    bool bHost;
+    bool bSingleContext;
+};
+
+/**
+*  @brief Measurements of one configuration over all of its timed trials.
+*  Latency is per frame, from submitting the packet that carries it to the frame being
+*  returned by the decoder. Memory is the peak above the level before the trials started.
+*/
+struct BenchResult
+{
+    BenchConfig config;
+    int nFramePerTrial = 0;
+    std::vector<double> vFps;
+    std::vector<double> vLatency;
+    double msCpuPerFrame = 0;
+    double mbPeakHost = 0;
+    double mbPeakDevice = 0;
+};
+
+/** CPU time of the whole process (user + system) in seconds */
+static double GetProcessCpuTime()
+{
+#ifdef _WIN32
+    FILETIME ftCreate, ftExit, ftKernel, ftUser;
+    GetProcessTimes(GetCurrentProcess(), &ftCreate, &ftExit, &ftKernel, &ftUser);
+    auto ToSec = [](const FILETIME &ft) { return (((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 1.0e7; };
+    return ToSec(ftKernel) + ToSec(ftUser);
+#else
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1.0e6;
+#endif
+}
+
+/** Resident set size of the process in bytes */
+static uint64_t GetProcessResidentMemory()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc = {};
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return pmc.WorkingSetSize;
+#else
+    long nPage = 0, nResident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp)
+    {
+        if (fscanf(fp, "%ld %ld", &nPage, &nResident) != 2)
+        {
+            nResident = 0;
+        }
+        fclose(fp);
+    }
+    return (uint64_t)nResident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/**
+*  @brief Samples host resident memory and device memory in use from a background thread
+*  and keeps the peaks. Device usage is read with cuMemGetInfo, so it covers every process
+*  on the GPU; run the benchmark on an otherwise idle GPU.
+*/
+class MemoryMonitor
+{
+public:
+    MemoryMonitor(CUcontext cuContext) : cuContext(cuContext)
+    {
+        nBaseHost = nPeakHost = GetProcessResidentMemory();
+        nBaseDevice = nPeakDevice = GetDeviceUsed();
+        th = std::thread(&MemoryMonitor::Sample, this);
+    }
+    ~MemoryMonitor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            bStop = true;
+        }
+        cv.notify_one();
+        th.join();
+    }
+    double GetPeakHostMB()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return (nPeakHost - nBaseHost) / 1048576.0;
+    }
+    double GetPeakDeviceMB()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return (nPeakDevice - nBaseDevice) / 1048576.0;
+    }
+
+private:
+    uint64_t GetDeviceUsed()
+    {
+        size_t nFree = 0, nTotal = 0;
+        cuCtxPushCurrent(cuContext);
+        cuMemGetInfo(&nFree, &nTotal);
+        cuCtxPopCurrent(NULL);
+        return nTotal - nFree;
+    }
+    void Sample()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!cv.wait_for(lock, std::chrono::milliseconds(10), [this] { return bStop; }))
+        {
+            lock.unlock();
+            uint64_t nHost = GetProcessResidentMemory(), nDevice = GetDeviceUsed();
+            lock.lock();
+            nPeakHost = (std::max)(nPeakHost, nHost);
+            nPeakDevice = (std::max)(nPeakDevice, nDevice);
+        }
+    }
+
+    CUcontext cuContext;
+    uint64_t nBaseHost, nPeakHost, nBaseDevice, nPeakDevice;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool bStop = false;
+    std::thread th;
+};
+
+/**
+*  @brief Feeds the packets of the input to one decoder and records the latency of every frame.
+*  Packets carry their index as timestamp, which the decoder hands back with the frame.
+*/
+void DecProc(NvDecoder *pDec, const BenchInput *pInput, int nMaxFrame, int *pnFrame, std::vector<double> *pvLatency,
+    std::exception_ptr &ex)
+{
+    try
+    {
+        typedef std::chrono::high_resolution_clock Clock;
+        std::vector<Clock::time_point> vtSubmit(pInput->vPacket.size() + 1);
+        int nFrame = 0, nFrameReturned = 0;
+        uint8_t **ppFrame = NULL;
+        int64_t *pTimestamp = NULL;
+        for (size_t i = 0; i <= pInput->vPacket.size(); i++)
+        {
+            // The last call with no data flushes the decoder
+            bool bEnd = i == pInput->vPacket.size() || (nMaxFrame && nFrame >= nMaxFrame);
+            vtSubmit[i] = Clock::now();
+            pDec->Decode(bEnd ? NULL : pInput->vPacket[i].data(), bEnd ? 0 : (int)pInput->vPacket[i].size(),
+                &ppFrame, &nFrameReturned, 0, &pTimestamp, i);
+            Clock::time_point t = Clock::now();
+            for (int j = 0; j < nFrameReturned; j++)
+            {
+                pvLatency->push_back(std::chrono::duration<double, std::milli>(t - vtSubmit[pTimestamp[j]]).count());
+            }
+            nFrame += nFrameReturned;
+            if (bEnd)
+            {
+                break;
+            }
+        }
+        *pnFrame = nFrame;
+    }
+    catch (std::exception&)
+    {
+        ex = std::current_exception();
+    }
+}
+
+/**
+*  @brief Runs the configuration nWarmup times without measuring, then nTrial times with measuring.
+*  Contexts are created once per configuration; decoders are created anew for every trial,
+*  outside the timed region.
+*/
+BenchResult RunConfig(const BenchConfig &config, CUdevice cuDevice, CUcontext cuMonitorContext, int nWarmup, int nTrial,
+    int nMaxFrame)
+{
+    BenchResult result;
+    result.config = config;
+    const BenchInput *pInput = config.pInput;
+    std::vector<CUcontext> vContext(config.bSingleContext ? 1 : config.nSession);
+    for (CUcontext &cuContext : vContext)
+    {
+        ck(cuCtxCreate(&cuContext, 0, cuDevice));
+        ck(cuCtxPopCurrent(NULL));
+    }
+    std::mutex mtxContext;
+
+    double secCpu = 0;
+    int nTotalFrame = 0;
+    std::unique_ptr<MemoryMonitor> pMonitor;
+    for (int iRun = 0; iRun < nWarmup + nTrial; iRun++)
+    {
+        bool bTimed = iRun >= nWarmup;
+        if (bTimed && !pMonitor)
+        {
+            // Started after the warm-up, so one-time driver allocations are not counted
+            pMonitor.reset(new MemoryMonitor(cuMonitorContext));
+        }
+        std::vector<std::unique_ptr<NvDecoder>> vDec;
+        for (int i = 0; i < config.nSession; i++)
+        {
+            vDec.emplace_back(new NvDecoder(vContext[config.bSingleContext ? 0 : i], pInput->nWidth, pInput->nHeight,
+                !config.bHost, pInput->eCodec, config.bSingleContext ? &mtxContext : NULL));
+        }
+        std::vector<int> vnFrame(config.nSession, 0);
+        std::vector<std::vector<double>> vvLatency(config.nSession);
+        std::vector<std::exception_ptr> vExceptionPtrs(config.nSession);
+        std::vector<NvThread> vThread;
+
+        double secCpuBegin = GetProcessCpuTime();
+        StopWatch watch;
+        watch.Start();
+        for (int i = 0; i < config.nSession; i++)
+        {
+            vThread.push_back(NvThread(std::thread(DecProc, vDec[i].get(), pInput, nMaxFrame, &vnFrame[i], &vvLatency[i],
+                std::ref(vExceptionPtrs[i]))));
+        }
+        for (NvThread &th : vThread)
+        {
+            th.join();
+        }
+        double sec = watch.Stop();
+        double secCpuRun = GetProcessCpuTime() - secCpuBegin;
+        for (std::exception_ptr &ex : vExceptionPtrs)
+        {
+            if (ex)
+            {
+                std::rethrow_exception(ex);
+            }
+        }
+
+        int nFrame = 0;
+        for (int n : vnFrame)
+        {
+            nFrame += n;
+        }
+        if (!bTimed)
+        {
+            continue;
+        }
+        result.nFramePerTrial = nFrame;
+        result.vFps.push_back(nFrame / sec);
+        for (std::vector<double> &v : vvLatency)
+        {
+            result.vLatency.insert(result.vLatency.end(), v.begin(), v.end());
+        }
+        secCpu += secCpuRun;
+        nTotalFrame += nFrame;
+    }
+    if (pMonitor)
+    {
+        result.mbPeakHost = pMonitor->GetPeakHostMB();
+        result.mbPeakDevice = pMonitor->GetPeakDeviceMB();
+    }
+    result.msCpuPerFrame = nTotalFrame ? secCpu * 1000.0 / nTotalFrame : 0;
+    std::sort(result.vLatency.begin(), result.vLatency.end());
+    for (CUcontext cuContext : vContext)
+    {
+        ck(cuCtxDestroy(cuContext));
+    }
+    return result;
+}
+
+static double Percentile(const std::vector<double> &vSorted, double p)
+{
+    return vSorted.empty() ? 0 : vSorted[(std::min)(vSorted.size() - 1, (size_t)(p * vSorted.size()))];
+}
+
+static double Median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    return Percentile(v, 0.5);
+}
+
+static std::string EscapeJson(const std::string &str)
+{
+    std::string s;
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            s += '\\';
+        }
+        s += (unsigned char)c < 0x20 ? ' ' : c;
+    }
+    return s;
+}
+
+void WriteJson(const char *szPath, const std::vector<BenchResult> &vResult, const char *szDeviceName, int nDriverVersion,
+    int nWarmup, int nTrial)
+{
+    std::ofstream fp(szPath);
+    if (!fp)
+    {
+        std::ostringstream err;
+        err << "Unable to open output file: " << szPath << std::endl;
+        throw std::invalid_argument(err.str());
+    }
+    fp << std::fixed << std::setprecision(3);
+    fp << "{\n  \"gpu\": \"" << EscapeJson(szDeviceName) << "\",\n"
+        << "  \"driver_version\": " << nDriverVersion << ",\n"
+        << "  \"time\": " << (long long)time(NULL) << ",\n"
+        << "  \"warmup\": " << nWarmup << ",\n"
+        << "  \"trial\": " << nTrial << ",\n"
+        << "  \"results\": [";
+    for (size_t i = 0; i < vResult.size(); i++)
+    {
+        const BenchResult &r = vResult[i];
+        fp << (i ? "," : "") << "\n    {\"input\": \"" << EscapeJson(r.config.pInput->strPath) << "\""
+            << ", \"width\": " << r.config.pInput->nWidth << ", \"height\": " << r.config.pInput->nHeight
+            << ", \"sessions\": " << r.config.nSession
+            << ", \"output\": \"" << (r.config.bHost ? "host" : "device") << "\""
+            << ", \"context\": \"" << (r.config.bSingleContext ? "single" : "multi") << "\""
+            << ", \"frames_per_trial\": " << r.nFramePerTrial
+            << ", \"fps\": [";
+        for (size_t j = 0; j < r.vFps.size(); j++)
+        {
+            fp << (j ? ", " : "") << r.vFps[j];
+        }
+        fp << "], \"fps_median\": " << Median(r.vFps)
+            << ", \"latency_ms\": {\"p50\": " << Percentile(r.vLatency, 0.5) << ", \"p90\": " << Percentile(r.vLatency, 0.9)
+            << ", \"p99\": " << Percentile(r.vLatency, 0.99) << ", \"max\": " << (r.vLatency.empty() ? 0 : r.vLatency.back()) << "}"
+            << ", \"cpu_ms_per_frame\": " << r.msCpuPerFrame
+            << ", \"peak_host_mb\": " << r.mbPeakHost
+            << ", \"peak_device_mb\": " << r.mbPeakDevice << "}";
+    }
+    fp << "\n  ]\n}\n";
+}
+
+void WriteCsv(const char *szPath, const std::vector<BenchResult> &vResult, const char *szDeviceName, int nDriverVersion)
+{
+    std::ofstream fp(szPath);
+    if (!fp)
+    {
+        std::ostringstream err;
+        err << "Unable to open output file: " << szPath << std::endl;
+        throw std::invalid_argument(err.str());
+    }
+    fp << std::fixed << std::setprecision(3);
+    fp << "gpu,driver_version,input,width,height,sessions,output,context,frames_per_trial,fps_median,fps_min,fps_max,"
+        "latency_p50_ms,latency_p90_ms,latency_p99_ms,latency_max_ms,cpu_ms_per_frame,peak_host_mb,peak_device_mb\n";
+    for (const BenchResult &r : vResult)
+    {
+        fp << "\"" << szDeviceName << "\"," << nDriverVersion << ",\"" << r.config.pInput->strPath << "\","
+            << r.config.pInput->nWidth << "," << r.config.pInput->nHeight << ","
+            << r.config.nSession << "," << (r.config.bHost ? "host" : "device") << ","
+            << (r.config.bSingleContext ? "single" : "multi") << "," << r.nFramePerTrial << ","
+            << Median(r.vFps) << "," << *std::min_element(r.vFps.begin(), r.vFps.end()) << ","
+            << *std::max_element(r.vFps.begin(), r.vFps.end()) << ","
+            << Percentile(r.vLatency, 0.5) << "," << Percentile(r.vLatency, 0.9) << ","
+            << Percentile(r.vLatency, 0.99) << "," << (r.vLatency.empty() ? 0 : r.vLatency.back()) << ","
+            << r.msCpuPerFrame << "," << r.mbPeakHost << "," << r.mbPeakDevice << "\n";
+    }
+}
+
+void ShowHelpAndExit(const char *szBadOption = NULL)
+{
+    std::ostringstream oss;
+    bool bThrowError = false;
+    if (szBadOption)
+    {
+        bThrowError = true;
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
+    }
+    oss << "Options:" << std::endl
+        << "-i           Input file path; repeat to benchmark several inputs" << std::endl
+        << "-gpu         Ordinal of GPU to use" << std::endl
+        << "-session     Comma-separated numbers of concurrent decode sessions (default is 1)" << std::endl
+        << "-output      Frame destination: device, host or both (default is device)" << std::endl
+        << "-context     Context mode: multi (one context per session), single or both (default is multi)" << std::endl
+        << "-warmup      Number of untimed runs per configuration (default is 1)" << std::endl
+        << "-trial       Number of timed runs per configuration (default is 3)" << std::endl
+        << "-frame       Maximum number of frames per session and run (default is the whole input)" << std::endl
+        << "-json        Write the results to this JSON file" << std::endl
+        << "-csv         Write the results to this CSV file" << std::endl
+        ;
+    if (bThrowError)
+    {
+        throw std::invalid_argument(oss.str());
+    }
+    else
+    {
+        std::cout << oss.str();
+        exit(0);
+    }
+}
+
+/** Parses "device", "host" or "both" style values into the list of flags to benchmark */
+static bool ParseChoice(const char *szValue, const char *szFalse, const char *szTrue, std::vector<bool> &vChoice)
+{
+    vChoice.clear();
+    if (!_stricmp(szValue, szFalse) || !_stricmp(szValue, "both"))
+    {
+        vChoice.push_back(false);
+    }
+    if (!_stricmp(szValue, szTrue) || !_stricmp(szValue, "both"))
+    {
+        vChoice.push_back(true);
+    }
+    return !vChoice.empty();
+}
+
+void ParseCommandLine(int argc, char *argv[], std::vector<std::string> &vstrInput, int &iGpu, std::vector<int> &vnSession,
+    std::vector<bool> &vbHost, std::vector<bool> &vbSingleContext, int &nWarmup, int &nTrial, int &nMaxFrame,
+    char *szJsonFilePath, char *szCsvFilePath)
+{
+    for (int i = 1; i < argc; i++) {
+        if (!_stricmp(argv[i], "-h")) {
+            ShowHelpAndExit();
+        }
+        if (!_stricmp(argv[i], "-i")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-i");
+            }
+            vstrInput.push_back(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-gpu")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-gpu");
+            }
+            iGpu = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-session")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-session");
+            }
+            vnSession.clear();
+            std::istringstream iss(argv[i]);
+            std::string strToken;
+            while (std::getline(iss, strToken, ',')) {
+                int n = atoi(strToken.c_str());
+                if (n <= 0) {
+                    ShowHelpAndExit("-session");
+                }
+                vnSession.push_back(n);
+            }
+            if (vnSession.empty()) {
+                ShowHelpAndExit("-session");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-output")) {
+            if (++i == argc || !ParseChoice(argv[i], "device", "host", vbHost)) {
+                ShowHelpAndExit("-output");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-context")) {
+            if (++i == argc || !ParseChoice(argv[i], "multi", "single", vbSingleContext)) {
+                ShowHelpAndExit("-context");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-warmup")) {
+            if (++i == argc || (nWarmup = atoi(argv[i])) < 0) {
+                ShowHelpAndExit("-warmup");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-trial")) {
+            if (++i == argc || (nTrial = atoi(argv[i])) <= 0) {
+                ShowHelpAndExit("-trial");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-frame")) {
+            if (++i == argc || (nMaxFrame = atoi(argv[i])) <= 0) {
+                ShowHelpAndExit("-frame");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-json")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-json");
+            }
+            sprintf(szJsonFilePath, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-csv")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-csv");
+            }
+            sprintf(szCsvFilePath, "%s", argv[i]);
+            continue;
+        }
+        ShowHelpAndExit(argv[i]);
+    }
+    if (vstrInput.empty()) {
+        ShowHelpAndExit("-i");
+    }
+}
+
+/**
+*  This sample application benchmarks decoding over a matrix of inputs, numbers of
+*  concurrent sessions, frame destinations (device or host memory) and context modes
+*  (a context per session or one shared context). Every configuration gets warm-up runs
+*  and several timed trials; the application reports throughput, per-frame latency
+*  percentiles, CPU time per frame and peak host/device memory, and can write the
+*  results as JSON and CSV for tracking across driver and SDK versions.
+*/
+int main(int argc, char **argv)
+{
+    std::vector<std::string> vstrInput;
+    int iGpu = 0;
+    std::vector<int> vnSession = {1};
+    std::vector<bool> vbHost = {false}, vbSingleContext = {false};
+    int nWarmup = 1, nTrial = 3, nMaxFrame = 0;
+    char szJsonFilePath[256] = "", szCsvFilePath[256] = "";
+    try
+    {
+        ParseCommandLine(argc, argv, vstrInput, iGpu, vnSession, vbHost, vbSingleContext, nWarmup, nTrial, nMaxFrame,
+            szJsonFilePath, szCsvFilePath);
+
+        std::vector<BenchInput> vInput(vstrInput.size());
+        for (size_t i = 0; i < vstrInput.size(); i++)
+        {
+            CheckInputFile(vstrInput[i].c_str());
+            FFmpegDemuxer demuxer(vstrInput[i].c_str());
+            BenchInput &input = vInput[i];
+            input.strPath = vstrInput[i];
+            input.eCodec = FFmpeg2NvCodecId(demuxer.GetVideoCodec());
+            input.nWidth = demuxer.GetWidth();
+            input.nHeight = demuxer.GetHeight();
+            uint8_t *pVideo = NULL;
+            int nVideoBytes = 0;
+            while (demuxer.Demux(&pVideo, &nVideoBytes) && nVideoBytes)
+            {
+                input.vPacket.push_back(std::vector<uint8_t>(pVideo, pVideo + nVideoBytes));
+            }
+        }
+
+        ck(cuInit(0));
+        int nGpu = 0;
+        ck(cuDeviceGetCount(&nGpu));
+        if (iGpu < 0 || iGpu >= nGpu) {
+            std::cout << "GPU ordinal out of range. Should be within [" << 0 << ", " << nGpu - 1 << "]" << std::endl;
+            return 1;
+        }
+        CUdevice cuDevice = 0;
+        ck(cuDeviceGet(&cuDevice, iGpu));
+        char szDeviceName[80];
+        ck(cuDeviceGetName(szDeviceName, sizeof(szDeviceName), cuDevice));
+        int nDriverVersion = 0;
+        ck(cuDriverGetVersion(&nDriverVersion));
+        std::cout << "GPU in use: " << szDeviceName << ", CUDA driver version " << nDriverVersion << std::endl;
+        CUcontext cuMonitorContext = NULL;
+        ck(cuCtxCreate(&cuMonitorContext, 0, cuDevice));
+        ck(cuCtxPopCurrent(NULL));
+
+        std::vector<BenchResult> vResult;
+        std::cout << std::fixed << std::setprecision(2)
+            << std::left << std::setw(32) << "input" << std::right
+            << std::setw(5) << "sess" << std::setw(8) << "output" << std::setw(8) << "context"
+            << std::setw(10) << "fps" << std::setw(9) << "p50 ms" << std::setw(9) << "p99 ms"
+            << std::setw(10) << "cpu ms/f" << std::setw(10) << "host MB" << std::setw(10) << "dev MB" << std::endl;
+        for (const BenchInput &input : vInput)
+        {
+            for (int nSession : vnSession)
+            {
+                for (bool bHost : vbHost)
+                {
+                    for (bool bSingleContext : vbSingleContext)
+                    {
+                        if (bSingleContext && nSession == 1 && vbSingleContext.size() > 1)
+                        {
+                            // Same as multi with one session
+                            continue;
+                        }
+                        BenchConfig config = {&input, nSession, bHost, bSingleContext};
+                        vResult.push_back(RunConfig(config, cuDevice, cuMonitorContext, nWarmup, nTrial, nMaxFrame));
+                        const BenchResult &r = vResult.back();
+                        std::string strName = input.strPath.size() > 31 ? "..." + input.strPath.substr(input.strPath.size() - 28) : input.strPath;
+                        std::cout << std::left << std::setw(32) << strName << std::right
+                            << std::setw(5) << nSession << std::setw(8) << (bHost ? "host" : "device")
+                            << std::setw(8) << (bSingleContext ? "single" : "multi")
+                            << std::setw(10) << Median(r.vFps) << std::setw(9) << Percentile(r.vLatency, 0.5)
+                            << std::setw(9) << Percentile(r.vLatency, 0.99) << std::setw(10) << r.msCpuPerFrame
+                            << std::setw(10) << r.mbPeakHost << std::setw(10) << r.mbPeakDevice << std::endl;
+                    }
+                }
+            }
+        }
+        ck(cuCtxDestroy(cuMonitorContext));
+
+        if (*szJsonFilePath)
+        {
+            WriteJson(szJsonFilePath, vResult, szDeviceName, nDriverVersion, nWarmup, nTrial);
+            std::cout << "Results saved in file " << szJsonFilePath << std::endl;
+        }
+        if (*szCsvFilePath)
+        {
+            WriteCsv(szCsvFilePath, vResult, szDeviceName, nDriverVersion);
+            std::cout << "Results saved in file " << szCsvFilePath << std::endl;
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << ex.what();
+        exit(1);
+    }
+    return 0;
+}
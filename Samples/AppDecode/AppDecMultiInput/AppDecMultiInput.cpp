@@ -19,75 +19,172 @@
 #include "NvDecoder/NvDecoder.h"
 #include "../Utils/NvCodecUtils.h"
 #include "../Utils/FFmpegDemuxer.h"
-#include "../Common/AppDecUtils.h"
+#include "../Utils/NvFrameSync.h"
 
 simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
 
+using FramePtr = std::shared_ptr<uint8_t>;
+
 void LaunchRipple(cudaStream_t stream, uint8_t *dpImage, int nWidth, int nHeight, int xCenter, int yCenter, int iTime);
 void LaunchOverlayRipple(cudaStream_t stream, uint8_t *dpNv12, uint8_t *dpRipple, int nWidth, int nHeight);
-void LaunchMerge(cudaStream_t stream, uint8_t *dpNv12Merged, uint8_t **pdpNv12, int nImage, int nWidth, int nHeight);
+void LaunchTile(cudaStream_t stream, uint8_t *dpNv12Wall, uint8_t **dadpNv12, int nImage, int nCol, int nRow, int nWidth, int nHeight);
 
-void DecProc(NvDecoder *pDec, const char *szInFilePath, int nWidth, int nHeight, uint8_t **apFrameBuffer,
-    int nFrameBuffer, int *piEnd, int *piHead, bool *pbStop, cudaStream_t stream, 
-    int xCenter, int yCenter, std::exception_ptr &ex) 
+/**
+*  @brief Decodes one input and hands every frame to the synchronizer as source iSource. With
+*  nDrop > 0, one frame in nDrop is dropped (at a different position for each source) to show how
+*  the synchronizer fills the gap.
+*/
+void DecProc(NvPipeline::Stage &stage, NvDecoder *pDec, const char *szInFilePath, int nWidth, int nHeight,
+    NvFrameSync<FramePtr> *pSync, int iSource, int nDrop, cudaStream_t stream, int xCenter, int yCenter)
 {
-    try
+    FFmpegDemuxer demuxer(szInFilePath);
+    ck(cuCtxSetCurrent(pDec->GetContext()));
+    uint8_t *dpRippleImage;
+    ck(cudaMalloc(&dpRippleImage, nWidth * nHeight));
+    int iTime = 0, iFrame = 0;
+    // Render a ripple image on dpRippleImage
+    LaunchRipple(stream, dpRippleImage, nWidth, nHeight, xCenter, yCenter, iTime++);
+    int nVideoBytes = 0, nFrameReturned = 0;
+    uint8_t *pVideo = NULL, **ppFrame;
+
+    do
     {
-        FFmpegDemuxer demuxer(szInFilePath);
-        ck(cuCtxSetCurrent(pDec->GetContext()));
-        uint8_t *dpRippleImage;
-        ck(cudaMalloc(&dpRippleImage, nWidth * nHeight));
-        int iTime = 0;
-        // Render a ripple image on dpRippleImage
-        LaunchRipple(stream, dpRippleImage, nWidth, nHeight, xCenter, yCenter, iTime++);
-        int nVideoBytes = 0, nFrameReturned = 0, nFrame = 0;
-        uint8_t *pVideo = NULL, **ppFrame;
-
-        do
-        {
-            demuxer.Demux(&pVideo, &nVideoBytes);
-            pDec->DecodeLockFrame(pVideo, nVideoBytes, &ppFrame, &nFrameReturned);
-
-            for (int i = 0; i < nFrameReturned; i++) {
-                // For each decoded frame
-                while (*piHead == *piEnd) {
-                    // Queue is full
-                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                }
-                // Frame buffer is locked, so no data copy is needed here
-                apFrameBuffer[*piHead % nFrameBuffer] = ppFrame[i];
-                // Overlay dpRippleImage onto the frame buffer
-                LaunchOverlayRipple(stream, apFrameBuffer[*piHead % nFrameBuffer], dpRippleImage, nWidth, nHeight);
-                // Make sure CUDA kernel is finished before marking the current position as ready
-                ck(cudaStreamSynchronize(stream));
-                // Mark as ready
-                ++*piHead;
-                LaunchRipple(stream, dpRippleImage, nWidth, nHeight, xCenter, yCenter, iTime++);
+        demuxer.Demux(&pVideo, &nVideoBytes);
+        pDec->DecodeLockFrame(pVideo, nVideoBytes, &ppFrame, &nFrameReturned);
+
+        for (int i = 0; i < nFrameReturned; i++) {
+            if (nDrop && iFrame++ % nDrop == iSource % nDrop)
+            {
+                pDec->UnlockFrame(&ppFrame[i], 1);
+                pSync->Skip(iSource);
+                continue;
+            }
+            // For each decoded frame
+            // Frame buffer is locked, so no data copy is needed here
+            // Overlay dpRippleImage onto the frame buffer
+            LaunchOverlayRipple(stream, ppFrame[i], dpRippleImage, nWidth, nHeight);
+            // Make sure CUDA kernel is finished before handing the frame to the compositor
+            ck(cudaStreamSynchronize(stream));
+            // The frame is unlocked once the compositor is done with it (or the synchronizer drops it)
+            FramePtr pFrame(ppFrame[i], [pDec](uint8_t *pFrame) { pDec->UnlockFrame(&pFrame, 1); });
+            // Blocks while the queue of this source is full; fails once the compositor has stopped
+            if (!pSync->Push(iSource, std::move(pFrame)))
+            {
+                pDec->UnlockFrame(&ppFrame[i + 1], nFrameReturned - i - 1);
+                nVideoBytes = 0;
+                break;
             }
-        } while (nVideoBytes);
+            stage.AddItem();
+            LaunchRipple(stream, dpRippleImage, nWidth, nHeight, xCenter, yCenter, iTime++);
+        }
+    } while (nVideoBytes);
+
+    ck(cudaFree(dpRippleImage));
+    pSync->End(iSource);
+}
 
-        ck(cudaFree(dpRippleImage));
-        *pbStop = true;
+void ShowHelpAndExit(const char *szBadOption = NULL)
+{
+    std::ostringstream oss;
+    if (szBadOption)
+    {
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
     }
-    catch (std::exception&)
+    oss << "Options:" << std::endl
+        << "-i           Input file path" << std::endl
+        << "-o           Output file path" << std::endl
+        << "-gpu         Ordinal of GPU to use" << std::endl
+        << "-n           Number of decoders (tiles of the wall), 1 to 64; default is 4" << std::endl
+        << "-queue       Frames queued per decoder; default is 4" << std::endl
+        << "-drop        Drop one frame in N per decoder, to exercise the synchronizer" << std::endl
+        << "-wait        Milliseconds to wait for a stalled decoder before composing without it; default is 0 (wait)" << std::endl
+        << "-stopfirst   Stop at the first decoder that ends rather than at the last one" << std::endl
+        ;
+    if (szBadOption)
     {
-        ex = std::current_exception();
+        throw std::invalid_argument(oss.str());
+    }
+    std::cout << oss.str();
+    exit(0);
+}
+
+void ParseCommandLine(int argc, char *argv[], char *szInputFileName, char *szOutputFileName, int &iGpu,
+    int &nDecoder, int &nDrop, NvFrameSyncParams &syncParams)
+{
+    for (int i = 1; i < argc; i++) {
+        if (!_stricmp(argv[i], "-h")) {
+            ShowHelpAndExit();
+        }
+        if (!_stricmp(argv[i], "-i")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-i");
+            }
+            sprintf(szInputFileName, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-o")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-o");
+            }
+            sprintf(szOutputFileName, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-gpu")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-gpu");
+            }
+            iGpu = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-n")) {
+            if (++i == argc || (nDecoder = atoi(argv[i])) < 1 || nDecoder > 64) {
+                ShowHelpAndExit("-n");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-queue")) {
+            if (++i == argc || (syncParams.nQueueSize = atoi(argv[i])) < 1) {
+                ShowHelpAndExit("-queue");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-drop")) {
+            if (++i == argc || (nDrop = atoi(argv[i])) < 0) {
+                ShowHelpAndExit("-drop");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-wait")) {
+            if (++i == argc || (syncParams.msMaxWait = atoi(argv[i])) < 0) {
+                ShowHelpAndExit("-wait");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-stopfirst")) {
+            syncParams.bStopAtFirstEnd = true;
+            continue;
+        }
+        ShowHelpAndExit(argv[i]);
     }
 }
 
 /**
-*  This sample application demonstrates shows how to decode multiple raw video files and
-*  post-process them with CUDA kernels on different CUDA streams.
+*  This sample application demonstrates shows how to decode multiple raw video files,
+*  post-process them with CUDA kernels on different CUDA streams and compose them into a
+*  video wall. NvFrameSync aligns the decoders by frame index; a decoder that drops a frame or
+*  ends early shows its last frame in its tile.
 */
 
 int main(int argc, char *argv[])
 {
     char szInFilePath[256] = "", szOutFilePath[256] = "out.nv12";
     int iGpu = 0;
-    std::vector<std::exception_ptr> vExceptionPtrs;
+    // Number of decoders
+    int n = 4, nDrop = 0;
+    NvFrameSyncParams syncParams;
     try
     {
-        ParseCommandLine(argc, argv, szInFilePath, szOutFilePath, iGpu);
+        ParseCommandLine(argc, argv, szInFilePath, szOutFilePath, iGpu, n, nDrop, syncParams);
         CheckInputFile(szInFilePath);
 
         ck(cuInit(0));
@@ -110,35 +207,40 @@ int main(int argc, char *argv[])
 
         FFmpegDemuxer demuxer(szInFilePath);
         int nWidth = demuxer.GetWidth(), nHeight = demuxer.GetHeight(), nByte = nWidth * nHeight * 3 / 2;
+        // Tiles of the wall, laid out in a near-square grid
+        int nCol = 1;
+        while (nCol * nCol < n)
+        {
+            nCol++;
+        }
+        int nRow = (n + nCol - 1) / nCol;
+        if (nWidth / nCol < 2 || nHeight / nRow < 2)
+        {
+            // Tile() needs tiles of at least 2x2 luma samples, for a chroma pair
+            std::ostringstream err;
+            err << "Too many decoders for a " << nWidth << "x" << nHeight << " input: tiles of a " << nCol << "x" << nRow
+                << " grid would be smaller than 2x2" << std::endl;
+            throw std::invalid_argument(err.str());
+        }
 
-        // Number of decoders
-        const int n = 4;
-        // Every decoder has its own round queue
-        uint8_t *aapFrameBuffer[n][8];
-        // Queue capacity
-        const int nFrameBuffer = sizeof(aapFrameBuffer[0]) / sizeof(aapFrameBuffer[0][0]);
-        int iEnd = nFrameBuffer;
-        bool abStop[n] = {};
-        int aiHead[n] = {};
-        std::vector <NvThread> vThreads;
         std::vector <std::unique_ptr<NvDecoder>> vDecoders;
-        // Coordinate of the ripple center for each decoder
-        int axCenter[] = { nWidth / 4, nWidth / 4 * 3, nWidth / 4, nWidth / 4 * 3 };
-        int ayCenter[] = { nHeight / 4, nHeight / 4, nHeight / 4 * 3, nHeight / 4 * 3 };
-        cudaStream_t aStream[n];
-        vExceptionPtrs.resize(n);
+        std::vector<cudaStream_t> vStream(n);
         for (int i = 0; i < n; i++)
         {
-            ck(cudaStreamCreate(&aStream[i]));
+            ck(cudaStreamCreate(&vStream[i]));
             std::unique_ptr<NvDecoder> dec(new NvDecoder(cuContext, demuxer.GetWidth(), demuxer.GetHeight(), true, FFmpeg2NvCodecId(demuxer.GetVideoCodec())));
             vDecoders.push_back(std::move(dec));
-            vThreads.push_back(NvThread(std::thread(DecProc, vDecoders[i].get(), szInFilePath, nWidth, nHeight, aapFrameBuffer[i],
-                nFrameBuffer, &iEnd, aiHead + i, abStop + i, aStream[i], axCenter[i], ayCenter[i], std::ref(vExceptionPtrs[i]))));
         }
+        // Declared after the decoders, so that no frame outlives its decoder
+        NvPipeline pipeline;
+        std::shared_ptr<NvFrameSync<FramePtr>> pSync(new NvFrameSync<FramePtr>(n, syncParams));
+        pipeline.Attach(pSync);
 
         std::unique_ptr<uint8_t[]> pImage(new uint8_t[nByte]);
         uint8_t* dpImage = nullptr;
         ck(cudaMalloc(&dpImage, nByte));
+        uint8_t **dadpFrame = nullptr;
+        ck(cudaMalloc(&dadpFrame, sizeof(uint8_t *) * n));
         std::ofstream fpOut(szOutFilePath, std::ios::out | std::ios::binary);
         if (!fpOut)
         {
@@ -147,56 +249,68 @@ int main(int argc, char *argv[])
             throw std::invalid_argument(err.str());
         }
 
+        for (int i = 0; i < n; i++)
+        {
+            NvDecoder *pDec = vDecoders[i].get();
+            NvFrameSync<FramePtr> *pSyncRaw = pSync.get();
+            cudaStream_t stream = vStream[i];
+            // Coordinate of the ripple center: the center of the decoder's own tile
+            int xCenter = nWidth * (2 * (i % nCol) + 1) / (2 * nCol), yCenter = nHeight * (2 * (i / nCol) + 1) / (2 * nRow);
+            pipeline.AddStage("Decode #" + std::to_string(i), [=](NvPipeline::Stage &stage)
+            {
+                DecProc(stage, pDec, szInFilePath, nWidth, nHeight, pSyncRaw, i, nDrop, stream, xCenter, yCenter);
+            });
+        }
+
         int nFrame = 0;
-        for (int i = 0;; i++)
+        pipeline.AddStage("Compose", [&](NvPipeline::Stage &stage)
         {
-            // For each decoded frame #i
-            // iHead is used for ensuring all decoders have made progress
-            int iHead = INT_MAX;
-            for (int j = 0; j < n; j++)
+            ck(cuCtxSetCurrent(cuContext));
+            NvFrameSet<FramePtr> set;
+            std::vector<uint8_t *> vdpFrame(n);
+            // Each set holds one frame of every decoder; a missing frame leaves its tile black
+            while (pSync->Pop(set))
             {
-                while (!abStop[j] && aiHead[j] <= i)
+                std::cout << "Compose frames at #" << set.nKey << "\r";
+                for (int j = 0; j < n; j++)
                 {
-                    // Decoder #j hasn't decoded frame #i
-                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    vdpFrame[j] = set.vFrame[j].get();
                 }
-                iHead = (std::min)(iHead, aiHead[j]);
-            }
-            if (iHead <= i)
-            {
-                // Some decoder stops
-                nFrame = i;
-                break;
-            }
-
-            std::cout << "Merge frames at #" << i << "\r";
-            uint8_t *apNv12[] = { aapFrameBuffer[0][i % nFrameBuffer], aapFrameBuffer[1][i % nFrameBuffer], aapFrameBuffer[2][i % nFrameBuffer], aapFrameBuffer[3][i % nFrameBuffer] };
-            // Merge all frames into dpImage
-            LaunchMerge(0, dpImage, apNv12, n, nWidth, nHeight);
-            ck(cudaMemcpy(pImage.get(), dpImage, nByte, cudaMemcpyDeviceToHost));
-            fpOut.write(reinterpret_cast<char*>(pImage.get()), nByte);
-
-            for (int j = 0; j < n; j++)
-            {
-                vDecoders[j]->UnlockFrame(&aapFrameBuffer[j][i % nFrameBuffer], 1);
+                ck(cudaMemcpy(dadpFrame, vdpFrame.data(), sizeof(uint8_t *) * n, cudaMemcpyHostToDevice));
+                LaunchTile(0, dpImage, dadpFrame, n, nCol, nRow, nWidth, nHeight);
+                ck(cudaMemcpy(pImage.get(), dpImage, nByte, cudaMemcpyDeviceToHost));
+                fpOut.write(reinterpret_cast<char*>(pImage.get()), nByte);
+                stage.AddItem();
+                nFrame++;
             }
-            iEnd++;
-        }
+        });
+        pipeline.Wait();
         fpOut.close();
+        ck(cudaFree(dadpFrame));
         ck(cudaFree(dpImage));
-
         for (int i = 0; i < n; i++)
         {
-            if (vExceptionPtrs[i])
-            {
-                std::rethrow_exception(vExceptionPtrs[i]);
-            }
+            ck(cudaStreamDestroy(vStream[i]));
+        }
+        std::cout << std::endl;
+        pipeline.PrintMetrics(std::cout);
+
+        uint64_t nRepeated = 0, nMissing = 0, nDropped = 0;
+        int nMaxDepth = 0;
+        for (const NvFrameSync<FramePtr>::SourceStats &stats : pSync->GetStats())
+        {
+            nRepeated += stats.nRepeated;
+            nMissing += stats.nMissing;
+            nDropped += stats.nDropped;
+            nMaxDepth = (std::max)(nMaxDepth, stats.nMaxDepth);
         }
+        std::cout << "Frame sets: " << pSync->GetSetCount() << " of " << n << " (" << nCol << "x" << nRow << " wall); tiles repeated: " << nRepeated
+            << ", missing: " << nMissing << ", late frames dropped: " << nDropped << ", deepest queue: " << nMaxDepth << std::endl;
 
         ck(cudaProfilerStop());
         if (nFrame)
         {
-            std::cout << "Merged video saved in " << szOutFilePath << ". A total of " << nFrame << " frames were decoded." << std::endl;
+            std::cout << "Merged video saved in " << szOutFilePath << ". A total of " << nFrame << " frame sets were composed." << std::endl;
             return 0;
         }
         else
@@ -56,32 +56,30 @@ void LaunchOverlayRipple(cudaStream_t stream, uint8_t *dpNv12, uint8_t *dpRipple
     OverlayRipple<<<dim3((nWidth + 15) / 16, (nHeight + 15) / 16), dim3(16, 16), 0, stream>>>(dpNv12, dpRipple, nWidth, nHeight);
 }
 
-static __global__ void Merge(uint8_t *pNv12Merged, uint8_t **apNv12, int nImage, int nWidth, int nHeight) {
+static __global__ void Tile(uint8_t *pNv12Wall, uint8_t **apNv12, int nImage, int nCol, int nRow, int nWidth, int nHeight) {
     int ix = blockIdx.x * blockDim.x + threadIdx.x,
         iy = blockIdx.y * blockDim.y + threadIdx.y;
     if (ix >= nWidth / 2 || iy >= nHeight / 2) {
         return;
     }
-    uint2 y01 = {}, y23 = {}, uv = {};
-    for (int i = 0; i < nImage; i++) {
-        uchar2 c2;
-        c2 = *(uchar2 *)(apNv12[i] + nWidth * iy * 2 + ix * 2);
-        y01.x += c2.x; y01.y += c2.y;
-        c2 = *(uchar2 *)(apNv12[i] + nWidth * (iy * 2 + 1) + ix * 2);
-        y23.x += c2.x; y23.y += c2.y;
-        c2 = *(uchar2 *)(apNv12[i] + nWidth * (nHeight + iy) + ix * 2);
-        uv.x += c2.x; uv.y += c2.y;
+    // Each thread writes a 2x2 luma block and its chroma pair; tiles have even sizes
+    int nTileWidth = nWidth / nCol & ~1, nTileHeight = nHeight / nRow & ~1;
+    int x = ix * 2, y = iy * 2, iCol = x / nTileWidth, iRow = y / nTileHeight, iImage = iRow * nCol + iCol;
+    uchar2 y01 = {16, 16}, y23 = {16, 16}, uv = {128, 128};
+    if (iCol < nCol && iRow < nRow && iImage < nImage && apNv12[iImage]) {
+        uint8_t *pSrc = apNv12[iImage];
+        int x0 = (x - iCol * nTileWidth) * nWidth / nTileWidth, x1 = (x + 1 - iCol * nTileWidth) * nWidth / nTileWidth,
+            y0 = (y - iRow * nTileHeight) * nHeight / nTileHeight, y1 = (y + 1 - iRow * nTileHeight) * nHeight / nTileHeight;
+        y01 = uchar2 {pSrc[nWidth * y0 + x0], pSrc[nWidth * y0 + x1]};
+        y23 = uchar2 {pSrc[nWidth * y1 + x0], pSrc[nWidth * y1 + x1]};
+        uv = *(uchar2 *)(pSrc + nWidth * (nHeight + y0 / 2) + (x0 & ~1));
     }
-    *(uchar2 *)(pNv12Merged + nWidth * iy * 2 + ix * 2) = uchar2 {(uint8_t)(y01.x / nImage), (uint8_t)(y01.y / nImage)};
-    *(uchar2 *)(pNv12Merged + nWidth * (iy * 2 + 1) + ix * 2) = uchar2 {(uint8_t)(y23.x / nImage), (uint8_t)(y23.y / nImage)};
-    *(uchar2 *)(pNv12Merged + nWidth * (nHeight + iy) + ix * 2) = uchar2 {(uint8_t)(uv.x / nImage), (uint8_t)(uv.y / nImage)};
+    *(uchar2 *)(pNv12Wall + nWidth * y + x) = y01;
+    *(uchar2 *)(pNv12Wall + nWidth * (y + 1) + x) = y23;
+    *(uchar2 *)(pNv12Wall + nWidth * (nHeight + iy) + x) = uv;
     sleep(SLEEP_TIME);
 }
 
-void LaunchMerge(cudaStream_t stream, uint8_t *dpNv12Merged, uint8_t **pdpNv12, int nImage, int nWidth, int nHeight) {
-    uint8_t **dadpNv12;
-    ck(cudaMalloc(&dadpNv12, sizeof(uint8_t *) * nImage));
-    ck(cudaMemcpy(dadpNv12, pdpNv12, sizeof(uint8_t *) * nImage, cudaMemcpyHostToDevice));
-    Merge<<<dim3((nWidth + 15) / 16, (nHeight + 15) / 16), dim3(8, 8), 0, stream>>>(dpNv12Merged, dadpNv12, nImage, nWidth, nHeight);
-    ck(cudaFree(dadpNv12));
+void LaunchTile(cudaStream_t stream, uint8_t *dpNv12Wall, uint8_t **dadpNv12, int nImage, int nCol, int nRow, int nWidth, int nHeight) {
+    Tile<<<dim3((nWidth + 15) / 16, (nHeight + 15) / 16), dim3(8, 8), 0, stream>>>(dpNv12Wall, dadpNv12, nImage, nCol, nRow, nWidth, nHeight);
 }
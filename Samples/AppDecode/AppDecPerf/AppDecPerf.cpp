@@ -19,20 +19,31 @@
 #include <memory>
 #include "NvDecoder/NvDecoder.h"
 #include "../Utils/NvCodecUtils.h"
+#include "../Utils/NvCudaContext.h"
 #include "../Utils/FFmpegDemuxer.h"
 
-simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+// Decode threads log without contending on a console lock
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateAsyncLogger(simplelogger::LoggerFactory::CreateConsoleLogger());
 
-void DecProc(NvDecoder *pDec, FFmpegDemuxer *demuxer, int *pnFrame, std::exception_ptr &ex)
+/**
+*  @brief Decodes on the thread's own stream (0 for the default stream). A thread given cuBindContext
+*  keeps it current, so the decoder finds it current instead of pushing it for every frame.
+*/
+void DecProc(NvDecoder *pDec, FFmpegDemuxer *demuxer, CUcontext cuBindContext, CUstream cuStream, int *pnFrame,
+    NvCudaContextScope::Stats *pStats, std::exception_ptr &ex)
 {
     try
     {
         int nVideoBytes = 0, nFrameReturned = 0, nFrame = 0;
         uint8_t *pVideo = NULL, **ppFrame = NULL;
+        if (cuBindContext)
+        {
+            ck(NvCudaContextScope::Bind(cuBindContext));
+        }
 
         do {
             demuxer->Demux(&pVideo, &nVideoBytes);
-            pDec->Decode(pVideo, nVideoBytes, &ppFrame, &nFrameReturned);
+            pDec->Decode(pVideo, nVideoBytes, &ppFrame, &nFrameReturned, 0, NULL, 0, cuStream);
             if (!nFrame && nFrameReturned)
                 LOG(INFO) << pDec->GetVideoInfo();
 
@@ -44,6 +55,7 @@ void DecProc(NvDecoder *pDec, FFmpegDemuxer *demuxer, int *pnFrame, std::excepti
     {
         ex = std::current_exception();
     }
+    *pStats = NvCudaContextScope::GetThreadStats();
 }
 
 void ShowHelpAndExit(const char *szBadOption = NULL)
@@ -60,6 +72,8 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
         << "-gpu         Ordinal of GPU to use" << std::endl
         << "-thread      Number of decoding thread" << std::endl
         << "-single      (No value) Use single context (this may result in suboptimal performance; default is multiple contexts)" << std::endl
+        << "-primary     (No value) Use the primary context of the GPU, shared by all threads without a lock, and a stream per thread" << std::endl
+        << "-nobind      (No value) Push and pop the context around every CUDA call, rather than keep it current on each thread" << std::endl
         << "-host        (No value) Copy frame to host memory (this may result in suboptimal performance; default is device memory)" << std::endl
         ;
     if (bThrowError)
@@ -73,7 +87,8 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
     }
 }
 
-void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &iGpu, int &nThread, bool &bSingle, bool &bHost) 
+void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &iGpu, int &nThread, bool &bSingle, bool &bPrimary,
+    bool &bNoBind, bool &bHost) 
 {
     for (int i = 1; i < argc; i++) {
         if (!_stricmp(argv[i], "-h")) {
@@ -104,6 +119,14 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &iGpu,
             bSingle = true;
             continue;
         }
+        if (!_stricmp(argv[i], "-primary")) {
+            bPrimary = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-nobind")) {
+            bNoBind = true;
+            continue;
+        }
         if (!_stricmp(argv[i], "-host")) {
             bHost = true;
             continue;
@@ -136,6 +159,10 @@ int CUDAAPI HandleVideoData(void *pUserData, CUVIDSOURCEDATAPACKET *pPacket) {
 *  default. The application supports measuring the decode performance only (keeping decoded
 *  frames in device memory as well as measuring the decode performance including transfer
 *  of frames to the host memory.
+*  Each thread keeps its context current, so that the decoder need not push and pop it around
+*  every CUDA call; the application reports the pushes made and saved, and what a push and pop
+*  costs, and "-nobind" measures the decoding without it. With "-primary" all threads share the
+*  primary context of the GPU, each with a stream of its own.
 */
 
 int main(int argc, char **argv)
@@ -144,11 +171,13 @@ int main(int argc, char **argv)
     int iGpu = 0;
     int nThread = 1; 
     bool bSingle = false;
+    bool bPrimary = false;
+    bool bNoBind = false;
     bool bHost = false;
     std::vector<std::exception_ptr> vExceptionPtrs;
     try
     {
-        ParseCommandLine(argc, argv, szInFilePath, iGpu, nThread, bSingle, bHost);
+        ParseCommandLine(argc, argv, szInFilePath, iGpu, nThread, bSingle, bPrimary, bNoBind, bHost);
         CheckInputFile(szInFilePath);
 
         struct stat st;
@@ -185,18 +214,31 @@ int main(int argc, char **argv)
 
         std::vector<std::unique_ptr<FFmpegDemuxer>> vDemuxer;
         std::vector<std::unique_ptr<NvDecoder>> vDec;
+        NvCudaContextManager contextManager;
+        std::vector<std::unique_ptr<NvCudaStream>> vStream;
         CUcontext cuContext = NULL;
-        ck(cuCtxCreate(&cuContext, 0, cuDevice));
+        if (bPrimary)
+        {
+            cuContext = contextManager.GetContext(iGpu);
+        }
+        else
+        {
+            ck(cuCtxCreate(&cuContext, 0, cuDevice));
+        }
         vExceptionPtrs.resize(nThread);
         std::mutex m;
         for (int i = 0; i < nThread; i++)
         {
-            if (!bSingle)
+            if (bPrimary)
+            {
+                vStream.push_back(contextManager.CreateStream(iGpu));
+            }
+            else if (!bSingle)
             {
                 ck(cuCtxCreate(&cuContext, 0, cuDevice));
             }
             std::unique_ptr<FFmpegDemuxer> demuxer(new FFmpegDemuxer(szInFilePath));
-            std::unique_ptr<NvDecoder> dec(new NvDecoder(cuContext, demuxer->GetWidth(), demuxer->GetHeight(), !bHost, FFmpeg2NvCodecId(demuxer->GetVideoCodec()), bSingle ? &m : NULL));
+            std::unique_ptr<NvDecoder> dec(new NvDecoder(cuContext, demuxer->GetWidth(), demuxer->GetHeight(), !bHost, FFmpeg2NvCodecId(demuxer->GetVideoCodec()), bSingle && !bPrimary ? &m : NULL));
             vDemuxer.push_back(std::move(demuxer));
             vDec.push_back(std::move(dec));
         }
@@ -204,12 +246,15 @@ int main(int argc, char **argv)
         std::vector<NvThread> vThread;
         std::vector<int> vnFrame;
         vnFrame.resize(nThread, 0);
+        std::vector<NvCudaContextScope::Stats> vStats(nThread);
 
         StopWatch watch;
         watch.Start();
         for (int i = 0; i < nThread; i++)
         {
-            vThread.push_back(NvThread(std::thread(DecProc, vDec[i].get(), vDemuxer[i].get(), &vnFrame[i], std::ref(vExceptionPtrs[i]))));
+            vThread.push_back(NvThread(std::thread(DecProc, vDec[i].get(), vDemuxer[i].get(),
+                bNoBind ? NULL : vDec[i]->GetContext(), bPrimary ? vStream[i]->GetStream() : (CUstream)0,
+                &vnFrame[i], &vStats[i], std::ref(vExceptionPtrs[i]))));
         }
         for (int i = 0; i < nThread; i++)
         {
@@ -218,12 +263,18 @@ int main(int argc, char **argv)
         double sec = watch.Stop();
 
         int nTotal = 0;
+        NvCudaContextScope::Stats stats;
         for (int i = 0; i < nThread; i++)
         {
             nTotal += vnFrame[i];
+            stats.nPush += vStats[i].nPush;
+            stats.nSkip += vStats[i].nSkip;
             vDec[i].reset(nullptr);
         }
         std::cout << "Total Frames Decoded=" << nTotal << ", time=" << sec << " seconds, FPS=" << (nTotal / sec) << std::endl;
+        double nsPushPop = NvCudaContextScope::MeasurePushPop(cuContext);
+        std::cout << "Context push/pop: " << stats.nPush << " made, " << stats.nSkip << " saved, " << nsPushPop
+            << " ns each, " << stats.nSkip * nsPushPop / 1e6 << " ms saved" << std::endl;
 
         ck(cuProfilerStop());
 
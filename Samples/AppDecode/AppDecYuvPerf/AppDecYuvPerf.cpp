@@ -0,0 +1,390 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <stdio.h>
+#include <iostream>
+#include <iomanip>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "../Utils/NvCodecUtils.h"
+#include "../Utils/ColorSpaceConverter.h"
+#include "../Utils/YuvScaler.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+std::vector<YuvSimdLevel> GetSupportedLevels()
+{
+    std::vector<YuvSimdLevel> vLevel = {YUV_SIMD_SCALAR};
+#if defined(YUV_SIMD_X86)
+    YuvSimdLevel eBest = GetYuvSimdLevel();
+    if (eBest >= YUV_SIMD_SSE2) vLevel.push_back(YUV_SIMD_SSE2);
+    if (eBest >= YUV_SIMD_AVX2) vLevel.push_back(YUV_SIMD_AVX2);
+#elif defined(YUV_SIMD_NEON)
+    vLevel.push_back(YUV_SIMD_NEON);
+#endif
+    return vLevel;
+}
+
+template<typename Func>
+double MeasureGBps(Func func, size_t nBytes, int nIter)
+{
+    // One untimed run to fault in pages and warm the caches
+    func();
+    StopWatch watch;
+    watch.Start();
+    for (int i = 0; i < nIter; i++) {
+        func();
+    }
+    double sec = watch.Stop();
+    return sec > 0 ? nBytes * (double)nIter / sec / 1.0e9 : 0;
+}
+
+void PrintResult(const char *szKernel, int nBitDepth, YuvSimdLevel eLevel, int nThread, double gbps, bool bMatch)
+{
+    std::cout << std::left << std::setw(24) << szKernel << std::setw(8) << nBitDepth << std::setw(10) << GetYuvSimdLevelName(eLevel)
+        << std::setw(8) << nThread << std::right << std::setw(10) << std::fixed << std::setprecision(2) << gbps
+        << (bMatch ? "" : "   MISMATCH") << std::endl;
+}
+
+/**
+*  @brief Compares two planar 4:2:0 frames of nPitch, leaving out the padding at the end of every
+*  row, which the in-place conversions do not preserve.
+*/
+template<typename T>
+bool PlanarFramesMatch(const std::vector<T> &vA, const std::vector<T> &vB, int nWidth, int nHeight, int nPitch)
+{
+    for (int y = 0; y < nHeight; y++) {
+        if (!std::equal(vA.begin() + (size_t)y * nPitch, vA.begin() + (size_t)y * nPitch + nWidth, vB.begin() + (size_t)y * nPitch)) {
+            return false;
+        }
+    }
+    // The U plane and then the V plane, each nHeight / 2 rows of half the pitch
+    size_t nChromaStart = (size_t)nPitch * nHeight;
+    int nChromaPitch = nPitch / 2, nChromaWidth = nWidth / 2;
+    for (int y = 0; y < nHeight / 2 * 2; y++) {
+        size_t i = nChromaStart + (size_t)y * nChromaPitch;
+        if (!std::equal(vA.begin() + i, vA.begin() + i + nChromaWidth, vB.begin() + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+*  @brief Measures the out-of-place kernels and the in-place YuvConverter for one sample type.
+*  Throughput counts the chroma bytes read plus the chroma bytes written by the conversion,
+*  so in-place and out-of-place numbers can be compared directly.
+*/
+template<typename T>
+bool BenchmarkSampleType(int nWidth, int nHeight, int nPitch, int nThread, int nIter)
+{
+    int nBitDepth = sizeof(T) * 8;
+    int nChromaWidth = nWidth / 2, nChromaHeight = nHeight / 2;
+    size_t nPlane = (size_t)nChromaWidth * nChromaHeight;
+    size_t nBytes = nPlane * 2 * sizeof(T) * 2;
+
+    std::vector<T> vU(nPlane), vV(nPlane), vUV((size_t)nPitch * nChromaHeight);
+    for (size_t i = 0; i < nPlane; i++) {
+        vU[i] = (T)(i * 7);
+        vV[i] = (T)(i * 13 + 1);
+    }
+    std::vector<T> vRefUV(vUV.size()), vRefU(nPlane), vRefV(nPlane);
+    YuvConverter<T>::Interleave(vU.data(), nChromaWidth, vV.data(), nChromaWidth, vRefUV.data(), nPitch, nChromaWidth, nChromaHeight, YUV_SIMD_SCALAR);
+    YuvConverter<T>::Deinterleave(vRefUV.data(), nPitch, vRefU.data(), nChromaWidth, vRefV.data(), nChromaWidth, nChromaWidth, nChromaHeight, YUV_SIMD_SCALAR);
+
+    std::vector<T> vFrame((size_t)nPitch * nHeight * 3 / 2);
+    bool bAllMatch = true;
+    for (YuvSimdLevel eLevel : GetSupportedLevels()) {
+        bool bMatch;
+        double gbps = MeasureGBps([&] {
+            YuvConverter<T>::Interleave(vU.data(), nChromaWidth, vV.data(), nChromaWidth, vUV.data(), nPitch, nChromaWidth, nChromaHeight, eLevel);
+        }, nBytes, nIter);
+        bMatch = vUV == vRefUV;
+        bAllMatch &= bMatch;
+        PrintResult("interleave", nBitDepth, eLevel, 1, gbps, bMatch);
+
+        std::vector<T> vOutU(nPlane), vOutV(nPlane);
+        gbps = MeasureGBps([&] {
+            YuvConverter<T>::Deinterleave(vRefUV.data(), nPitch, vOutU.data(), nChromaWidth, vOutV.data(), nChromaWidth, nChromaWidth, nChromaHeight, eLevel);
+        }, nBytes, nIter);
+        bMatch = vOutU == vRefU && vOutV == vRefV;
+        bAllMatch &= bMatch;
+        PrintResult("deinterleave", nBitDepth, eLevel, 1, gbps, bMatch);
+
+        std::vector<int> vThreadCount = {1};
+        if (nThread > 1) {
+            vThreadCount.push_back(nThread);
+        }
+        for (int n : vThreadCount) {
+            YuvConverter<T> converter(nWidth, nHeight, n, eLevel);
+            for (size_t i = 0; i < vFrame.size(); i++) {
+                vFrame[i] = (T)(i * 5);
+            }
+            std::vector<T> vOriginal(vFrame);
+            // Each pair of conversions restores the frame, which also verifies the round trip
+            gbps = MeasureGBps([&] {
+                converter.PlanarToUVInterleaved(vFrame.data(), nPitch);
+                converter.UVInterleavedToPlanar(vFrame.data(), nPitch);
+            }, nBytes * 2, nIter);
+            bMatch = PlanarFramesMatch(vFrame, vOriginal, nWidth, nHeight, nPitch);
+            bAllMatch &= bMatch;
+            PrintResult("in-place round trip", nBitDepth, eLevel, n, gbps, bMatch);
+        }
+    }
+    return bAllMatch;
+}
+
+struct ColorConversion {
+    const char *szName;
+    void (ColorSpaceConverter::*Convert)(const uint8_t *, int, uint8_t *, int, int, int, int);
+    int nSrcBytePerPixel, nDstBytePerPixel;
+    /** Output rows per input row pair: 3 for YUV 4:2:0 output, 6 for planar BGR */
+    int nDstRowPer2Row;
+    /** Destination sample size in bytes and allowed difference from the scalar reference in sample units */
+    int nDstSampleSize, nTolerance;
+};
+
+/** Largest difference between two outputs, in units of nSampleSize-byte samples */
+int MaxSampleDifference(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b, int nSampleSize)
+{
+    int nMax = 0;
+    for (size_t i = 0; i + nSampleSize <= a.size(); i += nSampleSize) {
+        int va = nSampleSize == 2 ? *(const uint16_t *)&a[i] : a[i], vb = nSampleSize == 2 ? *(const uint16_t *)&b[i] : b[i];
+        nMax = (std::max)(nMax, abs(va - vb));
+    }
+    return nMax;
+}
+
+/**
+*  @brief Measures the host ColorSpaceConverter against its scalar reference, which follows
+*  the arithmetic of the ColorSpace.cu kernels. Outputs of 8-bit YUV go through fixed point
+*  and may differ by 1 LSB of the 8-bit value; everything else must match exactly.
+*  Throughput counts the bytes read plus the bytes written.
+*/
+bool BenchmarkColorSpace(int nWidth, int nHeight, int nThread, int nIter)
+{
+    const ColorConversion aConversion[] = {
+        {"Nv12ToBgra32", &ColorSpaceConverter::Nv12ToBgra32, 1, 4, 2, 1, 1},
+        {"Nv12ToBgra64", &ColorSpaceConverter::Nv12ToBgra64, 1, 8, 2, 2, 256},
+        {"Nv12ToBgrPlanar", &ColorSpaceConverter::Nv12ToBgrPlanar, 1, 1, 6, 1, 1},
+        {"P016ToBgra32", &ColorSpaceConverter::P016ToBgra32, 2, 4, 2, 1, 0},
+        {"P016ToBgra64", &ColorSpaceConverter::P016ToBgra64, 2, 8, 2, 2, 0},
+        {"P016ToBgrPlanar", &ColorSpaceConverter::P016ToBgrPlanar, 2, 1, 6, 1, 0},
+        {"Bgra64ToP016", &ColorSpaceConverter::Bgra64ToP016, 8, 2, 3, 2, 0},
+    };
+    bool bAllMatch = true;
+    for (const ColorConversion &c : aConversion) {
+        bool bYuvSrc = c.nSrcBytePerPixel <= 2;
+        int nSrcPitch = nWidth * c.nSrcBytePerPixel, nDstPitch = nWidth * c.nDstBytePerPixel;
+        size_t nSrcSize = (size_t)nSrcPitch * (bYuvSrc ? nHeight * 3 / 2 : nHeight);
+        size_t nDstSize = (size_t)nDstPitch * nHeight / 2 * c.nDstRowPer2Row;
+        std::vector<uint8_t> vSrc(nSrcSize), vRef(nDstSize), vDst(nDstSize);
+        for (size_t i = 0; i < nSrcSize; i++) {
+            vSrc[i] = (uint8_t)(i * 7 + i / 4099);
+        }
+        ColorSpaceConverter reference(1, YUV_SIMD_SCALAR);
+        (reference.*c.Convert)(vSrc.data(), nSrcPitch, vRef.data(), nDstPitch, nWidth, nHeight, bYuvSrc && c.nSrcBytePerPixel == 1 ? 0 : 4);
+
+        std::vector<int> vThreadCount = {1};
+        if (nThread > 1) {
+            vThreadCount.push_back(nThread);
+        }
+        for (YuvSimdLevel eLevel : GetSupportedLevels()) {
+            // SSE2 runs the scalar code
+            if (eLevel == YUV_SIMD_SSE2) {
+                continue;
+            }
+            for (int n : vThreadCount) {
+                ColorSpaceConverter converter(n, eLevel);
+                double gbps = MeasureGBps([&] {
+                    (converter.*c.Convert)(vSrc.data(), nSrcPitch, vDst.data(), nDstPitch, nWidth, nHeight, bYuvSrc && c.nSrcBytePerPixel == 1 ? 0 : 4);
+                }, nSrcSize + nDstSize, nIter);
+                bool bMatch = MaxSampleDifference(vRef, vDst, c.nDstSampleSize) <= c.nTolerance;
+                bAllMatch &= bMatch;
+                PrintResult(c.szName, c.nDstSampleSize * 8, eLevel, n, gbps, bMatch);
+            }
+        }
+    }
+    return bAllMatch;
+}
+
+/**
+*  @brief Measures the host YuvScaler on NV12 and P016 for a half and a quarter size ladder,
+*  with each filter. SIMD kernels sum the horizontal taps in a different order than the scalar
+*  reference, so outputs may differ by 1 LSB. Throughput counts the bytes read plus the bytes
+*  written.
+*/
+bool BenchmarkScaler(int nWidth, int nHeight, int nThread, int nIter)
+{
+    const int anDivisor[] = {2, 4};
+    bool bAllMatch = true;
+    for (int nSampleSize = 1; nSampleSize <= 2; nSampleSize++) {
+        int nSrcPitch = nWidth * nSampleSize;
+        size_t nSrcSize = (size_t)nSrcPitch * nHeight * 3 / 2;
+        std::vector<uint8_t> vSrc(nSrcSize);
+        for (size_t i = 0; i < nSrcSize; i++) {
+            vSrc[i] = (uint8_t)(i * 7 + i / 4099);
+        }
+        for (int nDivisor : anDivisor) {
+            int nDstWidth = nWidth / nDivisor / 2 * 2, nDstHeight = nHeight / nDivisor / 2 * 2;
+            if (nDstWidth == 0 || nDstHeight == 0) {
+                continue;
+            }
+            int nDstPitch = nDstWidth * nSampleSize;
+            size_t nDstSize = (size_t)nDstPitch * nDstHeight * 3 / 2;
+            std::vector<uint8_t> vRef(nDstSize), vDst(nDstSize);
+            for (int iFilter = YUV_SCALE_BILINEAR; iFilter <= YUV_SCALE_LANCZOS; iFilter++) {
+                YuvScaleFilter eFilter = (YuvScaleFilter)iFilter;
+                auto Resize = [&](YuvScaler &scaler, std::vector<uint8_t> &vOut) {
+                    if (nSampleSize == 1) {
+                        scaler.ResizeNv12(vOut.data(), nDstPitch, nDstWidth, nDstHeight, vSrc.data(), nSrcPitch, nWidth, nHeight);
+                    } else {
+                        scaler.ResizeP016(vOut.data(), nDstPitch, nDstWidth, nDstHeight, vSrc.data(), nSrcPitch, nWidth, nHeight);
+                    }
+                };
+                YuvScaler reference(eFilter, 1, YUV_SIMD_SCALAR);
+                Resize(reference, vRef);
+
+                std::ostringstream oss;
+                oss << GetYuvScaleFilterName(eFilter) << " " << nDstWidth << "x" << nDstHeight;
+                std::vector<int> vThreadCount = {1};
+                if (nThread > 1) {
+                    vThreadCount.push_back(nThread);
+                }
+                for (YuvSimdLevel eLevel : GetSupportedLevels()) {
+                    for (int n : vThreadCount) {
+                        YuvScaler scaler(eFilter, n, eLevel);
+                        double gbps = MeasureGBps([&] { Resize(scaler, vDst); }, nSrcSize + nDstSize, nIter);
+                        bool bMatch = MaxSampleDifference(vRef, vDst, nSampleSize) <= 1;
+                        bAllMatch &= bMatch;
+                        PrintResult(oss.str().c_str(), nSampleSize * 8, eLevel, n, gbps, bMatch);
+                    }
+                }
+            }
+        }
+    }
+    return bAllMatch;
+}
+
+void ShowHelpAndExit(const char *szBadOption = NULL)
+{
+    std::ostringstream oss;
+    bool bThrowError = false;
+    if (szBadOption)
+    {
+        bThrowError = true;
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
+    }
+    oss << "Options:" << std::endl
+        << "-s           Frame resolution in this form: WxH" << std::endl
+        << "-pitch       Luma pitch in samples (default: width)" << std::endl
+        << "-thread      Number of threads for the in-place YuvConverter, the color conversions and the scaler" << std::endl
+        << "-iter        Number of iterations per kernel" << std::endl
+        ;
+    if (bThrowError)
+    {
+        throw std::invalid_argument(oss.str());
+    }
+    else
+    {
+        std::cout << oss.str();
+        exit(0);
+    }
+}
+
+void ParseCommandLine(int argc, char *argv[], int &nWidth, int &nHeight, int &nPitch, int &nThread, int &nIter)
+{
+    for (int i = 1; i < argc; i++) {
+        if (!_stricmp(argv[i], "-h")) {
+            ShowHelpAndExit();
+        }
+        if (!_stricmp(argv[i], "-s")) {
+            if (++i == argc || 2 != sscanf(argv[i], "%dx%d", &nWidth, &nHeight)) {
+                ShowHelpAndExit("-s");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-pitch")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-pitch");
+            }
+            nPitch = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-thread")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-thread");
+            }
+            nThread = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-iter")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-iter");
+            }
+            nIter = atoi(argv[i]);
+            continue;
+        }
+        ShowHelpAndExit(argv[i]);
+    }
+    if (nWidth <= 0 || nHeight <= 0 || nWidth % 2 || nHeight % 2) {
+        ShowHelpAndExit("-s");
+    }
+    if (nPitch == 0) {
+        nPitch = nWidth;
+    }
+    if (nPitch < nWidth || nPitch % 2) {
+        ShowHelpAndExit("-pitch");
+    }
+    if (nThread <= 0) {
+        ShowHelpAndExit("-thread");
+    }
+    if (nIter <= 0) {
+        ShowHelpAndExit("-iter");
+    }
+}
+
+/**
+*  This sample application measures the host-side chroma layout conversions that
+*  AppDec and AppEncQual run on decoded frames (NV12/P016 to planar and back), for
+*  every SIMD level the CPU supports, and reports the throughput in GB/s. It also
+*  measures the host versions of the ColorSpace.cu conversions and of the Resize.cu
+*  scalers, and checks them against their scalar reference. No GPU is needed.
+*/
+int main(int argc, char **argv)
+{
+    int nWidth = 1920, nHeight = 1080, nPitch = 0, nThread = 4, nIter = 200;
+    try
+    {
+        ParseCommandLine(argc, argv, nWidth, nHeight, nPitch, nThread, nIter);
+
+        std::cout << "Frame " << nWidth << "x" << nHeight << ", pitch " << nPitch
+            << ", best SIMD level: " << GetYuvSimdLevelName(GetYuvSimdLevel()) << std::endl;
+        std::cout << std::left << std::setw(24) << "kernel" << std::setw(8) << "bits" << std::setw(10) << "simd"
+            << std::setw(8) << "thread" << std::right << std::setw(10) << "GB/s" << std::endl;
+        bool bMatch = BenchmarkSampleType<uint8_t>(nWidth, nHeight, nPitch, nThread, nIter);
+        bMatch &= BenchmarkSampleType<uint16_t>(nWidth, nHeight, nPitch, nThread, nIter);
+        bMatch &= BenchmarkColorSpace(nWidth, nHeight, nThread, nIter);
+        bMatch &= BenchmarkScaler(nWidth, nHeight, nThread, nIter);
+        if (!bMatch)
+        {
+            std::cout << "Some kernels produced output different from the scalar reference" << std::endl;
+            return 1;
+        }
+    }
+    catch (const std::exception &ex)
+    {
+        std::cout << ex.what();
+        exit(1);
+    }
+    return 0;
+}
@@ -17,14 +17,19 @@
 #include "../Utils/Logger.h"
 #include "../Utils/NvEncoderCLIOptions.h"
 #include "../Utils/NvCodecUtils.h"
+#include "../Utils/FrameGenerator.h"
 
 simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
 
 void EncodeCuda(CUcontext cuContext, char *szInFilePath, int nWidth, int nHeight, NV_ENC_BUFFER_FORMAT eFormat,
-    char *szOutFilePath, NvEncoderInitParam *pEncodeCLIOptions)
+    char *szOutFilePath, NvEncoderInitParam *pEncodeCLIOptions, int nSynthFrame, const FrameGeneratorParams &synthParams)
 {
-    std::ifstream fpIn(szInFilePath, std::ifstream::in | std::ifstream::binary);
-    if (!fpIn)
+    std::ifstream fpIn;
+    if (!nSynthFrame)
+    {
+        fpIn.open(szInFilePath, std::ifstream::in | std::ifstream::binary);
+    }
+    if (!nSynthFrame && !fpIn)
     {
         std::ostringstream err;
         err << "Unable to open input file: " << szInFilePath << std::endl;
@@ -53,11 +58,25 @@ void EncodeCuda(CUcontext cuContext, char *szInFilePath, int nWidth, int nHeight
     int nFrameSize = enc.GetFrameSize();
 
     std::unique_ptr<uint8_t[]> pHostFrame(new uint8_t[nFrameSize]);
-    int nFrame = 0;
+    FrameGenerator generator(nWidth, nHeight, eFormat, synthParams);
+    int nFrame = 0, nFrameIn = 0;
     while (true)
     {
-        // Load the next frame from disk
-        std::streamsize nRead = fpIn.read(reinterpret_cast<char*>(pHostFrame.get()), nFrameSize).gcount();
+        std::streamsize nRead = 0;
+        if (nSynthFrame)
+        {
+            // Render the next synthetic frame
+            if (nFrameIn < nSynthFrame)
+            {
+                generator.Generate(nFrameIn++, pHostFrame.get());
+                nRead = nFrameSize;
+            }
+        }
+        else
+        {
+            // Load the next frame from disk
+            nRead = fpIn.read(reinterpret_cast<char*>(pHostFrame.get()), nFrameSize).gcount();
+        }
         // For receiving encoded packets
         std::vector<std::vector<uint8_t>> vPacket;
         if (nRead == nFrameSize)
@@ -145,6 +164,9 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
     }
     oss << "Options:" << std::endl
         << "-i           Input file path" << std::endl
+        << "-synth       Encode this number of synthetic frames (FrameGenerator) instead of reading -i" << std::endl
+        << "-noise       Noise amplitude of synthetic frames in bits, 0 to 8 (default is 2)" << std::endl
+        << "-scenecut    Scene length of synthetic frames in frames (default is 0, a single scene)" << std::endl
         << "-o           Output file path" << std::endl
         << "-s           Input resolution in this form: WxH" << std::endl
         << "-if          Input format: iyuv nv12 yuv444 p010 yuv444p16 bgra bgra10 ayuv abgr abgr10" << std::endl
@@ -164,7 +186,8 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
 }
 
 void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth, int &nHeight, 
-    NV_ENC_BUFFER_FORMAT &eFormat, char *szOutputFileName, NvEncoderInitParam &initParam, int &iGpu)
+    NV_ENC_BUFFER_FORMAT &eFormat, char *szOutputFileName, NvEncoderInitParam &initParam, int &iGpu,
+    int &nSynthFrame, FrameGeneratorParams &synthParams)
 {
     std::ostringstream oss;
     int i;
@@ -240,6 +263,30 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
             iGpu = atoi(argv[i]);
             continue;
         }
+        if (!_stricmp(argv[i], "-synth"))
+        {
+            if (++i == argc || (nSynthFrame = atoi(argv[i])) <= 0)
+            {
+                ShowHelpAndExit("-synth");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-noise"))
+        {
+            if (++i == argc || (synthParams.nNoiseBits = atoi(argv[i])) < 0 || synthParams.nNoiseBits > 8)
+            {
+                ShowHelpAndExit("-noise");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-scenecut"))
+        {
+            if (++i == argc || (synthParams.nSceneLength = atoi(argv[i])) < 0)
+            {
+                ShowHelpAndExit("-scenecut");
+            }
+            continue;
+        }
         // Regard as encoder parameter
         if (argv[i][0] != '-')
         {
@@ -269,12 +316,18 @@ int main(int argc, char **argv)
     int nWidth = 1920, nHeight = 1080;
     NV_ENC_BUFFER_FORMAT eFormat = NV_ENC_BUFFER_FORMAT_IYUV;
     int iGpu = 0;
+    int nSynthFrame = 0;
+    FrameGeneratorParams synthParams;
     try
     {
         NvEncoderInitParam encodeCLIOptions;
-        ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eFormat, szOutFilePath, encodeCLIOptions, iGpu);
+        ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eFormat, szOutFilePath, encodeCLIOptions, iGpu,
+            nSynthFrame, synthParams);
 
-        CheckInputFile(szInFilePath);
+        if (!nSynthFrame)
+        {
+            CheckInputFile(szInFilePath);
+        }
 
         if (!*szOutFilePath)
         {
@@ -297,7 +350,7 @@ int main(int argc, char **argv)
         CUcontext cuContext = NULL;
         ck(cuCtxCreate(&cuContext, 0, cuDevice));
 
-        EncodeCuda(cuContext, szInFilePath, nWidth, nHeight, eFormat, szOutFilePath, &encodeCLIOptions);
+        EncodeCuda(cuContext, szInFilePath, nWidth, nHeight, eFormat, szOutFilePath, &encodeCLIOptions, nSynthFrame, synthParams);
     }
     catch (const std::exception &ex)
     {
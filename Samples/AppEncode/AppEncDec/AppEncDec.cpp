@@ -22,6 +22,7 @@
 #include "../Utils/NvEncoderCLIOptions.h"
 #include "../Utils/NvCodecUtils.h"
 #include "../Utils/FFmpegStreamer.h"
+#include "../Utils/FFmpegSegmenter.h"
 #include "../Utils/FFmpegDemuxer.h"
 
 simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
@@ -42,6 +43,9 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
         << "-if          Input format: iyuv nv12 p010 bgra bgra64" << std::endl
         << "-of          Output format: native(nv12/p010) bgra bgra64" << std::endl
         << "-gpu         Ordinal of GPU to use" << std::endl
+        << "-hls         Also write rolling HLS segments and playlist.m3u8 to this directory;" << std::endl
+        << "             segments are cut at IDR frames, so pass -gop to bound their length" << std::endl
+        << "-fmp4        Write the HLS segments as fragmented MP4 instead of MPEG-TS" << std::endl
         ;
     oss << NvEncoderInitParam().GetHelpMessage(false, false, true);
     if (bThrowError)
@@ -67,7 +71,7 @@ std::vector<std::string> vstrOutputFormatName =
 
 void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth, int &nHeight,
     NV_ENC_BUFFER_FORMAT &eInputFormat, OutputFormat &eOutputFormat, char *szOutputFileName,
-    NvEncoderInitParam &initParam, int &iGpu)
+    NvEncoderInitParam &initParam, int &iGpu, char *szHlsDir, bool &bFmp4)
 {
     std::ostringstream oss;
     int i;
@@ -134,6 +138,17 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
             iGpu = atoi(argv[i]);
             continue;
         }
+        if (!_stricmp(argv[i], "-hls")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-hls");
+            }
+            sprintf(szHlsDir, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-fmp4")) {
+            bFmp4 = true;
+            continue;
+        }
         // Regard as encoder parameter
         if (argv[i][0] != '-') {
             ShowHelpAndExit(argv[i]);
@@ -165,7 +180,8 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
 }
 
 void EncodeProc(CUdevice cuDevice, int nWidth, int nHeight, NV_ENC_BUFFER_FORMAT eFormat, NvEncoderInitParam *pEncodeCLIOptions,
-    bool bBgra64, const char *szInFilePath, const char *szMediaPath, std::exception_ptr &encExceptionPtr) 
+    bool bBgra64, const char *szInFilePath, const char *szMediaPath, const char *szHlsDir, bool bFmp4,
+    std::exception_ptr &encExceptionPtr) 
 {
     CUdeviceptr dpFrame = 0, dpBgraFrame = 0;
     CUcontext cuContext = NULL;
@@ -196,7 +212,15 @@ void EncodeProc(CUdevice cuDevice, int nWidth, int nHeight, NV_ENC_BUFFER_FORMAT
         ck(cuMemAlloc(&dpBgraFrame, nWidth * nHeight * 8));
         int nFrame = 0;
         std::streamsize nRead = 0;
-        FFmpegStreamer streamer(pEncodeCLIOptions->IsCodecH264() ? AV_CODEC_ID_H264 : AV_CODEC_ID_HEVC, nWidth, nHeight, 25, szMediaPath);
+        // Packets reach the socket in 64 KB chunks instead of one write per packet
+        FFmpegStreamer streamer(pEncodeCLIOptions->IsCodecH264() ? AV_CODEC_ID_H264 : AV_CODEC_ID_HEVC, nWidth, nHeight, 25, szMediaPath, 64 * 1024);
+        // Files are written by the segmenter's own thread, so a rollover does not hold up encoding
+        std::unique_ptr<FFmpegSegmenter> pSegmenter;
+        if (*szHlsDir)
+        {
+            pSegmenter.reset(new FFmpegSegmenter(pEncodeCLIOptions->IsCodecH264() ? AV_CODEC_ID_H264 : AV_CODEC_ID_HEVC, nWidth, nHeight, 25, szHlsDir,
+                bFmp4 ? SEGMENT_FORMAT_FMP4 : SEGMENT_FORMAT_TS));
+        }
         do {
             std::vector<std::vector<uint8_t>> vPacket;
             nRead = fpIn.read(reinterpret_cast<char*>(pHostFrame.get()), nHostFrameSize).gcount();
@@ -227,8 +251,15 @@ void EncodeProc(CUdevice cuDevice, int nWidth, int nHeight, NV_ENC_BUFFER_FORMAT
             {
                 enc.EndEncode(vPacket);
             }
-            for (std::vector<uint8_t> &packet : vPacket) {
-                streamer.Stream(packet.data(), (int)packet.size(), nFrame++);
+            // Frame indices serve as timestamps; B-frames make dts differ from pts
+            const std::vector<NvEncPacketInfo> &vInfo = enc.GetPacketInfo();
+            for (size_t i = 0; i < vPacket.size(); i++) {
+                streamer.Stream(vPacket[i].data(), (int)vPacket[i].size(), vInfo[i].nPts, vInfo[i].nDts);
+                if (pSegmenter)
+                {
+                    pSegmenter->Write(vPacket[i].data(), (int)vPacket[i].size(), vInfo[i].nPts, vInfo[i].nDts);
+                }
+                nFrame++;
             }
         } while (nRead == nHostFrameSize);
         ck(cuMemFree(dpBgraFrame));
@@ -236,6 +267,11 @@ void EncodeProc(CUdevice cuDevice, int nWidth, int nHeight, NV_ENC_BUFFER_FORMAT
 
         enc.DestroyEncoder();
         fpIn.close();
+        if (pSegmenter)
+        {
+            pSegmenter->Close();
+            std::cout << "HLS segments saved in " << szHlsDir << std::endl;
+        }
 
         std::cout << std::flush << "Total frames encoded: " << nFrame << std::endl << std::flush;
     }
@@ -351,7 +387,9 @@ void DecodeProc(CUdevice cuDevice, const char *szMediaUri, OutputFormat eOutputF
 int main(int argc, char **argv)
 {
     char szInFilePath[256] = "",
-        szOutFilePath[256] = "";
+        szOutFilePath[256] = "",
+        szHlsDir[256] = "";
+    bool bFmp4 = false;
     int nWidth = 1920, nHeight = 1080;
     NV_ENC_BUFFER_FORMAT eInputFormat = NV_ENC_BUFFER_FORMAT_IYUV;
     OutputFormat eOutputFormat = native;
@@ -362,7 +400,7 @@ int main(int argc, char **argv)
     try
     {
         NvEncoderInitParam encodeCLIOptions;
-        ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eInputFormat, eOutputFormat, szOutFilePath, encodeCLIOptions, iGpu);
+        ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eInputFormat, eOutputFormat, szOutFilePath, encodeCLIOptions, iGpu, szHlsDir, bFmp4);
 
         CheckInputFile(szInFilePath);
 
@@ -393,7 +431,7 @@ int main(int argc, char **argv)
         char szMediaUriDecode[1024];
         sprintf(szMediaUriDecode, "%s?listen", szMediaUri);
         NvThread thDecode(std::thread(DecodeProc, cuDevice, szMediaUriDecode, eOutputFormat, szOutFilePath, std::ref(decExceptionPtr)));
-        NvThread thEncode(std::thread(EncodeProc, cuDevice, nWidth, nHeight, eInputFormat, &encodeCLIOptions, bBgra64, szInFilePath, szMediaUri, std::ref(encExceptionPtr)));
+        NvThread thEncode(std::thread(EncodeProc, cuDevice, nWidth, nHeight, eInputFormat, &encodeCLIOptions, bBgra64, szInFilePath, szMediaUri, szHlsDir, bFmp4, std::ref(encExceptionPtr)));
         thEncode.join();
         thDecode.join();
         if (encExceptionPtr)
@@ -0,0 +1,773 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string.h>
+#include <cuda.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+#include "NvEncoder/NvEncoderCuda.h"
+#include "NvDecoder/NvDecoder.h"
+#include "../Utils/Logger.h"
+#include "../Utils/NvEncoderCLIOptions.h"
+#include "../Utils/NvCodecUtils.h"
+#include "../Utils/NvPipeline.h"
+#include "../Utils/FrameGenerator.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+/** Side of the square blocks that carry the bits of a frame ID */
+const int nStampBlock = 16;
+const int nStampBit = 32;
+
+/** Rows of the luma plane covered by the stamp */
+int GetStampHeight(int nWidth)
+{
+    int nBlockPerRow = nWidth / nStampBlock;
+    return (2 * nStampBit + nBlockPerRow - 1) / nBlockPerRow * nStampBlock;
+}
+
+/**
+*  @brief Paints nId into the top of the luma plane as 32 black or white blocks, followed by
+*  its complement, so that a frame read back after encoding and decoding can be identified,
+*  and a stamp damaged by compression is detected rather than misread.
+*/
+void StampFrameId(uint8_t *pLuma, int nPitch, int nWidth, uint32_t nId)
+{
+    int nBlockPerRow = nWidth / nStampBlock;
+    for (int k = 0; k < 2 * nStampBit; k++)
+    {
+        bool bOne = ((nId >> (k % nStampBit)) & 1) != (k >= nStampBit);
+        int x0 = k % nBlockPerRow * nStampBlock, y0 = k / nBlockPerRow * nStampBlock;
+        for (int y = 0; y < nStampBlock; y++)
+        {
+            memset(pLuma + (y0 + y) * nPitch + x0, bOne ? 235 : 16, nStampBlock);
+        }
+    }
+}
+
+/**
+*  @brief Reads back the ID painted by StampFrameId(); returns false if the stamp is damaged.
+*  Only the center of each block is sampled, away from the edges that compression blurs.
+*/
+bool ReadFrameId(const uint8_t *pLuma, int nPitch, int nWidth, uint32_t &nId)
+{
+    int nBlockPerRow = nWidth / nStampBlock;
+    uint32_t a = 0, b = 0;
+    for (int k = 0; k < 2 * nStampBit; k++)
+    {
+        int x0 = k % nBlockPerRow * nStampBlock, y0 = k / nBlockPerRow * nStampBlock, nSum = 0;
+        for (int y = nStampBlock / 4; y < nStampBlock * 3 / 4; y++)
+        {
+            for (int x = nStampBlock / 4; x < nStampBlock * 3 / 4; x++)
+            {
+                nSum += pLuma[(y0 + y) * nPitch + x0 + x];
+            }
+        }
+        uint32_t bit = nSum > 125 * (nStampBlock / 2) * (nStampBlock / 2) ? 1 : 0;
+        if (k < nStampBit)
+        {
+            a |= bit << k;
+        }
+        else
+        {
+            b |= bit << (k - nStampBit);
+        }
+    }
+    nId = a;
+    return a == ~b;
+}
+
+/**
+*  @brief Carries encoded packets from the sender to the receiver. Each packet travels with
+*  its pts, which lets the receiver pass it through the decoder and split the latency by
+*  stage, and with the time it was sent. Close() unblocks both sides, so that a pipeline
+*  that fails can close the transport along with its channels.
+*/
+class LoopbackTransport : public NvChannelBase
+{
+public:
+    virtual ~LoopbackTransport() {}
+    /** Returns false once the transport is closed */
+    virtual bool Send(const uint8_t *pData, int nSize, uint32_t nPts, int64_t tSend) = 0;
+    /** Blocks for the next packet; returns false at the end of the stream */
+    virtual bool Receive(std::vector<uint8_t> &vData, uint32_t &nPts, int64_t &tSend) = 0;
+    /** Ends the stream; the receiver still gets what was sent before */
+    virtual void EndOfStream() = 0;
+};
+
+/**
+*  @brief Hands packets over in memory; the baseline without any network stack.
+*/
+class MemoryTransport : public LoopbackTransport
+{
+public:
+    MemoryTransport() : channel(64) {}
+
+    bool Send(const uint8_t *pData, int nSize, uint32_t nPts, int64_t tSend)
+    {
+        Packet packet;
+        packet.vData.assign(pData, pData + nSize);
+        packet.nPts = nPts;
+        packet.tSend = tSend;
+        return channel.Push(std::move(packet));
+    }
+    bool Receive(std::vector<uint8_t> &vData, uint32_t &nPts, int64_t &tSend)
+    {
+        Packet packet;
+        if (!channel.Pop(packet))
+        {
+            return false;
+        }
+        vData.swap(packet.vData);
+        nPts = packet.nPts;
+        tSend = packet.tSend;
+        return true;
+    }
+    void EndOfStream()
+    {
+        channel.Close();
+    }
+    void Close()
+    {
+        channel.Close();
+    }
+
+private:
+    struct Packet
+    {
+        std::vector<uint8_t> vData;
+        uint32_t nPts;
+        int64_t tSend;
+    };
+    NvChannel<Packet> channel;
+};
+
+// SOCKET and INVALID_SOCKET come from Logger.h, which links ws2_32.lib on Windows
+#ifdef _WIN32
+#define SHUT_WR SD_SEND
+#define SHUT_RDWR SD_BOTH
+#else
+#define closesocket close
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/**
+*  @brief Sends packets through a TCP connection over 127.0.0.1 with Nagle's algorithm off, so
+*  that the kernel's socket path is part of the measurement. Each packet is a 16-byte header
+*  (size, pts, send time) followed by the bitstream.
+*/
+class TcpTransport : public LoopbackTransport
+{
+public:
+    /** nPort = 0 picks a free port */
+    TcpTransport(int nPort)
+    {
+#ifdef _WIN32
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData))
+        {
+            throw std::runtime_error("WSAStartup failed");
+        }
+#endif
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)nPort);
+        socklen_t nAddr = sizeof(addr);
+        SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener == INVALID_SOCKET || bind(listener, (sockaddr *)&addr, sizeof(addr)) || listen(listener, 1)
+            || getsockname(listener, (sockaddr *)&addr, &nAddr))
+        {
+            if (listener != INVALID_SOCKET)
+            {
+                closesocket(listener);
+            }
+            throw std::runtime_error("Unable to listen on 127.0.0.1:" + std::to_string(nPort));
+        }
+        // The connection completes in the listen backlog, so connect() and accept() can run on one thread
+        sender = socket(AF_INET, SOCK_STREAM, 0);
+        if (sender == INVALID_SOCKET || connect(sender, (sockaddr *)&addr, sizeof(addr))
+            || (receiver = accept(listener, NULL, NULL)) == INVALID_SOCKET)
+        {
+            closesocket(listener);
+            CloseSockets();
+            throw std::runtime_error("Unable to connect to 127.0.0.1:" + std::to_string(ntohs(addr.sin_port)));
+        }
+        closesocket(listener);
+        int nOne = 1;
+        setsockopt(sender, IPPROTO_TCP, TCP_NODELAY, (const char *)&nOne, sizeof(nOne));
+        setsockopt(receiver, IPPROTO_TCP, TCP_NODELAY, (const char *)&nOne, sizeof(nOne));
+        LOG(INFO) << "TCP loopback on port " << ntohs(addr.sin_port);
+    }
+    ~TcpTransport()
+    {
+        CloseSockets();
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+
+    bool Send(const uint8_t *pData, int nSize, uint32_t nPts, int64_t tSend)
+    {
+        Header header = {(uint32_t)nSize, nPts, tSend};
+        return SendAll((const char *)&header, sizeof(header)) && SendAll((const char *)pData, nSize);
+    }
+    bool Receive(std::vector<uint8_t> &vData, uint32_t &nPts, int64_t &tSend)
+    {
+        Header header;
+        if (!ReceiveAll((char *)&header, sizeof(header)))
+        {
+            return false;
+        }
+        vData.resize(header.nSize);
+        nPts = header.nPts;
+        tSend = header.tSend;
+        return ReceiveAll((char *)vData.data(), header.nSize);
+    }
+    void EndOfStream()
+    {
+        shutdown(sender, SHUT_WR);
+    }
+    void Close()
+    {
+        shutdown(sender, SHUT_RDWR);
+        shutdown(receiver, SHUT_RDWR);
+    }
+
+private:
+    struct Header
+    {
+        uint32_t nSize, nPts;
+        int64_t tSend;
+    };
+
+    bool SendAll(const char *p, int n)
+    {
+        while (n > 0)
+        {
+            int nSent = send(sender, p, n, MSG_NOSIGNAL);
+            if (nSent <= 0)
+            {
+                return false;
+            }
+            p += nSent;
+            n -= nSent;
+        }
+        return true;
+    }
+    bool ReceiveAll(char *p, int n)
+    {
+        while (n > 0)
+        {
+            int nReceived = recv(receiver, p, n, 0);
+            if (nReceived <= 0)
+            {
+                return false;
+            }
+            p += nReceived;
+            n -= nReceived;
+        }
+        return true;
+    }
+    void CloseSockets()
+    {
+        if (sender != INVALID_SOCKET)
+        {
+            closesocket(sender);
+            sender = INVALID_SOCKET;
+        }
+        if (receiver != INVALID_SOCKET)
+        {
+            closesocket(receiver);
+            receiver = INVALID_SOCKET;
+        }
+    }
+
+    SOCKET sender = INVALID_SOCKET, receiver = INVALID_SOCKET;
+};
+
+/**
+*  @brief Timestamps of one frame on the common Tracer clock, in nanoseconds; -1 if not reached.
+*  Each field is written by one stage only, and read after the pipeline has finished. tSent is
+*  taken by the sender when it hands the packet to the transport, and recorded by the receiver
+*  from the packet.
+*/
+struct FrameTimes
+{
+    int64_t tCapture = -1, tUploaded = -1, tEncoded = -1, tSent = -1, tReceived = -1, tDecoded = -1, tDisplayed = -1;
+};
+
+void PrintLatency(const char *szName, std::vector<double> v)
+{
+    if (v.empty())
+    {
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for (double t : v)
+    {
+        sum += t;
+    }
+    auto Percentile = [&v](double p) { return v[(std::min)(v.size() - 1, (size_t)(p * v.size()))]; };
+    std::cout << std::fixed << std::setprecision(3)
+        << "  " << std::left << std::setw(16) << szName << std::right
+        << " mean=" << sum / v.size()
+        << " p50=" << Percentile(0.5)
+        << " p95=" << Percentile(0.95)
+        << " p99=" << Percentile(0.99)
+        << " max=" << v.back() << " ms" << std::endl;
+}
+
+void ShowHelpAndExit(const char *szBadOption = NULL)
+{
+    bool bThrowError = false;
+    std::ostringstream oss;
+    if (szBadOption)
+    {
+        bThrowError = true;
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
+    }
+    oss << "Options:" << std::endl
+        << "-s           Resolution of the synthetic frames in this form: WxH (default is 1920x1080)" << std::endl
+        << "-gpu         Ordinal of GPU to use" << std::endl
+        << "-frame       Number of frames to send (default is 600)" << std::endl
+        << "-warmup      Number of leading frames left out of the statistics (default is 30)" << std::endl
+        << "-rate        Capture rate in frames per second; 0 captures as fast as the pipeline goes (default is 60)" << std::endl
+        << "-transport   memory or tcp (default is memory)" << std::endl
+        << "-port        TCP port on 127.0.0.1 (default is 0, any free port)" << std::endl
+        << "-csv         Write the per-frame stage latencies to this file" << std::endl
+        ;
+    oss << NvEncoderInitParam("", nullptr, true).GetHelpMessage() << std::endl;
+    if (bThrowError)
+    {
+        throw std::invalid_argument(oss.str());
+    }
+    else
+    {
+        std::cout << oss.str();
+        exit(0);
+    }
+}
+
+void ParseCommandLine(int argc, char *argv[], int &nWidth, int &nHeight, NvEncoderInitParam &initParam, int &iGpu,
+    int &nFrame, int &nWarmup, int &nRate, bool &bTcp, int &nPort, char *szCsvFilePath)
+{
+    std::ostringstream oss;
+    int i;
+    for (i = 1; i < argc; i++)
+    {
+        if (!_stricmp(argv[i], "-h"))
+        {
+            ShowHelpAndExit();
+        }
+        if (!_stricmp(argv[i], "-s"))
+        {
+            if (++i == argc || 2 != sscanf(argv[i], "%dx%d", &nWidth, &nHeight) || nWidth < 256 || nHeight < 64)
+            {
+                ShowHelpAndExit("-s");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-gpu"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-gpu");
+            }
+            iGpu = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-frame"))
+        {
+            if (++i == argc || (nFrame = atoi(argv[i])) <= 0)
+            {
+                ShowHelpAndExit("-frame");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-warmup"))
+        {
+            if (++i == argc || (nWarmup = atoi(argv[i])) < 0)
+            {
+                ShowHelpAndExit("-warmup");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-rate"))
+        {
+            if (++i == argc || (nRate = atoi(argv[i])) < 0)
+            {
+                ShowHelpAndExit("-rate");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-transport"))
+        {
+            if (++i == argc || (_stricmp(argv[i], "memory") && _stricmp(argv[i], "tcp")))
+            {
+                ShowHelpAndExit("-transport");
+            }
+            bTcp = !_stricmp(argv[i], "tcp");
+            continue;
+        }
+        if (!_stricmp(argv[i], "-port"))
+        {
+            if (++i == argc || (nPort = atoi(argv[i])) < 0 || nPort > 65535)
+            {
+                ShowHelpAndExit("-port");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-csv"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-csv");
+            }
+            sprintf(szCsvFilePath, "%s", argv[i]);
+            continue;
+        }
+        // Regard as encoder parameter
+        if (argv[i][0] != '-')
+        {
+            ShowHelpAndExit(argv[i]);
+        }
+        oss << argv[i] << " ";
+        while (i + 1 < argc && argv[i + 1][0] != '-')
+        {
+            oss << argv[++i] << " ";
+        }
+    }
+    initParam = NvEncoderInitParam(oss.str().c_str(), nullptr, true);
+}
+
+/**
+*  This sample application measures the glass-to-glass latency of the low latency path: from a
+*  frame being captured to the same frame being decoded and displayed on the other side.
+*  Synthetic frames carry their ID in the picture; they are encoded by a zero-delay NvEncoderCuda
+*  session, sent over a loopback transport (in memory, or TCP over 127.0.0.1), decoded by an
+*  NvDecoder in low latency mode with CUVID_PKT_ENDOFPICTURE, and identified again from the
+*  decoded pixels. Capture, encode and receive/decode run as pipeline stages on their own
+*  threads. The application reports the latency distribution of every stage and of the whole
+*  path, and checks that every frame comes out once, in order, and recognizable.
+*/
+int main(int argc, char **argv)
+{
+    int nWidth = 1920, nHeight = 1080;
+    int iGpu = 0, nFrame = 600, nWarmup = 30, nRate = 60, nPort = 0;
+    bool bTcp = false;
+    char szCsvFilePath[256] = "";
+    try
+    {
+        NvEncoderInitParam encodeCLIOptions;
+        ParseCommandLine(argc, argv, nWidth, nHeight, encodeCLIOptions, iGpu, nFrame, nWarmup, nRate, bTcp, nPort, szCsvFilePath);
+        nWidth &= ~1;
+        nHeight &= ~1;
+
+        ck(cuInit(0));
+        int nGpu = 0;
+        ck(cuDeviceGetCount(&nGpu));
+        if (iGpu < 0 || iGpu >= nGpu) {
+            std::cout << "GPU ordinal out of range. Should be within [" << 0 << ", " << nGpu - 1 << "]" << std::endl;
+            return 1;
+        }
+        CUdevice cuDevice = 0;
+        ck(cuDeviceGet(&cuDevice, iGpu));
+        char szDeviceName[80];
+        ck(cuDeviceGetName(szDeviceName, sizeof(szDeviceName), cuDevice));
+        std::cout << "GPU in use: " << szDeviceName << std::endl;
+        CUcontext cuContext = NULL;
+        ck(cuCtxCreate(&cuContext, 0, cuDevice));
+
+        // Zero-delay low latency session without B-frames: one frame in, one packet out
+        const NV_ENC_BUFFER_FORMAT eFormat = NV_ENC_BUFFER_FORMAT_NV12;
+        NvEncoderCuda enc(cuContext, nWidth, nHeight, eFormat, 0);
+        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        initializeParams.encodeConfig = &encodeConfig;
+        enc.CreateDefaultEncoderParams(&initializeParams, encodeCLIOptions.GetEncodeGUID(), encodeCLIOptions.GetPresetGUID());
+        encodeConfig.gopLength = NVENC_INFINITE_GOPLENGTH;
+        encodeConfig.frameIntervalP = 1;
+        if (encodeCLIOptions.IsCodecH264())
+        {
+            encodeConfig.encodeCodecConfig.h264Config.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+        }
+        else
+        {
+            encodeConfig.encodeCodecConfig.hevcConfig.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+        }
+        encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
+        encodeConfig.rcParams.averageBitRate = (static_cast<unsigned int>(5.0f * initializeParams.encodeWidth * initializeParams.encodeHeight) / (1280 * 720)) * 1000000;
+        encodeConfig.rcParams.vbvBufferSize = encodeConfig.rcParams.averageBitRate * initializeParams.frameRateDen / initializeParams.frameRateNum;
+        encodeConfig.rcParams.maxBitRate = encodeConfig.rcParams.averageBitRate;
+        encodeConfig.rcParams.vbvInitialDelay = encodeConfig.rcParams.vbvBufferSize;
+        encodeCLIOptions.SetInitParams(&initializeParams, eFormat);
+        enc.CreateEncoder(&initializeParams);
+
+        /* bLowLatency=true: a frame comes out of the Decode() call that got its packet, which must be
+           flagged with CUVID_PKT_ENDOFPICTURE. Device frames: only the stamp is copied back. */
+        NvDecoder dec(cuContext, nWidth, nHeight, true, encodeCLIOptions.IsCodecH264() ? cudaVideoCodec_H264 : cudaVideoCodec_HEVC,
+            NULL, true);
+
+        // Content is rendered ahead of time; capturing a frame copies it and stamps the ID
+        FrameGeneratorParams synthParams;
+        synthParams.bFrameNumber = false;
+        FrameGenerator generator(nWidth, nHeight, eFormat, synthParams, (std::max)((int)std::thread::hardware_concurrency(), 1));
+        const int nSynthFrame = 30, nBuffer = 4;
+        int nFrameSize = generator.GetFrameSize();
+        std::vector<uint8_t> vSynth((size_t)nFrameSize * nSynthFrame);
+        for (int i = 0; i < nSynthFrame; i++)
+        {
+            generator.Generate(i, vSynth.data() + (size_t)i * nFrameSize);
+        }
+        std::vector<std::vector<uint8_t>> vBuffer(nBuffer, std::vector<uint8_t>(nFrameSize));
+        int nStampHeight = GetStampHeight(nWidth);
+        if (nStampHeight > nHeight)
+        {
+            throw std::invalid_argument("The frame is too small for the frame ID stamp\n");
+        }
+
+        std::unique_ptr<LoopbackTransport> pTransport;
+        if (bTcp)
+        {
+            pTransport.reset(new TcpTransport(nPort));
+        }
+        else
+        {
+            pTransport.reset(new MemoryTransport());
+        }
+        LoopbackTransport *pLink = pTransport.get();
+        // The pipeline closes the transport too if a stage fails; the deleter leaves it to pTransport
+        std::shared_ptr<NvChannelBase> pLinkRef(pLink, [](NvChannelBase *) {});
+
+        std::vector<FrameTimes> vTimes(nFrame);
+        int nDisplayed = 0, nBadStamp = 0, nMismatch = 0, nOutOfOrder = 0;
+        Tracer &tracer = Tracer::Get();
+
+        NvPipeline pipeline;
+        pipeline.Attach(pLinkRef);
+        // Buffer indices: free ones go to the capture stage, captured ones to the encode stage
+        std::shared_ptr<NvChannel<int>> pFree = pipeline.CreateChannel<int>(nBuffer);
+        std::shared_ptr<NvChannel<std::pair<int, int>>> pCaptured = pipeline.CreateChannel<std::pair<int, int>>(nBuffer);
+        for (int i = 0; i < nBuffer; i++)
+        {
+            pFree->Push(i);
+        }
+
+        pipeline.AddStage("Capture", [&](NvPipeline::Stage &stage)
+        {
+            std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+            for (int i = 0; i < nFrame; i++)
+            {
+                if (nRate)
+                {
+                    std::this_thread::sleep_until(tStart + std::chrono::nanoseconds(1000000000LL * i / nRate));
+                }
+                int iBuffer;
+                if (!stage.Pop(*pFree, iBuffer))
+                {
+                    return;
+                }
+                uint8_t *pFrame = vBuffer[iBuffer].data();
+                memcpy(pFrame, vSynth.data() + (size_t)(i % nSynthFrame) * nFrameSize, nFrameSize);
+                StampFrameId(pFrame, nWidth, nWidth, (uint32_t)i);
+                vTimes[i].tCapture = tracer.Now();
+                if (!stage.Push(*pCaptured, std::make_pair(i, iBuffer)))
+                {
+                    return;
+                }
+                stage.AddItem();
+            }
+            pCaptured->Close();
+        });
+
+        pipeline.AddStage("Encode and send", [&](NvPipeline::Stage &stage)
+        {
+            std::vector<std::vector<uint8_t>> vPacket;
+            std::pair<int, int> captured;
+            while (stage.Pop(*pCaptured, captured))
+            {
+                int i = captured.first;
+                const NvEncInputFrame* encoderInputFrame = enc.GetNextInputFrame();
+                NvEncoderCuda::CopyToDeviceFrame(cuContext, vBuffer[captured.second].data(), 0, (CUdeviceptr)encoderInputFrame->inputPtr,
+                    (int)encoderInputFrame->pitch, enc.GetEncodeWidth(), enc.GetEncodeHeight(), CU_MEMORYTYPE_HOST,
+                    encoderInputFrame->bufferFormat, encoderInputFrame->chromaOffsets, encoderInputFrame->numChromaPlanes);
+                vTimes[i].tUploaded = tracer.Now();
+                pFree->Push(captured.second);
+                enc.EncodeFrame(vPacket);
+                vTimes[i].tEncoded = tracer.Now();
+                const std::vector<NvEncPacketInfo> &vInfo = enc.GetPacketInfo();
+                for (int j = 0; j < (int)vPacket.size(); j++)
+                {
+                    if (!pLink->Send(vPacket[j].data(), (int)vPacket[j].size(), (uint32_t)vInfo[j].nPts, tracer.Now()))
+                    {
+                        return;
+                    }
+                }
+                stage.AddItem();
+            }
+            enc.EndEncode(vPacket);
+            const std::vector<NvEncPacketInfo> &vInfo = enc.GetPacketInfo();
+            for (int j = 0; j < (int)vPacket.size(); j++)
+            {
+                pLink->Send(vPacket[j].data(), (int)vPacket[j].size(), (uint32_t)vInfo[j].nPts, tracer.Now());
+            }
+            pLink->EndOfStream();
+        });
+
+        pipeline.AddStage("Receive and decode", [&](NvPipeline::Stage &stage)
+        {
+            std::vector<uint8_t> vPacket, vStamp((size_t)nWidth * nStampHeight);
+            uint8_t **ppFrame = NULL;
+            int64_t *pTimestamp = NULL;
+            int nFrameReturned = 0, iLastId = -1;
+            uint32_t nPts = 0;
+            int64_t tSend = 0;
+            while (true)
+            {
+                bool bPacket = pLink->Receive(vPacket, nPts, tSend);
+                int64_t tReceived = tracer.Now();
+                if (bPacket && nPts < (uint32_t)nFrame)
+                {
+                    vTimes[nPts].tSent = tSend;
+                    vTimes[nPts].tReceived = tReceived;
+                }
+                // An empty packet flushes the decoder at the end of the stream
+                dec.Decode(bPacket ? vPacket.data() : NULL, bPacket ? (int)vPacket.size() : 0, &ppFrame, &nFrameReturned,
+                    CUVID_PKT_ENDOFPICTURE, &pTimestamp, nPts);
+                int64_t tDecoded = tracer.Now();
+                for (int i = 0; i < nFrameReturned; i++)
+                {
+                    CUDA_MEMCPY2D m = { 0 };
+                    m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+                    m.srcDevice = (CUdeviceptr)ppFrame[i];
+                    m.srcPitch = dec.GetDeviceFramePitch();
+                    m.dstMemoryType = CU_MEMORYTYPE_HOST;
+                    m.dstHost = vStamp.data();
+                    m.dstPitch = nWidth;
+                    m.WidthInBytes = nWidth;
+                    m.Height = nStampHeight;
+                    ck(cuCtxPushCurrent(cuContext));
+                    ck(cuMemcpy2D(&m));
+                    ck(cuCtxPopCurrent(NULL));
+                    uint32_t nId = 0;
+                    bool bStamp = ReadFrameId(vStamp.data(), nWidth, nWidth, nId);
+                    int64_t tDisplayed = tracer.Now();
+                    if (!bStamp || nId >= (uint32_t)nFrame)
+                    {
+                        nBadStamp++;
+                        continue;
+                    }
+                    if (nId != (uint32_t)pTimestamp[i])
+                    {
+                        nMismatch++;
+                    }
+                    if ((int)nId <= iLastId)
+                    {
+                        nOutOfOrder++;
+                    }
+                    iLastId = (int)nId;
+                    vTimes[nId].tDecoded = tDecoded;
+                    vTimes[nId].tDisplayed = tDisplayed;
+                    nDisplayed++;
+                    stage.AddItem();
+                }
+                if (!bPacket)
+                {
+                    break;
+                }
+            }
+        });
+
+        pipeline.Wait();
+        enc.DestroyEncoder();
+        pipeline.PrintMetrics(std::cout);
+
+        std::vector<double> vUpload, vEncode, vSendWait, vTransport, vDecode, vDisplay, vTotal;
+        auto Ms = [](int64_t t0, int64_t t1) { return (t1 - t0) / 1.0e6; };
+        std::unique_ptr<std::ofstream> fpCsv;
+        if (*szCsvFilePath)
+        {
+            fpCsv.reset(new std::ofstream(szCsvFilePath));
+            if (!*fpCsv)
+            {
+                std::ostringstream err;
+                err << "Unable to open output file: " << szCsvFilePath << std::endl;
+                throw std::invalid_argument(err.str());
+            }
+            *fpCsv << "frame,capture_to_upload_ms,encode_ms,send_wait_ms,transport_ms,decode_ms,display_ms,total_ms" << std::endl;
+        }
+        for (int i = nWarmup; i < nFrame; i++)
+        {
+            const FrameTimes &t = vTimes[i];
+            if (t.tDisplayed < 0 || t.tReceived < 0)
+            {
+                continue;
+            }
+            vUpload.push_back(Ms(t.tCapture, t.tUploaded));
+            vEncode.push_back(Ms(t.tUploaded, t.tEncoded));
+            // The wait for the sender to get to the packet is kept apart from the time on the wire
+            vSendWait.push_back(Ms(t.tEncoded, t.tSent));
+            vTransport.push_back(Ms(t.tSent, t.tReceived));
+            vDecode.push_back(Ms(t.tReceived, t.tDecoded));
+            vDisplay.push_back(Ms(t.tDecoded, t.tDisplayed));
+            vTotal.push_back(Ms(t.tCapture, t.tDisplayed));
+            if (fpCsv)
+            {
+                *fpCsv << i << "," << vUpload.back() << "," << vEncode.back() << "," << vSendWait.back() << "," << vTransport.back() << ","
+                    << vDecode.back() << "," << vDisplay.back() << "," << vTotal.back() << std::endl;
+            }
+        }
+
+        std::cout << "Glass-to-glass latency over " << (bTcp ? "TCP loopback" : "in-memory transport") << ", "
+            << vTotal.size() << " frames after " << nWarmup << " warm-up frames:" << std::endl;
+        PrintLatency("capture->upload", vUpload);
+        PrintLatency("encode", vEncode);
+        PrintLatency("send wait", vSendWait);
+        PrintLatency("transport", vTransport);
+        PrintLatency("decode", vDecode);
+        PrintLatency("readback", vDisplay);
+        PrintLatency("glass-to-glass", vTotal);
+        std::cout << "Frames sent: " << nFrame << ", displayed: " << nDisplayed << ", lost: " << nFrame - nDisplayed
+            << ", unreadable stamps: " << nBadStamp << ", stamp/pts mismatches: " << nMismatch
+            << ", out of order: " << nOutOfOrder << std::endl;
+        if (fpCsv)
+        {
+            std::cout << "Saved per-frame latencies in file " << szCsvFilePath << std::endl;
+        }
+        return nDisplayed == nFrame && !nMismatch && !nOutOfOrder ? 0 : 1;
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << e.what();
+        exit(1);
+    }
+    return 0;
+}
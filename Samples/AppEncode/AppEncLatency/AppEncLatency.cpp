@@ -0,0 +1,402 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cuda.h>
+#include <memory>
+#include "NvEncoder/NvEncoderCuda.h"
+#include "../Utils/Logger.h"
+#include "../Utils/NvEncoderCLIOptions.h"
+#include "../Utils/NvCodecUtils.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+/**
+*  @brief Per-frame latencies of one run, in milliseconds.
+*  Time to first byte is measured from submitting the frame to the first bitstream
+*  data becoming available; frame latency from submission to the last byte.
+*/
+struct LatencyStats
+{
+    std::vector<double> vFirstByte;
+    std::vector<double> vFrame;
+};
+
+void PrintLatency(const char *szName, std::vector<double> v)
+{
+    if (v.empty())
+    {
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for (double t : v)
+    {
+        sum += t;
+    }
+    auto Percentile = [&v](double p) { return v[(std::min)(v.size() - 1, (size_t)(p * v.size()))]; };
+    std::cout << std::fixed << std::setprecision(3)
+        << "  " << std::left << std::setw(16) << szName << std::right
+        << " mean=" << sum / v.size()
+        << " p50=" << Percentile(0.5)
+        << " p95=" << Percentile(0.95)
+        << " p99=" << Percentile(0.99)
+        << " max=" << v.back() << " ms" << std::endl;
+}
+
+/**
+*  @brief Runs nFrame frames through a zero-delay low latency session.
+*  With nSlice > 1 the session splits every picture into nSlice slices and the
+*  bitstream is read back slice by slice with NvEncoder::EncodeFrameSlices().
+*/
+LatencyStats EncodeLatency(CUcontext cuContext, uint8_t *pBuf, uint64_t nBufSize, int nFrame, int nWidth, int nHeight,
+    NV_ENC_BUFFER_FORMAT eFormat, int nSlice, NvEncoderInitParam *pEncodeCLIOptions, std::ofstream *pfpOut)
+{
+    NvEncoderCuda enc(cuContext, nWidth, nHeight, eFormat, 0);
+
+    NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+    NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+    initializeParams.encodeConfig = &encodeConfig;
+    enc.CreateDefaultEncoderParams(&initializeParams, pEncodeCLIOptions->GetEncodeGUID(), pEncodeCLIOptions->GetPresetGUID());
+
+    encodeConfig.gopLength = NVENC_INFINITE_GOPLENGTH;
+    encodeConfig.frameIntervalP = 1;
+    if (pEncodeCLIOptions->IsCodecH264())
+    {
+        encodeConfig.encodeCodecConfig.h264Config.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+    }
+    else
+    {
+        encodeConfig.encodeCodecConfig.hevcConfig.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+    }
+
+    encodeConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
+    encodeConfig.rcParams.averageBitRate = (static_cast<unsigned int>(5.0f * initializeParams.encodeWidth * initializeParams.encodeHeight) / (1280 * 720)) * 1000000;
+    encodeConfig.rcParams.vbvBufferSize = encodeConfig.rcParams.averageBitRate * initializeParams.frameRateDen / initializeParams.frameRateNum;
+    encodeConfig.rcParams.maxBitRate = encodeConfig.rcParams.averageBitRate;
+    encodeConfig.rcParams.vbvInitialDelay = encodeConfig.rcParams.vbvBufferSize;
+
+    pEncodeCLIOptions->SetInitParams(&initializeParams, eFormat);
+
+    if (nSlice > 1)
+    {
+        if (!enc.GetCapabilityValue(initializeParams.encodeGUID, NV_ENC_CAPS_SUPPORT_SUBFRAME_READBACK))
+        {
+            throw std::invalid_argument("Sub-frame readback isn't supported on this GPU\n");
+        }
+        // sliceMode 3: sliceModeData is the number of slices per picture
+        if (pEncodeCLIOptions->IsCodecH264())
+        {
+            encodeConfig.encodeCodecConfig.h264Config.sliceMode = 3;
+            encodeConfig.encodeCodecConfig.h264Config.sliceModeData = nSlice;
+        }
+        else
+        {
+            encodeConfig.encodeCodecConfig.hevcConfig.sliceMode = 3;
+            encodeConfig.encodeCodecConfig.hevcConfig.sliceModeData = nSlice;
+        }
+        initializeParams.reportSliceOffsets = 1;
+        initializeParams.enableSubFrameWrite = 1;
+        initializeParams.enableEncodeAsync = 0;
+    }
+
+    enc.CreateEncoder(&initializeParams);
+
+    LatencyStats stats;
+    uint32_t nFrameSize = enc.GetFrameSize();
+    uint32_t nFrameInBuf = (uint32_t)(nBufSize / nFrameSize);
+    if (!nFrameInBuf)
+    {
+        enc.DestroyEncoder();
+        throw std::invalid_argument("Input file is smaller than one frame\n");
+    }
+    std::vector<std::vector<uint8_t>> vPacket;
+    StopWatch w;
+    for (int i = 0; i < nFrame; i++)
+    {
+        // Uploading the frame is not part of the encode latency
+        const NvEncInputFrame* encoderInputFrame = enc.GetNextInputFrame();
+        NvEncoderCuda::CopyToDeviceFrame(cuContext,
+            pBuf + (uint64_t)(i % nFrameInBuf) * nFrameSize,
+            0,
+            (CUdeviceptr)encoderInputFrame->inputPtr,
+            (int)encoderInputFrame->pitch,
+            enc.GetEncodeWidth(),
+            enc.GetEncodeHeight(),
+            CU_MEMORYTYPE_HOST,
+            encoderInputFrame->bufferFormat,
+            encoderInputFrame->chromaOffsets,
+            encoderInputFrame->numChromaPlanes);
+
+        double tFirstByte = -1;
+        w.Start();
+        if (nSlice > 1)
+        {
+            enc.EncodeFrameSlices([&](const uint8_t *pSlice, uint32_t nSliceSize, uint32_t iSlice)
+            {
+                if (tFirstByte < 0)
+                {
+                    tFirstByte = w.Stop();
+                }
+                if (pfpOut)
+                {
+                    pfpOut->write(reinterpret_cast<const char*>(pSlice), nSliceSize);
+                }
+            });
+        }
+        else
+        {
+            enc.EncodeFrame(vPacket);
+            // The whole frame arrives at once
+            tFirstByte = w.Stop();
+            for (std::vector<uint8_t> &packet : vPacket)
+            {
+                if (pfpOut)
+                {
+                    pfpOut->write(reinterpret_cast<char*>(packet.data()), packet.size());
+                }
+            }
+        }
+        double tFrame = w.Stop();
+        if (tFirstByte >= 0)
+        {
+            stats.vFirstByte.push_back(tFirstByte * 1000.0);
+            stats.vFrame.push_back(tFrame * 1000.0);
+        }
+    }
+    enc.EndEncode(vPacket);
+    for (std::vector<uint8_t> &packet : vPacket)
+    {
+        if (pfpOut)
+        {
+            pfpOut->write(reinterpret_cast<char*>(packet.data()), packet.size());
+        }
+    }
+    enc.DestroyEncoder();
+    return stats;
+}
+
+void ShowHelpAndExit(const char *szBadOption = NULL)
+{
+    bool bThrowError = false;
+    std::ostringstream oss;
+    if (szBadOption)
+    {
+        bThrowError = true;
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
+    }
+    oss << "Options:" << std::endl
+        << "-i           Input file path" << std::endl
+        << "-o           Output file path for the slice mode bitstream (optional)" << std::endl
+        << "-s           Input resolution in this form: WxH" << std::endl
+        << "-if          Input format: iyuv nv12" << std::endl
+        << "-gpu         Ordinal of GPU to use" << std::endl
+        << "-frame       Number of frames to encode per run (default is 300)" << std::endl
+        << "-slice       Number of slices per picture in slice mode (default is 4)" << std::endl
+        ;
+    oss << NvEncoderInitParam("", nullptr, true).GetHelpMessage() << std::endl;
+    if (bThrowError)
+    {
+        throw std::invalid_argument(oss.str());
+    }
+    else
+    {
+        std::cout << oss.str();
+        exit(0);
+    }
+}
+
+void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth, int &nHeight,
+    NV_ENC_BUFFER_FORMAT &eFormat, char *szOutputFileName, NvEncoderInitParam &initParam,
+    int &iGpu, int &nFrame, int &nSlice)
+{
+    std::ostringstream oss;
+    int i;
+    for (i = 1; i < argc; i++)
+    {
+        if (!_stricmp(argv[i], "-h"))
+        {
+            ShowHelpAndExit();
+        }
+        if (!_stricmp(argv[i], "-i"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-i");
+            }
+            sprintf(szInputFileName, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-o"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-o");
+            }
+            sprintf(szOutputFileName, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-s"))
+        {
+            if (++i == argc || 2 != sscanf(argv[i], "%dx%d", &nWidth, &nHeight))
+            {
+                ShowHelpAndExit("-s");
+            }
+            continue;
+        }
+
+        std::vector<std::string> vszFileFormatName = { "iyuv", "nv12" };
+
+        NV_ENC_BUFFER_FORMAT aFormat[] =
+        {
+            NV_ENC_BUFFER_FORMAT_IYUV,
+            NV_ENC_BUFFER_FORMAT_NV12,
+        };
+
+        if (!_stricmp(argv[i], "-if"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-if");
+            }
+            auto it = std::find(vszFileFormatName.begin(), vszFileFormatName.end(), argv[i]);
+            if (it == vszFileFormatName.end())
+            {
+                ShowHelpAndExit("-if");
+            }
+            eFormat = aFormat[it - vszFileFormatName.begin()];
+            continue;
+        }
+        if (!_stricmp(argv[i], "-gpu"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-gpu");
+            }
+            iGpu = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-frame"))
+        {
+            if (++i == argc || (nFrame = atoi(argv[i])) <= 0)
+            {
+                ShowHelpAndExit("-frame");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-slice"))
+        {
+            if (++i == argc || (nSlice = atoi(argv[i])) < 2)
+            {
+                ShowHelpAndExit("-slice");
+            }
+            continue;
+        }
+        // Regard as encoder parameter
+        if (argv[i][0] != '-')
+        {
+            ShowHelpAndExit(argv[i]);
+        }
+        oss << argv[i] << " ";
+        while (i + 1 < argc && argv[i + 1][0] != '-')
+        {
+            oss << argv[++i] << " ";
+        }
+    }
+    initParam = NvEncoderInitParam(oss.str().c_str(), nullptr, true);
+}
+
+/**
+*  This sample application compares the encode latency of frame mode and slice mode.
+*  Both runs use the same zero-delay low latency configuration; in slice mode every
+*  picture is split into several slices which are read back as soon as each of them
+*  has been written (sub-frame readback), so the first bytes of a frame can be sent
+*  to the network while the rest of the frame is still being encoded. The application
+*  reports time to first byte and full frame latency for both modes.
+*/
+int main(int argc, char **argv)
+{
+    char szInFilePath[256] = "",
+        szOutFilePath[256] = "";
+    int nWidth = 1920, nHeight = 1080;
+    NV_ENC_BUFFER_FORMAT eFormat = NV_ENC_BUFFER_FORMAT_IYUV;
+    int iGpu = 0;
+    int nFrame = 300;
+    int nSlice = 4;
+    try
+    {
+        NvEncoderInitParam encodeCLIOptions;
+        ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eFormat, szOutFilePath, encodeCLIOptions, iGpu, nFrame, nSlice);
+
+        CheckInputFile(szInFilePath);
+
+        ck(cuInit(0));
+        int nGpu = 0;
+        ck(cuDeviceGetCount(&nGpu));
+        if (iGpu < 0 || iGpu >= nGpu) {
+            std::cout << "GPU ordinal out of range. Should be within [" << 0 << ", " << nGpu - 1 << "]" << std::endl;
+            return 1;
+        }
+        CUdevice cuDevice = 0;
+        ck(cuDeviceGet(&cuDevice, iGpu));
+        char szDeviceName[80];
+        ck(cuDeviceGetName(szDeviceName, sizeof(szDeviceName), cuDevice));
+        std::cout << "GPU in use: " << szDeviceName << std::endl;
+        CUcontext cuContext = NULL;
+        ck(cuCtxCreate(&cuContext, 0, cuDevice));
+
+        // Frames are served from memory so that disk reads don't disturb the measurement
+        uint8_t *pBuf = NULL;
+        uint64_t nBufSize = 0;
+        BufferedFileReader bufferedFileReader(szInFilePath, true);
+        if (!bufferedFileReader.GetBuffer(&pBuf, &nBufSize)) {
+            std::cout << "Failed to read file " << szInFilePath << std::endl;
+            return 1;
+        }
+
+        std::unique_ptr<std::ofstream> fpOut;
+        if (*szOutFilePath)
+        {
+            fpOut.reset(new std::ofstream(szOutFilePath, std::ios::out | std::ios::binary));
+            if (!*fpOut)
+            {
+                std::ostringstream err;
+                err << "Unable to open output file: " << szOutFilePath << std::endl;
+                throw std::invalid_argument(err.str());
+            }
+        }
+
+        LatencyStats frameStats = EncodeLatency(cuContext, pBuf, nBufSize, nFrame, nWidth, nHeight, eFormat, 1,
+            &encodeCLIOptions, nullptr);
+        LatencyStats sliceStats = EncodeLatency(cuContext, pBuf, nBufSize, nFrame, nWidth, nHeight, eFormat, nSlice,
+            &encodeCLIOptions, fpOut.get());
+
+        std::cout << "Frame mode:" << std::endl;
+        PrintLatency("time to 1st byte", frameStats.vFirstByte);
+        PrintLatency("frame latency", frameStats.vFrame);
+        std::cout << "Slice mode (" << nSlice << " slices):" << std::endl;
+        PrintLatency("time to 1st byte", sliceStats.vFirstByte);
+        PrintLatency("frame latency", sliceStats.vFrame);
+        if (fpOut)
+        {
+            std::cout << "Saved slice mode bitstream in file " << szOutFilePath << std::endl;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << e.what();
+        exit(1);
+    }
+    return 0;
+}
@@ -10,40 +10,214 @@
 */
 
 #include <iostream>
+#include <iomanip>
 #include <cuda.h>
 #include <memory>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <stdint.h>
 #include "NvEncoder/NvEncoderCuda.h"
 #include "../Utils/Logger.h"
 #include "../Utils/NvEncoderCLIOptions.h"
 #include "../Utils/NvCodecUtils.h"
+#include "../Utils/MvFile.h"
+#include "../Utils/MvAnalyzer.h"
 
 
 simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
 
-void MotionEstimationWithBufferedFile(NvEncoderCuda *pEnc, int nWidth, int nHeight, NvEncoderInitParam *pInitParam,
-    char *szInFilePath, char *szOutFilePath, uint32_t nFrame)
+/**
+*  @brief Motion vector data of one frame pair as returned by NvEncoder::RunMotionEstimation().
+*/
+struct MvJob
 {
-    std::ofstream fpOut(szOutFilePath, std::ios::out | std::ios::binary);
-    if (!fpOut)
+    uint32_t iFrame, iReferenceFrame;
+    std::vector<uint8_t> vMvData;
+};
+
+/**
+*  @brief Bounded hand-off between the motion estimation loop and the thread that converts,
+*  analyzes and writes the results. Buffers are recycled so that steady state does not allocate.
+*/
+class MvJobQueue
+{
+public:
+    MvJobQueue(int nMaxPending) : m_nMaxPending(nMaxPending) {}
+
+    void Push(MvJob &job)
     {
-        std::ostringstream err;
-        err << "Unable to open output file: " << szOutFilePath << std::endl;
-        throw std::invalid_argument(err.str());
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cv.wait(lock, [&] { return m_bAbort || (int)m_qJob.size() < m_nMaxPending; });
+        if (m_bAbort)
+        {
+            return;
+        }
+        m_qJob.push_back(std::move(job));
+        m_cv.notify_all();
+    }
+
+    /** Returns false once the queue is closed and drained, or aborted */
+    bool Pop(MvJob &job)
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cv.wait(lock, [&] { return m_bAbort || m_bClosed || !m_qJob.empty(); });
+        if (m_bAbort || m_qJob.empty())
+        {
+            return false;
+        }
+        job = std::move(m_qJob.front());
+        m_qJob.pop_front();
+        m_cv.notify_all();
+        return true;
+    }
+
+    /** Returns a consumed buffer for reuse by the producer */
+    void Recycle(std::vector<uint8_t> &vMvData)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if ((int)m_vFree.size() < m_nMaxPending)
+        {
+            m_vFree.push_back(std::move(vMvData));
+        }
+    }
+
+    std::vector<uint8_t> GetFreeBuffer()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        std::vector<uint8_t> v;
+        if (!m_vFree.empty())
+        {
+            v = std::move(m_vFree.back());
+            m_vFree.pop_back();
+        }
+        return v;
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_bClosed = true;
+        m_cv.notify_all();
+    }
+
+    void Abort()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_bAbort = true;
+        m_cv.notify_all();
+    }
+
+    bool IsAborted()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_bAbort;
+    }
+
+private:
+    int m_nMaxPending;
+    std::deque<MvJob> m_qJob;
+    std::vector<std::vector<uint8_t>> m_vFree;
+    bool m_bClosed = false, m_bAbort = false;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+};
+
+/**
+*  @brief Converts motion vector data to the binary .mv layout, writes it and optionally
+*  runs the CPU analytics on it. Runs on its own thread so that this work overlaps with
+*  motion estimation of the following frames.
+*/
+void MvSinkProc(MvJobQueue *pQueue, const NvMvFileHeader header, const char *szOutFilePath, const char *szStatsFilePath,
+    int nRegionX, int nRegionY, float fSceneChangeThreshold, std::exception_ptr *pException)
+{
+    try
+    {
+        NvMvFileWriter writer(szOutFilePath, header);
+        std::unique_ptr<NvMvAnalyzer> pAnalyzer;
+        std::ofstream fpStats;
+        if (szStatsFilePath[0])
+        {
+            fpStats.open(szStatsFilePath, std::ios::out);
+            if (!fpStats)
+            {
+                std::ostringstream err;
+                err << "Unable to open output file: " << szStatsFilePath << std::endl;
+                throw std::invalid_argument(err.str());
+            }
+            pAnalyzer.reset(new NvMvAnalyzer(header, nRegionX, nRegionY, fSceneChangeThreshold));
+            fpStats << "frame, reference, globalX, globalY, zoom, rotation, inlierRatio, intraRatio, meanCost, meanEnergy, sceneChangeScore, sceneChange";
+            for (int i = 0; i < nRegionX * nRegionY; i++)
+            {
+                fpStats << ", energy" << i;
+            }
+            fpStats << std::endl << std::fixed << std::setprecision(4);
+        }
+
+        std::vector<NvMvBlock> vBlock;
+        NvMvFrameStats stats;
+        std::vector<uint32_t> vSceneChange;
+        MvJob job;
+        while (pQueue->Pop(job))
+        {
+            NvMvFieldConverter::Convert(header, job.vMvData.data(), job.vMvData.size(), vBlock);
+            pQueue->Recycle(job.vMvData);
+            writer.WriteFrame(job.iFrame, job.iReferenceFrame, vBlock.data());
+            if (!pAnalyzer)
+            {
+                continue;
+            }
+
+            pAnalyzer->Analyze(vBlock.data(), stats);
+            fpStats << job.iFrame << ", " << job.iReferenceFrame << ", " << stats.fGlobalX << ", " << stats.fGlobalY << ", "
+                << stats.fZoom << ", " << stats.fRotationDegree << ", " << stats.fInlierRatio << ", " << stats.fIntraRatio << ", "
+                << stats.fMeanCost << ", " << stats.fMeanEnergy << ", " << stats.fSceneChangeScore << ", " << (int)stats.bSceneChange;
+            for (float fEnergy : stats.vRegionEnergy)
+            {
+                fpStats << ", " << fEnergy;
+            }
+            fpStats << "\n";
+            if (stats.bSceneChange)
+            {
+                vSceneChange.push_back(job.iFrame);
+            }
+        }
+        writer.Close();
+        std::cout << "Motion vectors of " << writer.GetFrameCount() << " frames saved in file " << szOutFilePath << std::endl;
+
+        if (pAnalyzer)
+        {
+            std::cout << "Frame statistics saved in file " << szStatsFilePath << std::endl << "Scene changes at frames:";
+            for (uint32_t iFrame : vSceneChange)
+            {
+                std::cout << " " << iFrame;
+            }
+            std::cout << (vSceneChange.empty() ? " none" : "") << std::endl;
+        }
     }
+    catch (...)
+    {
+        *pException = std::current_exception();
+        pQueue->Abort();
+    }
+}
 
-    uint8_t *pBuf = NULL;
-    uint32_t nBufSize = 0;
-    BufferedFileReader bufferedFileReader(szInFilePath);
-    if (!bufferedFileReader.GetBuffer(&pBuf, &nBufSize)) {
+void MotionEstimationWithBufferedFile(NvEncoderCuda *pEnc, int nWidth, int nHeight, NvEncoderInitParam *pInitParam,
+    char *szInFilePath, char *szOutFilePath, char *szStatsFilePath, int nRegionX, int nRegionY, float fSceneChangeThreshold,
+    uint32_t nFrame)
+{
+    // Frames are consumed in order, so stream them through a prefetch window instead of
+    // mapping the whole file into memory
+    FrameWindowReader reader(szInFilePath, pEnc->GetFrameSize());
+    if (!reader.IsOpen()) {
         std::ostringstream err;
         err << "Failed to read file " << szInFilePath << std::endl;
         throw std::invalid_argument(err.str());
     }
 
-    uint64_t nFrameSize = pEnc->GetFrameSize();
-    uint32_t n = static_cast<uint32_t>(nBufSize / nFrameSize);
+    uint32_t n = static_cast<uint32_t>((std::min)(reader.GetFrameCount(), (uint64_t)UINT32_MAX));
 
     if (nFrame == 0)
     {
@@ -61,79 +235,82 @@ void MotionEstimationWithBufferedFile(NvEncoderCuda *pEnc, int nWidth, int nHeig
         throw std::invalid_argument(err.str());
     }
 
-    for (uint32_t i = 0; i < nFrame - 1; i++)
+    NvMvFileHeader header = NvMvMakeFileHeader(pInitParam->IsCodecH264() ? NV_MV_CODEC_H264 : NV_MV_CODEC_HEVC, nWidth, nHeight);
+    MvJobQueue queue(4);
+    std::exception_ptr sinkException;
+    std::thread thSink(MvSinkProc, &queue, header, szOutFilePath, szStatsFilePath, nRegionX, nRegionY, fSceneChangeThreshold, &sinkException);
+
+    try
     {
-        uint32_t iReferenceFrame = i, iFrame = i + 1;
-
-        const NvEncInputFrame* inputFrame = pEnc->GetNextInputFrame();
-        const NvEncInputFrame* referenceFrame = pEnc->GetNextReferenceFrame();
-
-        NvEncoderCuda::CopyToDeviceFrame(reinterpret_cast<CUcontext>(pEnc->GetDevice()),
-            (uint8_t *)pBuf + iFrame * nFrameSize,
-            0, 
-            (CUdeviceptr)inputFrame->inputPtr,
-            (uint32_t)inputFrame->pitch,
-            pEnc->GetEncodeWidth(),
-            pEnc->GetEncodeHeight(),
-            CU_MEMORYTYPE_HOST,
-            inputFrame->bufferFormat,
-            inputFrame->chromaOffsets,
-            inputFrame->numChromaPlanes);
-
-        NvEncoderCuda::CopyToDeviceFrame(reinterpret_cast<CUcontext>(pEnc->GetDevice()),
-            (uint8_t *)pBuf + iReferenceFrame * nFrameSize,
-            0,
-            (CUdeviceptr)referenceFrame->inputPtr,
-            (uint32_t)referenceFrame->pitch,
-            pEnc->GetEncodeWidth(),
-            pEnc->GetEncodeHeight(),
-            CU_MEMORYTYPE_HOST,
-            referenceFrame->bufferFormat,
-            referenceFrame->chromaOffsets,
-            referenceFrame->numChromaPlanes);
-
-        std::vector<uint8_t> mvData;
-        pEnc->RunMotionEstimation(mvData);
-
-        fpOut << "Motion Vectors for input frame = " << iFrame << ", reference frame = " << iReferenceFrame << std::endl;
-        if (pInitParam->IsCodecH264())
+        for (uint32_t i = 0; i < nFrame - 1 && !queue.IsAborted(); i++)
         {
-            int m = ((nWidth + 15) / 16) * ((nHeight + 15) / 16);
-            fpOut << "block, mb_type, partitionType, "
-                << "MV[0].x, MV[0].y, MV[1].x, MV[1].y, MV[2].x, MV[2].y, MV[3].x, MV[3].y, cost" << std::endl;
+            uint32_t iReferenceFrame = i, iFrame = i + 1;
 
-            NV_ENC_H264_MV_DATA *outputMV = (NV_ENC_H264_MV_DATA *)mvData.data();
-            for (int l = 0; l < m; l++) 
-            {
-                fpOut << l << ", " << static_cast<int>(outputMV[l].mbType) << ", " << static_cast<int>(outputMV[l].partitionType) << ", " <<
-                    outputMV[l].mv[0].mvx << ", " << outputMV[l].mv[0].mvy << ", " << outputMV[l].mv[1].mvx << ", " << outputMV[l].mv[1].mvy << ", " <<
-                    outputMV[l].mv[2].mvx << ", " << outputMV[l].mv[2].mvy << ", " << outputMV[l].mv[3].mvx << ", " << outputMV[l].mv[3].mvy << ", " << outputMV[l].mbCost;
-                fpOut << std::endl;
-            }
-        } else {
-            int m = ((nWidth + 31) / 32) * ((nHeight + 31) / 32);
-            fpOut << "ctb, cuType, cuSize, partitionMode, " <<
-                "MV[0].x, MV[0].y, MV[1].x, MV[1].y, MV[2].x, MV[2].y, MV[3].x, MV[3].y" << std::endl;
-            NV_ENC_HEVC_MV_DATA *outputMV = (NV_ENC_HEVC_MV_DATA *)mvData.data();
-            bool lastCUInCTB = false;
-            for (int l = 0; l < m;) 
-            {
-                do 
-                {
-                    lastCUInCTB = outputMV->lastCUInCTB ? true : false;
-                    fpOut << l << ", " << static_cast<int>(outputMV->cuType) << ", " << static_cast<int>(outputMV->cuSize) << ", " << static_cast<int>(outputMV->partitionMode) << ", " <<
-                    outputMV->mv[0].mvx << ", " << outputMV->mv[0].mvy << ", " << outputMV->mv[1].mvx << ", " << outputMV->mv[1].mvy << ", " <<
-                    outputMV->mv[2].mvx << ", " << outputMV->mv[2].mvy << ", " << outputMV->mv[3].mvx << ", " << outputMV->mv[3].mvy << std::endl;
-
-                    outputMV += 1;
-                    l++;
-                } while (!lastCUInCTB);
-            }
+            const NvEncInputFrame* inputFrame = pEnc->GetNextInputFrame();
+            const NvEncInputFrame* referenceFrame = pEnc->GetNextReferenceFrame();
+
+            NvEncoderCuda::CopyToDeviceFrame(reinterpret_cast<CUcontext>(pEnc->GetDevice()),
+                reader.GetFrame(iFrame),
+                0, 
+                (CUdeviceptr)inputFrame->inputPtr,
+                (uint32_t)inputFrame->pitch,
+                pEnc->GetEncodeWidth(),
+                pEnc->GetEncodeHeight(),
+                CU_MEMORYTYPE_HOST,
+                inputFrame->bufferFormat,
+                inputFrame->chromaOffsets,
+                inputFrame->numChromaPlanes);
+
+            NvEncoderCuda::CopyToDeviceFrame(reinterpret_cast<CUcontext>(pEnc->GetDevice()),
+                reader.GetFrame(iReferenceFrame),
+                0,
+                (CUdeviceptr)referenceFrame->inputPtr,
+                (uint32_t)referenceFrame->pitch,
+                pEnc->GetEncodeWidth(),
+                pEnc->GetEncodeHeight(),
+                CU_MEMORYTYPE_HOST,
+                referenceFrame->bufferFormat,
+                referenceFrame->chromaOffsets,
+                referenceFrame->numChromaPlanes);
+
+            MvJob job;
+            job.iFrame = iFrame;
+            job.iReferenceFrame = iReferenceFrame;
+            job.vMvData = queue.GetFreeBuffer();
+            pEnc->RunMotionEstimation(job.vMvData);
+            queue.Push(job);
         }
     }
-    fpOut.close();
+    catch (...)
+    {
+        queue.Abort();
+        thSink.join();
+        throw;
+    }
+    queue.Close();
+    thSink.join();
+    if (sinkException)
+    {
+        std::rethrow_exception(sinkException);
+    }
+}
 
-    std::cout << "Motion vectors saved in file " << szOutFilePath << std::endl;
+/**
+*  @brief Writes a binary motion vector file as text. Needs no GPU.
+*/
+void ConvertToText(const char *szInFilePath, const char *szOutFilePath)
+{
+    NvMvFileReader reader(szInFilePath);
+    std::ofstream fpOut(szOutFilePath, std::ios::out);
+    if (!fpOut)
+    {
+        std::ostringstream err;
+        err << "Unable to open output file: " << szOutFilePath << std::endl;
+        throw std::invalid_argument(err.str());
+    }
+    NvMvWriteText(reader, fpOut);
+    fpOut.close();
+    std::cout << "Motion vectors of " << reader.GetFrameCount() << " frames saved as text in file " << szOutFilePath << std::endl;
 }
 
 void ShowHelpAndExit(const char *szBadOption = NULL)
@@ -147,11 +324,15 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
     }
     oss << "Options:" << std::endl
         << "-i           Input file path" << std::endl
-        << "-o           Output file path" << std::endl
+        << "-o           Output file path (binary motion vector file)" << std::endl
         << "-s           Input resolution in this form: WxH" << std::endl
         << "-if          Input format: iyuv nv12 yuv444 p010 yuv444p16 bgra" << std::endl
         << "-gpu         Ordinal of GPU to use" << std::endl
         << "-frame       Number of frames to encode" << std::endl
+        << "-stats       Per-frame analytics (global motion, region energy, scene change) CSV file path" << std::endl
+        << "-region      Number of regions for motion energy in this form: CxR" << std::endl
+        << "-sc          Scene change score threshold (0 to 1)" << std::endl
+        << "-totext      Convert the binary motion vector file given with -i into text written to -o" << std::endl
         ;
     oss << NvEncoderInitParam().GetHelpMessage(true);
     if (bThrowError)
@@ -167,7 +348,8 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
 
 void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth, int &nHeight, 
     NV_ENC_BUFFER_FORMAT &eFormat, char *szOutputFileName, NvEncoderInitParam &initParam, 
-    int &iGpu, uint32_t &nFrame) 
+    int &iGpu, uint32_t &nFrame, char *szStatsFileName, int &nRegionX, int &nRegionY, float &fSceneChangeThreshold,
+    bool &bToText) 
 {
     std::ostringstream oss;
     int i;
@@ -253,6 +435,37 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
             nFrame = atoi(argv[i]);
             continue;
         }
+        if (!_stricmp(argv[i], "-stats"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-stats");
+            }
+            sprintf(szStatsFileName, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-region"))
+        {
+            if (++i == argc || 2 != sscanf(argv[i], "%dx%d", &nRegionX, &nRegionY) || nRegionX <= 0 || nRegionY <= 0)
+            {
+                ShowHelpAndExit("-region");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-sc"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-sc");
+            }
+            fSceneChangeThreshold = (float)atof(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-totext"))
+        {
+            bToText = true;
+            continue;
+        }
         // Regard as encoder parameter
         if (argv[i][0] != '-')
         {
@@ -272,15 +485,23 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
 *  motion vectors. The application uses the CUDA device type and associated
 *  buffers when demonstrating the usage of the ME-only mode but can be used
 *  with other device types like D3D and OpenGL.
+*  Motion vectors are written in the compact binary layout described in Utils/MvFile.h,
+*  which can be memory-mapped by consumers; -totext converts such a file to text.
+*  With -stats, global motion, per-region motion energy and scene change scores are
+*  computed on the CPU while the GPU works on the following frames.
 */
 int main(int argc, char **argv)
 {
     char szInFilePath[256] = "",
-        szOutFilePath[256] = "out.mv.txt";
+        szOutFilePath[256] = "out.mv",
+        szStatsFilePath[256] = "";
     int nWidth = 1920, nHeight = 1080;
     NV_ENC_BUFFER_FORMAT eFormat = NV_ENC_BUFFER_FORMAT_IYUV;
     int iGpu = 0;
     uint32_t nFrame = 0;
+    int nRegionX = 4, nRegionY = 4;
+    float fSceneChangeThreshold = 0.5f;
+    bool bToText = false;
     try
     {
         using NvEncCudaPtr = std::unique_ptr<NvEncoderCuda, std::function<void(NvEncoderCuda*)>>;
@@ -294,10 +515,17 @@ int main(int argc, char **argv)
         };
         
         NvEncoderInitParam encodeCLIOptions;
-        ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eFormat, szOutFilePath, encodeCLIOptions, iGpu, nFrame);
+        ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eFormat, szOutFilePath, encodeCLIOptions, iGpu, nFrame,
+            szStatsFilePath, nRegionX, nRegionY, fSceneChangeThreshold, bToText);
 
         CheckInputFile(szInFilePath);
 
+        if (bToText)
+        {
+            ConvertToText(szInFilePath, szOutFilePath);
+            return 0;
+        }
+
         ck(cuInit(0));
         int nGpu = 0;
         ck(cuDeviceGetCount(&nGpu));
@@ -323,7 +551,8 @@ int main(int argc, char **argv)
 
         pEnc->CreateEncoder(&initializeParams);
 
-        MotionEstimationWithBufferedFile(pEnc.get(), nWidth, nHeight, &encodeCLIOptions, szInFilePath, szOutFilePath, nFrame);
+        MotionEstimationWithBufferedFile(pEnc.get(), nWidth, nHeight, &encodeCLIOptions, szInFilePath, szOutFilePath,
+            szStatsFilePath, nRegionX, nRegionY, fSceneChangeThreshold, nFrame);
     }
     catch (const std::exception &ex)
     {
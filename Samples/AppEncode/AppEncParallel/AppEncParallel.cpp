@@ -0,0 +1,517 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <stdio.h>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <cuda.h>
+#include "NvEncoder/NvEncoderCuda.h"
+#include "../Utils/NvEncoderCLIOptions.h"
+#include "../Utils/NvCodecUtils.h"
+#include "../Utils/NalUnitParser.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+/**
+*  @brief Hands finished segments from the encoding threads to the writer in input order.
+*  Encoding threads may run at most nMaxPending segments ahead of the writer, which bounds
+*  the amount of bitstream held in memory.
+*/
+class SegmentQueue
+{
+public:
+    SegmentQueue(int nSegment, int nMaxPending) : m_nSegment(nSegment), m_nMaxPending(nMaxPending) {}
+
+    /**
+    *  @brief Returns the index of the next segment to encode, or -1 when there is none left.
+    *  Blocks while the caller would get too far ahead of the writer.
+    */
+    int Acquire()
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        int iSeg = m_iNextAcquire;
+        if (iSeg >= m_nSegment || m_bAbort)
+        {
+            return -1;
+        }
+        m_iNextAcquire++;
+        m_cv.wait(lock, [&] { return m_bAbort || iSeg < m_iNextWrite + m_nMaxPending; });
+        return m_bAbort ? -1 : iSeg;
+    }
+
+    void Complete(int iSeg, std::vector<std::vector<uint8_t>> &vPacket)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_mapDone[iSeg].swap(vPacket);
+        m_cv.notify_all();
+    }
+
+    /**
+    *  @brief Waits until segment iSeg is done and moves its packets out.
+    *  Returns false if encoding was aborted.
+    */
+    bool Take(int iSeg, std::vector<std::vector<uint8_t>> &vPacket)
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cv.wait(lock, [&] { return m_bAbort || m_mapDone.count(iSeg); });
+        if (m_bAbort)
+        {
+            return false;
+        }
+        vPacket.swap(m_mapDone[iSeg]);
+        m_mapDone.erase(iSeg);
+        m_iNextWrite = iSeg + 1;
+        m_cv.notify_all();
+        return true;
+    }
+
+    void Abort()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_bAbort = true;
+        m_cv.notify_all();
+    }
+
+private:
+    const int m_nSegment, m_nMaxPending;
+    int m_iNextAcquire = 0, m_iNextWrite = 0;
+    bool m_bAbort = false;
+    std::map<int, std::vector<std::vector<uint8_t>>> m_mapDone;
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+};
+
+/**
+*  @brief Writes segments back to back, dropping parameter sets that repeat the ones already
+*  written. Each segment starts with an IDR carrying its own SPS/PPS (and VPS); since all
+*  sessions share one configuration these are normally byte-identical to the previous ones
+*  and only the first copy is kept. A parameter set whose content changed is always written.
+*/
+class SegmentSplicer
+{
+public:
+    SegmentSplicer(std::ofstream &fpOut, bool bHevc) : m_fpOut(fpOut), m_parser(bHevc) {}
+
+    void Write(const std::vector<std::vector<uint8_t>> &vPacket)
+    {
+        for (const std::vector<uint8_t> &packet : vPacket)
+        {
+            m_parser.ForEach(packet.data(), packet.size(), [&](const NalUnitParser::NalUnit &nal)
+            {
+                if (m_parser.IsParameterSet(nal.nType))
+                {
+                    std::vector<uint8_t> &last = m_mapParamSet[nal.nType];
+                    const uint8_t *pPayload = nal.pStart + nal.nHeaderOffset;
+                    size_t nPayload = nal.nSize - nal.nHeaderOffset;
+                    if (last.size() == nPayload && std::equal(last.begin(), last.end(), pPayload))
+                    {
+                        m_nDropped++;
+                        return true;
+                    }
+                    last.assign(pPayload, pPayload + nPayload);
+                }
+                m_fpOut.write(reinterpret_cast<const char*>(nal.pStart), nal.nSize);
+                return true;
+            });
+        }
+    }
+
+    int GetDroppedCount() const { return m_nDropped; }
+
+private:
+    std::ofstream &m_fpOut;
+    NalUnitParser m_parser;
+    std::map<int, std::vector<uint8_t>> m_mapParamSet;
+    int m_nDropped = 0;
+};
+
+void EncProc(NvEncoder *pEnc, const char *szInFilePath, int nSegmentFrame, int nFrameTotal,
+    SegmentQueue *pQueue, std::exception_ptr &encException)
+{
+    try
+    {
+        std::ifstream fpIn(szInFilePath, std::ifstream::in | std::ifstream::binary);
+        if (!fpIn)
+        {
+            std::ostringstream err;
+            err << "Unable to open input file: " << szInFilePath << std::endl;
+            throw std::invalid_argument(err.str());
+        }
+        CUcontext cuContext = (CUcontext)pEnc->GetDevice();
+        int nFrameSize = pEnc->GetFrameSize();
+        std::unique_ptr<uint8_t[]> pHostFrame(new uint8_t[nFrameSize]);
+
+        NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        reconfigureParams.reInitEncodeParams.encodeConfig = &encodeConfig;
+        pEnc->GetInitializeParams(&reconfigureParams.reInitEncodeParams);
+        // Start every segment from a freshly reset rate control state
+        reconfigureParams.resetEncoder = 1;
+        reconfigureParams.forceIDR = 1;
+
+        bool bFirstSegment = true;
+        std::vector<std::vector<uint8_t>> vPacket, vSegmentPacket;
+        for (int iSeg = pQueue->Acquire(); iSeg >= 0; iSeg = pQueue->Acquire())
+        {
+            if (!bFirstSegment)
+            {
+                pEnc->Reconfigure(&reconfigureParams);
+            }
+            bFirstSegment = false;
+
+            int iFrameBegin = iSeg * nSegmentFrame;
+            int iFrameEnd = (std::min)(iFrameBegin + nSegmentFrame, nFrameTotal);
+            fpIn.clear();
+            fpIn.seekg((std::streamoff)iFrameBegin * nFrameSize);
+            vSegmentPacket.clear();
+            for (int iFrame = iFrameBegin; iFrame < iFrameEnd; iFrame++)
+            {
+                if (fpIn.read(reinterpret_cast<char*>(pHostFrame.get()), nFrameSize).gcount() != nFrameSize)
+                {
+                    NVENC_THROW_ERROR("Unexpected end of input file", NV_ENC_ERR_GENERIC);
+                }
+                const NvEncInputFrame* encoderInputFrame = pEnc->GetNextInputFrame();
+                NvEncoderCuda::CopyToDeviceFrame(cuContext, pHostFrame.get(), 0, (CUdeviceptr)encoderInputFrame->inputPtr,
+                    (int)encoderInputFrame->pitch,
+                    pEnc->GetEncodeWidth(),
+                    pEnc->GetEncodeHeight(),
+                    CU_MEMORYTYPE_HOST,
+                    encoderInputFrame->bufferFormat,
+                    encoderInputFrame->chromaOffsets,
+                    encoderInputFrame->numChromaPlanes);
+
+                // The first picture of a segment must be a self-contained IDR
+                NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
+                picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+                pEnc->EncodeFrame(vPacket, iFrame == iFrameBegin ? &picParams : nullptr);
+                vSegmentPacket.insert(vSegmentPacket.end(), vPacket.begin(), vPacket.end());
+            }
+            // Flushing closes the segment: no later frame can reference into it
+            pEnc->EndEncode(vPacket);
+            vSegmentPacket.insert(vSegmentPacket.end(), vPacket.begin(), vPacket.end());
+            pQueue->Complete(iSeg, vSegmentPacket);
+        }
+    }
+    catch (const std::exception&)
+    {
+        encException = std::current_exception();
+        pQueue->Abort();
+    }
+}
+
+void ShowHelpAndExit(const char *szBadOption = NULL)
+{
+    bool bThrowError = false;
+    std::ostringstream oss;
+    if (szBadOption)
+    {
+        bThrowError = true;
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
+    }
+    oss << "Options:" << std::endl
+        << "-i           Input file path" << std::endl
+        << "-o           Output file path" << std::endl
+        << "-s           Input resolution in this form: WxH" << std::endl
+        << "-if          Input format: iyuv nv12 yuv444 p010 yuv444p16 bgra" << std::endl
+        << "-gpu         Ordinal of GPU to use" << std::endl
+        << "-thread      Number of encoding sessions (default is 2)" << std::endl
+        << "-seglen      Frames per segment, rounded up to whole GOPs (default is 300)" << std::endl
+        ;
+    oss << NvEncoderInitParam().GetHelpMessage();
+    if (bThrowError)
+    {
+        throw std::invalid_argument(oss.str());
+    }
+    else
+    {
+        std::cout << oss.str();
+        exit(0);
+    }
+}
+
+void ParseCommandLine(int argc, char *argv[], char *szInputFileName, char *szOutputFileName,
+    int &nWidth, int &nHeight, NV_ENC_BUFFER_FORMAT &eFormat, int &iGpu, int &nThread,
+    int &nSegmentFrame, NvEncoderInitParam &initParam)
+{
+    std::ostringstream oss;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!_stricmp(argv[i], "-h"))
+        {
+            ShowHelpAndExit();
+        }
+        if (!_stricmp(argv[i], "-i"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-i");
+            }
+            sprintf(szInputFileName, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-o"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-o");
+            }
+            sprintf(szOutputFileName, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-s"))
+        {
+            if (++i == argc || 2 != sscanf(argv[i], "%dx%d", &nWidth, &nHeight))
+            {
+                ShowHelpAndExit("-s");
+            }
+            continue;
+        }
+        std::vector<std::string> vszFileFormatName =
+        {
+            "iyuv", "nv12", "yv12", "yuv444", "p010", "yuv444p16", "bgra", "argb10", "ayuv", "abgr", "abgr10"
+        };
+        NV_ENC_BUFFER_FORMAT aFormat[] =
+        {
+            NV_ENC_BUFFER_FORMAT_IYUV,
+            NV_ENC_BUFFER_FORMAT_NV12,
+            NV_ENC_BUFFER_FORMAT_YV12,
+            NV_ENC_BUFFER_FORMAT_YUV444,
+            NV_ENC_BUFFER_FORMAT_YUV420_10BIT,
+            NV_ENC_BUFFER_FORMAT_YUV444_10BIT,
+            NV_ENC_BUFFER_FORMAT_ARGB,
+            NV_ENC_BUFFER_FORMAT_ARGB10,
+            NV_ENC_BUFFER_FORMAT_AYUV,
+            NV_ENC_BUFFER_FORMAT_ABGR,
+            NV_ENC_BUFFER_FORMAT_ABGR10,
+        };
+        if (!_stricmp(argv[i], "-if"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-if");
+            }
+            auto it = std::find(vszFileFormatName.begin(), vszFileFormatName.end(), argv[i]);
+            if (it == vszFileFormatName.end())
+            {
+                ShowHelpAndExit("-if");
+            }
+            eFormat = aFormat[it - vszFileFormatName.begin()];
+            continue;
+        }
+        if (!_stricmp(argv[i], "-gpu"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-gpu");
+            }
+            iGpu = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-thread"))
+        {
+            if (++i == argc || (nThread = atoi(argv[i])) <= 0)
+            {
+                ShowHelpAndExit("-thread");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-seglen"))
+        {
+            if (++i == argc || (nSegmentFrame = atoi(argv[i])) <= 0)
+            {
+                ShowHelpAndExit("-seglen");
+            }
+            continue;
+        }
+        // Regard as encoder parameter
+        if (argv[i][0] != '-')
+        {
+            ShowHelpAndExit(argv[i]);
+        }
+        oss << argv[i] << " ";
+        while (i + 1 < argc && argv[i + 1][0] != '-')
+        {
+            oss << argv[++i] << " ";
+        }
+    }
+    initParam = NvEncoderInitParam(oss.str().c_str());
+}
+
+/**
+*  @brief Adjusts the parameters so that independently encoded segments splice into one
+*  valid stream that behaves like a single-session encode with closed GOPs.
+*  Returns the segment length, rounded up to a whole number of GOPs.
+*/
+int SetSegmentParams(NV_ENC_INITIALIZE_PARAMS *pInitializeParams, bool bHevc, int nSegmentFrame)
+{
+    NV_ENC_CONFIG *pConfig = pInitializeParams->encodeConfig;
+    if (pConfig->gopLength == NVENC_INFINITE_GOPLENGTH || (int)pConfig->gopLength > nSegmentFrame)
+    {
+        pConfig->gopLength = nSegmentFrame;
+    }
+    nSegmentFrame = (nSegmentFrame + pConfig->gopLength - 1) / pConfig->gopLength * pConfig->gopLength;
+
+    // Every GOP is closed, so the cut points are indistinguishable from regular GOP boundaries
+    if (bHevc)
+    {
+        pConfig->encodeCodecConfig.hevcConfig.idrPeriod = pConfig->gopLength;
+    }
+    else
+    {
+        pConfig->encodeCodecConfig.h264Config.idrPeriod = pConfig->gopLength;
+    }
+
+    // Each session resets rate control at the start of its segment. Starting the VBV model
+    // from a full buffer gives every segment the same initial state, so the boundary frames
+    // get the same treatment no matter which session encoded the previous segment.
+    NV_ENC_RC_PARAMS &rcParams = pConfig->rcParams;
+    if (rcParams.rateControlMode != NV_ENC_PARAMS_RC_CONSTQP && rcParams.vbvBufferSize)
+    {
+        rcParams.vbvInitialDelay = rcParams.vbvBufferSize;
+    }
+    return nSegmentFrame;
+}
+
+/**
+*  This sample application splits a long raw input into segments made of whole closed GOPs,
+*  encodes the segments concurrently on several encoder sessions (one host thread and one
+*  CUDA context per session) and splices the resulting bitstreams back together in order.
+*  Parameter sets repeated at the start of every segment are written only once. On systems
+*  with GeForce GPUs the number of simultaneous encode sessions is restricted to 2.
+*/
+int main(int argc, char **argv)
+{
+    char szInFilePath[256] = "", szOutFilePath[256] = "out.h264";
+    int nWidth = 1920, nHeight = 1080;
+    NV_ENC_BUFFER_FORMAT eFormat = NV_ENC_BUFFER_FORMAT_IYUV;
+    int iGpu = 0;
+    int nThread = 2;
+    int nSegmentFrame = 300;
+    std::vector<std::exception_ptr> vExceptionPtrs;
+    using NvEncPtr = std::unique_ptr<NvEncoder, std::function<void(NvEncoder*)>>;
+    auto EncodeDeleteFunc = [](NvEncoder *pEnc)
+    {
+        if (pEnc)
+        {
+            pEnc->DestroyEncoder();
+            delete pEnc;
+        }
+    };
+    try
+    {
+        NvEncoderInitParam encodeCLIOptions;
+        ParseCommandLine(argc, argv, szInFilePath, szOutFilePath, nWidth, nHeight, eFormat,
+            iGpu, nThread, nSegmentFrame, encodeCLIOptions);
+
+        CheckInputFile(szInFilePath);
+
+        std::ofstream fpOut(szOutFilePath, std::ios::out | std::ios::binary);
+        if (!fpOut)
+        {
+            std::ostringstream err;
+            err << "Unable to open output file: " << szOutFilePath << std::endl;
+            throw std::invalid_argument(err.str());
+        }
+
+        ck(cuInit(0));
+        int nGpu = 0;
+        ck(cuDeviceGetCount(&nGpu));
+        if (iGpu < 0 || iGpu >= nGpu) {
+            std::cout << "GPU ordinal out of range. Should be within [" << 0 << ", " << nGpu - 1 << "]" << std::endl;
+            return 1;
+        }
+        CUdevice cuDevice = 0;
+        ck(cuDeviceGet(&cuDevice, iGpu));
+        char szDeviceName[80];
+        ck(cuDeviceGetName(szDeviceName, sizeof(szDeviceName), cuDevice));
+        std::cout << "GPU in use: " << szDeviceName << std::endl;
+
+        std::vector<NvEncPtr> vEnc;
+        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        initializeParams.encodeConfig = &encodeConfig;
+        for (int i = 0; i < nThread; i++)
+        {
+            CUcontext cuContext = NULL;
+            ck(cuCtxCreate(&cuContext, CU_CTX_SCHED_BLOCKING_SYNC, cuDevice));
+            NvEncPtr pEnc(new NvEncoderCuda(cuContext, nWidth, nHeight, eFormat), EncodeDeleteFunc);
+            if (i == 0)
+            {
+                pEnc->CreateDefaultEncoderParams(&initializeParams, encodeCLIOptions.GetEncodeGUID(), encodeCLIOptions.GetPresetGUID());
+                encodeCLIOptions.SetInitParams(&initializeParams, eFormat);
+                nSegmentFrame = SetSegmentParams(&initializeParams, encodeCLIOptions.IsCodecHEVC(), nSegmentFrame);
+            }
+            // All sessions must share exactly the same configuration for the segments to splice
+            pEnc->CreateEncoder(&initializeParams);
+            vEnc.push_back(std::move(pEnc));
+        }
+
+        std::ifstream fpIn(szInFilePath, std::ifstream::in | std::ifstream::binary);
+        fpIn.seekg(0, std::ios::end);
+        int nFrameTotal = (int)(fpIn.tellg() / vEnc[0]->GetFrameSize());
+        int nSegment = (nFrameTotal + nSegmentFrame - 1) / nSegmentFrame;
+        std::cout << "Encoding " << nFrameTotal << " frames in " << nSegment << " segments of up to "
+            << nSegmentFrame << " frames on " << nThread << " sessions" << std::endl;
+
+        SegmentQueue queue(nSegment, 2 * nThread);
+        std::vector<NvThread> vThread;
+        vExceptionPtrs.resize(nThread);
+        StopWatch w;
+        w.Start();
+        for (int i = 0; i < nThread; i++)
+        {
+            vThread.push_back(NvThread(std::thread(EncProc, vEnc[i].get(), szInFilePath,
+                nSegmentFrame, nFrameTotal, &queue, std::ref(vExceptionPtrs[i]))));
+        }
+
+        SegmentSplicer splicer(fpOut, encodeCLIOptions.IsCodecHEVC());
+        std::vector<std::vector<uint8_t>> vPacket;
+        int nPacket = 0;
+        for (int iSeg = 0; iSeg < nSegment && queue.Take(iSeg, vPacket); iSeg++)
+        {
+            splicer.Write(vPacket);
+            nPacket += (int)vPacket.size();
+        }
+
+        for (auto& t : vThread)
+            t.join();
+
+        double t = w.Stop();
+
+        for (int i = 0; i < nThread; i++)
+        {
+            if (vExceptionPtrs[i])
+                std::rethrow_exception(vExceptionPtrs[i]);
+        }
+
+        fpOut.close();
+        std::cout << "Total frames encoded: " << nPacket << ", duplicate parameter sets dropped: "
+            << splicer.GetDroppedCount() << std::endl;
+        if (t)
+        {
+            std::cout << "time=" << t << " seconds, FPS=" << nPacket / t << std::endl;
+        }
+        std::cout << "Saved in file " << szOutFilePath << std::endl;
+    }
+    catch (const std::exception &ex)
+    {
+        std::cout << ex.what();
+        exit(1);
+    }
+
+    return 0;
+}
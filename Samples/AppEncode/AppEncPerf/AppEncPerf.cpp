@@ -18,18 +18,28 @@
 #include "NvEncoder/NvEncoderCuda.h"
 #include "../Utils/NvEncoderCLIOptions.h"
 #include "../Utils/NvCodecUtils.h"
+#include "../Utils/NvCudaContext.h"
+#include "../Utils/FrameGenerator.h"
 
 simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
 
-void EncProc(NvEncoder *pEnc, uint8_t *pBuf, uint32_t nBufSize, uint32_t nFrameTotal,
-    std::exception_ptr &encException)
+void EncProc(NvEncoder *pEnc, uint8_t *pBuf, uint64_t nBufSize, uint32_t nFrameTotal, bool bBind,
+    NvCudaContextScope::Stats *pStats, std::exception_ptr &encException)
 {
     try
     {
         std::vector<std::vector<uint8_t>> vPacket;
         uint64_t nFrameSize = pEnc->GetFrameSize();
         uint32_t n = static_cast<uint32_t>(nBufSize / nFrameSize);
-        ck(cuCtxSetCurrent((CUcontext)pEnc->GetDevice()));
+        if (bBind)
+        {
+            // The copies below find the context current and skip their push and pop
+            ck(NvCudaContextScope::Bind((CUcontext)pEnc->GetDevice()));
+        }
+        else
+        {
+            ck(cuCtxSetCurrent((CUcontext)pEnc->GetDevice()));
+        }
         for (uint32_t i = 0; i < nFrameTotal; i++)
         {
             uint32_t iFrame = i / n % 2 ? (n - i % n - 1) : i % n;
@@ -54,6 +64,7 @@ void EncProc(NvEncoder *pEnc, uint8_t *pBuf, uint32_t nBufSize, uint32_t nFrameT
     {
         encException = std::current_exception();
     }
+    *pStats = NvCudaContextScope::GetThreadStats();
 }
 
 void ShowHelpAndExit(const char *szBadOption = NULL)
@@ -67,12 +78,17 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
     }
     oss << "Options:" << std::endl
         << "-i           Input file path" << std::endl
+        << "-synth       Number of synthetic frames to render and encode in a loop instead of reading -i" << std::endl
+        << "-noise       Noise amplitude of synthetic frames in bits, 0 to 8 (default is 2)" << std::endl
+        << "-scenecut    Scene length of synthetic frames in frames (default is 0, a single scene)" << std::endl
         << "-s           Input resolution in this form: WxH" << std::endl
         << "-if          Input format: iyuv nv12 yuv444 p010 yuv444p16 bgra" << std::endl
         << "-gpu         Ordinal of GPU to use" << std::endl
         << "-frame       Number of frames to encode per thread (default is 1000)" << std::endl
         << "-thread      Number of encoding thread (default is 2)" << std::endl
         << "-single      (No value) Use single context (this may result in suboptimal performance; default is multiple contexts)" << std::endl
+        << "-primary     (No value) Use the primary context of the GPU, shared by all threads, and a single copy of the frames" << std::endl
+        << "-nobind      (No value) Push and pop the context around every frame copy, rather than keep it current on each thread" << std::endl
         ;
     oss << NvEncoderInitParam().GetHelpMessage();
     if (bThrowError)
@@ -88,7 +104,7 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
 
 void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth, int &nHeight, 
     NV_ENC_BUFFER_FORMAT &eFormat, int &iGpu, uint32_t &nFrame, int &nThread, 
-    bool &bSingle, NvEncoderInitParam &initParam) 
+    bool &bSingle, bool &bPrimary, bool &bNoBind, NvEncoderInitParam &initParam, int &nSynthFrame, FrameGeneratorParams &synthParams) 
 {
     std::ostringstream oss;
     for (int i = 1; i < argc; i++)
@@ -178,6 +194,40 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
             bSingle = true;
             continue;
         }
+        if (!_stricmp(argv[i], "-primary"))
+        {
+            bPrimary = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-nobind"))
+        {
+            bNoBind = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-synth"))
+        {
+            if (++i == argc || (nSynthFrame = atoi(argv[i])) <= 0)
+            {
+                ShowHelpAndExit("-synth");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-noise"))
+        {
+            if (++i == argc || (synthParams.nNoiseBits = atoi(argv[i])) < 0 || synthParams.nNoiseBits > 8)
+            {
+                ShowHelpAndExit("-noise");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-scenecut"))
+        {
+            if (++i == argc || (synthParams.nSceneLength = atoi(argv[i])) < 0)
+            {
+                ShowHelpAndExit("-scenecut");
+            }
+            continue;
+        }
         // Regard as encoder parameter
         if (argv[i][0] != '-')
         {
@@ -200,6 +250,11 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
 *  The application creates 2 host threads, each with a separate encode session, by
 *  default. Note that on systems with GeForce GPUs, the number of simultaneous encode
 *  sessions allowed on the system is restricted to 2 sessions.
+*  With "-synth" the frames are rendered by FrameGenerator instead of being read from a
+*  file, so runs can be reproduced without raw video fixtures.
+*  Each thread keeps its context current, so the frame copies need not push and pop it; the
+*  application reports the pushes made and saved and what a push and pop costs, and "-nobind"
+*  measures the encoding without it. "-primary" shares the primary context of the GPU.
 */
 
 int main(int argc, char **argv)
@@ -211,6 +266,10 @@ int main(int argc, char **argv)
     uint32_t nFrame = 1000;
     int nThread = 2;
     bool bSingle = false;
+    bool bPrimary = false;
+    bool bNoBind = false;
+    int nSynthFrame = 0;
+    FrameGeneratorParams synthParams;
     std::vector<std::exception_ptr> vExceptionPtrs;
     std::vector<CUdeviceptr> vdpBuf;
     using NvEncPtr = std::unique_ptr<NvEncoder, std::function<void(NvEncoder*)>>;
@@ -226,9 +285,12 @@ int main(int argc, char **argv)
     {
         NvEncoderInitParam encodeCLIOptions;
         ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eFormat,
-            iGpu, nFrame, nThread, bSingle, encodeCLIOptions);
+            iGpu, nFrame, nThread, bSingle, bPrimary, bNoBind, encodeCLIOptions, nSynthFrame, synthParams);
 
-        CheckInputFile(szInFilePath);
+        if (!nSynthFrame)
+        {
+            CheckInputFile(szInFilePath);
+        }
 
         ck(cuInit(0));
         int nGpu = 0;
@@ -244,15 +306,59 @@ int main(int argc, char **argv)
         std::cout << "GPU in use: " << szDeviceName << std::endl;
 
         uint8_t *pBuf = NULL;
-        uint32_t nBufSize = 0;
-        BufferedFileReader bufferedFileReader(szInFilePath, true);
-        if (!bufferedFileReader.GetBuffer(&pBuf, &nBufSize)) {
-            std::cout << "Failed to read file " << szInFilePath << std::endl;
-            return 1;
+        uint64_t nBufSize = 0;
+        std::unique_ptr<BufferedFileReader> pFileReader;
+        std::vector<uint8_t> vSynthFrame;
+        if (nSynthFrame)
+        {
+            // Rendered up front, so the generator does not limit the measured throughput
+            if (!FrameGenerator::IsFormatSupported(eFormat))
+            {
+                ShowHelpAndExit("-if");
+            }
+            FrameGenerator generator(nWidth, nHeight, eFormat, synthParams, (std::max)((int)std::thread::hardware_concurrency(), 1));
+            size_t nFrameSize = generator.GetFrameSize();
+            vSynthFrame.resize(nFrameSize * nSynthFrame);
+            for (int i = 0; i < nSynthFrame; i++)
+            {
+                generator.Generate(i, vSynthFrame.data() + nFrameSize * i);
+            }
+            pBuf = vSynthFrame.data();
+            nBufSize = vSynthFrame.size();
+        }
+        else
+        {
+            pFileReader.reset(new BufferedFileReader(szInFilePath));
+            if (!pFileReader->GetBuffer(&pBuf, &nBufSize)) {
+                std::cout << "Failed to read file " << szInFilePath << std::endl;
+                return 1;
+            }
         }
 
+        NvCudaContextManager contextManager(CU_CTX_SCHED_BLOCKING_SYNC);
         CUcontext cuContext = NULL;
-        ck(cuCtxCreate(&cuContext, CU_CTX_SCHED_BLOCKING_SYNC, cuDevice));
+        if (bPrimary)
+        {
+            // Shared like a single context; NvEncoderCuda needs no lock around it
+            bSingle = true;
+            cuContext = contextManager.GetContext(iGpu);
+            ck(NvCudaContextScope::Bind(cuContext));
+        }
+        else
+        {
+            ck(cuCtxCreate(&cuContext, CU_CTX_SCHED_BLOCKING_SYNC, cuDevice));
+        }
+
+        // Every context holds its own copy of the frames in device memory; of a file larger than
+        // half the free memory only the leading part is used, and only that part is read from disk
+        size_t nFree = 0, nTotal = 0;
+        ck(cuMemGetInfo(&nFree, &nTotal));
+        uint64_t nMaxBufSize = nFree / 2 / (bSingle ? 1 : nThread);
+        if (nBufSize > nMaxBufSize)
+        {
+            LOG(WARNING) << "File is too large - only " << std::setprecision(4) << 100.0 * nMaxBufSize / nBufSize << "% is used";
+            nBufSize = nMaxBufSize;
+        }
 
         std::vector<CUdeviceptr> vdpBuf;
 
@@ -293,6 +399,7 @@ int main(int argc, char **argv)
 
         std::vector<NvThread> vThread;
         vExceptionPtrs.resize(nThread);
+        std::vector<NvCudaContextScope::Stats> vStats(nThread);
         StopWatch w;
         w.Start();
         for (int i = 0; i < nThread; i++) 
@@ -300,7 +407,7 @@ int main(int argc, char **argv)
             vThread.push_back(NvThread(std::thread(EncProc,
                 vEnc[i].get(), 
                 (uint8_t *)(bSingle ? dpBuf : vdpBuf[i]),
-                nBufSize, nFrame, 
+                nBufSize, nFrame, !bNoBind, &vStats[i],
                 std::ref(vExceptionPtrs[i]))));
         }
 
@@ -309,6 +416,14 @@ int main(int argc, char **argv)
 
         double t = w.Stop();
 
+        NvCudaContextScope::Stats stats;
+        for (int i = 0; i < nThread; i++)
+        {
+            stats.nPush += vStats[i].nPush;
+            stats.nSkip += vStats[i].nSkip;
+        }
+        double nsPushPop = NvCudaContextScope::MeasurePushPop((CUcontext)vEnc[0]->GetDevice());
+
         for (int i = 0; i < nThread; i++)
         {
             ck(cuCtxSetCurrent((CUcontext)vEnc[i]->GetDevice()));
@@ -334,6 +449,8 @@ int main(int argc, char **argv)
         {
             int nTotal = nFrame * nThread;
             std::cout << "nTotal=" << nTotal << ", time=" << t << " seconds, FPS=" << nTotal / t << std::endl;
+            std::cout << "Context push/pop: " << stats.nPush << " made, " << stats.nSkip << " saved, " << nsPushPop
+                << " ns each, " << stats.nSkip * nsPushPop / 1e6 << " ms saved" << std::endl;
         }
     }
     catch (const std::exception &ex)
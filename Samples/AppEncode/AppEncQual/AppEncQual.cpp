@@ -13,12 +13,18 @@
 #include <iostream>
 #include <iomanip>
 #include <memory>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <stdexcept>
 #include <stdint.h>
 #include "NvEncoder/NvEncoderCuda.h"
 #include "NvDecoder/NvDecoder.h"
 #include "../Utils/NvEncoderCLIOptions.h"
 #include "../Utils/NvCodecUtils.h"
-#include "PSNR.h"
+#include "../Utils/NvPipeline.h"
+#include "../Utils/VideoMetrics.h"
 
 simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
 
@@ -37,6 +43,13 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
         << "-s           Input resolution in this form: WxH" << std::endl
         << "-if          Input format: iyuv nv12 p010" << std::endl
         << "-gpu         Ordinal of GPU to use" << std::endl
+        << "-csv         Per-frame metrics CSV file path" << std::endl
+        << "-thread      Number of threads for metric computation" << std::endl
+        << "-prefetch    Number of input frames read ahead of the encoders (default is 8)" << std::endl
+        << "-config      Encoder options of one configuration, quoted, e.g. -config \"-preset hq -bitrate 2M\";" << std::endl
+        << "             repeat it to evaluate several configurations against the input in one pass." << std::endl
+        << "             Encoder options outside -config apply to every configuration. With several" << std::endl
+        << "             configurations, -o files get the configuration index appended (out_0.yuv, ...)" << std::endl
         ;
     oss << NvEncoderInitParam().GetHelpMessage(false, false, true);
     if (bThrowError)
@@ -51,20 +64,20 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
 }
 
 void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth, int &nHeight,
-    NV_ENC_BUFFER_FORMAT &eFormat, char *szOutputFileName, NvEncoderInitParam &initParam,
-    int &iGpu)
+    NV_ENC_BUFFER_FORMAT &eFormat, char *szOutputFileName, std::string &strCommonOptions,
+    std::vector<std::string> &vstrConfig, int &iGpu, char *szCsvFileName, int &nThread, int &nPrefetch)
 {
     std::ostringstream oss;
     int i;
     for (i = 1; i < argc; i++)
     {
-        if (!_stricmp(argv[i], "-h")) 
+        if (!_stricmp(argv[i], "-h"))
         {
             ShowHelpAndExit();
         }
         if (!_stricmp(argv[i], "-i"))
         {
-            if (++i == argc) 
+            if (++i == argc)
             {
                 ShowHelpAndExit("-i");
             }
@@ -92,7 +105,7 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
         {
             "iyuv", "nv12", "p010"
         };
-        NV_ENC_BUFFER_FORMAT aFormat[] = 
+        NV_ENC_BUFFER_FORMAT aFormat[] =
         {
             NV_ENC_BUFFER_FORMAT_IYUV,
             NV_ENC_BUFFER_FORMAT_NV12,
@@ -100,7 +113,7 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
         };
         if (!_stricmp(argv[i], "-if"))
         {
-            if (++i == argc) 
+            if (++i == argc)
             {
                 ShowHelpAndExit("-if");
             }
@@ -119,6 +132,34 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
             iGpu = atoi(argv[i]);
             continue;
         }
+        if (!_stricmp(argv[i], "-csv")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-csv");
+            }
+            sprintf(szCsvFileName, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-thread")) {
+            if (++i == argc || atoi(argv[i]) <= 0) {
+                ShowHelpAndExit("-thread");
+            }
+            nThread = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-prefetch")) {
+            if (++i == argc || atoi(argv[i]) <= 0) {
+                ShowHelpAndExit("-prefetch");
+            }
+            nPrefetch = atoi(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-config")) {
+            if (++i == argc) {
+                ShowHelpAndExit("-config");
+            }
+            vstrConfig.push_back(argv[i]);
+            continue;
+        }
         // Regard as encoder parameter
         if (argv[i][0] != '-') {
             ShowHelpAndExit(argv[i]);
@@ -128,11 +169,91 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, int &nWidth
             oss << argv[++i] << " ";
         }
     }
-    initParam = NvEncoderInitParam(oss.str().c_str());
+    strCommonOptions = oss.str();
+    if (vstrConfig.empty())
+    {
+        vstrConfig.push_back("");
+    }
+}
+
+/** With several configurations, out.yuv becomes out_<iConfig>.yuv */
+std::string GetConfigFilePath(const char *szPath, int iConfig, int nConfig)
+{
+    std::string strPath(szPath);
+    if (nConfig == 1)
+    {
+        return strPath;
+    }
+    size_t iDot = strPath.find_last_of('.'), iSlash = strPath.find_last_of("/\\");
+    if (iDot == std::string::npos || (iSlash != std::string::npos && iDot < iSlash))
+    {
+        iDot = strPath.size();
+    }
+    return strPath.substr(0, iDot) + "_" + std::to_string(iConfig) + strPath.substr(iDot);
 }
 
+/**
+*  @brief A frame of the input file, shared by the encoders of all configurations and by the
+*  metric tasks. It returns to the prefetch pool when the last of them lets go of it.
+*/
+struct RefFrame
+{
+    int iFrame = 0;
+    /** As read from the file, for the encoders */
+    std::vector<uint8_t> vRaw;
+    /** Planar copy for the metrics; made by the first metric task that needs it */
+    std::vector<uint8_t> vPlanar;
+    bool bPlanar = false;
+    std::mutex mtx;
+};
+typedef std::shared_ptr<RefFrame> RefFramePtr;
+
+struct EncodedPacket
+{
+    std::vector<uint8_t> vData;
+    /** The frame submitted by the EncodeFrame() call that returned vData; null for EndEncode() */
+    RefFramePtr pRef;
+};
+
+/** A decoded frame, still locked in its decoder, with the input frame it is compared against */
+struct MetricsJob
+{
+    int iConfig;
+    RefFramePtr pRef;
+    std::shared_ptr<uint8_t> pDecFrame;
+};
+
+/** One encoder configuration under evaluation, with its encode/decode sessions and results */
+struct QualConfig
+{
+    std::string strOptions;
+    NvEncoderInitParam initParam;
+    std::unique_ptr<NvEncoderCuda> pEnc;
+    std::unique_ptr<NvDecoder> pDec;
+    double fps = 0;
+    uint64_t nByte = 0;
+    std::atomic<int> nDecoded{0};
+    std::vector<VideoMetricsResult> vResult;
+    std::shared_ptr<NvChannel<RefFramePtr>> pInput;
+    std::shared_ptr<NvChannel<EncodedPacket>> pPacket;
+    /** Metric tasks finish out of order; decoded frames wait here to be written in order */
+    std::ofstream fout;
+    std::mutex mtxOut;
+    std::map<int, std::shared_ptr<uint8_t>> mPending;
+    int iNextOut = 0;
+};
+
+/**
+*  @brief Encodes and decodes the input with every configuration in vstrConfig, and computes the
+*  metrics of each decoded frame against the input. The work is split into stages that run
+*  concurrently: one thread prefetches the input file, each configuration has an encode thread and
+*  a decode thread, and nThread threads compute the metrics of different frames in parallel, each
+*  with its own VideoMetrics. Input frames are read once and shared by all configurations, so a
+*  rate-distortion sweep costs one pass over the file; the slowest configuration sets the pace.
+*/
 template <typename YuvUnit>
-void EncQual(char *szInFilePath, char *szOutFilePath, int nWidth, int nHeight, NV_ENC_BUFFER_FORMAT eFormat, int iGpu, NvEncoderInitParam &encodeCLIOptions)
+void EncQual(char *szInFilePath, char *szOutFilePath, int nWidth, int nHeight, NV_ENC_BUFFER_FORMAT eFormat, int iGpu,
+    const std::string &strCommonOptions, const std::vector<std::string> &vstrConfig, char *szCsvFilePath, int nThread, int nPrefetch)
 {
     ck(cuInit(0));
     int nGpu = 0;
@@ -150,176 +271,441 @@ void EncQual(char *szInFilePath, char *szOutFilePath, int nWidth, int nHeight, N
     CUcontext cuContext = NULL;
     ck(cuCtxCreate(&cuContext, 0, cuDevice));
 
-    NvEncoderCuda enc(cuContext, nWidth, nHeight, eFormat);
+    std::ifstream fpYuv(szInFilePath, std::ifstream::in | std::ifstream::binary);
+    if (!fpYuv)
+    {
+        std::cout << "Unable to open input file: " << szInFilePath << std::endl;
+        exit(1);
+    }
 
-    NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
-    NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
-    initializeParams.encodeConfig = &encodeConfig;
-    enc.CreateDefaultEncoderParams(&initializeParams, encodeCLIOptions.GetEncodeGUID(), encodeCLIOptions.GetPresetGUID());
+    // Frames a configuration may hold before it returns any: its encoder's lookahead, B-frames and
+    // output delay (3 by default), and as many again for the reordering in the decoder
+    const int nQueue = 4;
+    int nMaxDelay = 0, nSize = 0;
+    int nConfig = (int)vstrConfig.size();
+    std::vector<std::unique_ptr<QualConfig>> vpConfig;
+    for (int iConfig = 0; iConfig < nConfig; iConfig++)
+    {
+        vpConfig.emplace_back(new QualConfig);
+        QualConfig &cfg = *vpConfig.back();
+        cfg.strOptions = strCommonOptions + vstrConfig[iConfig];
+        cfg.initParam = NvEncoderInitParam(cfg.strOptions.c_str());
+        cfg.pEnc.reset(new NvEncoderCuda(cuContext, nWidth, nHeight, eFormat));
 
-    encodeCLIOptions.SetInitParams(&initializeParams, eFormat);
+        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        initializeParams.encodeConfig = &encodeConfig;
+        cfg.pEnc->CreateDefaultEncoderParams(&initializeParams, cfg.initParam.GetEncodeGUID(), cfg.initParam.GetPresetGUID());
 
-    enc.CreateEncoder(&initializeParams);
+        cfg.initParam.SetInitParams(&initializeParams, eFormat);
 
-    NvDecoder dec(cuContext, nWidth, nHeight, false, encodeCLIOptions.IsCodecH264() ? cudaVideoCodec_H264 : cudaVideoCodec_HEVC);
+        cfg.pEnc->CreateEncoder(&initializeParams);
+        cfg.fps = initializeParams.frameRateDen ? (double)initializeParams.frameRateNum / initializeParams.frameRateDen : 0;
+        nMaxDelay = (std::max)(nMaxDelay, 2 * (int)encodeConfig.frameIntervalP + (int)encodeConfig.rcParams.lookaheadDepth + 3);
+        nSize = cfg.pEnc->GetFrameSize();
 
-    int nSize = enc.GetFrameSize();
-    std::streamsize nRead = 0;
-    const int nFrame = 32;
-    std::vector<std::unique_ptr<uint8_t[]>> vEncFrame;
-    for (int i = 0; i < nFrame; i++) 
-    {
-        std::unique_ptr<uint8_t[]> frame(new uint8_t[nSize]);
-        vEncFrame.push_back(std::move(frame));
+        cfg.pDec.reset(new NvDecoder(cuContext, nWidth, nHeight, false, cfg.initParam.IsCodecH264() ? cudaVideoCodec_H264 : cudaVideoCodec_HEVC));
     }
 
-    int iEnc = 0, iDec = 0;
-    std::ifstream fpYuv(szInFilePath, std::ifstream::in | std::ifstream::binary);
-    if (!fpYuv)
-    {
-        std::cout << "Unable to open input file: " << szInFilePath << std::endl;
-        exit(1);
-    }
+    fpYuv.seekg(0, std::ios::end);
+    int nFrame = (int)(fpYuv.tellg() / nSize);
+    fpYuv.seekg(0, std::ios::beg);
 
-    int64_t eySum = 0, euSum = 0, evSum = 0;
-    int64_t eyuvMin = INT64_MAX, eyuvMax = INT64_MIN;
-    double sySum = 0, suSum = 0, svSum = 0, syuvSum = 0;
     std::cout << std::setprecision(4) << std::fixed;
-    YuvConverter<YuvUnit> converter(nWidth, nHeight);
-    std::ofstream fout;
-    if (*szOutFilePath)
+    for (int iConfig = 0; iConfig < nConfig; iConfig++)
     {
-        fout.open(szOutFilePath, std::ios::out | std::ios::binary);
-        if (!fout.is_open())
+        QualConfig &cfg = *vpConfig[iConfig];
+        cfg.vResult.resize(nFrame);
+        if (*szOutFilePath)
         {
-            std::cout << "Unable to open output file: " << szOutFilePath << std::endl;
+            std::string strOutFilePath = GetConfigFilePath(szOutFilePath, iConfig, nConfig);
+            cfg.fout.open(strOutFilePath, std::ios::out | std::ios::binary);
+            if (!cfg.fout.is_open())
+            {
+                std::cout << "Unable to open output file: " << strOutFilePath << std::endl;
+                exit(1);
+            }
+        }
+    }
+    std::ofstream fCsv;
+    if (*szCsvFilePath)
+    {
+        fCsv.open(szCsvFilePath, std::ios::out);
+        if (!fCsv.is_open())
+        {
+            std::cout << "Unable to open CSV file: " << szCsvFilePath << std::endl;
             exit(1);
         }
     }
-    int MAX, shift;
+    // P010 carries 10 significant bits in the high bits of each 16-bit sample
+    int nBitDepth, nShift;
     if (eFormat == NV_ENC_BUFFER_FORMAT_YUV420_10BIT)
     {
-        MAX = 1023;
-        shift = 6;
+        nBitDepth = 10;
+        nShift = 6;
     }
     else
     {
-        MAX = 255;
-        shift = 0;
+        nBitDepth = 8;
+        nShift = 0;
     }
 
-    do 
+    /* The input frames in flight: read ahead, queued for or held by the encoders and decoders, or
+       waiting for their metrics. Fewer than that would stall an encoder that still waits for input
+       before it returns its first packet. Declared ahead of the pipeline, which must go first. */
+    int nJobQueue = 2 * nThread;
+    int nPool = nPrefetch + nMaxDelay + 2 * nQueue + nJobQueue + nThread;
+    std::vector<std::unique_ptr<RefFrame>> vpRefFrame;
+    for (int i = 0; i < nPool; i++)
     {
-        nRead = fpYuv.read(reinterpret_cast<char*>(vEncFrame[iEnc % nFrame].get()), nSize).gcount();
-        std::vector<std::vector<uint8_t>> vPacket;
-        if (nRead == nSize)
-        {
-            const NvEncInputFrame* encoderInputFrame = enc.GetNextInputFrame();
+        vpRefFrame.emplace_back(new RefFrame);
+        vpRefFrame.back()->vRaw.resize(nSize);
+    }
 
-            NvEncoderCuda::CopyToDeviceFrame(cuContext, vEncFrame[iEnc++ % nFrame].get(), 0, (CUdeviceptr)encoderInputFrame->inputPtr,
-                (int)encoderInputFrame->pitch, enc.GetEncodeWidth(), enc.GetEncodeHeight(), CU_MEMORYTYPE_HOST, 
-                encoderInputFrame->bufferFormat,
-                encoderInputFrame->chromaOffsets,
-                encoderInputFrame->numChromaPlanes);
+    NvPipeline pipeline;
+    std::shared_ptr<NvChannel<RefFrame *>> pFree = pipeline.CreateChannel<RefFrame *>(nPool);
+    for (std::unique_ptr<RefFrame> &pRefFrame : vpRefFrame)
+    {
+        pFree->Push(pRefFrame.get());
+    }
+    std::shared_ptr<NvChannel<MetricsJob>> pJob = pipeline.CreateChannel<MetricsJob>(nJobQueue);
+    for (std::unique_ptr<QualConfig> &pConfig : vpConfig)
+    {
+        pConfig->pInput = pipeline.CreateChannel<RefFramePtr>(nQueue);
+        pConfig->pPacket = pipeline.CreateChannel<EncodedPacket>(nQueue);
+    }
+    int nRead = 0;
+    std::atomic<int> nDecodeRunning(nConfig);
 
-            enc.EncodeFrame(vPacket);
-        }
-        else
+    pipeline.AddStage("Prefetch", [&](NvPipeline::Stage &stage)
+    {
+        for (int i = 0; i < nFrame; i++)
         {
-            enc.EndEncode(vPacket);
+            RefFrame *pRefFrame;
+            if (!stage.Pop(*pFree, pRefFrame))
+            {
+                return;
+            }
+            if (fpYuv.read(reinterpret_cast<char *>(pRefFrame->vRaw.data()), nSize).gcount() != nSize)
+            {
+                pFree->Push(pRefFrame);
+                break;
+            }
+            pRefFrame->iFrame = i;
+            pRefFrame->bPlanar = false;
+            // The frames are owned by vpRefFrame; the last reference only hands the frame back
+            RefFramePtr pRef(pRefFrame, [pFree](RefFrame *p) { pFree->Push(p); });
+            for (std::unique_ptr<QualConfig> &pConfig : vpConfig)
+            {
+                if (!stage.Push(*pConfig->pInput, pRef))
+                {
+                    return;
+                }
+            }
+            nRead++;
+            stage.AddItem();
         }
-        std::vector<uint8_t> vTmpPacket;
-        for (std::vector<uint8_t> &packet : vPacket)
+        for (std::unique_ptr<QualConfig> &pConfig : vpConfig)
         {
-            vTmpPacket.insert(vTmpPacket.end(), packet.data(), packet.data() + (int)packet.size());
+            pConfig->pInput->Close();
         }
+    });
+
+    for (int iConfig = 0; iConfig < nConfig; iConfig++)
+    {
+        QualConfig &cfg = *vpConfig[iConfig];
+        pipeline.AddStage("Encode " + std::to_string(iConfig), [&cfg, cuContext](NvPipeline::Stage &stage)
+        {
+            NvEncoderCuda &enc = *cfg.pEnc;
+            std::vector<std::vector<uint8_t>> vPacket;
+            RefFramePtr pRef;
+            while (true)
+            {
+                bool bFrame = stage.Pop(*cfg.pInput, pRef);
+                if (bFrame)
+                {
+                    const NvEncInputFrame* encoderInputFrame = enc.GetNextInputFrame();
 
-        uint8_t **apDecFrame;
-        int nFrameReturned = 0;
-        dec.Decode(vTmpPacket.data(), (int)vTmpPacket.size(), &apDecFrame, &nFrameReturned, nRead != nSize);
-        for (int i = 0; i < nFrameReturned; i++)
+                    NvEncoderCuda::CopyToDeviceFrame(cuContext, pRef->vRaw.data(), 0, (CUdeviceptr)encoderInputFrame->inputPtr,
+                        (int)encoderInputFrame->pitch, enc.GetEncodeWidth(), enc.GetEncodeHeight(), CU_MEMORYTYPE_HOST,
+                        encoderInputFrame->bufferFormat,
+                        encoderInputFrame->chromaOffsets,
+                        encoderInputFrame->numChromaPlanes);
+
+                    enc.EncodeFrame(vPacket);
+                    stage.AddItem();
+                }
+                else if (cfg.pInput->IsClosed() && cfg.pPacket->IsClosed())
+                {
+                    // Cancelled
+                    return;
+                }
+                else
+                {
+                    enc.EndEncode(vPacket);
+                    pRef = nullptr;
+                }
+                EncodedPacket packet;
+                for (std::vector<uint8_t> &v : vPacket)
+                {
+                    packet.vData.insert(packet.vData.end(), v.begin(), v.end());
+                }
+                cfg.nByte += packet.vData.size();
+                packet.pRef = std::move(pRef);
+                if (!stage.Push(*cfg.pPacket, std::move(packet)) || !bFrame)
+                {
+                    break;
+                }
+            }
+            cfg.pPacket->Close();
+        });
+
+        pipeline.AddStage("Decode " + std::to_string(iConfig), [&cfg, iConfig, pJob, &nDecodeRunning](NvPipeline::Stage &stage)
         {
-            uint8_t *pEncFrame = vEncFrame[iDec % nFrame].get(), *pDecFrame = apDecFrame[i];
-            if (eFormat != NV_ENC_BUFFER_FORMAT_IYUV)
+            NvDecoder *pDec = cfg.pDec.get();
+            // Input frames submitted to the encoder and not decoded yet, in display order
+            std::deque<RefFramePtr> dqRef;
+            EncodedPacket packet;
+            while (true)
             {
-                converter.UVInterleavedToPlanar((YuvUnit *)pEncFrame);
+                bool bPacket = stage.Pop(*cfg.pPacket, packet);
+                if (bPacket && packet.pRef)
+                {
+                    dqRef.push_back(std::move(packet.pRef));
+                }
+                // An empty packet would end the stream; it only flushes the decoder once the encoder is done
+                if (bPacket && packet.vData.empty())
+                {
+                    continue;
+                }
+                uint8_t **ppFrame = NULL;
+                int nFrameReturned = 0;
+                pDec->DecodeLockFrame(bPacket ? packet.vData.data() : NULL, bPacket ? (int)packet.vData.size() : 0,
+                    &ppFrame, &nFrameReturned);
+                for (int i = 0; i < nFrameReturned; i++)
+                {
+                    if (dqRef.empty())
+                    {
+                        pDec->UnlockFrame(ppFrame + i, nFrameReturned - i);
+                        throw std::runtime_error("The decoder returned more frames than were encoded");
+                    }
+                    MetricsJob job;
+                    job.iConfig = iConfig;
+                    job.pRef = std::move(dqRef.front());
+                    dqRef.pop_front();
+                    job.pDecFrame.reset(ppFrame[i], [pDec](uint8_t *p) { pDec->UnlockFrame(&p, 1); });
+                    cfg.nDecoded++;
+                    stage.AddItem();
+                    if (!stage.Push(*pJob, std::move(job)))
+                    {
+                        pDec->UnlockFrame(ppFrame + i + 1, nFrameReturned - i - 1);
+                        return;
+                    }
+                }
+                if (!bPacket)
+                {
+                    break;
+                }
             }
-            converter.UVInterleavedToPlanar((YuvUnit *)pDecFrame);
-            if (fout.is_open())
+            if (--nDecodeRunning == 0)
+            {
+                pJob->Close();
+            }
+        });
+    }
+
+    for (int k = 0; k < nThread; k++)
+    {
+        pipeline.AddStage("Metrics " + std::to_string(k), [&](NvPipeline::Stage &stage)
+        {
+            YuvConverter<YuvUnit> converter(nWidth, nHeight);
+            VideoMetrics<YuvUnit> metrics(nWidth, nHeight, false, nBitDepth, nShift);
+            MetricsJob job;
+            while (stage.Pop(*pJob, job))
             {
-                fout.write(reinterpret_cast<char*>(pDecFrame), dec.GetFrameSize());
+                QualConfig &cfg = *vpConfig[job.iConfig];
+                RefFrame &ref = *job.pRef;
+                const uint8_t *pEncFrame = ref.vRaw.data();
+                if (eFormat != NV_ENC_BUFFER_FORMAT_IYUV)
+                {
+                    std::lock_guard<std::mutex> lock(ref.mtx);
+                    if (!ref.bPlanar)
+                    {
+                        ref.vPlanar = ref.vRaw;
+                        converter.UVInterleavedToPlanar((YuvUnit *)ref.vPlanar.data());
+                        ref.bPlanar = true;
+                    }
+                    pEncFrame = ref.vPlanar.data();
+                }
+                uint8_t *pDecFrame = job.pDecFrame.get();
+                converter.UVInterleavedToPlanar((YuvUnit *)pDecFrame);
+                metrics.Compute((const YuvUnit *)pEncFrame, (const YuvUnit *)pDecFrame, cfg.vResult[ref.iFrame]);
+                if (cfg.fout.is_open())
+                {
+                    std::lock_guard<std::mutex> lock(cfg.mtxOut);
+                    cfg.mPending[ref.iFrame] = std::move(job.pDecFrame);
+                    for (auto it = cfg.mPending.begin(); it != cfg.mPending.end() && it->first == cfg.iNextOut; it = cfg.mPending.erase(it))
+                    {
+                        cfg.fout.write(reinterpret_cast<char*>(it->second.get()), cfg.pDec->GetFrameSize());
+                        cfg.iNextOut++;
+                    }
+                }
+                // Let go of the frames here rather than at the next Pop(), which may wait a while
+                job = MetricsJob();
+                stage.AddItem();
             }
+        });
+    }
+
+    pipeline.Wait();
+    fpYuv.close();
+    for (std::unique_ptr<QualConfig> &pConfig : vpConfig)
+    {
+        pConfig->pEnc->DestroyEncoder();
+        pConfig->fout.close();
+        if (pConfig->nDecoded != nRead)
+        {
+            std::ostringstream err;
+            err << "Frames read: " << nRead << ", decoded: " << pConfig->nDecoded << std::endl;
+            throw std::runtime_error(err.str());
+        }
+    }
 
-            int64_t ey, eu, ev;
-            SumSquareErrorFor420Planar((YuvUnit *)pEncFrame, (YuvUnit *)pDecFrame, nWidth, nHeight, &ey, &eu, &ev, shift);
-            eySum += ey; euSum += eu; evSum += ev;
-            int64_t eyuv = ey + eu + ev;
-            eyuvMin = (std::min)(eyuvMin, eyuv);
-            eyuvMax = (std::max)(eyuvMax, eyuv);
+    if (fCsv.is_open())
+    {
+        fCsv << (nConfig > 1 ? "config," : "") << "frame,psnr_y,psnr_u,psnr_v,psnr_avg,ssim_y,ssim_u,ssim_v,ssim_avg,ms_ssim" << std::endl;
+        fCsv << std::setprecision(6) << std::fixed;
+    }
+    std::vector<std::unique_ptr<VideoMetricsSummary>> vpSummary;
+    for (int iConfig = 0; iConfig < nConfig; iConfig++)
+    {
+        QualConfig &cfg = *vpConfig[iConfig];
+        vpSummary.emplace_back(new VideoMetricsSummary((1 << nBitDepth) - 1));
+        VideoMetricsSummary &summary = *vpSummary.back();
+        for (int iDec = 0; iDec < nRead; iDec++)
+        {
+            const VideoMetricsResult &r = cfg.vResult[iDec];
+            summary.Add(r);
+            int64_t nSse = r.anSse[0] + r.anSse[1] + r.anSse[2];
             std::cout << std::setprecision(2);
-            std::cout << "n:" << iDec + 1 << " mse_avg:" << 1.0 * eyuv / (nWidth * nHeight * 3 / 2)
-                << " mse_y:" << 1.0 * ey / (nWidth * nHeight)
-                << " mse_u:" << 1.0 * eu * 4 / (nWidth * nHeight)
-                << " mse_v:" << 1.0 * ev * 4 / (nWidth * nHeight)
-                << " psnr_avg:" << psnr(eyuv, nWidth * nHeight * 3 / 2, MAX)
-                << " psnr_y:" << psnr(ey, nWidth * nHeight, MAX)
-                << " psnr_u:" << psnr(eu, nWidth * nHeight / 4, MAX)
-                << " psnr_v:" << psnr(ev, nWidth * nHeight / 4, MAX)
+            if (nConfig > 1)
+            {
+                std::cout << "config:" << iConfig << " ";
+            }
+            std::cout << "n:" << iDec + 1 << " mse_avg:" << 1.0 * nSse / (r.anSample[0] + r.anSample[1] + r.anSample[2])
+                << " mse_y:" << 1.0 * r.anSse[0] / r.anSample[0]
+                << " mse_u:" << 1.0 * r.anSse[1] / r.anSample[1]
+                << " mse_v:" << 1.0 * r.anSse[2] / r.anSample[2]
+                << " psnr_avg:" << r.dPsnr
+                << " psnr_y:" << r.adPsnr[0]
+                << " psnr_u:" << r.adPsnr[1]
+                << " psnr_v:" << r.adPsnr[2]
+                << std::setprecision(4)
+                << " ssim_avg:" << r.dSsim
+                << " ssim_y:" << r.adSsim[0]
+                << " ms_ssim:" << r.dMsSsim
                 << " " << std::endl;
+            if (fCsv.is_open())
+            {
+                if (nConfig > 1)
+                {
+                    fCsv << iConfig << ",";
+                }
+                fCsv << iDec + 1 << "," << r.adPsnr[0] << "," << r.adPsnr[1] << "," << r.adPsnr[2] << "," << r.dPsnr
+                    << "," << r.adSsim[0] << "," << r.adSsim[1] << "," << r.adSsim[2] << "," << r.dSsim
+                    << "," << r.dMsSsim << std::endl;
+            }
+        }
+    }
+    fCsv.close();
 
-            iDec++;
+    for (int iConfig = 0; iConfig < nConfig; iConfig++)
+    {
+        QualConfig &cfg = *vpConfig[iConfig];
+        const VideoMetricsSummary &summary = *vpSummary[iConfig];
+        if (nConfig > 1)
+        {
+            std::cout << "Config " << iConfig << ": " << cfg.strOptions << std::endl;
         }
-    } while (nRead == nSize);
-    fout.close();
-    fpYuv.close();
+        std::cout << std::setprecision(6);
+        std::cout << "PSNR y:" << summary.GetPsnr(0)
+            << " u:" << summary.GetPsnr(1)
+            << " v:" << summary.GetPsnr(2)
+            << " average:" << summary.GetPsnr()
+            << " min:" << summary.GetPsnrMin()
+            << " max:" << summary.GetPsnrMax()
+            << std::endl;
+        std::cout << "SSIM y:" << summary.GetSsim(0)
+            << " u:" << summary.GetSsim(1)
+            << " v:" << summary.GetSsim(2)
+            << " average:" << summary.GetSsim()
+            << std::endl;
+        std::cout << "MS-SSIM y:" << summary.GetMsSsim() << std::endl;
 
-    std::cout << std::setprecision(6);
-    std::cout << "PSNR y:" << psnr(eySum, (int64_t)nWidth * nHeight * iEnc, MAX)
-        << " u:" << psnr(euSum, (int64_t)nWidth * nHeight / 4 * iEnc, MAX)
-        << " v:" << psnr(evSum, (int64_t)nWidth * nHeight / 4 * iEnc, MAX)
-        << " average:" << psnr(eySum + euSum + evSum, (int64_t)nWidth * nHeight * 3 / 2 * iEnc, MAX)
-        << " min:" << psnr(eyuvMax, (int64_t)nWidth * nHeight * 3 / 2, MAX)
-        << " max:" << psnr(eyuvMin, (int64_t)nWidth * nHeight * 3 / 2, MAX)
-        << std::endl;
-
-    if (*szOutFilePath) {
-        std::cout << "Total frame encoded and decoded: " << iDec << std::endl
-            << "Saved in file " << szOutFilePath << " in "
-            << (dec.GetBitDepth() == 8 ? "iyuv" : "yuv420p16")
-            << " format" << std::endl;
+        if (*szOutFilePath) {
+            std::cout << "Total frame encoded and decoded: " << nRead << std::endl
+                << "Saved in file " << GetConfigFilePath(szOutFilePath, iConfig, nConfig) << " in "
+                << (cfg.pDec->GetBitDepth() == 8 ? "iyuv" : "yuv420p16")
+                << " format" << std::endl;
+        }
     }
 
-    enc.DestroyEncoder();
-
+    if (nConfig > 1)
+    {
+        // One point per configuration, for rate-distortion curves and convex hulls
+        std::cout << std::endl << std::left << std::setw(8) << "Config" << std::right << std::setw(14) << "Bitrate(kbps)"
+            << std::setw(10) << "PSNR" << std::setw(10) << "SSIM" << std::setw(10) << "MS-SSIM" << "  Options" << std::endl;
+        for (int iConfig = 0; iConfig < nConfig; iConfig++)
+        {
+            QualConfig &cfg = *vpConfig[iConfig];
+            const VideoMetricsSummary &summary = *vpSummary[iConfig];
+            std::cout << std::left << std::setw(8) << iConfig << std::right
+                << std::setprecision(1) << std::setw(14) << (nRead ? cfg.nByte * 8.0 * cfg.fps / nRead / 1000 : 0)
+                << std::setprecision(4) << std::setw(10) << summary.GetPsnr()
+                << std::setw(10) << summary.GetSsim() << std::setw(10) << summary.GetMsSsim()
+                << "  " << cfg.strOptions << std::endl;
+        }
+    }
+    std::cout << std::endl;
+    pipeline.PrintMetrics(std::cout);
 }
 
 /**
 *  This sample application demonstrates measurement of encoding quality, in
-*  terms of PSNR. The application encodes frames from the input file and then
-*  decodes them, computing PSNR between input and decoded output. The decoded
-*  output can be saved to a file by using the "-o" option.
+*  terms of PSNR, SSIM and MS-SSIM. The application encodes frames from the input
+*  file and then decodes them, computing the metrics between input and decoded
+*  output. The decoded output can be saved to a file by using the "-o" option,
+*  and the per-frame metrics to a CSV file by using the "-csv" option.
+*  Reading, encoding, decoding and metric computation run concurrently as pipeline
+*  stages, and several encoder configurations given with "-config" are evaluated
+*  against the same input in one pass.
 */
 int main(int argc, char **argv)
 {
     char szInFilePath[256] = "",
-        szOutFilePath[256] = "";
+        szOutFilePath[256] = "",
+        szCsvFilePath[256] = "";
     int nWidth = 1920, nHeight = 1080;
     NV_ENC_BUFFER_FORMAT eFormat = NV_ENC_BUFFER_FORMAT_IYUV;
-    int iGpu = 0;
+    int iGpu = 0, nThread = 4, nPrefetch = 8;
     try
     {
-        NvEncoderInitParam encodeCLIOptions;
-        ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eFormat, szOutFilePath, encodeCLIOptions, iGpu);
+        std::string strCommonOptions;
+        std::vector<std::string> vstrConfig;
+        ParseCommandLine(argc, argv, szInFilePath, nWidth, nHeight, eFormat, szOutFilePath, strCommonOptions, vstrConfig,
+            iGpu, szCsvFilePath, nThread, nPrefetch);
 
         CheckInputFile(szInFilePath);
 
         if (eFormat == NV_ENC_BUFFER_FORMAT_YUV420_10BIT)
         {
-            EncQual<uint16_t>(szInFilePath, szOutFilePath, nWidth, nHeight, eFormat, iGpu, encodeCLIOptions);
+            EncQual<uint16_t>(szInFilePath, szOutFilePath, nWidth, nHeight, eFormat, iGpu, strCommonOptions, vstrConfig,
+                szCsvFilePath, nThread, nPrefetch);
         }
         else
         {
-            EncQual<uint8_t>(szInFilePath, szOutFilePath, nWidth, nHeight, eFormat, iGpu, encodeCLIOptions);
+            EncQual<uint8_t>(szInFilePath, szOutFilePath, nWidth, nHeight, eFormat, iGpu, strCommonOptions, vstrConfig,
+                szCsvFilePath, nThread, nPrefetch);
         }
     }
     catch (const std::exception &e)
@@ -0,0 +1,165 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include "../Utils/NvCodecUtils.h"
+#include "../Utils/Tracer.h"
+#include "NvApiTrace/NvApiTrace.h"
+#include "NvApiTrace/NvApiReplay.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+void ShowHelpAndExit(const char *szBadOption = NULL)
+{
+    std::ostringstream oss;
+    bool bThrowError = false;
+    if (szBadOption)
+    {
+        bThrowError = true;
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
+    }
+    oss << "Options:" << std::endl
+        << "-i           Input API trace file path" << std::endl
+        << "-summary     (No value) Print the calls of the trace before replaying it" << std::endl
+        << "-noreplay    (No value) Do not replay the trace" << std::endl
+        << "-asap        (No value) Feed each session its frames as fast as it takes them, rather than at the recorded times" << std::endl
+        << "-scale       Factor on the recorded duration of every call (default is 1; 0 makes the backend instant)" << std::endl
+        << "-trace       Write a Chrome trace of the replay, with a span for every call, to this file" << std::endl
+        ;
+    if (bThrowError)
+    {
+        throw std::invalid_argument(oss.str());
+    }
+    else
+    {
+        std::cout << oss.str();
+        exit(0);
+    }
+}
+
+void ParseCommandLine(int argc, char *argv[], char *szInputFileName, bool &bSummary, bool &bReplay,
+    char *szTraceFilePath, NvApiReplayParams &params)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (!_stricmp(argv[i], "-h"))
+        {
+            ShowHelpAndExit();
+        }
+        if (!_stricmp(argv[i], "-i"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-i");
+            }
+            sprintf(szInputFileName, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-summary"))
+        {
+            bSummary = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-noreplay"))
+        {
+            bReplay = false;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-asap"))
+        {
+            params.bPaced = false;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-scale"))
+        {
+            if (++i == argc || atof(argv[i]) < 0)
+            {
+                ShowHelpAndExit("-scale");
+            }
+            params.fTimeScale = atof(argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-trace"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-trace");
+            }
+            sprintf(szTraceFilePath, "%s", argv[i]);
+            params.bTraceCalls = true;
+            continue;
+        }
+        ShowHelpAndExit(argv[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char szInFilePath[256] = "", szTraceFilePath[256] = "";
+    bool bSummary = false, bReplay = true;
+    NvApiReplayParams params;
+    try
+    {
+        ParseCommandLine(argc, argv, szInFilePath, bSummary, bReplay, szTraceFilePath, params);
+
+        CheckInputFile(szInFilePath);
+
+        NvApiTrace trace;
+        std::string strError;
+        if (!trace.Load(szInFilePath, strError))
+        {
+            std::cout << "Failed to load API trace " << szInFilePath << ": " << strError << std::endl;
+            return 1;
+        }
+        std::cout << "Trace: " << trace.GetEvents().size() << " calls, " << trace.GetEncodeSessionCount() << " encode sessions, "
+            << trace.GetDecodeSessionCount() << " decode sessions, " << trace.GetThreadCount() << " threads" << std::endl;
+        if (bSummary)
+        {
+            PrintApiTraceSummary(std::cout, trace);
+        }
+        if (!bReplay)
+        {
+            return 0;
+        }
+
+        if (*szTraceFilePath)
+        {
+            Tracer::Get().Start();
+        }
+        NvApiReplayer replayer(trace, params);
+        bool bReplayed = replayer.Run();
+        replayer.PrintReport(std::cout);
+        if (*szTraceFilePath)
+        {
+            Tracer::Get().Stop();
+            if (!Tracer::Get().WriteChromeTrace(szTraceFilePath))
+            {
+                std::cout << "Failed to write trace " << szTraceFilePath << std::endl;
+            }
+        }
+        if (!bReplayed)
+        {
+            std::cout << "Not all sessions were replayed" << std::endl;
+            return 1;
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << ex.what();
+        exit(1);
+    }
+    return 0;
+}
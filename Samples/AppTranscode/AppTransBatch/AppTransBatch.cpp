@@ -0,0 +1,492 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <cuda.h>
+#include <iostream>
+#include <memory>
+#include <functional>
+#include "NvEncoder/NvEncoderCuda.h"
+#include "NvEncoder/NvEncoderPool.h"
+#include "NvDecoder/NvDecoder.h"
+#include "NvTranscoder/NvJobRunner.h"
+#include "NvTranscoder/NvDeviceScheduler.h"
+#include "../Utils/NvCodecUtils.h"
+#include "../Utils/NvEncoderCLIOptions.h"
+#include "../Utils/FFmpegDemuxer.h"
+
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
+
+/**
+*  @brief Transcodes a job the way AppTrans does, on the GPU the scheduler picks for it. The
+*  decoder and the encoder of a job are placed together, and share the context of their GPU
+*  with the other jobs there. The output keeps the bit depth of the input. Encode sessions come
+*  from a NvEncoderPool per GPU, which keeps up to nMaxIdleEncoder of them open between jobs, so
+*  that the next job of the same size and format skips their setup.
+*/
+class NvCudaTranscodeBackend : public NvTranscodeBackend
+{
+public:
+    NvCudaTranscodeBackend(const NvCudaDeviceInventory *pInventory, NvDeviceScheduler *pScheduler, int nMaxIdleEncoder)
+        : m_pInventory(pInventory), m_pScheduler(pScheduler)
+    {
+        for (int i = 0; i < pInventory->GetDeviceCount(); i++)
+        {
+            m_vpPool.emplace_back(new NvEncoderPool(pInventory->GetContext(i), nMaxIdleEncoder, nMaxIdleEncoder));
+        }
+    }
+
+    int Transcode(const NvTranscodeJob &job, const std::string &strOutputPath)
+    {
+        if (!std::ifstream(job.strInput))
+        {
+            throw std::invalid_argument("Unable to open input file: " + job.strInput);
+        }
+        std::ofstream fpOut(strOutputPath, std::ios::out | std::ios::binary);
+        if (!fpOut)
+        {
+            throw std::invalid_argument("Unable to open output file: " + strOutputPath);
+        }
+        NvEncoderInitParam encodeCLIOptions(job.strEncoderOptions.c_str());
+
+        FFmpegDemuxer demuxer(job.strInput.c_str());
+        if (!demuxer.GetWidth() || !demuxer.GetHeight())
+        {
+            throw std::invalid_argument("Unable to demux input file: " + job.strInput);
+        }
+
+        NvSessionRequest request;
+        // Decode surfaces and encoder buffers, roughly
+        request.nMemory = (size_t)demuxer.GetWidth() * demuxer.GetHeight() * 3 / 2 * (demuxer.GetBitDepth() > 8 ? 2 : 1) * 32;
+        request.strAffinityKey = job.strInput;
+        NvDevicePlacement placement(m_pScheduler, request);
+        if (placement.GetDevice() < 0)
+        {
+            // Retried by the runner once another job has ended
+            NVENC_THROW_ERROR("No GPU has room for the sessions of the job", NV_ENC_ERR_ENCODER_BUSY);
+        }
+        CUcontext cuContext = m_pInventory->GetContext(placement.GetDevice());
+        NvEncoderPool *pPool = m_vpPool[placement.GetDevice()].get();
+
+        // Declared after the placement, so that the sessions are closed, or back in the pool, before it gives them back
+        NvEncoderPool::NvEncoderPtr pEnc;
+        NvDecoder dec(cuContext, demuxer.GetWidth(), demuxer.GetHeight(), true, FFmpeg2NvCodecId(demuxer.GetVideoCodec()), nullptr, false, true);
+
+        int nVideoBytes = 0, nFrameReturned = 0, nFrame = 0;
+        try
+        {
+            uint8_t *pVideo = NULL, **ppFrame = NULL;
+            std::vector<std::vector<uint8_t>> vPacket;
+            do {
+                demuxer.Demux(&pVideo, &nVideoBytes);
+                dec.Decode(pVideo, nVideoBytes, &ppFrame, &nFrameReturned);
+
+                for (int i = 0; i < nFrameReturned; i++)
+                {
+                    NV_ENC_BUFFER_FORMAT eFormat = dec.GetBitDepth() > 8 ? NV_ENC_BUFFER_FORMAT_YUV420_10BIT : NV_ENC_BUFFER_FORMAT_NV12;
+                    if (!pEnc)
+                    {
+                        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+                        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+                        initializeParams.encodeConfig = &encodeConfig;
+                        NvEncoderPool::Spare spare;
+                        pPool->CreateDefaultEncoderParams(&initializeParams, encodeCLIOptions.GetEncodeGUID(), encodeCLIOptions.GetPresetGUID(),
+                            dec.GetWidth(), dec.GetHeight(), eFormat, spare);
+
+                        encodeCLIOptions.SetInitParams(&initializeParams, eFormat);
+
+                        pEnc = pPool->Acquire(&initializeParams, eFormat, 3, &spare);
+                    }
+
+                    const NvEncInputFrame* encoderInputFrame = pEnc->GetNextInputFrame();
+                    NvEncoderCuda::CopyToDeviceFrame(cuContext,
+                        ppFrame[i],
+                        dec.GetDeviceFramePitch(),
+                        (CUdeviceptr)encoderInputFrame->inputPtr,
+                        encoderInputFrame->pitch,
+                        pEnc->GetEncodeWidth(),
+                        pEnc->GetEncodeHeight(),
+                        CU_MEMORYTYPE_DEVICE,
+                        encoderInputFrame->bufferFormat,
+                        encoderInputFrame->chromaOffsets,
+                        encoderInputFrame->numChromaPlanes);
+                    pEnc->EncodeFrame(vPacket);
+                    nFrame += (int)vPacket.size();
+                    for (std::vector<uint8_t> &packet : vPacket)
+                    {
+                        fpOut.write(reinterpret_cast<char*>(packet.data()), packet.size());
+                    }
+                }
+            } while (nVideoBytes);
+
+            if (pEnc)
+            {
+                pEnc->EndEncode(vPacket);
+                nFrame += (int)vPacket.size();
+                for (std::vector<uint8_t> &packet : vPacket)
+                {
+                    fpOut.write(reinterpret_cast<char*>(packet.data()), packet.size());
+                }
+            }
+        }
+        catch (...)
+        {
+            // A session that did not reach EndEncode() must not go back to the pool
+            NvEncoderPool::Discard(pEnc);
+            throw;
+        }
+        fpOut.close();
+        if (!fpOut)
+        {
+            throw std::runtime_error("Unable to write output file: " + strOutputPath);
+        }
+        return nFrame;
+    }
+
+    /** Encode sessions each pool opened, and those it handed out again */
+    void PrintEncoderPools(std::ostream &os) const
+    {
+        for (size_t i = 0; i < m_vpPool.size(); i++)
+        {
+            os << "GPU " << m_pInventory->GetDeviceInfo((int)i).iGpu << ": " << m_vpPool[i]->GetCreatedCount()
+                << " encode sessions created, " << m_vpPool[i]->GetReusedCount() << " reused" << std::endl;
+        }
+    }
+
+private:
+    const NvCudaDeviceInventory *m_pInventory;
+    NvDeviceScheduler *m_pScheduler;
+    std::vector<std::unique_ptr<NvEncoderPool>> m_vpPool;
+};
+
+/**
+*  @brief Runs jobs on simulated GPUs, placed by the scheduler the way NvCudaTranscodeBackend
+*  places them on real ones. Each device of the scheduler's inventory is a
+*  NvSimulatedTranscodeBackend with the session capacity of the simulated hardware, so refusals
+*  of the scheduler and failures of the hardware can both be tried out.
+*/
+class NvSimulatedDevicesBackend : public NvTranscodeBackend
+{
+public:
+    NvSimulatedDevicesBackend(NvDeviceScheduler *pScheduler, int nEncodeCapacity, int nDecodeCapacity, int msPerJob,
+        double fTransientFailure) : m_pScheduler(pScheduler)
+    {
+        for (int i = 0; i < pScheduler->GetDeviceCount(); i++)
+        {
+            m_vpDevice.emplace_back(new NvSimulatedTranscodeBackend(nEncodeCapacity, nDecodeCapacity, msPerJob, fTransientFailure, i + 1));
+        }
+    }
+
+    int Transcode(const NvTranscodeJob &job, const std::string &strOutputPath)
+    {
+        NvSessionRequest request;
+        request.strAffinityKey = job.strInput;
+        NvDevicePlacement placement(m_pScheduler, request);
+        if (placement.GetDevice() < 0)
+        {
+            // Retried by the runner once another job has ended
+            NVENC_THROW_ERROR("No GPU has room for the sessions of the job", NV_ENC_ERR_ENCODER_BUSY);
+        }
+        return m_vpDevice[placement.GetDevice()]->Transcode(job, strOutputPath);
+    }
+
+    const NvSimulatedTranscodeBackend *GetDevice(int iDevice) const { return m_vpDevice[iDevice].get(); }
+
+private:
+    NvDeviceScheduler *m_pScheduler;
+    std::vector<std::unique_ptr<NvSimulatedTranscodeBackend>> m_vpDevice;
+};
+
+void ShowHelpAndExit(const char *szBadOption = NULL)
+{
+    bool bThrowError = false;
+    std::ostringstream oss;
+    if (szBadOption)
+    {
+        oss << "Error parsing \"" << szBadOption << "\"" << std::endl;
+        bThrowError = true;
+    }
+    oss << "Options:" << std::endl
+        << "-manifest    Job manifest: one job per line, \"input output [encoder options]\"; # starts a comment" << std::endl
+        << "-journal     Progress file (default is the manifest path with .journal appended)" << std::endl
+        << "-resume      Skip the jobs the journal records as done" << std::endl
+        << "-dec         Number of concurrent decode sessions per GPU (default is 2)" << std::endl
+        << "-enc         Number of concurrent encode sessions per GPU (default is 2)" << std::endl
+        << "-retry       Retries of a job that fails for lack of sessions or memory (default is 5)" << std::endl
+        << "-backoff     Wait before the first retry in ms, doubled for each retry (default is 500)" << std::endl
+        << "-gpu         Ordinals of GPUs to use, comma-separated, or \"all\" (default is 0)" << std::endl
+        << "-placement   How jobs are placed on GPUs: least (least loaded GPU, default) or affinity" << std::endl
+        << "             (jobs with the same input on the same GPU, while it has room)" << std::endl
+        << "-simulate    Run the jobs on simulated GPUs instead, in this form: enc,dec,ms[,p]:" << std::endl
+        << "             encode and decode session capacity, time per job, and probability of a" << std::endl
+        << "             transient out of memory error. Inputs containing \"fail\" always fail." << std::endl
+        << "             Jobs are placed on the simulated GPUs as -placement says." << std::endl
+        << "-simgpu      Number of simulated GPUs (default is 1)" << std::endl
+        << "-pool        Encode sessions kept open per GPU between jobs, for later jobs of the same size and" << std::endl
+        << "             format (default is 0). They count against the session limit of the GPU besides -enc." << std::endl
+        << "Encoder options given here apply to every job; the options of a job override them." << std::endl
+        ;
+    oss << NvEncoderInitParam().GetHelpMessage(false, false, true);
+    if (bThrowError)
+    {
+        throw std::invalid_argument(oss.str());
+    }
+    else
+    {
+        std::cout << oss.str();
+        exit(0);
+    }
+}
+
+void ParseCommandLine(int argc, char *argv[], char *szManifestFilePath, NvJobRunnerParams &params, std::vector<int> &vGpu,
+    NvPlacementPolicy &ePolicy, int &nPool, bool &bSimulate, int &nSimGpu, int &nSimEncode, int &nSimDecode, int &msSimJob, double &fSimFailure, std::string &strDefaultOptions)
+{
+    std::ostringstream oss;
+    int i;
+    for (i = 1; i < argc; i++)
+    {
+        if (!_stricmp(argv[i], "-h"))
+        {
+            ShowHelpAndExit();
+        }
+        if (!_stricmp(argv[i], "-manifest"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-manifest");
+            }
+            sprintf(szManifestFilePath, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-journal"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-journal");
+            }
+            params.strJournal = argv[i];
+            continue;
+        }
+        if (!_stricmp(argv[i], "-resume"))
+        {
+            params.bResume = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-dec"))
+        {
+            if (++i == argc || (params.nDecodeSession = atoi(argv[i])) <= 0)
+            {
+                ShowHelpAndExit("-dec");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-enc"))
+        {
+            if (++i == argc || (params.nEncodeSession = atoi(argv[i])) <= 0)
+            {
+                ShowHelpAndExit("-enc");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-retry"))
+        {
+            if (++i == argc || (params.nMaxRetry = atoi(argv[i])) < 0)
+            {
+                ShowHelpAndExit("-retry");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-backoff"))
+        {
+            if (++i == argc || (params.msBackoff = atoi(argv[i])) < 0)
+            {
+                ShowHelpAndExit("-backoff");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-gpu"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-gpu");
+            }
+            vGpu.clear();
+            if (!_stricmp(argv[i], "all"))
+            {
+                continue;
+            }
+            std::istringstream iss(argv[i]);
+            std::string strGpu;
+            while (std::getline(iss, strGpu, ','))
+            {
+                vGpu.push_back(atoi(strGpu.c_str()));
+            }
+            if (vGpu.empty())
+            {
+                ShowHelpAndExit("-gpu");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-placement"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-placement");
+            }
+            if (!_stricmp(argv[i], "least"))
+            {
+                ePolicy = NV_PLACEMENT_LEAST_LOADED;
+            }
+            else if (!_stricmp(argv[i], "affinity"))
+            {
+                ePolicy = NV_PLACEMENT_AFFINITY;
+            }
+            else
+            {
+                ShowHelpAndExit("-placement");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-simulate"))
+        {
+            if (++i == argc || sscanf(argv[i], "%d,%d,%d,%lf", &nSimEncode, &nSimDecode, &msSimJob, &fSimFailure) < 3
+                || nSimEncode <= 0 || nSimDecode <= 0 || msSimJob < 0)
+            {
+                ShowHelpAndExit("-simulate");
+            }
+            bSimulate = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-pool"))
+        {
+            if (++i == argc || (nPool = atoi(argv[i])) < 0)
+            {
+                ShowHelpAndExit("-pool");
+            }
+            continue;
+        }
+        if (!_stricmp(argv[i], "-simgpu"))
+        {
+            if (++i == argc || (nSimGpu = atoi(argv[i])) <= 0)
+            {
+                ShowHelpAndExit("-simgpu");
+            }
+            continue;
+        }
+        // Regard as encoder parameter
+        if (argv[i][0] != '-')
+        {
+            ShowHelpAndExit(argv[i]);
+        }
+        oss << argv[i] << " ";
+        while (i + 1 < argc && argv[i + 1][0] != '-')
+        {
+            oss << argv[++i] << " ";
+        }
+    }
+    strDefaultOptions = oss.str();
+}
+
+/**
+*  This sample application runs a batch of transcodes listed in a manifest within a number
+*  of concurrent NVDEC and NVENC sessions, instead of one process per file. Jobs that fail
+*  because the GPU is out of encode sessions or memory are retried with backoff, and the
+*  session limit is lowered to what the GPU actually allows. With several GPUs, each job's
+*  decoder and encoder are placed together on the least loaded GPU, or on the GPU of the jobs
+*  with the same input. Progress is kept in a journal,
+*  so that an interrupted batch continues where it stopped with "-resume". With "-simulate"
+*  the jobs run against simulated GPUs, to try out the limits, the placement and the retry policy.
+*/
+int main(int argc, char **argv)
+{
+    char szManifestFilePath[260] = "";
+    NvJobRunnerParams params;
+    std::vector<int> vGpu(1, 0);
+    NvPlacementPolicy ePolicy = NV_PLACEMENT_LEAST_LOADED;
+    int nPool = 0;
+    bool bSimulate = false;
+    int nSimGpu = 1, nSimEncode = 2, nSimDecode = 2, msSimJob = 100;
+    double fSimFailure = 0;
+    std::string strDefaultOptions;
+    try
+    {
+        ParseCommandLine(argc, argv, szManifestFilePath, params, vGpu, ePolicy, nPool, bSimulate, nSimGpu, nSimEncode, nSimDecode, msSimJob, fSimFailure,
+            strDefaultOptions);
+        CheckInputFile(szManifestFilePath);
+        if (params.strJournal.empty())
+        {
+            params.strJournal = std::string(szManifestFilePath) + ".journal";
+        }
+
+        std::ifstream fpManifest(szManifestFilePath);
+        std::vector<NvTranscodeJob> vJob;
+        std::string strError;
+        if (!ParseJobManifest(fpManifest, strDefaultOptions, vJob, strError))
+        {
+            std::ostringstream err;
+            err << szManifestFilePath << ": " << strError << std::endl;
+            throw std::invalid_argument(err.str());
+        }
+
+        // In this order, so the backend is gone before the scheduler and the devices it uses
+        std::unique_ptr<NvDeviceInventory> pInventory;
+        std::unique_ptr<NvDeviceScheduler> pScheduler;
+        std::unique_ptr<NvTranscodeBackend> pBackend;
+        if (bSimulate)
+        {
+            // The scheduler keeps to the session limits; the simulated hardware has its own capacity
+            pInventory.reset(new NvFakeDeviceInventory(nSimGpu, params.nDecodeSession, params.nEncodeSession));
+            pScheduler.reset(new NvDeviceScheduler(pInventory.get(), ePolicy));
+            pBackend.reset(new NvSimulatedDevicesBackend(pScheduler.get(), nSimEncode, nSimDecode, msSimJob, fSimFailure));
+        }
+        else
+        {
+            ck(cuInit(0));
+            NvCudaDeviceInventory *pCudaInventory = new NvCudaDeviceInventory(vGpu, params.nDecodeSession, params.nEncodeSession);
+            pInventory.reset(pCudaInventory);
+            for (int i = 0; i < pInventory->GetDeviceCount(); i++)
+            {
+                std::cout << "GPU in use: " << pInventory->GetDeviceInfo(i).strName << std::endl;
+            }
+            pScheduler.reset(new NvDeviceScheduler(pInventory.get(), ePolicy));
+            pBackend.reset(new NvCudaTranscodeBackend(pCudaInventory, pScheduler.get(), nPool));
+        }
+        // The limits are per GPU; the runner admits jobs for all of them
+        params.nDecodeSession *= pInventory->GetDeviceCount();
+        params.nEncodeSession *= pInventory->GetDeviceCount();
+        std::cout << vJob.size() << " jobs, " << params.nDecodeSession << " decode and " << params.nEncodeSession
+            << " encode sessions, journal " << params.strJournal << std::endl;
+
+        NvJobRunner runner(pBackend.get(), params);
+        int nFailed = runner.Run(vJob);
+        runner.PrintSummary(std::cout, vJob);
+        pScheduler->PrintLoad(std::cout);
+        if (!bSimulate)
+        {
+            static_cast<NvCudaTranscodeBackend *>(pBackend.get())->PrintEncoderPools(std::cout);
+        }
+        else
+        {
+            NvSimulatedDevicesBackend *pSim = static_cast<NvSimulatedDevicesBackend *>(pBackend.get());
+            for (int i = 0; i < pScheduler->GetDeviceCount(); i++)
+            {
+                std::cout << "Simulated GPU " << i << ": peak of " << pSim->GetDevice(i)->GetPeakDecodeSessions() << " decode and "
+                    << pSim->GetDevice(i)->GetPeakEncodeSessions() << " encode sessions requested" << std::endl;
+            }
+        }
+        return nFailed ? 1 : 0;
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << ex.what();
+        exit(1);
+    }
+    return 0;
+}
@@ -12,161 +12,15 @@
 #include <cuda_runtime.h>
 #include <stdio.h>
 #include <iostream>
-#include <thread>
-#include <algorithm>
-#include <chrono>
-#include <mutex>
 #include <string.h>
-#include <memory>
-#include "NvEncoder/NvEncoderCuda.h"
 #include "NvDecoder/NvDecoder.h"
+#include "NvTranscoder/NvAbrTranscoder.h"
 #include "../Utils/NvEncoderCLIOptions.h"
 #include "../Utils/NvCodecUtils.h"
 #include "../Utils/FFmpegDemuxer.h"
 
-using NvEncCudaPtr = std::unique_ptr<NvEncoderCuda, std::function<void(NvEncoderCuda*)>>;
-
 simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
 
-int FindMin(volatile int *a, int n) 
-{
-    int r = INT_MAX;
-    for (int i = 0; i < n; i++)
-    {
-        if (a[i] < r)
-        {
-            r = a[i];
-        }
-    }
-    return r;
-}
-
-void EncProc(NvEncoderCuda *pEnc, uint8_t **apSrcFrame, int nSrcFrame, int nSrcFramePitch, int nSrcFrameWidth, int nSrcFrameHeight, bool bOut10,
-        volatile int *piEnc, volatile int *piDec, volatile bool *pbEnd, const char *szOutFileNamePrefix, const char *szOutFileNameSuffix, std::exception_ptr & encException, int encoderId)
-{
-    try
-    {
-        char szOutFilePath[80];
-        sprintf(szOutFilePath, "%s_%dx%d_%d.%s", szOutFileNamePrefix, pEnc->GetEncodeWidth(), pEnc->GetEncodeHeight(), encoderId, szOutFileNameSuffix);
-        std::ofstream fpOut(szOutFilePath, std::ios::out | std::ios::binary);
-        if (!fpOut)
-        {
-            std::cout << "Unable to open output file: " << szOutFilePath << std::endl;
-            return;
-        }
-
-        ck(cuCtxSetCurrent((CUcontext)pEnc->GetDevice()));
-        CUdeviceptr pFrameResized;
-        ck(cuMemAlloc(&pFrameResized, pEnc->GetFrameSize()));
-
-        while (*piEnc != *piDec || !*pbEnd)
-        {
-            if (*piEnc == *piDec)
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                continue;
-            }
-            for (; *piEnc < *piDec || *pbEnd; (*piEnc)++)
-            {
-                std::vector<std::vector<uint8_t>> vPacket;
-                if (*piEnc < *piDec)
-                {
-                    const NvEncInputFrame* encoderInputFrame = pEnc->GetNextInputFrame();
-                    if (bOut10)
-                    {
-                        ResizeP016((unsigned char *)encoderInputFrame->inputPtr, (int)encoderInputFrame->pitch, pEnc->GetEncodeWidth(), pEnc->GetEncodeHeight(),
-                            apSrcFrame[*piEnc % nSrcFrame], nSrcFramePitch, nSrcFrameWidth, nSrcFrameHeight);
-                    }
-                    else
-                    {
-                        ResizeNv12((unsigned char *)encoderInputFrame->inputPtr, (int)encoderInputFrame->pitch, pEnc->GetEncodeWidth(), pEnc->GetEncodeHeight(),
-                            apSrcFrame[*piEnc % nSrcFrame], nSrcFramePitch, nSrcFrameWidth, nSrcFrameHeight);
-                    }
-                    pEnc->EncodeFrame(vPacket);
-                }
-                else
-                {
-                    pEnc->EndEncode(vPacket);
-                }
-                for (std::vector<uint8_t> packet : vPacket)
-                {
-                    fpOut.write(reinterpret_cast<char*>(packet.data()), packet.size());
-                }
-                if (*piEnc == *piDec && *pbEnd) break;
-            }
-        }
-        ck(cuMemFree(pFrameResized));
-        fpOut.close();
-    }
-    catch (const std::exception&)
-    {
-        encException = std::current_exception();
-    }
-}
-
-void TranscodeOneToN(NvDecoder *pDec, FFmpegDemuxer *pDemuxer, std::vector<NvEncCudaPtr>& vEncoders, int nEnc, int *pnFrameTrans,
-    const char *szOutFileNamePrefix, const char *szOutFileNameSuffix, std::vector<std::exception_ptr>& vExceptionPtrs)
-{
-    const int nSrcFrame = 8;
-
-    volatile bool bEnd = false;
-    // next frame to be decoded. apFrame[iDec] is unoccupied when iDec - iEnc < nFrame
-    volatile int iDec = 0;
-    // iEnc=aiEnc[i]: next frame to be encoded. apFrame[iEnc] is eligible for encoding when iEnc < iDec
-
-    uint8_t *apSrcFrame[nSrcFrame] = { 0 };
-    std::vector<NvThread> vpth;
-    int nVideoBytes = 0, nFrameReturned = 0, nFrame = 0;
-    uint8_t *pVideo = NULL, **ppFrame = NULL;
-
-    std::unique_ptr<int[]> aiEncPtr(new int[nEnc]);
-    volatile int *aiEnc = aiEncPtr.get();
-    memset((void *)aiEnc, 0, nEnc * sizeof(int));
-    do {
-
-        pDemuxer->Demux(&pVideo, &nVideoBytes);
-        pDec->DecodeLockFrame(pVideo, nVideoBytes, &ppFrame, &nFrameReturned);
-        if (nFrameReturned && !apSrcFrame[0])
-        {
-            for (int i = 0; i < nEnc; i++)
-            {
-                vpth.push_back(NvThread(std::thread(EncProc, vEncoders[i].get(), apSrcFrame, nSrcFrame,
-                    pDec->GetDeviceFramePitch(), pDemuxer->GetWidth(), pDemuxer->GetHeight(), pDemuxer->GetBitDepth() > 8,
-                    aiEnc + i, &iDec, &bEnd, szOutFileNamePrefix, szOutFileNameSuffix, std::ref(vExceptionPtrs[i]), i)));
-            }
-        }
-        for (int i = 0; i < nFrameReturned; i++)
-        {
-            while (iDec - FindMin(aiEnc, nEnc) == nSrcFrame)
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            }
-            if (apSrcFrame[iDec % nSrcFrame])
-            {
-                // Unlock (recycle) the frame buffer before proceeding
-                pDec->UnlockFrame(&apSrcFrame[iDec % nSrcFrame], 1);
-            }
-            // No need for data copy because frame buffer is locked
-            apSrcFrame[iDec % nSrcFrame] = ppFrame[i];
-            iDec++;
-        }
-    } while (nVideoBytes);
-    bEnd = true;
-    for (auto& pth : vpth)
-    {
-        pth.join();
-    }
-    for (int i = 0; i < nSrcFrame; i++)
-    {
-        if (apSrcFrame[i])
-        {
-            pDec->UnlockFrame(&apSrcFrame[i], 1);
-        }
-    }
-
-    *pnFrameTrans = iDec;
-}
-
 void ShowHelpAndExit(char *szExeName, bool bHelp = false)
 {
     std::ostringstream oss;
@@ -174,6 +28,7 @@ void ShowHelpAndExit(char *szExeName, bool bHelp = false)
         << "-i           input_file" << std::endl
         << "-o           output_file" << std::endl 
         << "-r           W1xH1 W2xH2 ..." << std::endl
+        << "-ladder      Ladder spec in place of -r, e.g. 1920x1080:6M:hevc,1280x720:3M,640x360:800k:h264" << std::endl
         << "-gpu         GPU ordinal" << std::endl
         ;
     oss << NvEncoderInitParam().GetHelpMessage(false, false, true);
@@ -189,9 +44,11 @@ void ShowHelpAndExit(char *szExeName, bool bHelp = false)
 }
 
 void ParseCommandLine(int argc, char *argv[], char *szInputFileName, char *szOutputFileName, 
-    std::vector<int2> &vResolution, int &iGpu, NvEncoderInitParam &initParam) 
+    std::vector<NvAbrRung> &vRung, int &iGpu) 
 {
     std::ostringstream oss;
+    std::vector<int2> vResolution;
+    std::string strLadder;
     for (int i = 1; i < argc; i++) {
         if (!_stricmp(argv[i], "-h")) {
             ShowHelpAndExit(argv[0], true);
@@ -210,6 +67,13 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, char *szOut
             sprintf(szOutputFileName, "%s", argv[i]);
             continue;
         }
+        if (!_stricmp(argv[i], "-ladder")) {
+            if (++i == argc) {
+                ShowHelpAndExit(argv[0]);
+            }
+            strLadder = argv[i];
+            continue;
+        }
         if (!_stricmp(argv[i], "-r")) {
             int w, h;
             if (++i == argc || 2 != sscanf(argv[i], "%dx%d", &w, &h)) {
@@ -240,12 +104,26 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName, char *szOut
             oss << argv[++i] << " ";
         }
     }
-    initParam = NvEncoderInitParam(oss.str().c_str());
+    // Validate the encoder options up front; each rung parses them again with its codec
+    NvEncoderInitParam(oss.str().c_str());
+    if (!strLadder.empty()) {
+        if (!vResolution.empty() || !ParseAbrLadder(strLadder, oss.str(), vRung)) {
+            ShowHelpAndExit(argv[0]);
+        }
+        return;
+    }
     // fill default values
     if (vResolution.empty()) {
         vResolution.push_back(make_int2(1280, 720));
         vResolution.push_back(make_int2(800, 480));
     }
+    for (int2 xy : vResolution) {
+        NvAbrRung rung;
+        rung.nWidth = xy.x;
+        rung.nHeight = xy.y;
+        rung.strEncoderOptions = oss.str();
+        vRung.push_back(rung);
+    }
 }
 
 int main(int argc, char *argv[]) 
@@ -253,22 +131,10 @@ int main(int argc, char *argv[])
     int iGpu = 0;
     char szInFilePath[260] = "";
     char szOutFileNamePrefix[260] = "out";
-    std::vector<int2> vResolution;
-    std::vector<std::exception_ptr> vExceptionPtrs;
+    std::vector<NvAbrRung> vRung;
     try
     {
-        auto EncodeDeleteFunc = [](NvEncoderCuda *pEnc)
-        {
-            if (pEnc)
-            {
-                pEnc->DestroyEncoder();
-                delete pEnc;
-            }
-        };
-        std::vector<NvEncCudaPtr> vEncoders;
-
-        NvEncoderInitParam encodeCLIOptions;
-        ParseCommandLine(argc, argv, szInFilePath, szOutFileNamePrefix, vResolution, iGpu, encodeCLIOptions);
+        ParseCommandLine(argc, argv, szInFilePath, szOutFileNamePrefix, vRung, iGpu);
 
         CheckInputFile(szInFilePath);
 
@@ -276,8 +142,8 @@ int main(int argc, char *argv[])
             << "Input file             : " << szInFilePath << std::endl
             << "Output file name pefix : " << szOutFileNamePrefix << std::endl
             << "Output resolutions     : ";
-        for (int2 xy : vResolution) {
-            std::cout << xy.x << "x" << xy.y << " ";
+        for (NvAbrRung &rung : vRung) {
+            std::cout << rung.nWidth << "x" << rung.nHeight << " ";
         }
         std::cout << std::endl
             << "GPU ordinal        : " << iGpu << std::endl;
@@ -298,36 +164,12 @@ int main(int argc, char *argv[])
         ck(cuCtxCreate(&cuContext, 0, cuDevice));
 
         FFmpegDemuxer demuxer(szInFilePath);
-        int nEnc = (int)vResolution.size();
-        for (int i = 0; i < nEnc; i++)
-        {
-            NvEncCudaPtr encPtr(new NvEncoderCuda(cuContext, vResolution[i].x, vResolution[i].y,
-                demuxer.GetBitDepth() == 8 ? NV_ENC_BUFFER_FORMAT_NV12 : NV_ENC_BUFFER_FORMAT_YUV420_10BIT), EncodeDeleteFunc);
-            vEncoders.push_back(std::move(encPtr));
-
-            NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
-            NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
-            initializeParams.encodeConfig = &encodeConfig;
-            vEncoders[i]->CreateDefaultEncoderParams(&initializeParams, encodeCLIOptions.GetEncodeGUID(), encodeCLIOptions.GetPresetGUID());
-            encodeCLIOptions.SetInitParams(&initializeParams, demuxer.GetBitDepth() == 8 ? NV_ENC_BUFFER_FORMAT_NV12 : NV_ENC_BUFFER_FORMAT_YUV420_10BIT);
-
-            vEncoders[i]->CreateEncoder(&initializeParams);
-        }
-
-        int nFrameTrans = 0;
-        vExceptionPtrs.resize(nEnc);
-        NvDecoder dec(cuContext, demuxer.GetWidth(), demuxer.GetHeight(), true, FFmpeg2NvCodecId(demuxer.GetVideoCodec()), NULL, false, true);
-        TranscodeOneToN(&dec, &demuxer, vEncoders, nEnc, &nFrameTrans, szOutFileNamePrefix, encodeCLIOptions.IsCodecH264() ? "h264" : "hevc", vExceptionPtrs);
-
-        for (int i = 0; i < nEnc; i++)
-        {
-            if (vExceptionPtrs[i])
-            {
-                std::rethrow_exception(vExceptionPtrs[i]);
-            }
-        }
+        NvAbrTranscoder transcoder(cuContext, vRung);
+        NvAbrFileSink sink(szOutFileNamePrefix);
+        int nFrameTrans = transcoder.Transcode(&demuxer, &sink);
+        transcoder.PrintMetrics(std::cout);
 
-        std::cout << "Frames transcoded: " << nFrameTrans << " x " << nEnc << std::endl;
+        std::cout << "Frames transcoded: " << nFrameTrans << " x " << vRung.size() << std::endl;
     }
     catch (const std::exception& ex)
     {
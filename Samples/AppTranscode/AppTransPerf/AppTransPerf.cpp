@@ -22,70 +22,61 @@
 #include "../Utils/NvEncoderCLIOptions.h"
 #include "NvDecoder/NvDecoder.h"
 #include "../Utils/NvCodecUtils.h"
+#include "../Utils/NvCudaContext.h"
 #include "../Utils/FFmpegDemuxer.h"
+#include "../Utils/Tracer.h"
+#include "NvApiTrace/NvApiTrace.h"
 
 simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger();
 
-void EncProc(NvEncoderCuda *pEnc, uint8_t **apFrame, int nFrame, uint32_t inputFramePitch,
-    volatile int *piEnc, volatile int *piDec, volatile bool *pbEnd, int *pnFrameTrans, std::exception_ptr& encException)
+using NvEncCudaPtr = std::unique_ptr<NvEncoderCuda, std::function<void(NvEncoderCuda*)>>;
+
+/**
+*  @brief Adds the two stages of one transcoding session to the pipeline: demux and decode, then
+*  copy and encode. Decoded frames stay locked in the decoder while they wait in the channel, so
+*  they are handed over without a copy, and the channel capacity bounds how far decoding runs ahead.
+*  With pStream, the decoder and the encoder share its stream; otherwise they use the default
+*  stream. With bBind, each stage keeps cuContext current on its thread. pStats receives the
+*  context push counts of the two stages.
+*/
+void AddTransStages(NvPipeline &pipeline, int iSession, CUcontext cuContext, NvDecoder *pDec, FFmpegDemuxer *pDemuxer,
+    int *pnFrameTrans, NvEncoderInitParam *pEncodeCLIOptions, NvCudaStream *pStream, bool bBind,
+    NvCudaContextScope::Stats *pStats)
 {
-    try
+    std::shared_ptr<NvChannel<uint8_t *>> pFrameChannel = pipeline.CreateChannel<uint8_t *>(16);
+    std::string strSession = " #" + std::to_string(iSession);
+    CUstream cuStream = pStream ? pStream->GetStream() : 0;
+
+    pipeline.AddStage("Demux and decode" + strSession, [=](NvPipeline::Stage &stage)
     {
-        StopWatch w;
-        w.Start();
-        while (*piEnc != *piDec || !*pbEnd)
+        int nVideoBytes = 0, nFrameReturned = 0;
+        uint8_t *pVideo = NULL, **ppFrame = NULL;
+        if (bBind)
         {
-            if (*piEnc == *piDec)
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                continue;
-            }
-            for (; *piEnc < *piDec || *pbEnd; (*piEnc)++)
+            ck(NvCudaContextScope::Bind(cuContext));
+        }
+        do
+        {
+            pDemuxer->Demux(&pVideo, &nVideoBytes);
+            pDec->DecodeLockFrame(pVideo, nVideoBytes, &ppFrame, &nFrameReturned, 0, NULL, 0, cuStream);
+            for (int i = 0; i < nFrameReturned; i++)
             {
-                std::vector<std::vector<uint8_t>> vPacket;
-                if (*piEnc < *piDec)
-                {
-                    const NvEncInputFrame* encoderInputFrame = pEnc->GetNextInputFrame();
-                    NvEncoderCuda::CopyToDeviceFrame((CUcontext)pEnc->GetDevice(), (void*)apFrame[*piEnc % nFrame], inputFramePitch, (CUdeviceptr)encoderInputFrame->inputPtr,
-                        encoderInputFrame->pitch, pEnc->GetEncodeWidth(), pEnc->GetEncodeHeight(), CU_MEMORYTYPE_DEVICE,
-                        encoderInputFrame->bufferFormat,
-                        encoderInputFrame->chromaOffsets,
-                        encoderInputFrame->numChromaPlanes);
-
-                    pEnc->EncodeFrame(vPacket);
-                }
-                else
+                if (!stage.Push(*pFrameChannel, ppFrame[i]))
                 {
-                    pEnc->EndEncode(vPacket);
+                    // The pipeline was cancelled; nobody will encode the rest
+                    pDec->UnlockFrame(&ppFrame[i], nFrameReturned - i);
+                    pStats[0] = NvCudaContextScope::GetThreadStats();
+                    return;
                 }
-                *pnFrameTrans += (int)vPacket.size();
-                if (*piEnc == *piDec && *pbEnd) break;
+                stage.AddItem();
             }
-        }
-        std::cout << "Thread FPS=" << *pnFrameTrans / w.Stop() << std::endl;
-    }
-    catch (const std::exception&)
-    {
-        encException = std::current_exception();
-    }
-}
+        } while (nVideoBytes);
+        pFrameChannel->Close();
+        pStats[0] = NvCudaContextScope::GetThreadStats();
+    });
 
-void TransProc(CUcontext cuContext, NvDecoder *pDec, FFmpegDemuxer *pDemuxer, int *pnFrameTrans,
-    NvEncoderInitParam *pEncodeCLIOptions, std::exception_ptr& decException, std::exception_ptr& encException)
-{
-    try
+    pipeline.AddStage("Encode" + strSession, [=](NvPipeline::Stage &stage)
     {
-        // next frame to be decoded. apFrame[iDec] is unoccupied when iDec - iEnc < nFrame
-        volatile int iDec = 0;
-        // next frame to be encoded. apFrame[iEnc] is eligible for encoding when iEnc < iDec
-        volatile int iEnc = 0;
-        uint8_t *apFrameBuffer[16] = {};
-        const int nFrameBuffer = sizeof(apFrameBuffer) / sizeof(apFrameBuffer[0]);
-        volatile bool bEnd = false;
-
-        int nVideoBytes = 0, nFrameReturned = 0, nFrame = 0;
-        uint8_t *pVideo = NULL, **ppFrame = NULL;
-        using NvEncCudaPtr = std::unique_ptr<NvEncoderCuda, std::function<void(NvEncoderCuda*)>>;
         auto EncodeDeleteFunc = [](NvEncoderCuda *pEnc)
         {
             if (pEnc)
@@ -95,13 +86,18 @@ void TransProc(CUcontext cuContext, NvDecoder *pDec, FFmpegDemuxer *pDemuxer, in
             }
         };
         NvEncCudaPtr pEnc(nullptr, EncodeDeleteFunc);
-        NvThread thread;
-        do
+        std::vector<std::vector<uint8_t>> vPacket;
+        uint8_t *pFrame = NULL;
+        int iFrame = 0;
+        if (bBind)
         {
-            pDemuxer->Demux(&pVideo, &nVideoBytes);
-            pDec->DecodeLockFrame(pVideo, nVideoBytes, &ppFrame, &nFrameReturned);
-            if (!pEnc && nFrameReturned)
+            ck(NvCudaContextScope::Bind(cuContext));
+        }
+        while (stage.Pop(*pFrameChannel, pFrame))
+        {
+            if (!pEnc)
             {
+                // Created here because the decoder knows the frame size only after the first frame
                 pEnc.reset(new NvEncoderCuda(cuContext, pDec->GetWidth(), pDec->GetHeight(),
                     pDec->GetBitDepth() == 8 ? NV_ENC_BUFFER_FORMAT_NV12 : NV_ENC_BUFFER_FORMAT_YUV420_10BIT));
 
@@ -113,41 +109,39 @@ void TransProc(CUcontext cuContext, NvDecoder *pDec, FFmpegDemuxer *pDemuxer, in
                 pEncodeCLIOptions->SetInitParams(&initializeParams, pDec->GetBitDepth() == 8 ? NV_ENC_BUFFER_FORMAT_NV12 : NV_ENC_BUFFER_FORMAT_YUV420_10BIT);
 
                 pEnc->CreateEncoder(&initializeParams);
-
-                thread = NvThread(std::thread(EncProc, pEnc.get(), apFrameBuffer, nFrameBuffer, pDec->GetDeviceFramePitch(), &iEnc, &iDec, &bEnd, pnFrameTrans, std::ref(encException)));
             }
-            for (int i = 0; i < nFrameReturned; i++)
             {
-                while (iDec - iEnc == nFrameBuffer)
+                NVTRACE_SCOPE_ARG("Encode frame", iFrame++);
+                if (pStream)
                 {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    // Queued behind the decoder's copy into the frame, and ahead of its next copy into
+                    // it once recycled, on the same stream; EncodeFrame() waits for the upload
+                    pEnc->CopyToNextInputFrameAsync(pFrame, pDec->GetDeviceFramePitch(), CU_MEMORYTYPE_DEVICE, cuStream);
                 }
-                if (apFrameBuffer[iDec % nFrameBuffer])
+                else
                 {
-                    pDec->UnlockFrame(&apFrameBuffer[iDec % nFrameBuffer], 1);
+                    const NvEncInputFrame* encoderInputFrame = pEnc->GetNextInputFrame();
+                    NvEncoderCuda::CopyToDeviceFrame(cuContext, (void*)pFrame, pDec->GetDeviceFramePitch(), (CUdeviceptr)encoderInputFrame->inputPtr,
+                        encoderInputFrame->pitch, pEnc->GetEncodeWidth(), pEnc->GetEncodeHeight(), CU_MEMORYTYPE_DEVICE,
+                        encoderInputFrame->bufferFormat,
+                        encoderInputFrame->chromaOffsets,
+                        encoderInputFrame->numChromaPlanes);
                 }
-                apFrameBuffer[iDec % nFrameBuffer] = ppFrame[i];
-                iDec++;
-            }
-        } while (nVideoBytes);
+                // The decoder writes a recycled frame on the same stream, after this copy
+                pDec->UnlockFrame(&pFrame, 1);
 
-        bEnd = true;
-
-        thread.join();
-
-        for (int i = 0; i < nFrameBuffer; i++)
-        {
-            if (apFrameBuffer[i])
-            {
-                pDec->UnlockFrame(&apFrameBuffer[i], 1);
+                pEnc->EncodeFrame(vPacket);
             }
+            *pnFrameTrans += (int)vPacket.size();
+            stage.AddItem();
         }
-    }
-    catch (const std::exception&)
-    {
-        decException = std::current_exception();
-    }
-
+        if (pEnc)
+        {
+            pEnc->EndEncode(vPacket);
+            *pnFrameTrans += (int)vPacket.size();
+        }
+        pStats[1] = NvCudaContextScope::GetThreadStats();
+    });
 }
 
 void ShowHelpAndExit(const char *szBadOption = NULL) 
@@ -163,6 +157,11 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
         << "-i           Input file path" << std::endl
         << "-gpu         Ordinal of GPU to use" << std::endl
         << "-thread      Number of encoding thread (default is 2)" << std::endl
+        << "-single      (No value) Use single context (default is a context per session)" << std::endl
+        << "-primary     (No value) Use the primary context of the GPU, with a stream per session shared by its decoder and encoder" << std::endl
+        << "-nobind      (No value) Push and pop the context around every CUDA call, rather than keep it current on each thread" << std::endl
+        << "-trace       Write a Chrome trace of demux, decode and encode to this file" << std::endl
+        << "-apitrace    Record the NVDEC and NVENC calls of the sessions to this file, for AppApiReplay" << std::endl
         ;
     oss << NvEncoderInitParam().GetHelpMessage(false, false, true);
     if (bThrowError)
@@ -177,7 +176,8 @@ void ShowHelpAndExit(const char *szBadOption = NULL)
 }
 
 void ParseCommandLine(int argc, char *argv[], char *szInputFileName, 
-    int &iGpu, int &nThread, bool &bSingle, NvEncoderInitParam &initParam) 
+    int &iGpu, int &nThread, bool &bSingle, bool &bPrimary, bool &bNoBind, char *szTraceFilePath, char *szApiTraceFilePath,
+    NvEncoderInitParam &initParam) 
 {
     std::ostringstream oss;
     for (int i = 1; i < argc; i++)
@@ -218,6 +218,34 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName,
             bSingle = true;
             continue;
         }
+        if (!_stricmp(argv[i], "-primary"))
+        {
+            bPrimary = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-nobind"))
+        {
+            bNoBind = true;
+            continue;
+        }
+        if (!_stricmp(argv[i], "-trace"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-trace");
+            }
+            sprintf(szTraceFilePath, "%s", argv[i]);
+            continue;
+        }
+        if (!_stricmp(argv[i], "-apitrace"))
+        {
+            if (++i == argc)
+            {
+                ShowHelpAndExit("-apitrace");
+            }
+            sprintf(szApiTraceFilePath, "%s", argv[i]);
+            continue;
+        }
         // Regard as encoder parameter
         if (argv[i][0] != '-')
         {
@@ -234,21 +262,22 @@ void ParseCommandLine(int argc, char *argv[], char *szInputFileName,
 
 int main(int argc, char **argv)
 {
-    char szInFilePath[256] = "";
+    char szInFilePath[256] = "", szTraceFilePath[256] = "", szApiTraceFilePath[256] = "";
     int iGpu = 0;
     int nThread = 2;
     bool bSingle = false;
-    std::vector<std::exception_ptr> vDecExceptionPtrs;
-    std::vector<std::exception_ptr> vEncExceptionPtrs;
+    bool bPrimary = false;
+    bool bNoBind = false;
     try
     {
         NvEncoderInitParam encodeCLIOptions;
-        ParseCommandLine(argc, argv, szInFilePath, iGpu, nThread, bSingle, encodeCLIOptions);
+        ParseCommandLine(argc, argv, szInFilePath, iGpu, nThread, bSingle, bPrimary, bNoBind, szTraceFilePath, szApiTraceFilePath,
+            encodeCLIOptions);
 
         CheckInputFile(szInFilePath);
 
         uint8_t *pBuf = NULL;
-        uint32_t nBufSize = 0;
+        uint64_t nBufSize = 0;
         BufferedFileReader bufferedFileReader(szInFilePath);
         if (!bufferedFileReader.GetBuffer(&pBuf, &nBufSize)) {
             std::cout << "Failed to read file" << std::endl;
@@ -270,17 +299,38 @@ int main(int argc, char **argv)
 
         std::vector<std::unique_ptr<FFmpegDemuxer>> vDemuxer;
         std::vector<std::unique_ptr<NvDecoder>> vpDec;
-        std::vector<NvThread> vpThread;
         std::vector<int> vnFrameTrans(nThread);
+        NvCudaContextManager contextManager;
+        std::vector<std::unique_ptr<NvCudaStream>> vStream;
+        std::vector<NvCudaContextScope::Stats> vStats(2 * nThread);
         CUcontext cuContext = NULL;
-        ck(cuCtxCreate(&cuContext, 0, cuDevice));
+        if (bPrimary)
+        {
+            cuContext = contextManager.GetContext(iGpu);
+        }
+        else
+        {
+            ck(cuCtxCreate(&cuContext, 0, cuDevice));
+        }
+        if (*szTraceFilePath)
+        {
+            Tracer::Get().Start();
+        }
+        if (*szApiTraceFilePath && !NvApiRecorder::Start(szApiTraceFilePath))
+        {
+            std::cout << "Failed to create API trace " << szApiTraceFilePath << std::endl;
+            return 1;
+        }
         auto t0 = std::chrono::high_resolution_clock::now();
-        vDecExceptionPtrs.resize(nThread);
-        vEncExceptionPtrs.resize(nThread);
+        NvPipeline pipeline;
 
         for (int i = 0; i < nThread; i++)
         {
-            if (!bSingle)
+            if (bPrimary)
+            {
+                vStream.push_back(contextManager.CreateStream(iGpu));
+            }
+            else if (!bSingle)
             {
                 ck(cuCtxCreate(&cuContext, 0, cuDevice));
             }
@@ -299,23 +349,10 @@ int main(int argc, char **argv)
 
             vpDec.push_back(std::move(dec));
 
-            vpThread.push_back(NvThread(std::thread(TransProc, cuContext, vpDec[i].get(), vDemuxer[i].get(), &vnFrameTrans[i], &encodeCLIOptions, std::ref(vDecExceptionPtrs[i]), std::ref(vEncExceptionPtrs[i]))));
-        }
-        for (int i = 0; i < nThread; i++) 
-        {
-            vpThread[i].join();
-        }
-        for (int i = 0; i < nThread; i++)
-        {
-            if (vDecExceptionPtrs[i])
-            {
-                std::rethrow_exception(vDecExceptionPtrs[i]);
-            }
-            if (vEncExceptionPtrs[i])
-            {
-                std::rethrow_exception(vDecExceptionPtrs[i]);
-            }
+            AddTransStages(pipeline, i, cuContext, vpDec[i].get(), vDemuxer[i].get(), &vnFrameTrans[i], &encodeCLIOptions,
+                bPrimary ? vStream[i].get() : NULL, !bNoBind, &vStats[2 * i]);
         }
+        pipeline.Wait();
 
         auto t1 = std::chrono::high_resolution_clock::now();
         auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(t1.time_since_epoch() - t0.time_since_epoch()).count();
@@ -326,7 +363,29 @@ int main(int argc, char **argv)
             nFrameTransTotal += vnFrameTrans[i];
             vpDec[i].reset(nullptr);
         }
+        if (*szApiTraceFilePath && !NvApiRecorder::Stop())
+        {
+            std::cout << "Failed to write API trace " << szApiTraceFilePath << std::endl;
+        }
+        NvCudaContextScope::Stats stats;
+        for (NvCudaContextScope::Stats &s : vStats)
+        {
+            stats.nPush += s.nPush;
+            stats.nSkip += s.nSkip;
+        }
+        double nsPushPop = NvCudaContextScope::MeasurePushPop(cuContext);
+        pipeline.PrintMetrics(std::cout);
         std::cout << "nFrameTransTotal=" << nFrameTransTotal << ", time=" << msec << " millisec, FPS=" << (nFrameTransTotal * 1000 / msec) << std::endl;
+        std::cout << "Context push/pop: " << stats.nPush << " made, " << stats.nSkip << " saved, " << nsPushPop
+            << " ns each, " << stats.nSkip * nsPushPop / 1e6 << " ms saved" << std::endl;
+        if (*szTraceFilePath)
+        {
+            Tracer::Get().Stop();
+            if (!Tracer::Get().WriteChromeTrace(szTraceFilePath))
+            {
+                std::cout << "Failed to write trace " << szTraceFilePath << std::endl;
+            }
+        }
     }
     catch (const std::exception& ex)
     {
@@ -0,0 +1,897 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <map>
+#include <thread>
+#include "NvDecoder/NvDecoder.h"
+#include "NvEncoder/NvEncoder.h"
+#include "NvApiTrace/NvApiReplay.h"
+#include "../Utils/Tracer.h"
+
+struct NvApiReplaySession
+{
+    bool bEncode = false;
+    int iSession = 0;
+    /** The calls of the session in the order they were recorded */
+    std::vector<const NvApiTraceEvent *> vpEvent;
+    /** The backend calls still to be served, by call */
+    std::deque<const NvApiTraceEvent *> adqCall[NV_API_CALL_COUNT];
+    /** Parser callbacks by the cuvidParseVideoData() call they came from, in the order they started */
+    std::map<uint32_t, std::vector<const NvApiTraceEvent *>> mCallback;
+    uint32_t nPacket = 0;
+    CUVIDPARSERPARAMS parserParams = {};
+    /** Stands in for the packets fed to the decoder and for the output of the encoder */
+    std::vector<uint8_t> vBitstream;
+    uintptr_t nHandle = 0;
+    uint64_t nCall = 0, nExtra = 0, nsBackend = 0, nsPacing = 0;
+};
+
+static std::atomic<bool> s_bReplaying(false);
+static const NvApiReplayParams *s_pParams = NULL;
+static std::chrono::steady_clock::time_point s_tStart;
+static std::atomic<uint64_t> s_nFakeDevicePtr(1ull << 32);
+/** Session of the calling thread, for the calls that carry no handle of it */
+static thread_local NvApiReplaySession *t_pSession = NULL;
+
+/** Sleeps until shortly before t and yields through the rest, as sleeping alone overshoots by more than a short call takes */
+static void WaitUntil(std::chrono::steady_clock::time_point t)
+{
+    const std::chrono::microseconds spin(200);
+    std::chrono::steady_clock::time_point tNow = std::chrono::steady_clock::now();
+    if (t - tNow > spin)
+    {
+        std::this_thread::sleep_for(t - tNow - spin);
+    }
+    while (std::chrono::steady_clock::now() < t)
+    {
+        std::this_thread::yield();
+    }
+}
+
+/** Takes as long as nsRecorded took in the recording, scaled */
+static void Wait(NvApiReplaySession *pSession, int64_t nsRecorded)
+{
+    if (nsRecorded <= 0 || s_pParams->fTimeScale <= 0)
+    {
+        return;
+    }
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    WaitUntil(t0 + std::chrono::nanoseconds((int64_t)(nsRecorded * s_pParams->fTimeScale)));
+    pSession->nsBackend += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/** Holds a frame back until the time it started in the recording */
+static void Pace(NvApiReplaySession *pSession, uint64_t nsStart)
+{
+    if (!s_pParams->bPaced)
+    {
+        return;
+    }
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    WaitUntil(s_tStart + std::chrono::nanoseconds(nsStart));
+    pSession->nsPacing += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/** Takes the next recorded eCall off the session; NULL, and counted, if the recording made no more */
+static const NvApiTraceEvent *Take(NvApiReplaySession *pSession, NvApiCall eCall)
+{
+    std::deque<const NvApiTraceEvent *> &dqCall = pSession->adqCall[eCall];
+    if (dqCall.empty())
+    {
+        pSession->nExtra++;
+        return NULL;
+    }
+    const NvApiTraceEvent *pEvent = dqCall.front();
+    dqCall.pop_front();
+    pSession->nCall++;
+    return pEvent;
+}
+
+static bool IsTracing()
+{
+    return s_pParams->bTraceCalls && Tracer::Get().IsEnabled();
+}
+
+/** Serves a call from the recording: takes its record and as long as it took */
+static const NvApiTraceEvent *Serve(NvApiReplaySession *pSession, NvApiCall eCall)
+{
+    if (!pSession)
+    {
+        return NULL;
+    }
+    bool bTrace = IsTracing();
+    int64_t tBegin = bTrace ? Tracer::Get().Now() : 0;
+    const NvApiTraceEvent *pEvent = Take(pSession, eCall);
+    if (pEvent)
+    {
+        Wait(pSession, pEvent->rec.nsDuration);
+    }
+    if (bTrace)
+    {
+        Tracer::Get().Record(GetApiCallName(eCall), tBegin, Tracer::Get().Now());
+    }
+    return pEvent;
+}
+
+/** What the recording returned; calls beyond the recording succeed */
+template<typename T>
+static T Result(const NvApiTraceEvent *pEvent, T ok)
+{
+    return pEvent ? (T)pEvent->rec.status : ok;
+}
+
+static void *NewHandle(NvApiReplaySession *pSession)
+{
+    return (void *)++pSession->nHandle;
+}
+
+static CUdeviceptr NewDevicePtr(uint64_t nSize)
+{
+    return (CUdeviceptr)s_nFakeDevicePtr.fetch_add((nSize + 255) & ~(uint64_t)255);
+}
+
+static NvApiReplaySession *EncoderSession(void *encoder)
+{
+    return (NvApiReplaySession *)encoder;
+}
+
+static NVENCSTATUS NVENCAPI FakeOpenEncodeSession(void *device, uint32_t deviceType, void **encoder)
+{
+    if (!t_pSession)
+    {
+        return NV_ENC_ERR_NO_ENCODE_DEVICE;
+    }
+    const NvApiTraceEvent *pEvent = Serve(t_pSession, NV_API_ENC_OPEN_ENCODE_SESSION);
+    *encoder = t_pSession;
+    return Result(pEvent, NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeOpenEncodeSessionEx(NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS *openSessionExParams, void **encoder)
+{
+    if (!t_pSession)
+    {
+        return NV_ENC_ERR_NO_ENCODE_DEVICE;
+    }
+    const NvApiTraceEvent *pEvent = Serve(t_pSession, NV_API_ENC_OPEN_ENCODE_SESSION_EX);
+    *encoder = t_pSession;
+    return Result(pEvent, NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeGetEncodeCaps(void *encoder, GUID encodeGUID, NV_ENC_CAPS_PARAM *capsParam, int *capsVal)
+{
+    const NvApiTraceEvent *pEvent = Serve(EncoderSession(encoder), NV_API_ENC_GET_ENCODE_CAPS);
+    NvApiEncodeCapsArgs args = {};
+    if (pEvent && pEvent->GetArg(args))
+    {
+        *capsVal = args.capsVal;
+    }
+    return Result(pEvent, NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeGetEncodePresetConfig(void *encoder, GUID encodeGUID, GUID presetGUID, NV_ENC_PRESET_CONFIG *presetConfig)
+{
+    // The configuration the encoder is created with comes from the recording, not from the preset
+    return Result(Serve(EncoderSession(encoder), NV_API_ENC_GET_ENCODE_PRESET_CONFIG), NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeInitializeEncoder(void *encoder, NV_ENC_INITIALIZE_PARAMS *createEncodeParams)
+{
+    return Result(Serve(EncoderSession(encoder), NV_API_ENC_INITIALIZE_ENCODER), NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeCreateBitstreamBuffer(void *encoder, NV_ENC_CREATE_BITSTREAM_BUFFER *createBitstreamBufferParams)
+{
+    const NvApiTraceEvent *pEvent = Serve(EncoderSession(encoder), NV_API_ENC_CREATE_BITSTREAM_BUFFER);
+    createBitstreamBufferParams->bitstreamBuffer = NewHandle(EncoderSession(encoder));
+    return Result(pEvent, NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeDestroyBitstreamBuffer(void *encoder, NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+    return Result(Serve(EncoderSession(encoder), NV_API_ENC_DESTROY_BITSTREAM_BUFFER), NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeEncodePicture(void *encoder, NV_ENC_PIC_PARAMS *encodePicParams)
+{
+    const NvApiTraceEvent *pEvent = Serve(EncoderSession(encoder), NV_API_ENC_ENCODE_PICTURE);
+#if defined(_WIN32)
+    // The fake hardware is done when the call returns
+    if (encodePicParams->completionEvent)
+    {
+        SetEvent(encodePicParams->completionEvent);
+    }
+#endif
+    return Result(pEvent, NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeLockBitstream(void *encoder, NV_ENC_LOCK_BITSTREAM *lockBitstreamBufferParams)
+{
+    NvApiReplaySession *pSession = EncoderSession(encoder);
+    const NvApiTraceEvent *pEvent = Serve(pSession, NV_API_ENC_LOCK_BITSTREAM);
+    NvApiLockBitstreamArgs args = {};
+    uint32_t nSize = 0;
+    if (pEvent && pEvent->GetArg(args))
+    {
+        nSize = (std::min)(pEvent->rec.nSize, (uint32_t)pSession->vBitstream.size());
+    }
+    lockBitstreamBufferParams->bitstreamBufferPtr = pSession->vBitstream.data();
+    lockBitstreamBufferParams->bitstreamSizeInBytes = nSize;
+    lockBitstreamBufferParams->frameIdx = args.frameIdx;
+    lockBitstreamBufferParams->pictureType = (NV_ENC_PIC_TYPE)args.pictureType;
+    lockBitstreamBufferParams->numSlices = args.numSlices;
+    lockBitstreamBufferParams->outputTimeStamp = args.outputTimeStamp;
+    return Result(pEvent, NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeUnlockBitstream(void *encoder, NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+    return Result(Serve(EncoderSession(encoder), NV_API_ENC_UNLOCK_BITSTREAM), NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeGetSequenceParams(void *encoder, NV_ENC_SEQUENCE_PARAM_PAYLOAD *sequenceParamPayload)
+{
+    const NvApiTraceEvent *pEvent = Serve(EncoderSession(encoder), NV_API_ENC_GET_SEQUENCE_PARAMS);
+    if (sequenceParamPayload->outSPSPPSPayloadSize)
+    {
+        *sequenceParamPayload->outSPSPPSPayloadSize = pEvent ? (std::min)(pEvent->rec.nSize, sequenceParamPayload->inBufferSize) : 0;
+    }
+    return Result(pEvent, NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeRegisterAsyncEvent(void *encoder, NV_ENC_EVENT_PARAMS *eventParams)
+{
+    return Result(Serve(EncoderSession(encoder), NV_API_ENC_REGISTER_ASYNC_EVENT), NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeUnregisterAsyncEvent(void *encoder, NV_ENC_EVENT_PARAMS *eventParams)
+{
+    return Result(Serve(EncoderSession(encoder), NV_API_ENC_UNREGISTER_ASYNC_EVENT), NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeMapInputResource(void *encoder, NV_ENC_MAP_INPUT_RESOURCE *mapInputResParams)
+{
+    const NvApiTraceEvent *pEvent = Serve(EncoderSession(encoder), NV_API_ENC_MAP_INPUT_RESOURCE);
+    mapInputResParams->mappedResource = NewHandle(EncoderSession(encoder));
+    return Result(pEvent, NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeUnmapInputResource(void *encoder, NV_ENC_INPUT_PTR mappedInputBuffer)
+{
+    return Result(Serve(EncoderSession(encoder), NV_API_ENC_UNMAP_INPUT_RESOURCE), NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeDestroyEncoder(void *encoder)
+{
+    return Result(Serve(EncoderSession(encoder), NV_API_ENC_DESTROY_ENCODER), NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeRegisterResource(void *encoder, NV_ENC_REGISTER_RESOURCE *registerResParams)
+{
+    const NvApiTraceEvent *pEvent = Serve(EncoderSession(encoder), NV_API_ENC_REGISTER_RESOURCE);
+    registerResParams->registeredResource = NewHandle(EncoderSession(encoder));
+    return Result(pEvent, NV_ENC_SUCCESS);
+}
+
+static NVENCSTATUS NVENCAPI FakeUnregisterResource(void *encoder, NV_ENC_REGISTERED_PTR registeredRes)
+{
+    return Result(Serve(EncoderSession(encoder), NV_API_ENC_UNREGISTER_RESOURCE), NV_ENC_SUCCESS);
+}
+
+/**
+*  @brief The loader of the encoders of a replay. It leaves out the entries only motion estimation
+*  and reconfiguration use, as sessions that use them are not replayed.
+*/
+static NVENCSTATUS NVENCAPI FakeCreateInstance(NV_ENCODE_API_FUNCTION_LIST *pFunctionList)
+{
+    pFunctionList->nvEncOpenEncodeSession = FakeOpenEncodeSession;
+    pFunctionList->nvEncOpenEncodeSessionEx = FakeOpenEncodeSessionEx;
+    pFunctionList->nvEncGetEncodeCaps = FakeGetEncodeCaps;
+    pFunctionList->nvEncGetEncodePresetConfig = FakeGetEncodePresetConfig;
+    pFunctionList->nvEncInitializeEncoder = FakeInitializeEncoder;
+    pFunctionList->nvEncCreateBitstreamBuffer = FakeCreateBitstreamBuffer;
+    pFunctionList->nvEncDestroyBitstreamBuffer = FakeDestroyBitstreamBuffer;
+    pFunctionList->nvEncEncodePicture = FakeEncodePicture;
+    pFunctionList->nvEncLockBitstream = FakeLockBitstream;
+    pFunctionList->nvEncUnlockBitstream = FakeUnlockBitstream;
+    pFunctionList->nvEncGetSequenceParams = FakeGetSequenceParams;
+    pFunctionList->nvEncRegisterAsyncEvent = FakeRegisterAsyncEvent;
+    pFunctionList->nvEncUnregisterAsyncEvent = FakeUnregisterAsyncEvent;
+    pFunctionList->nvEncMapInputResource = FakeMapInputResource;
+    pFunctionList->nvEncUnmapInputResource = FakeUnmapInputResource;
+    pFunctionList->nvEncDestroyEncoder = FakeDestroyEncoder;
+    pFunctionList->nvEncRegisterResource = FakeRegisterResource;
+    pFunctionList->nvEncUnregisterResource = FakeUnregisterResource;
+    return NV_ENC_SUCCESS;
+}
+
+static void InvokeCallback(NvApiReplaySession *pSession, const NvApiTraceEvent *pCallback)
+{
+    const CUVIDPARSERPARAMS &params = pSession->parserParams;
+    const size_t nOffset = sizeof(NvApiCallbackArgs);
+    switch (pCallback->rec.eCall)
+    {
+    case NV_API_DEC_SEQUENCE_CALLBACK:
+    {
+        CUVIDEOFORMAT videoFormat = {};
+        if (params.pfnSequenceCallback && pCallback->GetArg(videoFormat, nOffset))
+        {
+            params.pfnSequenceCallback(params.pUserData, &videoFormat);
+        }
+        break;
+    }
+    case NV_API_DEC_DECODE_CALLBACK:
+    {
+        NvApiPictureArgs args = {};
+        if (params.pfnDecodePicture && pCallback->GetArg(args, nOffset))
+        {
+            CUVIDPICPARAMS picParams = {};
+            picParams.CurrPicIdx = args.CurrPicIdx;
+            picParams.field_pic_flag = args.field_pic_flag;
+            picParams.bottom_field_flag = args.bottom_field_flag;
+            picParams.second_field = args.second_field;
+            picParams.nBitstreamDataLen = (std::min)(pCallback->rec.nSize, (uint32_t)pSession->vBitstream.size());
+            picParams.pBitstreamData = pSession->vBitstream.data();
+            picParams.nNumSlices = args.nNumSlices;
+            picParams.ref_pic_flag = args.ref_pic_flag;
+            picParams.intra_pic_flag = args.intra_pic_flag;
+            params.pfnDecodePicture(params.pUserData, &picParams);
+        }
+        break;
+    }
+    case NV_API_DEC_DISPLAY_CALLBACK:
+    {
+        CUVIDPARSERDISPINFO dispInfo = {};
+        if (params.pfnDisplayPicture && pCallback->GetArg(dispInfo, nOffset))
+        {
+            params.pfnDisplayPicture(params.pUserData, &dispInfo);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static CUresult CUDAAPI FakeCtxLockCreate(CUvideoctxlock *pLock, CUcontext ctx)
+{
+    // Not a call of any session in the recording
+    static int iFakeLock;
+    *pLock = (CUvideoctxlock)&iFakeLock;
+    return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI FakeCtxLockDestroy(CUvideoctxlock lck)
+{
+    return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI FakeCreateVideoParser(CUvideoparser *pObj, CUVIDPARSERPARAMS *pParams)
+{
+    if (!t_pSession)
+    {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+    const NvApiTraceEvent *pEvent = Serve(t_pSession, NV_API_DEC_CREATE_VIDEO_PARSER);
+    t_pSession->parserParams = *pParams;
+    *pObj = (CUvideoparser)t_pSession;
+    return Result(pEvent, CUDA_SUCCESS);
+}
+
+/**
+*  @brief Replays the callbacks the packet got in the recording, with the gaps the parser left
+*  around them, and waits out the rest of the call after the last one.
+*/
+static CUresult CUDAAPI FakeParseVideoData(CUvideoparser obj, CUVIDSOURCEDATAPACKET *pPacket)
+{
+    NvApiReplaySession *pSession = (NvApiReplaySession *)obj;
+    bool bTrace = IsTracing();
+    int64_t tBegin = bTrace ? Tracer::Get().Now() : 0;
+    const NvApiTraceEvent *pEvent = Take(pSession, NV_API_DEC_PARSE_VIDEO_DATA);
+    uint32_t iPacket = pSession->nPacket++;
+    if (!pEvent)
+    {
+        return CUDA_SUCCESS;
+    }
+    uint64_t nsEnd = pEvent->rec.nsStart;
+    auto it = pSession->mCallback.find(iPacket);
+    if (it != pSession->mCallback.end())
+    {
+        for (const NvApiTraceEvent *pCallback : it->second)
+        {
+            Wait(pSession, (int64_t)(pCallback->rec.nsStart - nsEnd));
+            nsEnd = (std::max)(nsEnd, pCallback->rec.nsStart + pCallback->rec.nsDuration);
+            InvokeCallback(pSession, pCallback);
+        }
+    }
+    Wait(pSession, (int64_t)(pEvent->rec.nsStart + pEvent->rec.nsDuration - nsEnd));
+    if (bTrace)
+    {
+        Tracer::Get().Record(GetApiCallName(NV_API_DEC_PARSE_VIDEO_DATA), tBegin, Tracer::Get().Now());
+    }
+    return (CUresult)pEvent->rec.status;
+}
+
+static CUresult CUDAAPI FakeDestroyVideoParser(CUvideoparser obj)
+{
+    return Result(Serve((NvApiReplaySession *)obj, NV_API_DEC_DESTROY_VIDEO_PARSER), CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeGetDecoderCaps(CUVIDDECODECAPS *pdc)
+{
+    const NvApiTraceEvent *pEvent = Serve(t_pSession, NV_API_DEC_GET_DECODER_CAPS);
+    if (pEvent)
+    {
+        pEvent->GetArg(*pdc);
+    }
+    return Result(pEvent, CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeCreateDecoder(CUvideodecoder *phDecoder, CUVIDDECODECREATEINFO *pdci)
+{
+    if (!t_pSession)
+    {
+        return CUDA_ERROR_NOT_INITIALIZED;
+    }
+    const NvApiTraceEvent *pEvent = Serve(t_pSession, NV_API_DEC_CREATE_DECODER);
+    *phDecoder = (CUvideodecoder)t_pSession;
+    return Result(pEvent, CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeDestroyDecoder(CUvideodecoder hDecoder)
+{
+    return Result(Serve((NvApiReplaySession *)hDecoder, NV_API_DEC_DESTROY_DECODER), CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeDecodePicture(CUvideodecoder hDecoder, CUVIDPICPARAMS *pPicParams)
+{
+    return Result(Serve((NvApiReplaySession *)hDecoder, NV_API_DEC_DECODE_PICTURE), CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeMapVideoFrame(CUvideodecoder hDecoder, int nPicIdx, CUdeviceptr *pDevPtr, unsigned int *pPitch,
+    CUVIDPROCPARAMS *pVPP)
+{
+    const NvApiTraceEvent *pEvent = Serve((NvApiReplaySession *)hDecoder, NV_API_DEC_MAP_VIDEO_FRAME);
+    NvApiMapVideoFrameArgs args = {};
+    if (pEvent)
+    {
+        pEvent->GetArg(args);
+    }
+    // Nothing reads the frame, so every mapping may share an address
+    static const CUdeviceptr dpFrame = NewDevicePtr(1);
+    *pDevPtr = dpFrame;
+    *pPitch = args.nPitch;
+    return Result(pEvent, CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeUnmapVideoFrame(CUvideodecoder hDecoder, CUdeviceptr DevPtr)
+{
+    return Result(Serve((NvApiReplaySession *)hDecoder, NV_API_DEC_UNMAP_VIDEO_FRAME), CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeMemAlloc(CUdeviceptr *dptr, size_t bytesize)
+{
+    const NvApiTraceEvent *pEvent = Serve(t_pSession, NV_API_DEC_MEM_ALLOC);
+    *dptr = NewDevicePtr(bytesize);
+    return Result(pEvent, CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeMemAllocPitch(CUdeviceptr *dptr, size_t *pPitch, size_t WidthInBytes, size_t Height, unsigned int ElementSizeBytes)
+{
+    const NvApiTraceEvent *pEvent = Serve(t_pSession, NV_API_DEC_MEM_ALLOC_PITCH);
+    NvApiMemAllocPitchArgs args = {};
+    *pPitch = pEvent && pEvent->GetArg(args) && args.Pitch ? (size_t)args.Pitch : (WidthInBytes + 255) & ~(size_t)255;
+    *dptr = NewDevicePtr((uint64_t)*pPitch * Height);
+    return Result(pEvent, CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeMemFree(CUdeviceptr dptr)
+{
+    return Result(Serve(t_pSession, NV_API_DEC_MEM_FREE), CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeMemcpy2DAsync(const CUDA_MEMCPY2D *pCopy, CUstream hStream)
+{
+    return Result(Serve(t_pSession, NV_API_DEC_MEMCPY_2D_ASYNC), CUDA_SUCCESS);
+}
+
+static CUresult CUDAAPI FakeStreamSynchronize(CUstream hStream)
+{
+    return Result(Serve(t_pSession, NV_API_DEC_STREAM_SYNCHRONIZE), CUDA_SUCCESS);
+}
+
+static const NvDecoderApi &GetFakeDecoderApi()
+{
+    static const NvDecoderApi api = {
+        FakeCtxLockCreate, FakeCtxLockDestroy, FakeCreateVideoParser, FakeParseVideoData, FakeDestroyVideoParser,
+        FakeGetDecoderCaps, FakeCreateDecoder, FakeDestroyDecoder, FakeDecodePicture, FakeMapVideoFrame,
+        FakeUnmapVideoFrame, FakeMemAlloc, FakeMemAllocPitch, FakeMemFree, FakeMemcpy2DAsync, FakeStreamSynchronize
+    };
+    return api;
+}
+
+/**
+*  @brief An encoder with its input frames in host memory, registered like the frames of the
+*  recording. The fake backend never reads them.
+*/
+class NvEncoderReplay : public NvEncoder
+{
+public:
+    NvEncoderReplay(uint32_t nWidth, uint32_t nHeight, NV_ENC_BUFFER_FORMAT eBufferFormat, uint32_t nExtraOutputDelay,
+        NV_ENC_INPUT_RESOURCE_TYPE eResourceType, uint32_t nPitch) :
+        NvEncoder(NV_ENC_DEVICE_TYPE_CUDA, NULL, nWidth, nHeight, eBufferFormat, nExtraOutputDelay, false),
+        m_eResourceType(eResourceType), m_nPitch(nPitch) {}
+    virtual ~NvEncoderReplay()
+    {
+        ReleaseInputBuffers();
+    }
+
+private:
+    void AllocateInputBuffers(int32_t numInputBuffers)
+    {
+        if (!IsHWEncoderInitialized())
+        {
+            NVENC_THROW_ERROR("Encoder intialization failed", NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
+        }
+        uint32_t nHeight = GetMaxEncodeHeight()
+            + GetNumChromaPlanes(GetPixelFormat()) * GetChromaHeight(GetPixelFormat(), GetMaxEncodeHeight());
+        std::vector<void *> vpFrame;
+        for (int i = 0; i < numInputBuffers; i++)
+        {
+            m_vpFrame.emplace_back(new uint8_t[(size_t)m_nPitch * nHeight]);
+            vpFrame.push_back(m_vpFrame.back().get());
+        }
+        RegisterResources(vpFrame, m_eResourceType, GetMaxEncodeWidth(), GetMaxEncodeHeight(), m_nPitch, GetPixelFormat());
+    }
+
+    void ReleaseInputBuffers()
+    {
+        if (!m_hEncoder)
+        {
+            return;
+        }
+        UnregisterResources();
+        m_vInputFrames.clear();
+        m_vpFrame.clear();
+    }
+
+private:
+    NV_ENC_INPUT_RESOURCE_TYPE m_eResourceType;
+    uint32_t m_nPitch;
+    std::vector<std::unique_ptr<uint8_t[]>> m_vpFrame;
+};
+
+NvApiReplayer::NvApiReplayer(const NvApiTrace &trace, const NvApiReplayParams &params) : m_trace(trace), m_params(params)
+{
+    BuildSessions();
+}
+
+NvApiReplayer::~NvApiReplayer()
+{
+}
+
+void NvApiReplayer::BuildSessions()
+{
+    int nEncode = m_trace.GetEncodeSessionCount(), nDecode = m_trace.GetDecodeSessionCount();
+    m_vpSession.clear();
+    m_vReport.assign(nEncode + nDecode, NvApiReplaySessionReport());
+    for (int i = 0; i < nEncode + nDecode; i++)
+    {
+        NvApiReplaySession *pSession = new NvApiReplaySession();
+        pSession->bEncode = i < nEncode;
+        pSession->iSession = pSession->bEncode ? i : i - nEncode;
+        m_vpSession.emplace_back(pSession);
+        m_vReport[i].bEncode = pSession->bEncode;
+        m_vReport[i].iSession = pSession->iSession;
+    }
+
+    std::vector<uint32_t> vnBitstream(m_vpSession.size(), 1);
+    for (const NvApiTraceEvent &event : m_trace.GetEvents())
+    {
+        const NvApiTraceRecord &rec = event.rec;
+        if (rec.iSession == NV_API_NO_SESSION)
+        {
+            continue;
+        }
+        int iSession = IsEncodeApiCall(rec.eCall) ? rec.iSession : nEncode + rec.iSession;
+        NvApiReplaySession *pSession = m_vpSession[iSession].get();
+        pSession->vpEvent.push_back(&event);
+        if (rec.eCall == NV_API_DEC_PARSE_VIDEO_DATA || rec.eCall == NV_API_DEC_DECODE_CALLBACK || rec.eCall == NV_API_ENC_LOCK_BITSTREAM)
+        {
+            vnBitstream[iSession] = (std::max)(vnBitstream[iSession], rec.nSize);
+        }
+        if (rec.eCall >= NV_API_DEC_SEQUENCE_CALLBACK)
+        {
+            NvApiCallbackArgs args;
+            if (event.GetArg(args))
+            {
+                pSession->mCallback[args.iPacket].push_back(&event);
+            }
+        }
+        else
+        {
+            pSession->adqCall[rec.eCall].push_back(&event);
+        }
+    }
+    for (size_t i = 0; i < m_vpSession.size(); i++)
+    {
+        NvApiReplaySession *pSession = m_vpSession[i].get();
+        // Callbacks are recorded as they end, which for nested ones is not the order they started in
+        for (auto &it : pSession->mCallback)
+        {
+            std::stable_sort(it.second.begin(), it.second.end(), [](const NvApiTraceEvent *a, const NvApiTraceEvent *b) {
+                return a->rec.nsStart < b->rec.nsStart;
+            });
+        }
+        pSession->vBitstream.resize(vnBitstream[i]);
+        if (!pSession->vpEvent.empty())
+        {
+            uint64_t nsFirst = UINT64_MAX, nsLast = 0;
+            for (const NvApiTraceEvent *pEvent : pSession->vpEvent)
+            {
+                nsFirst = (std::min)(nsFirst, pEvent->rec.nsStart);
+                nsLast = (std::max)(nsLast, pEvent->rec.nsStart + pEvent->rec.nsDuration);
+            }
+            m_vReport[i].nsRecorded = nsLast - nsFirst;
+        }
+    }
+}
+
+bool NvApiReplayer::Run()
+{
+    bool bReplaying = false;
+    if (!s_bReplaying.compare_exchange_strong(bReplaying, true))
+    {
+        return false;
+    }
+    BuildSessions();
+    s_pParams = &m_params;
+    NvEncoder::SetApiLoader(FakeCreateInstance);
+    NvDecoder::SetApi(&GetFakeDecoderApi());
+
+    s_tStart = std::chrono::steady_clock::now();
+    std::vector<std::thread> vThread;
+    for (size_t i = 0; i < m_vpSession.size(); i++)
+    {
+        vThread.push_back(std::thread(&NvApiReplayer::RunSession, this, m_vpSession[i].get(), std::ref(m_vReport[i])));
+    }
+    for (std::thread &t : vThread)
+    {
+        t.join();
+    }
+    m_nsReplay = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - s_tStart).count();
+
+    NvEncoder::SetApiLoader(NULL);
+    NvDecoder::SetApi(NULL);
+    s_bReplaying = false;
+    return std::all_of(m_vReport.begin(), m_vReport.end(), [](const NvApiReplaySessionReport &report) {
+        return report.bReplayed;
+    });
+}
+
+void NvApiReplayer::RunSession(NvApiReplaySession *pSession, NvApiReplaySessionReport &report)
+{
+    t_pSession = pSession;
+    if (Tracer::Get().IsEnabled())
+    {
+        Tracer::Get().SetThreadName((pSession->bEncode ? "Encode session " : "Decode session ") + std::to_string(pSession->iSession));
+    }
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    try
+    {
+        if (pSession->bEncode)
+        {
+            RunEncodeSession(pSession, report);
+        }
+        else
+        {
+            RunDecodeSession(pSession, report);
+        }
+    }
+    catch (const std::exception &ex)
+    {
+        report.bReplayed = false;
+        report.strError = ex.what();
+    }
+    report.nsReplay = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    report.nCall = pSession->nCall;
+    report.nExtra = pSession->nExtra;
+    report.nMissing = 0;
+    for (const std::deque<const NvApiTraceEvent *> &dqCall : pSession->adqCall)
+    {
+        report.nMissing += dqCall.size();
+    }
+    report.nsBackend = pSession->nsBackend;
+    report.nsPacing = pSession->nsPacing;
+    report.nsHost = report.nsReplay > report.nsBackend + report.nsPacing ? report.nsReplay - report.nsBackend - report.nsPacing : 0;
+    t_pSession = NULL;
+}
+
+static const NvApiTraceEvent *FindEvent(const NvApiReplaySession *pSession, NvApiCall eCall)
+{
+    for (const NvApiTraceEvent *pEvent : pSession->vpEvent)
+    {
+        if (pEvent->rec.eCall == eCall)
+        {
+            return pEvent;
+        }
+    }
+    return NULL;
+}
+
+void NvApiReplayer::RunEncodeSession(NvApiReplaySession *pSession, NvApiReplaySessionReport &report)
+{
+    if (FindEvent(pSession, NV_API_ENC_RUN_MOTION_ESTIMATION_ONLY) || FindEvent(pSession, NV_API_ENC_CREATE_MV_BUFFER))
+    {
+        report.strError = "Motion estimation only sessions are not replayed";
+        return;
+    }
+    if (FindEvent(pSession, NV_API_ENC_RECONFIGURE_ENCODER))
+    {
+        report.strError = "Sessions that reconfigure are not replayed";
+        return;
+    }
+    const NvApiTraceEvent *pInitialize = FindEvent(pSession, NV_API_ENC_INITIALIZE_ENCODER);
+    const NvApiTraceEvent *pRegister = FindEvent(pSession, NV_API_ENC_REGISTER_RESOURCE);
+    NV_ENC_INITIALIZE_PARAMS initializeParams = {};
+    NV_ENC_CONFIG encodeConfig = {};
+    NvApiRegisterResourceArgs resource = {};
+    if (!pInitialize || !pInitialize->GetArg(initializeParams) || !pInitialize->GetArg(encodeConfig, sizeof(initializeParams))
+        || !pRegister || !pRegister->GetArg(resource))
+    {
+        report.strError = "The recording has no nvEncInitializeEncoder() or nvEncRegisterResource()";
+        return;
+    }
+    // The extra output delay the recording was made with is what makes up the bitstream buffers it created
+    int nExtraOutputDelay = (int)pSession->adqCall[NV_API_ENC_CREATE_BITSTREAM_BUFFER].size()
+        - (int)encodeConfig.frameIntervalP - (int)encodeConfig.rcParams.lookaheadDepth;
+    if (nExtraOutputDelay < 0)
+    {
+        report.strError = "The recording created too few bitstream buffers";
+        return;
+    }
+
+    NvEncoderReplay enc(initializeParams.encodeWidth, initializeParams.encodeHeight, (NV_ENC_BUFFER_FORMAT)resource.bufferFormat,
+        nExtraOutputDelay, (NV_ENC_INPUT_RESOURCE_TYPE)resource.resourceType, resource.pitch);
+
+    // The queries of the application, made before the encoder was created
+    for (const NvApiTraceEvent *pEvent : pSession->vpEvent)
+    {
+        if (pEvent->rec.eCall == NV_API_ENC_GET_ENCODE_CAPS)
+        {
+            NvApiEncodeCapsArgs args = {};
+            pEvent->GetArg(args);
+            enc.GetCapabilityValue(args.encodeGUID, (NV_ENC_CAPS)args.capsToQuery);
+        }
+        else if (pEvent->rec.eCall == NV_API_ENC_GET_ENCODE_PRESET_CONFIG)
+        {
+            NvApiPresetConfigArgs args = {};
+            pEvent->GetArg(args);
+            NV_ENC_INITIALIZE_PARAMS defaultParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+            NV_ENC_CONFIG defaultConfig = { NV_ENC_CONFIG_VER };
+            defaultParams.encodeConfig = &defaultConfig;
+            enc.CreateDefaultEncoderParams(&defaultParams, args.encodeGUID, args.presetGUID);
+        }
+    }
+
+    initializeParams.version = NV_ENC_INITIALIZE_PARAMS_VER;
+    initializeParams.encodeConfig = &encodeConfig;
+    initializeParams.privData = NULL;
+    initializeParams.privDataSize = 0;
+    enc.CreateEncoder(&initializeParams);
+
+    std::vector<uint8_t> vSequenceParams;
+    for (size_t i = pSession->adqCall[NV_API_ENC_GET_SEQUENCE_PARAMS].size(); i > 0; i--)
+    {
+        enc.GetSequenceParams(vSequenceParams);
+    }
+
+    std::vector<std::vector<uint8_t>> vPacket;
+    uint64_t nsFrameStart = 0;
+    bool bFrameStart = false;
+    for (const NvApiTraceEvent *pEvent : pSession->vpEvent)
+    {
+        // A frame starts with the mapping of its input
+        if (pEvent->rec.eCall == NV_API_ENC_MAP_INPUT_RESOURCE && !bFrameStart)
+        {
+            nsFrameStart = pEvent->rec.nsStart;
+            bFrameStart = true;
+        }
+        NvApiEncodePictureArgs args = {};
+        if (pEvent->rec.eCall != NV_API_ENC_ENCODE_PICTURE || !pEvent->GetArg(args))
+        {
+            continue;
+        }
+        if (args.encodePicFlags & NV_ENC_PIC_FLAG_EOS)
+        {
+            enc.EndEncode(vPacket);
+            break;
+        }
+        Pace(pSession, bFrameStart ? nsFrameStart : pEvent->rec.nsStart);
+        bFrameStart = false;
+        enc.GetNextInputFrame();
+        NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
+        picParams.inputTimeStamp = args.inputTimeStamp;
+        picParams.encodePicFlags = args.encodePicFlags;
+        picParams.pictureType = (NV_ENC_PIC_TYPE)args.pictureType;
+        enc.EncodeFrame(vPacket, &picParams);
+        report.nFrame++;
+    }
+    enc.DestroyEncoder();
+    report.bReplayed = true;
+}
+
+void NvApiReplayer::RunDecodeSession(NvApiReplaySession *pSession, NvApiReplaySessionReport &report)
+{
+    const NvApiTraceEvent *pParser = FindEvent(pSession, NV_API_DEC_CREATE_VIDEO_PARSER);
+    NvApiVideoParserArgs parser = {};
+    if (!pParser || !pParser->GetArg(parser))
+    {
+        report.strError = "The recording has no cuvidCreateVideoParser()";
+        return;
+    }
+    const NvApiTraceEvent *pCreate = FindEvent(pSession, NV_API_DEC_CREATE_DECODER);
+    CUVIDDECODECREATEINFO createInfo = {};
+    if (pCreate && pCreate->GetArg(createInfo) && (createInfo.display_area.right || createInfo.display_area.bottom
+        || createInfo.ulTargetWidth != createInfo.ulWidth || createInfo.ulTargetHeight != createInfo.ulHeight))
+    {
+        report.strError = "Sessions that crop or resize are not replayed";
+        return;
+    }
+    bool bPitched = !pSession->adqCall[NV_API_DEC_MEM_ALLOC_PITCH].empty();
+    bool bUseDeviceFrame = bPitched || !pSession->adqCall[NV_API_DEC_MEM_ALLOC].empty();
+
+    NvDecoder dec(NULL, 0, 0, bUseDeviceFrame, (cudaVideoCodec)parser.CodecType, NULL, parser.ulMaxDisplayDelay == 0, bPitched);
+    for (const NvApiTraceEvent *pEvent : pSession->vpEvent)
+    {
+        NvApiPacketArgs args = {};
+        if (pEvent->rec.eCall != NV_API_DEC_PARSE_VIDEO_DATA || !pEvent->GetArg(args))
+        {
+            continue;
+        }
+        Pace(pSession, pEvent->rec.nsStart);
+        int nSize = (int)(std::min)(pEvent->rec.nSize, (uint32_t)pSession->vBitstream.size());
+        int nFrameReturned = 0;
+        dec.Decode(nSize ? pSession->vBitstream.data() : NULL, nSize, NULL, &nFrameReturned, args.flags, NULL, args.timestamp);
+        report.nFrame += nFrameReturned;
+    }
+    report.bReplayed = true;
+}
+
+void NvApiReplayer::PrintReport(std::ostream &os) const
+{
+    os << "Replayed " << m_vReport.size() << " sessions in " << std::fixed << std::setprecision(1) << m_nsReplay / 1e6 << " ms"
+        << (m_params.bPaced ? "" : ", unpaced") << ", backend time x" << m_params.fTimeScale << std::endl;
+    os << std::left << std::setw(12) << "Session" << std::right << std::setw(8) << "Frames" << std::setw(9) << "Calls"
+        << std::setw(9) << "Missing" << std::setw(7) << "Extra" << std::setw(13) << "Recorded ms" << std::setw(11) << "Replay ms"
+        << std::setw(12) << "Backend ms" << std::setw(11) << "Pacing ms" << std::setw(9) << "Host ms" << std::endl;
+    for (const NvApiReplaySessionReport &report : m_vReport)
+    {
+        os << std::left << std::setw(12) << ((report.bEncode ? "Encode " : "Decode ") + std::to_string(report.iSession))
+            << std::right << std::setw(8) << report.nFrame << std::setw(9) << report.nCall << std::setw(9) << report.nMissing
+            << std::setw(7) << report.nExtra << std::setw(13) << report.nsRecorded / 1e6 << std::setw(11) << report.nsReplay / 1e6
+            << std::setw(12) << report.nsBackend / 1e6 << std::setw(11) << report.nsPacing / 1e6 << std::setw(9) << report.nsHost / 1e6
+            << std::endl;
+        if (!report.strError.empty())
+        {
+            os << "    " << (report.bReplayed ? "" : "Not replayed: ") << report.strError << std::endl;
+        }
+    }
+    os.unsetf(std::ios_base::floatfield);
+    os << std::setprecision(6);
+}
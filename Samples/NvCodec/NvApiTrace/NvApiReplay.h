@@ -0,0 +1,98 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "NvApiTrace/NvApiTrace.h"
+
+struct NvApiReplaySession;
+
+struct NvApiReplayParams
+{
+    /** Start each frame no earlier than it started in the recording; otherwise feed frames as fast as they are taken */
+    bool bPaced = true;
+    /** Factor on the recorded duration of every backend call; 0 makes the backend instant */
+    double fTimeScale = 1.0;
+    /** Record a Tracer span for every backend call, next to the spans of NvEncoder and NvDecoder */
+    bool bTraceCalls = false;
+};
+
+/**
+*  @brief What became of a session in replay. Host time is the time the session thread spent
+*  outside the fake backend and outside pacing, which is the cost of the NvEncoder or NvDecoder
+*  logic (and of the replay loop) alone.
+*/
+struct NvApiReplaySessionReport
+{
+    bool bEncode = false;
+    int iSession = 0;
+    bool bReplayed = false;
+    /** Why the session was not replayed or failed */
+    std::string strError;
+    uint64_t nFrame = 0;
+    /** Backend calls served from the trace, recorded calls the session did not make, and calls it made beyond the trace */
+    uint64_t nCall = 0, nMissing = 0, nExtra = 0;
+    uint64_t nsRecorded = 0, nsReplay = 0, nsBackend = 0, nsPacing = 0, nsHost = 0;
+};
+
+/**
+*  @brief Re-drives the host side of NvEncoder and NvDecoder from a trace of NvApiRecorder, against
+*  a fake backend that answers every call with what the recording returned, after as long as the
+*  recording took.
+*
+*  Every session of the trace gets a thread, an NvDecoder or an encoder derived from NvEncoder made
+*  the way the recording made them, and the frames of the recording: the packets the decoder was
+*  fed, with their sizes, flags and timestamps, and the pictures the encoder was given, with their
+*  timestamps and picture types. The parser callbacks of a packet are replayed from inside its
+*  cuvidParseVideoData(), with the gaps between them. No GPU or bitstream is needed, and since the
+*  backend takes the recorded time on every run, queueing and threading in the host code can be
+*  measured, and changed, deterministically. The driver libraries must still be installed, as
+*  NvDecoder and NvEncoder link them; replayed sessions call into them only for cuGetErrorName(),
+*  when the recording had errors.
+*
+*  The fake backend is installed with NvEncoder::SetApiLoader() and NvDecoder::SetApi() for the
+*  duration of Run(), so only one replayer runs at a time and no real sessions may be created then.
+*  Sessions in motion estimation only mode, and those that reconfigure, are reported but not replayed.
+*/
+class NvApiReplayer
+{
+public:
+    NvApiReplayer(const NvApiTrace &trace, const NvApiReplayParams &params = NvApiReplayParams());
+    ~NvApiReplayer();
+    NvApiReplayer(const NvApiReplayer &) = delete;
+    NvApiReplayer &operator=(const NvApiReplayer &) = delete;
+
+    /** Replays all sessions at once; false if any could not be replayed, or if another replay is running */
+    bool Run();
+
+    const std::vector<NvApiReplaySessionReport> &GetReport() const { return m_vReport; }
+    uint64_t GetReplayTime() const { return m_nsReplay; }
+    void PrintReport(std::ostream &os) const;
+
+private:
+    /** Splits the trace into sessions, each with the calls it will be served */
+    void BuildSessions();
+    void RunSession(NvApiReplaySession *pSession, NvApiReplaySessionReport &report);
+    void RunEncodeSession(NvApiReplaySession *pSession, NvApiReplaySessionReport &report);
+    void RunDecodeSession(NvApiReplaySession *pSession, NvApiReplaySessionReport &report);
+
+private:
+    const NvApiTrace &m_trace;
+    NvApiReplayParams m_params;
+    std::vector<std::unique_ptr<NvApiReplaySession>> m_vpSession;
+    std::vector<NvApiReplaySessionReport> m_vReport;
+    uint64_t m_nsReplay = 0;
+};
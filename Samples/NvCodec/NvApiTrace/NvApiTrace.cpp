@@ -0,0 +1,1070 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include "NvDecoder/NvDecoder.h"
+#include "NvEncoder/NvEncoder.h"
+#include "NvApiTrace/NvApiTrace.h"
+
+static const char szTraceMagic[8] = {'N', 'V', 'A', 'P', 'I', 'T', 'R', 'C'};
+static const uint32_t nTraceVersion = 1;
+
+/**
+*  @brief Header of a trace file. The arguments of some calls are API structures, so a trace is
+*  only read by code built with the same NvEncodeAPI version.
+*/
+struct NvApiTraceHeader
+{
+    char szMagic[8];
+    uint32_t nVersion;
+    uint32_t nEncodeApiVersion;
+};
+
+static_assert(sizeof(NvApiTraceRecord) == 32, "NvApiTraceRecord is written as is");
+
+const char *GetApiCallName(NvApiCall eCall)
+{
+    static const char *aszName[] = {
+        "nvEncOpenEncodeSession", "nvEncOpenEncodeSessionEx", "nvEncGetEncodeGUIDCount", "nvEncGetEncodeGUIDs",
+        "nvEncGetEncodeProfileGUIDCount", "nvEncGetEncodeProfileGUIDs", "nvEncGetInputFormatCount", "nvEncGetInputFormats",
+        "nvEncGetEncodeCaps", "nvEncGetEncodePresetCount", "nvEncGetEncodePresetGUIDs", "nvEncGetEncodePresetConfig",
+        "nvEncInitializeEncoder", "nvEncCreateInputBuffer", "nvEncDestroyInputBuffer", "nvEncCreateBitstreamBuffer",
+        "nvEncDestroyBitstreamBuffer", "nvEncEncodePicture", "nvEncLockBitstream", "nvEncUnlockBitstream",
+        "nvEncLockInputBuffer", "nvEncUnlockInputBuffer", "nvEncGetEncodeStats", "nvEncGetSequenceParams",
+        "nvEncRegisterAsyncEvent", "nvEncUnregisterAsyncEvent", "nvEncMapInputResource", "nvEncUnmapInputResource",
+        "nvEncDestroyEncoder", "nvEncInvalidateRefFrames", "nvEncRegisterResource", "nvEncUnregisterResource",
+        "nvEncReconfigureEncoder", "nvEncCreateMVBuffer", "nvEncDestroyMVBuffer", "nvEncRunMotionEstimationOnly",
+        "cuvidCtxLockCreate", "cuvidCtxLockDestroy", "cuvidCreateVideoParser", "cuvidParseVideoData",
+        "cuvidDestroyVideoParser", "cuvidGetDecoderCaps", "cuvidCreateDecoder", "cuvidDestroyDecoder",
+        "cuvidDecodePicture", "cuvidMapVideoFrame", "cuvidUnmapVideoFrame", "cuMemAlloc",
+        "cuMemAllocPitch", "cuMemFree", "cuMemcpy2DAsync", "cuStreamSynchronize",
+        "Sequence callback", "Decode callback", "Display callback",
+    };
+    static_assert(sizeof(aszName) / sizeof(aszName[0]) == NV_API_CALL_COUNT, "A call has no name");
+    return eCall >= 0 && eCall < NV_API_CALL_COUNT ? aszName[eCall] : "Unknown";
+}
+
+/**
+*  @brief What the parser of a recorded decode session passes to the callbacks of NvDecoder, which
+*  the recorder puts itself in front of.
+*/
+struct NvApiParserHook
+{
+    CUVIDPARSERPARAMS params;
+    uint16_t iSession;
+    /** cuvidParseVideoData() calls so far */
+    uint32_t nPacket;
+};
+
+struct NvApiRecorderState
+{
+    std::atomic<bool> bRecording{false};
+    std::chrono::steady_clock::time_point t0;
+    std::atomic<int> nThread{0};
+
+    std::mutex mtx;
+    FILE *fp = NULL;
+    bool bWriteError = false;
+    std::vector<uint8_t> vBuffer;
+    /** The library's function list, loaded once and kept for the wrappers of all sessions */
+    NV_ENCODE_API_FUNCTION_LIST nvenc = {};
+    void *hModule = NULL;
+    /** Sessions of the encoders and decoders, and of the frames decoders allocate, which they free outside of callbacks */
+    std::map<void *, uint16_t> mEncoder, mDecoder, mMemory;
+    std::map<void *, NvApiParserHook *> mParser;
+    uint16_t nEncoder = 0, nDecoder = 0;
+};
+
+static NvApiRecorderState &GetRecorder()
+{
+    // Never destroyed: sessions may call their wrappers until the process ends
+    static NvApiRecorderState *pState = new NvApiRecorderState;
+    return *pState;
+}
+
+static const NV_ENCODE_API_FUNCTION_LIST &Nvenc()
+{
+    return GetRecorder().nvenc;
+}
+
+static const NvDecoderApi &Cuvid()
+{
+    return NvDecoderApi::GetDefault();
+}
+
+/** Decode session whose parser callback runs on the thread, for the calls NvDecoder makes from it */
+static thread_local uint16_t t_iDecodeSession = NV_API_NO_SESSION;
+
+static uint16_t FindSession(std::map<void *, uint16_t> &mSession, void *hHandle)
+{
+    NvApiRecorderState &r = GetRecorder();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    auto it = mSession.find(hHandle);
+    return it == mSession.end() ? NV_API_NO_SESSION : it->second;
+}
+
+static void EraseSession(std::map<void *, uint16_t> &mSession, void *hHandle)
+{
+    NvApiRecorderState &r = GetRecorder();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    mSession.erase(hHandle);
+}
+
+static void FlushRecords(NvApiRecorderState &r)
+{
+    if (r.vBuffer.empty())
+    {
+        return;
+    }
+    if (fwrite(r.vBuffer.data(), 1, r.vBuffer.size(), r.fp) != r.vBuffer.size())
+    {
+        r.bWriteError = true;
+    }
+    r.vBuffer.clear();
+}
+
+/** Numbers the calling thread on its first record */
+static int GetThreadIndex(NvApiRecorderState &r)
+{
+    static thread_local int iThread = -1;
+    if (iThread < 0)
+    {
+        iThread = r.nThread++;
+    }
+    return iThread;
+}
+
+/**
+*  @brief Times one call and writes its record when it ends. The arguments are copied from up to
+*  two blocks, so that a structure can be recorded without packing it first.
+*/
+class NvApiCallRecord
+{
+public:
+    NvApiCallRecord(NvApiCall eCall, uint16_t iSession) : m_eCall(eCall), m_iSession(iSession),
+        m_tStart(std::chrono::steady_clock::now()) {}
+
+    void SetSession(uint16_t iSession) { m_iSession = iSession; }
+
+    template<typename T>
+    T End(T status, uint64_t nSize = 0, const void *pArg = NULL, size_t nArgSize = 0, const void *pArg2 = NULL,
+        size_t nArgSize2 = 0)
+    {
+        NvApiRecorderState &r = GetRecorder();
+        if (!r.bRecording.load(std::memory_order_relaxed))
+        {
+            return status;
+        }
+        std::chrono::steady_clock::time_point tEnd = std::chrono::steady_clock::now();
+        int iThread = GetThreadIndex(r);
+        if (!pArg)
+        {
+            nArgSize = 0;
+        }
+        if (!pArg2 || nArgSize + nArgSize2 > 0xFFFF)
+        {
+            nArgSize2 = 0;
+        }
+
+        NvApiTraceRecord rec = {};
+        rec.eCall = (uint16_t)m_eCall;
+        rec.iSession = m_iSession;
+        rec.iThread = (uint16_t)(std::min)(iThread, 0xFFFF);
+        rec.nArgSize = (uint16_t)(nArgSize + nArgSize2);
+        rec.status = (int32_t)status;
+        rec.nSize = (uint32_t)(std::min)(nSize, (uint64_t)UINT32_MAX);
+        rec.nsStart = (uint64_t)(std::max)((int64_t)0,
+            (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(m_tStart - r.t0).count());
+        rec.nsDuration = (uint32_t)(std::min)((int64_t)UINT32_MAX,
+            (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(tEnd - m_tStart).count());
+
+        std::lock_guard<std::mutex> lock(r.mtx);
+        if (!r.fp)
+        {
+            return status;
+        }
+        const uint8_t *p = (const uint8_t *)&rec;
+        r.vBuffer.insert(r.vBuffer.end(), p, p + sizeof(rec));
+        r.vBuffer.insert(r.vBuffer.end(), (const uint8_t *)pArg, (const uint8_t *)pArg + nArgSize);
+        r.vBuffer.insert(r.vBuffer.end(), (const uint8_t *)pArg2, (const uint8_t *)pArg2 + nArgSize2);
+        if (r.vBuffer.size() >= (1 << 20))
+        {
+            FlushRecords(r);
+        }
+        return status;
+    }
+
+private:
+    NvApiCall m_eCall;
+    uint16_t m_iSession;
+    std::chrono::steady_clock::time_point m_tStart;
+};
+
+static uint16_t EncoderSession(void *hEncoder)
+{
+    return FindSession(GetRecorder().mEncoder, hEncoder);
+}
+
+static uint16_t AddEncoderSession(void *hEncoder)
+{
+    NvApiRecorderState &r = GetRecorder();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    return r.mEncoder[hEncoder] = r.nEncoder++;
+}
+
+static NVENCSTATUS NVENCAPI RecOpenEncodeSession(void *device, uint32_t deviceType, void **encoder)
+{
+    NvApiCallRecord call(NV_API_ENC_OPEN_ENCODE_SESSION, NV_API_NO_SESSION);
+    NVENCSTATUS nvStatus = Nvenc().nvEncOpenEncodeSession(device, deviceType, encoder);
+    if (nvStatus == NV_ENC_SUCCESS)
+    {
+        call.SetSession(AddEncoderSession(*encoder));
+    }
+    return call.End(nvStatus, 0, &deviceType, sizeof(deviceType));
+}
+
+static NVENCSTATUS NVENCAPI RecOpenEncodeSessionEx(NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS *openSessionExParams, void **encoder)
+{
+    NvApiCallRecord call(NV_API_ENC_OPEN_ENCODE_SESSION_EX, NV_API_NO_SESSION);
+    NVENCSTATUS nvStatus = Nvenc().nvEncOpenEncodeSessionEx(openSessionExParams, encoder);
+    if (nvStatus == NV_ENC_SUCCESS)
+    {
+        call.SetSession(AddEncoderSession(*encoder));
+    }
+    uint32_t deviceType = openSessionExParams ? (uint32_t)openSessionExParams->deviceType : 0;
+    return call.End(nvStatus, 0, &deviceType, sizeof(deviceType));
+}
+
+static NVENCSTATUS NVENCAPI RecGetEncodeGUIDCount(void *encoder, uint32_t *encodeGUIDCount)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_ENCODE_GUID_COUNT, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetEncodeGUIDCount(encoder, encodeGUIDCount);
+    return call.End(nvStatus, nvStatus == NV_ENC_SUCCESS ? *encodeGUIDCount : 0);
+}
+
+static NVENCSTATUS NVENCAPI RecGetEncodeGUIDs(void *encoder, GUID *GUIDs, uint32_t guidArraySize, uint32_t *GUIDCount)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_ENCODE_GUIDS, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetEncodeGUIDs(encoder, GUIDs, guidArraySize, GUIDCount);
+    return call.End(nvStatus, nvStatus == NV_ENC_SUCCESS ? *GUIDCount : 0);
+}
+
+static NVENCSTATUS NVENCAPI RecGetEncodeProfileGUIDCount(void *encoder, GUID encodeGUID, uint32_t *encodeProfileGUIDCount)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_ENCODE_PROFILE_GUID_COUNT, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetEncodeProfileGUIDCount(encoder, encodeGUID, encodeProfileGUIDCount);
+    return call.End(nvStatus, nvStatus == NV_ENC_SUCCESS ? *encodeProfileGUIDCount : 0);
+}
+
+static NVENCSTATUS NVENCAPI RecGetEncodeProfileGUIDs(void *encoder, GUID encodeGUID, GUID *profileGUIDs, uint32_t guidArraySize,
+    uint32_t *GUIDCount)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_ENCODE_PROFILE_GUIDS, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetEncodeProfileGUIDs(encoder, encodeGUID, profileGUIDs, guidArraySize, GUIDCount);
+    return call.End(nvStatus, nvStatus == NV_ENC_SUCCESS ? *GUIDCount : 0);
+}
+
+static NVENCSTATUS NVENCAPI RecGetInputFormatCount(void *encoder, GUID encodeGUID, uint32_t *inputFmtCount)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_INPUT_FORMAT_COUNT, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetInputFormatCount(encoder, encodeGUID, inputFmtCount);
+    return call.End(nvStatus, nvStatus == NV_ENC_SUCCESS ? *inputFmtCount : 0);
+}
+
+static NVENCSTATUS NVENCAPI RecGetInputFormats(void *encoder, GUID encodeGUID, NV_ENC_BUFFER_FORMAT *inputFmts,
+    uint32_t inputFmtArraySize, uint32_t *inputFmtCount)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_INPUT_FORMATS, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetInputFormats(encoder, encodeGUID, inputFmts, inputFmtArraySize, inputFmtCount);
+    return call.End(nvStatus, nvStatus == NV_ENC_SUCCESS ? *inputFmtCount : 0);
+}
+
+static NVENCSTATUS NVENCAPI RecGetEncodeCaps(void *encoder, GUID encodeGUID, NV_ENC_CAPS_PARAM *capsParam, int *capsVal)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_ENCODE_CAPS, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetEncodeCaps(encoder, encodeGUID, capsParam, capsVal);
+    NvApiEncodeCapsArgs args = {};
+    args.encodeGUID = encodeGUID;
+    args.capsToQuery = capsParam ? (uint32_t)capsParam->capsToQuery : 0;
+    args.capsVal = nvStatus == NV_ENC_SUCCESS && capsVal ? *capsVal : 0;
+    return call.End(nvStatus, 0, &args, sizeof(args));
+}
+
+static NVENCSTATUS NVENCAPI RecGetEncodePresetCount(void *encoder, GUID encodeGUID, uint32_t *encodePresetGUIDCount)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_ENCODE_PRESET_COUNT, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetEncodePresetCount(encoder, encodeGUID, encodePresetGUIDCount);
+    return call.End(nvStatus, nvStatus == NV_ENC_SUCCESS ? *encodePresetGUIDCount : 0);
+}
+
+static NVENCSTATUS NVENCAPI RecGetEncodePresetGUIDs(void *encoder, GUID encodeGUID, GUID *presetGUIDs, uint32_t guidArraySize,
+    uint32_t *encodePresetGUIDCount)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_ENCODE_PRESET_GUIDS, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetEncodePresetGUIDs(encoder, encodeGUID, presetGUIDs, guidArraySize, encodePresetGUIDCount);
+    return call.End(nvStatus, nvStatus == NV_ENC_SUCCESS ? *encodePresetGUIDCount : 0);
+}
+
+static NVENCSTATUS NVENCAPI RecGetEncodePresetConfig(void *encoder, GUID encodeGUID, GUID presetGUID, NV_ENC_PRESET_CONFIG *presetConfig)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_ENCODE_PRESET_CONFIG, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetEncodePresetConfig(encoder, encodeGUID, presetGUID, presetConfig);
+    NvApiPresetConfigArgs args = { encodeGUID, presetGUID };
+    return call.End(nvStatus, 0, &args, sizeof(args));
+}
+
+static NVENCSTATUS NVENCAPI RecInitializeEncoder(void *encoder, NV_ENC_INITIALIZE_PARAMS *createEncodeParams)
+{
+    NvApiCallRecord call(NV_API_ENC_INITIALIZE_ENCODER, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncInitializeEncoder(encoder, createEncodeParams);
+    return call.End(nvStatus, 0, createEncodeParams, sizeof(*createEncodeParams),
+        createEncodeParams ? createEncodeParams->encodeConfig : NULL, sizeof(NV_ENC_CONFIG));
+}
+
+static NVENCSTATUS NVENCAPI RecCreateInputBuffer(void *encoder, NV_ENC_CREATE_INPUT_BUFFER *createInputBufferParams)
+{
+    NvApiCallRecord call(NV_API_ENC_CREATE_INPUT_BUFFER, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncCreateInputBuffer(encoder, createInputBufferParams));
+}
+
+static NVENCSTATUS NVENCAPI RecDestroyInputBuffer(void *encoder, NV_ENC_INPUT_PTR inputBuffer)
+{
+    NvApiCallRecord call(NV_API_ENC_DESTROY_INPUT_BUFFER, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncDestroyInputBuffer(encoder, inputBuffer));
+}
+
+static NVENCSTATUS NVENCAPI RecCreateBitstreamBuffer(void *encoder, NV_ENC_CREATE_BITSTREAM_BUFFER *createBitstreamBufferParams)
+{
+    NvApiCallRecord call(NV_API_ENC_CREATE_BITSTREAM_BUFFER, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncCreateBitstreamBuffer(encoder, createBitstreamBufferParams));
+}
+
+static NVENCSTATUS NVENCAPI RecDestroyBitstreamBuffer(void *encoder, NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+    NvApiCallRecord call(NV_API_ENC_DESTROY_BITSTREAM_BUFFER, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncDestroyBitstreamBuffer(encoder, bitstreamBuffer));
+}
+
+static NVENCSTATUS NVENCAPI RecEncodePicture(void *encoder, NV_ENC_PIC_PARAMS *encodePicParams)
+{
+    NvApiCallRecord call(NV_API_ENC_ENCODE_PICTURE, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncEncodePicture(encoder, encodePicParams);
+    NvApiEncodePictureArgs args = {};
+    if (encodePicParams)
+    {
+        args.inputWidth = encodePicParams->inputWidth;
+        args.inputHeight = encodePicParams->inputHeight;
+        args.bufferFmt = encodePicParams->bufferFmt;
+        args.pictureStruct = encodePicParams->pictureStruct;
+        args.pictureType = encodePicParams->pictureType;
+        args.encodePicFlags = encodePicParams->encodePicFlags;
+        args.inputTimeStamp = encodePicParams->inputTimeStamp;
+    }
+    return call.End(nvStatus, 0, &args, sizeof(args));
+}
+
+static NVENCSTATUS NVENCAPI RecLockBitstream(void *encoder, NV_ENC_LOCK_BITSTREAM *lockBitstreamBufferParams)
+{
+    NvApiCallRecord call(NV_API_ENC_LOCK_BITSTREAM, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncLockBitstream(encoder, lockBitstreamBufferParams);
+    NvApiLockBitstreamArgs args = {};
+    uint32_t nSize = 0;
+    if (lockBitstreamBufferParams)
+    {
+        args.doNotWait = lockBitstreamBufferParams->doNotWait;
+        args.frameIdx = lockBitstreamBufferParams->frameIdx;
+        args.pictureType = lockBitstreamBufferParams->pictureType;
+        args.numSlices = lockBitstreamBufferParams->numSlices;
+        args.outputTimeStamp = lockBitstreamBufferParams->outputTimeStamp;
+        nSize = nvStatus == NV_ENC_SUCCESS ? lockBitstreamBufferParams->bitstreamSizeInBytes : 0;
+    }
+    return call.End(nvStatus, nSize, &args, sizeof(args));
+}
+
+static NVENCSTATUS NVENCAPI RecUnlockBitstream(void *encoder, NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+    NvApiCallRecord call(NV_API_ENC_UNLOCK_BITSTREAM, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncUnlockBitstream(encoder, bitstreamBuffer));
+}
+
+static NVENCSTATUS NVENCAPI RecLockInputBuffer(void *encoder, NV_ENC_LOCK_INPUT_BUFFER *lockInputBufferParams)
+{
+    NvApiCallRecord call(NV_API_ENC_LOCK_INPUT_BUFFER, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncLockInputBuffer(encoder, lockInputBufferParams));
+}
+
+static NVENCSTATUS NVENCAPI RecUnlockInputBuffer(void *encoder, NV_ENC_INPUT_PTR inputBuffer)
+{
+    NvApiCallRecord call(NV_API_ENC_UNLOCK_INPUT_BUFFER, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncUnlockInputBuffer(encoder, inputBuffer));
+}
+
+static NVENCSTATUS NVENCAPI RecGetEncodeStats(void *encoder, NV_ENC_STAT *encodeStats)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_ENCODE_STATS, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncGetEncodeStats(encoder, encodeStats));
+}
+
+static NVENCSTATUS NVENCAPI RecGetSequenceParams(void *encoder, NV_ENC_SEQUENCE_PARAM_PAYLOAD *sequenceParamPayload)
+{
+    NvApiCallRecord call(NV_API_ENC_GET_SEQUENCE_PARAMS, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncGetSequenceParams(encoder, sequenceParamPayload);
+    uint32_t nSize = nvStatus == NV_ENC_SUCCESS && sequenceParamPayload && sequenceParamPayload->outSPSPPSPayloadSize
+        ? *sequenceParamPayload->outSPSPPSPayloadSize : 0;
+    return call.End(nvStatus, nSize);
+}
+
+static NVENCSTATUS NVENCAPI RecRegisterAsyncEvent(void *encoder, NV_ENC_EVENT_PARAMS *eventParams)
+{
+    NvApiCallRecord call(NV_API_ENC_REGISTER_ASYNC_EVENT, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncRegisterAsyncEvent(encoder, eventParams));
+}
+
+static NVENCSTATUS NVENCAPI RecUnregisterAsyncEvent(void *encoder, NV_ENC_EVENT_PARAMS *eventParams)
+{
+    NvApiCallRecord call(NV_API_ENC_UNREGISTER_ASYNC_EVENT, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncUnregisterAsyncEvent(encoder, eventParams));
+}
+
+static NVENCSTATUS NVENCAPI RecMapInputResource(void *encoder, NV_ENC_MAP_INPUT_RESOURCE *mapInputResParams)
+{
+    NvApiCallRecord call(NV_API_ENC_MAP_INPUT_RESOURCE, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncMapInputResource(encoder, mapInputResParams));
+}
+
+static NVENCSTATUS NVENCAPI RecUnmapInputResource(void *encoder, NV_ENC_INPUT_PTR mappedInputBuffer)
+{
+    NvApiCallRecord call(NV_API_ENC_UNMAP_INPUT_RESOURCE, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncUnmapInputResource(encoder, mappedInputBuffer));
+}
+
+static NVENCSTATUS NVENCAPI RecDestroyEncoder(void *encoder)
+{
+    NvApiCallRecord call(NV_API_ENC_DESTROY_ENCODER, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncDestroyEncoder(encoder);
+    // The handle may come back for a later session
+    EraseSession(GetRecorder().mEncoder, encoder);
+    return call.End(nvStatus);
+}
+
+static NVENCSTATUS NVENCAPI RecInvalidateRefFrames(void *encoder, uint64_t invalidRefFrameTimeStamp)
+{
+    NvApiCallRecord call(NV_API_ENC_INVALIDATE_REF_FRAMES, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncInvalidateRefFrames(encoder, invalidRefFrameTimeStamp);
+    return call.End(nvStatus, 0, &invalidRefFrameTimeStamp, sizeof(invalidRefFrameTimeStamp));
+}
+
+static NVENCSTATUS NVENCAPI RecRegisterResource(void *encoder, NV_ENC_REGISTER_RESOURCE *registerResParams)
+{
+    NvApiCallRecord call(NV_API_ENC_REGISTER_RESOURCE, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncRegisterResource(encoder, registerResParams);
+    NvApiRegisterResourceArgs args = {};
+    if (registerResParams)
+    {
+        args.resourceType = registerResParams->resourceType;
+        args.width = registerResParams->width;
+        args.height = registerResParams->height;
+        args.pitch = registerResParams->pitch;
+        args.bufferFormat = registerResParams->bufferFormat;
+    }
+    return call.End(nvStatus, 0, &args, sizeof(args));
+}
+
+static NVENCSTATUS NVENCAPI RecUnregisterResource(void *encoder, NV_ENC_REGISTERED_PTR registeredRes)
+{
+    NvApiCallRecord call(NV_API_ENC_UNREGISTER_RESOURCE, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncUnregisterResource(encoder, registeredRes));
+}
+
+static NVENCSTATUS NVENCAPI RecReconfigureEncoder(void *encoder, NV_ENC_RECONFIGURE_PARAMS *reInitEncodeParams)
+{
+    NvApiCallRecord call(NV_API_ENC_RECONFIGURE_ENCODER, EncoderSession(encoder));
+    NVENCSTATUS nvStatus = Nvenc().nvEncReconfigureEncoder(encoder, reInitEncodeParams);
+    return call.End(nvStatus, 0, reInitEncodeParams, sizeof(*reInitEncodeParams),
+        reInitEncodeParams ? reInitEncodeParams->reInitEncodeParams.encodeConfig : NULL, sizeof(NV_ENC_CONFIG));
+}
+
+static NVENCSTATUS NVENCAPI RecCreateMVBuffer(void *encoder, NV_ENC_CREATE_MV_BUFFER *createMVBufferParams)
+{
+    NvApiCallRecord call(NV_API_ENC_CREATE_MV_BUFFER, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncCreateMVBuffer(encoder, createMVBufferParams));
+}
+
+static NVENCSTATUS NVENCAPI RecDestroyMVBuffer(void *encoder, NV_ENC_OUTPUT_PTR mvBuffer)
+{
+    NvApiCallRecord call(NV_API_ENC_DESTROY_MV_BUFFER, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncDestroyMVBuffer(encoder, mvBuffer));
+}
+
+static NVENCSTATUS NVENCAPI RecRunMotionEstimationOnly(void *encoder, NV_ENC_MEONLY_PARAMS *meOnlyParams)
+{
+    NvApiCallRecord call(NV_API_ENC_RUN_MOTION_ESTIMATION_ONLY, EncoderSession(encoder));
+    return call.End(Nvenc().nvEncRunMotionEstimationOnly(encoder, meOnlyParams));
+}
+
+/**
+*  @brief The loader NvEncoder uses while recording: the library's function list, with every entry
+*  the library fills in replaced by its wrapper.
+*/
+static NVENCSTATUS NVENCAPI RecordingCreateInstance(NV_ENCODE_API_FUNCTION_LIST *pFunctionList)
+{
+    NvApiRecorderState &r = GetRecorder();
+    {
+        std::lock_guard<std::mutex> lock(r.mtx);
+        if (!r.hModule)
+        {
+            NV_ENCODE_API_FUNCTION_LIST nvenc = { NV_ENCODE_API_FUNCTION_LIST_VER };
+            r.hModule = NvEncoder::LoadNvEncApiLibrary(&nvenc);
+            r.nvenc = nvenc;
+        }
+    }
+    const NV_ENCODE_API_FUNCTION_LIST &nvenc = r.nvenc;
+    *pFunctionList = nvenc;
+#define NV_API_WRAP(entry, wrapper) if (nvenc.entry) pFunctionList->entry = wrapper
+    NV_API_WRAP(nvEncOpenEncodeSession, RecOpenEncodeSession);
+    NV_API_WRAP(nvEncGetEncodeGUIDCount, RecGetEncodeGUIDCount);
+    NV_API_WRAP(nvEncGetEncodeProfileGUIDCount, RecGetEncodeProfileGUIDCount);
+    NV_API_WRAP(nvEncGetEncodeProfileGUIDs, RecGetEncodeProfileGUIDs);
+    NV_API_WRAP(nvEncGetEncodeGUIDs, RecGetEncodeGUIDs);
+    NV_API_WRAP(nvEncGetInputFormatCount, RecGetInputFormatCount);
+    NV_API_WRAP(nvEncGetInputFormats, RecGetInputFormats);
+    NV_API_WRAP(nvEncGetEncodeCaps, RecGetEncodeCaps);
+    NV_API_WRAP(nvEncGetEncodePresetCount, RecGetEncodePresetCount);
+    NV_API_WRAP(nvEncGetEncodePresetGUIDs, RecGetEncodePresetGUIDs);
+    NV_API_WRAP(nvEncGetEncodePresetConfig, RecGetEncodePresetConfig);
+    NV_API_WRAP(nvEncInitializeEncoder, RecInitializeEncoder);
+    NV_API_WRAP(nvEncCreateInputBuffer, RecCreateInputBuffer);
+    NV_API_WRAP(nvEncDestroyInputBuffer, RecDestroyInputBuffer);
+    NV_API_WRAP(nvEncCreateBitstreamBuffer, RecCreateBitstreamBuffer);
+    NV_API_WRAP(nvEncDestroyBitstreamBuffer, RecDestroyBitstreamBuffer);
+    NV_API_WRAP(nvEncEncodePicture, RecEncodePicture);
+    NV_API_WRAP(nvEncLockBitstream, RecLockBitstream);
+    NV_API_WRAP(nvEncUnlockBitstream, RecUnlockBitstream);
+    NV_API_WRAP(nvEncLockInputBuffer, RecLockInputBuffer);
+    NV_API_WRAP(nvEncUnlockInputBuffer, RecUnlockInputBuffer);
+    NV_API_WRAP(nvEncGetEncodeStats, RecGetEncodeStats);
+    NV_API_WRAP(nvEncGetSequenceParams, RecGetSequenceParams);
+    NV_API_WRAP(nvEncRegisterAsyncEvent, RecRegisterAsyncEvent);
+    NV_API_WRAP(nvEncUnregisterAsyncEvent, RecUnregisterAsyncEvent);
+    NV_API_WRAP(nvEncMapInputResource, RecMapInputResource);
+    NV_API_WRAP(nvEncUnmapInputResource, RecUnmapInputResource);
+    NV_API_WRAP(nvEncDestroyEncoder, RecDestroyEncoder);
+    NV_API_WRAP(nvEncInvalidateRefFrames, RecInvalidateRefFrames);
+    NV_API_WRAP(nvEncOpenEncodeSessionEx, RecOpenEncodeSessionEx);
+    NV_API_WRAP(nvEncRegisterResource, RecRegisterResource);
+    NV_API_WRAP(nvEncUnregisterResource, RecUnregisterResource);
+    NV_API_WRAP(nvEncReconfigureEncoder, RecReconfigureEncoder);
+    NV_API_WRAP(nvEncCreateMVBuffer, RecCreateMVBuffer);
+    NV_API_WRAP(nvEncDestroyMVBuffer, RecDestroyMVBuffer);
+    NV_API_WRAP(nvEncRunMotionEstimationOnly, RecRunMotionEstimationOnly);
+#undef NV_API_WRAP
+    return NV_ENC_SUCCESS;
+}
+
+/**
+*  @brief Points the calls NvDecoder makes from a parser callback at the session of the parser, for
+*  as long as the callback runs.
+*/
+class NvApiCallbackScope
+{
+public:
+    NvApiCallbackScope(uint16_t iSession) : m_iPrevious(t_iDecodeSession)
+    {
+        t_iDecodeSession = iSession;
+    }
+    ~NvApiCallbackScope()
+    {
+        t_iDecodeSession = m_iPrevious;
+    }
+
+private:
+    uint16_t m_iPrevious;
+};
+
+static void GetPictureArgs(const CUVIDPICPARAMS *pPicParams, NvApiPictureArgs &args)
+{
+    args = {};
+    if (!pPicParams)
+    {
+        return;
+    }
+    args.CurrPicIdx = pPicParams->CurrPicIdx;
+    args.nNumSlices = pPicParams->nNumSlices;
+    args.field_pic_flag = pPicParams->field_pic_flag;
+    args.bottom_field_flag = pPicParams->bottom_field_flag;
+    args.second_field = pPicParams->second_field;
+    args.intra_pic_flag = pPicParams->intra_pic_flag;
+    args.ref_pic_flag = pPicParams->ref_pic_flag;
+}
+
+static int CUDAAPI RecSequenceCallback(void *pUserData, CUVIDEOFORMAT *pVideoFormat)
+{
+    NvApiParserHook *pHook = (NvApiParserHook *)pUserData;
+    NvApiCallbackScope scope(pHook->iSession);
+    NvApiCallRecord call(NV_API_DEC_SEQUENCE_CALLBACK, pHook->iSession);
+    int r = pHook->params.pfnSequenceCallback(pHook->params.pUserData, pVideoFormat);
+    NvApiCallbackArgs args = { pHook->nPacket - 1 };
+    return call.End(r, 0, &args, sizeof(args), pVideoFormat, sizeof(*pVideoFormat));
+}
+
+static int CUDAAPI RecDecodeCallback(void *pUserData, CUVIDPICPARAMS *pPicParams)
+{
+    NvApiParserHook *pHook = (NvApiParserHook *)pUserData;
+    NvApiCallbackScope scope(pHook->iSession);
+    NvApiCallRecord call(NV_API_DEC_DECODE_CALLBACK, pHook->iSession);
+    int r = pHook->params.pfnDecodePicture(pHook->params.pUserData, pPicParams);
+    NvApiCallbackArgs args = { pHook->nPacket - 1 };
+    NvApiPictureArgs picArgs;
+    GetPictureArgs(pPicParams, picArgs);
+    return call.End(r, pPicParams ? pPicParams->nBitstreamDataLen : 0, &args, sizeof(args), &picArgs, sizeof(picArgs));
+}
+
+static int CUDAAPI RecDisplayCallback(void *pUserData, CUVIDPARSERDISPINFO *pDispInfo)
+{
+    NvApiParserHook *pHook = (NvApiParserHook *)pUserData;
+    NvApiCallbackScope scope(pHook->iSession);
+    NvApiCallRecord call(NV_API_DEC_DISPLAY_CALLBACK, pHook->iSession);
+    int r = pHook->params.pfnDisplayPicture(pHook->params.pUserData, pDispInfo);
+    NvApiCallbackArgs args = { pHook->nPacket - 1 };
+    return call.End(r, 0, &args, sizeof(args), pDispInfo, sizeof(*pDispInfo));
+}
+
+static NvApiParserHook *FindParser(CUvideoparser hParser)
+{
+    NvApiRecorderState &r = GetRecorder();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    auto it = r.mParser.find(hParser);
+    return it == r.mParser.end() ? NULL : it->second;
+}
+
+static CUresult CUDAAPI RecCtxLockCreate(CUvideoctxlock *pLock, CUcontext ctx)
+{
+    NvApiCallRecord call(NV_API_DEC_CTX_LOCK_CREATE, NV_API_NO_SESSION);
+    return call.End(Cuvid().pfnCtxLockCreate(pLock, ctx));
+}
+
+static CUresult CUDAAPI RecCtxLockDestroy(CUvideoctxlock lck)
+{
+    NvApiCallRecord call(NV_API_DEC_CTX_LOCK_DESTROY, NV_API_NO_SESSION);
+    return call.End(Cuvid().pfnCtxLockDestroy(lck));
+}
+
+static CUresult CUDAAPI RecCreateVideoParser(CUvideoparser *pObj, CUVIDPARSERPARAMS *pParams)
+{
+    NvApiRecorderState &r = GetRecorder();
+    NvApiParserHook *pHook = new NvApiParserHook();
+    pHook->params = *pParams;
+    {
+        std::lock_guard<std::mutex> lock(r.mtx);
+        pHook->iSession = r.nDecoder++;
+    }
+    CUVIDPARSERPARAMS params = *pParams;
+    params.pUserData = pHook;
+    params.pfnSequenceCallback = pParams->pfnSequenceCallback ? RecSequenceCallback : NULL;
+    params.pfnDecodePicture = pParams->pfnDecodePicture ? RecDecodeCallback : NULL;
+    params.pfnDisplayPicture = pParams->pfnDisplayPicture ? RecDisplayCallback : NULL;
+
+    NvApiCallRecord call(NV_API_DEC_CREATE_VIDEO_PARSER, pHook->iSession);
+    CUresult e = Cuvid().pfnCreateVideoParser(pObj, &params);
+    NvApiVideoParserArgs args = { (uint32_t)pParams->CodecType, pParams->ulMaxNumDecodeSurfaces, pParams->ulClockRate,
+        pParams->ulMaxDisplayDelay };
+    if (e == CUDA_SUCCESS)
+    {
+        std::lock_guard<std::mutex> lock(r.mtx);
+        r.mParser[*pObj] = pHook;
+    }
+    else
+    {
+        delete pHook;
+        pHook = NULL;
+    }
+    return call.End(e, 0, &args, sizeof(args));
+}
+
+static CUresult CUDAAPI RecParseVideoData(CUvideoparser obj, CUVIDSOURCEDATAPACKET *pPacket)
+{
+    NvApiParserHook *pHook = FindParser(obj);
+    uint16_t iSession = pHook ? pHook->iSession : NV_API_NO_SESSION;
+    if (pHook)
+    {
+        // Only the thread that feeds the parser counts its packets, as only it gets callbacks
+        pHook->nPacket++;
+    }
+    NvApiCallRecord call(NV_API_DEC_PARSE_VIDEO_DATA, iSession);
+    CUresult e = Cuvid().pfnParseVideoData(obj, pPacket);
+    NvApiPacketArgs args = {};
+    args.flags = pPacket ? (uint32_t)pPacket->flags : 0;
+    args.timestamp = pPacket ? (int64_t)pPacket->timestamp : 0;
+    return call.End(e, pPacket ? pPacket->payload_size : 0, &args, sizeof(args));
+}
+
+static CUresult CUDAAPI RecDestroyVideoParser(CUvideoparser obj)
+{
+    NvApiParserHook *pHook = FindParser(obj);
+    NvApiCallRecord call(NV_API_DEC_DESTROY_VIDEO_PARSER, pHook ? pHook->iSession : NV_API_NO_SESSION);
+    CUresult e = Cuvid().pfnDestroyVideoParser(obj);
+    if (pHook)
+    {
+        NvApiRecorderState &r = GetRecorder();
+        std::lock_guard<std::mutex> lock(r.mtx);
+        r.mParser.erase(obj);
+        delete pHook;
+    }
+    return call.End(e);
+}
+
+static CUresult CUDAAPI RecGetDecoderCaps(CUVIDDECODECAPS *pdc)
+{
+    NvApiCallRecord call(NV_API_DEC_GET_DECODER_CAPS, t_iDecodeSession);
+    CUresult e = Cuvid().pfnGetDecoderCaps(pdc);
+    return call.End(e, 0, pdc, sizeof(*pdc));
+}
+
+static CUresult CUDAAPI RecCreateDecoder(CUvideodecoder *phDecoder, CUVIDDECODECREATEINFO *pdci)
+{
+    NvApiCallRecord call(NV_API_DEC_CREATE_DECODER, t_iDecodeSession);
+    CUresult e = Cuvid().pfnCreateDecoder(phDecoder, pdci);
+    if (e == CUDA_SUCCESS && t_iDecodeSession != NV_API_NO_SESSION)
+    {
+        NvApiRecorderState &r = GetRecorder();
+        std::lock_guard<std::mutex> lock(r.mtx);
+        r.mDecoder[*phDecoder] = t_iDecodeSession;
+    }
+    return call.End(e, 0, pdci, sizeof(*pdci));
+}
+
+static CUresult CUDAAPI RecDestroyDecoder(CUvideodecoder hDecoder)
+{
+    NvApiCallRecord call(NV_API_DEC_DESTROY_DECODER, FindSession(GetRecorder().mDecoder, hDecoder));
+    CUresult e = Cuvid().pfnDestroyDecoder(hDecoder);
+    EraseSession(GetRecorder().mDecoder, hDecoder);
+    return call.End(e);
+}
+
+static CUresult CUDAAPI RecDecodePicture(CUvideodecoder hDecoder, CUVIDPICPARAMS *pPicParams)
+{
+    NvApiCallRecord call(NV_API_DEC_DECODE_PICTURE, FindSession(GetRecorder().mDecoder, hDecoder));
+    CUresult e = Cuvid().pfnDecodePicture(hDecoder, pPicParams);
+    NvApiPictureArgs args;
+    GetPictureArgs(pPicParams, args);
+    return call.End(e, pPicParams ? pPicParams->nBitstreamDataLen : 0, &args, sizeof(args));
+}
+
+static CUresult CUDAAPI RecMapVideoFrame(CUvideodecoder hDecoder, int nPicIdx, CUdeviceptr *pDevPtr, unsigned int *pPitch,
+    CUVIDPROCPARAMS *pVPP)
+{
+    NvApiCallRecord call(NV_API_DEC_MAP_VIDEO_FRAME, FindSession(GetRecorder().mDecoder, hDecoder));
+    CUresult e = Cuvid().pfnMapVideoFrame(hDecoder, nPicIdx, pDevPtr, pPitch, pVPP);
+    NvApiMapVideoFrameArgs args = {};
+    args.nPicIdx = nPicIdx;
+    args.nPitch = e == CUDA_SUCCESS && pPitch ? *pPitch : 0;
+    if (pVPP)
+    {
+        args.progressive_frame = pVPP->progressive_frame;
+        args.second_field = pVPP->second_field;
+        args.top_field_first = pVPP->top_field_first;
+        args.unpaired_field = pVPP->unpaired_field;
+    }
+    return call.End(e, 0, &args, sizeof(args));
+}
+
+static CUresult CUDAAPI RecUnmapVideoFrame(CUvideodecoder hDecoder, CUdeviceptr DevPtr)
+{
+    NvApiCallRecord call(NV_API_DEC_UNMAP_VIDEO_FRAME, FindSession(GetRecorder().mDecoder, hDecoder));
+    return call.End(Cuvid().pfnUnmapVideoFrame(hDecoder, DevPtr));
+}
+
+static void AddMemorySession(CUdeviceptr dptr)
+{
+    if (t_iDecodeSession == NV_API_NO_SESSION)
+    {
+        return;
+    }
+    NvApiRecorderState &r = GetRecorder();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    r.mMemory[(void *)(uintptr_t)dptr] = t_iDecodeSession;
+}
+
+static CUresult CUDAAPI RecMemAlloc(CUdeviceptr *dptr, size_t bytesize)
+{
+    NvApiCallRecord call(NV_API_DEC_MEM_ALLOC, t_iDecodeSession);
+    CUresult e = Cuvid().pfnMemAlloc(dptr, bytesize);
+    if (e == CUDA_SUCCESS)
+    {
+        AddMemorySession(*dptr);
+    }
+    return call.End(e, bytesize);
+}
+
+static CUresult CUDAAPI RecMemAllocPitch(CUdeviceptr *dptr, size_t *pPitch, size_t WidthInBytes, size_t Height, unsigned int ElementSizeBytes)
+{
+    NvApiCallRecord call(NV_API_DEC_MEM_ALLOC_PITCH, t_iDecodeSession);
+    CUresult e = Cuvid().pfnMemAllocPitch(dptr, pPitch, WidthInBytes, Height, ElementSizeBytes);
+    NvApiMemAllocPitchArgs args = { WidthInBytes, Height, ElementSizeBytes, e == CUDA_SUCCESS ? *pPitch : 0 };
+    if (e == CUDA_SUCCESS)
+    {
+        AddMemorySession(*dptr);
+    }
+    return call.End(e, args.Pitch * Height, &args, sizeof(args));
+}
+
+static CUresult CUDAAPI RecMemFree(CUdeviceptr dptr)
+{
+    NvApiRecorderState &r = GetRecorder();
+    uint16_t iSession = FindSession(r.mMemory, (void *)(uintptr_t)dptr);
+    NvApiCallRecord call(NV_API_DEC_MEM_FREE, iSession != NV_API_NO_SESSION ? iSession : t_iDecodeSession);
+    CUresult e = Cuvid().pfnMemFree(dptr);
+    EraseSession(r.mMemory, (void *)(uintptr_t)dptr);
+    return call.End(e);
+}
+
+static CUresult CUDAAPI RecMemcpy2DAsync(const CUDA_MEMCPY2D *pCopy, CUstream hStream)
+{
+    NvApiCallRecord call(NV_API_DEC_MEMCPY_2D_ASYNC, t_iDecodeSession);
+    CUresult e = Cuvid().pfnMemcpy2DAsync(pCopy, hStream);
+    NvApiMemcpy2DArgs args = { (uint32_t)pCopy->srcMemoryType, (uint32_t)pCopy->dstMemoryType, (uint32_t)pCopy->WidthInBytes,
+        (uint32_t)pCopy->Height };
+    return call.End(e, (uint64_t)pCopy->WidthInBytes * pCopy->Height, &args, sizeof(args));
+}
+
+static CUresult CUDAAPI RecStreamSynchronize(CUstream hStream)
+{
+    NvApiCallRecord call(NV_API_DEC_STREAM_SYNCHRONIZE, t_iDecodeSession);
+    return call.End(Cuvid().pfnStreamSynchronize(hStream));
+}
+
+static const NvDecoderApi &GetRecordingDecoderApi()
+{
+    static const NvDecoderApi api = {
+        RecCtxLockCreate, RecCtxLockDestroy, RecCreateVideoParser, RecParseVideoData, RecDestroyVideoParser,
+        RecGetDecoderCaps, RecCreateDecoder, RecDestroyDecoder, RecDecodePicture, RecMapVideoFrame,
+        RecUnmapVideoFrame, RecMemAlloc, RecMemAllocPitch, RecMemFree, RecMemcpy2DAsync, RecStreamSynchronize
+    };
+    return api;
+}
+
+bool NvApiRecorder::Start(const char *szFilePath)
+{
+    NvApiRecorderState &r = GetRecorder();
+    {
+        std::lock_guard<std::mutex> lock(r.mtx);
+        if (r.fp)
+        {
+            return false;
+        }
+        r.fp = fopen(szFilePath, "wb");
+        if (!r.fp)
+        {
+            return false;
+        }
+        NvApiTraceHeader header = {};
+        memcpy(header.szMagic, szTraceMagic, sizeof(header.szMagic));
+        header.nVersion = nTraceVersion;
+        header.nEncodeApiVersion = NVENCAPI_VERSION;
+        r.bWriteError = fwrite(&header, sizeof(header), 1, r.fp) != 1;
+        r.mEncoder.clear();
+        r.mDecoder.clear();
+        r.mMemory.clear();
+        r.nEncoder = r.nDecoder = 0;
+        r.t0 = std::chrono::steady_clock::now();
+        r.bRecording = true;
+    }
+    NvEncoder::SetApiLoader(RecordingCreateInstance);
+    NvDecoder::SetApi(&GetRecordingDecoderApi());
+    return true;
+}
+
+bool NvApiRecorder::Stop()
+{
+    NvEncoder::SetApiLoader(NULL);
+    NvDecoder::SetApi(NULL);
+    NvApiRecorderState &r = GetRecorder();
+    std::lock_guard<std::mutex> lock(r.mtx);
+    if (!r.fp)
+    {
+        return false;
+    }
+    r.bRecording = false;
+    FlushRecords(r);
+    bool bOk = !r.bWriteError;
+    if (fclose(r.fp) != 0)
+    {
+        bOk = false;
+    }
+    r.fp = NULL;
+    return bOk;
+}
+
+bool NvApiTrace::Load(const char *szFilePath, std::string &strError)
+{
+    m_vData.clear();
+    m_vEvent.clear();
+    m_nEncodeSession = m_nDecodeSession = m_nThread = 0;
+
+    FILE *fp = fopen(szFilePath, "rb");
+    if (!fp)
+    {
+        strError = std::string("Cannot open ") + szFilePath;
+        return false;
+    }
+    uint8_t aBuffer[1 << 16];
+    size_t n;
+    while ((n = fread(aBuffer, 1, sizeof(aBuffer), fp)) > 0)
+    {
+        m_vData.insert(m_vData.end(), aBuffer, aBuffer + n);
+    }
+    fclose(fp);
+
+    NvApiTraceHeader header;
+    if (m_vData.size() < sizeof(header))
+    {
+        strError = "Not an API trace: too short";
+        return false;
+    }
+    memcpy(&header, m_vData.data(), sizeof(header));
+    if (memcmp(header.szMagic, szTraceMagic, sizeof(header.szMagic)) || header.nVersion != nTraceVersion)
+    {
+        strError = "Not an API trace, or one of another version";
+        return false;
+    }
+    if (header.nEncodeApiVersion != NVENCAPI_VERSION)
+    {
+        std::ostringstream err;
+        err << "Trace recorded with NvEncodeAPI version " << std::hex << header.nEncodeApiVersion << ", this build has "
+            << NVENCAPI_VERSION;
+        strError = err.str();
+        return false;
+    }
+
+    size_t iPos = sizeof(header);
+    while (iPos < m_vData.size())
+    {
+        NvApiTraceEvent event;
+        if (iPos + sizeof(event.rec) > m_vData.size())
+        {
+            strError = "Trace truncated";
+            return false;
+        }
+        memcpy(&event.rec, &m_vData[iPos], sizeof(event.rec));
+        iPos += sizeof(event.rec);
+        if (iPos + event.rec.nArgSize > m_vData.size() || event.rec.eCall >= NV_API_CALL_COUNT)
+        {
+            strError = "Trace truncated or corrupt";
+            return false;
+        }
+        event.pArg = &m_vData[iPos];
+        iPos += event.rec.nArgSize;
+        m_vEvent.push_back(event);
+
+        if (event.rec.iSession != NV_API_NO_SESSION)
+        {
+            int &nSession = IsEncodeApiCall(event.rec.eCall) ? m_nEncodeSession : m_nDecodeSession;
+            nSession = (std::max)(nSession, event.rec.iSession + 1);
+        }
+        m_nThread = (std::max)(m_nThread, event.rec.iThread + 1);
+    }
+    return true;
+}
+
+void PrintApiTraceSummary(std::ostream &os, const NvApiTrace &trace)
+{
+    struct CallStats
+    {
+        uint64_t nCall = 0, nFailed = 0, nsTotal = 0, nsMax = 0, nBytes = 0;
+    };
+    struct SessionStats
+    {
+        std::set<int> siThread;
+        uint64_t nsFirst = UINT64_MAX, nsLast = 0, nFrame = 0, nBytes = 0;
+    };
+    std::vector<CallStats> vCall(NV_API_CALL_COUNT);
+    std::vector<SessionStats> vEncode(trace.GetEncodeSessionCount()), vDecode(trace.GetDecodeSessionCount());
+    for (const NvApiTraceEvent &event : trace.GetEvents())
+    {
+        const NvApiTraceRecord &rec = event.rec;
+        CallStats &call = vCall[rec.eCall];
+        call.nCall++;
+        // Callbacks return the number of decode surfaces or 1 when they succeed
+        bool bCallback = rec.eCall >= NV_API_DEC_SEQUENCE_CALLBACK;
+        if (bCallback ? rec.status == 0 : rec.status != 0 && !(rec.eCall == NV_API_ENC_ENCODE_PICTURE
+            && rec.status == NV_ENC_ERR_NEED_MORE_INPUT))
+        {
+            call.nFailed++;
+        }
+        call.nsTotal += rec.nsDuration;
+        call.nsMax = (std::max)(call.nsMax, (uint64_t)rec.nsDuration);
+        call.nBytes += rec.nSize;
+
+        if (rec.iSession == NV_API_NO_SESSION)
+        {
+            continue;
+        }
+        SessionStats &session = IsEncodeApiCall(rec.eCall) ? vEncode[rec.iSession] : vDecode[rec.iSession];
+        session.siThread.insert(rec.iThread);
+        session.nsFirst = (std::min)(session.nsFirst, rec.nsStart);
+        session.nsLast = (std::max)(session.nsLast, rec.nsStart + rec.nsDuration);
+        if (rec.eCall == NV_API_ENC_LOCK_BITSTREAM || rec.eCall == NV_API_DEC_DISPLAY_CALLBACK)
+        {
+            session.nFrame++;
+        }
+        if (rec.eCall == NV_API_ENC_LOCK_BITSTREAM || rec.eCall == NV_API_DEC_PARSE_VIDEO_DATA)
+        {
+            session.nBytes += rec.nSize;
+        }
+    }
+
+    os << trace.GetEvents().size() << " calls of " << trace.GetEncodeSessionCount() << " encode and "
+        << trace.GetDecodeSessionCount() << " decode sessions on " << trace.GetThreadCount() << " threads" << std::endl;
+    os << std::left << std::setw(32) << "Call" << std::right << std::setw(10) << "Count" << std::setw(8) << "Failed"
+        << std::setw(12) << "Total ms" << std::setw(12) << "Mean us" << std::setw(12) << "Max us" << std::setw(14) << "KB" << std::endl;
+    os << std::fixed << std::setprecision(1);
+    for (int i = 0; i < NV_API_CALL_COUNT; i++)
+    {
+        const CallStats &call = vCall[i];
+        if (!call.nCall)
+        {
+            continue;
+        }
+        os << std::left << std::setw(32) << GetApiCallName((NvApiCall)i) << std::right << std::setw(10) << call.nCall
+            << std::setw(8) << call.nFailed << std::setw(12) << call.nsTotal / 1e6 << std::setw(12) << call.nsTotal / 1e3 / call.nCall
+            << std::setw(12) << call.nsMax / 1e3 << std::setw(14) << call.nBytes / 1024.0 << std::endl;
+    }
+    for (int bEncode = 1; bEncode >= 0; bEncode--)
+    {
+        const std::vector<SessionStats> &vSession = bEncode ? vEncode : vDecode;
+        for (size_t i = 0; i < vSession.size(); i++)
+        {
+            const SessionStats &session = vSession[i];
+            if (session.nsFirst == UINT64_MAX)
+            {
+                continue;
+            }
+            os << (bEncode ? "Encode" : "Decode") << " session " << i << ": " << session.nFrame << " frames, "
+                << session.nBytes / 1024.0 << " KB of bitstream, " << session.nsFirst / 1e6 << " to " << session.nsLast / 1e6
+                << " ms, threads";
+            for (int iThread : session.siThread)
+            {
+                os << " " << iThread;
+            }
+            os << std::endl;
+        }
+    }
+    os.unsetf(std::ios_base::floatfield);
+    os << std::setprecision(6);
+}
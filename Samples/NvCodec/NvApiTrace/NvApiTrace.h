@@ -0,0 +1,275 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "nvEncodeAPI.h"
+#include "nvcuvid.h"
+
+/**
+*  @brief The calls an API trace records: every entry of NV_ENCODE_API_FUNCTION_LIST, the calls of
+*  NvDecoderApi, and the parser callbacks into NvDecoder, which the decode calls nest in.
+*/
+enum NvApiCall
+{
+    NV_API_ENC_OPEN_ENCODE_SESSION,
+    NV_API_ENC_OPEN_ENCODE_SESSION_EX,
+    NV_API_ENC_GET_ENCODE_GUID_COUNT,
+    NV_API_ENC_GET_ENCODE_GUIDS,
+    NV_API_ENC_GET_ENCODE_PROFILE_GUID_COUNT,
+    NV_API_ENC_GET_ENCODE_PROFILE_GUIDS,
+    NV_API_ENC_GET_INPUT_FORMAT_COUNT,
+    NV_API_ENC_GET_INPUT_FORMATS,
+    NV_API_ENC_GET_ENCODE_CAPS,
+    NV_API_ENC_GET_ENCODE_PRESET_COUNT,
+    NV_API_ENC_GET_ENCODE_PRESET_GUIDS,
+    NV_API_ENC_GET_ENCODE_PRESET_CONFIG,
+    NV_API_ENC_INITIALIZE_ENCODER,
+    NV_API_ENC_CREATE_INPUT_BUFFER,
+    NV_API_ENC_DESTROY_INPUT_BUFFER,
+    NV_API_ENC_CREATE_BITSTREAM_BUFFER,
+    NV_API_ENC_DESTROY_BITSTREAM_BUFFER,
+    NV_API_ENC_ENCODE_PICTURE,
+    NV_API_ENC_LOCK_BITSTREAM,
+    NV_API_ENC_UNLOCK_BITSTREAM,
+    NV_API_ENC_LOCK_INPUT_BUFFER,
+    NV_API_ENC_UNLOCK_INPUT_BUFFER,
+    NV_API_ENC_GET_ENCODE_STATS,
+    NV_API_ENC_GET_SEQUENCE_PARAMS,
+    NV_API_ENC_REGISTER_ASYNC_EVENT,
+    NV_API_ENC_UNREGISTER_ASYNC_EVENT,
+    NV_API_ENC_MAP_INPUT_RESOURCE,
+    NV_API_ENC_UNMAP_INPUT_RESOURCE,
+    NV_API_ENC_DESTROY_ENCODER,
+    NV_API_ENC_INVALIDATE_REF_FRAMES,
+    NV_API_ENC_REGISTER_RESOURCE,
+    NV_API_ENC_UNREGISTER_RESOURCE,
+    NV_API_ENC_RECONFIGURE_ENCODER,
+    NV_API_ENC_CREATE_MV_BUFFER,
+    NV_API_ENC_DESTROY_MV_BUFFER,
+    NV_API_ENC_RUN_MOTION_ESTIMATION_ONLY,
+
+    NV_API_DEC_CTX_LOCK_CREATE,
+    NV_API_DEC_CTX_LOCK_DESTROY,
+    NV_API_DEC_CREATE_VIDEO_PARSER,
+    NV_API_DEC_PARSE_VIDEO_DATA,
+    NV_API_DEC_DESTROY_VIDEO_PARSER,
+    NV_API_DEC_GET_DECODER_CAPS,
+    NV_API_DEC_CREATE_DECODER,
+    NV_API_DEC_DESTROY_DECODER,
+    NV_API_DEC_DECODE_PICTURE,
+    NV_API_DEC_MAP_VIDEO_FRAME,
+    NV_API_DEC_UNMAP_VIDEO_FRAME,
+    NV_API_DEC_MEM_ALLOC,
+    NV_API_DEC_MEM_ALLOC_PITCH,
+    NV_API_DEC_MEM_FREE,
+    NV_API_DEC_MEMCPY_2D_ASYNC,
+    NV_API_DEC_STREAM_SYNCHRONIZE,
+    NV_API_DEC_SEQUENCE_CALLBACK,
+    NV_API_DEC_DECODE_CALLBACK,
+    NV_API_DEC_DISPLAY_CALLBACK,
+
+    NV_API_CALL_COUNT
+};
+
+/** Session of the calls that belong to none, such as cuvidCtxLockCreate() */
+const uint16_t NV_API_NO_SESSION = 0xFFFF;
+
+/**
+*  @brief One call of a trace. Encode and decode sessions are numbered separately, in the order
+*  they were opened; a decode session is a parser and the decoder it creates. Threads are numbered
+*  in the order of their first call. Times are in nanoseconds from the start of the recording. The
+*  arguments of the call, nArgSize bytes whose layout depends on eCall, follow the record in the file.
+*/
+struct NvApiTraceRecord
+{
+    uint16_t eCall;
+    uint16_t iSession;
+    uint16_t iThread;
+    uint16_t nArgSize;
+    /** NVENCSTATUS or CUresult of the call, or the return value of a parser callback */
+    int32_t status;
+    /** Bytes of bitstream or frame data the call moved: the packet of cuvidParseVideoData(), the
+    *   bitstream of nvEncLockBitstream(), the picture data of cuvidDecodePicture() and so on */
+    uint32_t nSize;
+    uint64_t nsStart;
+    /** Clamped to about 4 s */
+    uint32_t nsDuration;
+    uint32_t reserved;
+};
+
+/** Arguments of nvEncEncodePicture() */
+struct NvApiEncodePictureArgs
+{
+    uint32_t inputWidth, inputHeight, bufferFmt, pictureStruct, pictureType, encodePicFlags;
+    uint64_t inputTimeStamp;
+};
+
+/** Arguments of nvEncLockBitstream(); nSize is bitstreamSizeInBytes */
+struct NvApiLockBitstreamArgs
+{
+    uint32_t doNotWait, frameIdx, pictureType, numSlices;
+    uint64_t outputTimeStamp;
+};
+
+/** Arguments of nvEncRegisterResource() */
+struct NvApiRegisterResourceArgs
+{
+    uint32_t resourceType, width, height, pitch, bufferFormat;
+};
+
+/** Arguments of nvEncGetEncodeCaps() */
+struct NvApiEncodeCapsArgs
+{
+    GUID encodeGUID;
+    uint32_t capsToQuery;
+    int32_t capsVal;
+};
+
+/** Arguments of nvEncGetEncodePresetConfig() */
+struct NvApiPresetConfigArgs
+{
+    GUID encodeGUID, presetGUID;
+};
+
+/** Arguments of cuvidCreateVideoParser() */
+struct NvApiVideoParserArgs
+{
+    uint32_t CodecType, ulMaxNumDecodeSurfaces, ulClockRate, ulMaxDisplayDelay;
+};
+
+/** Arguments of cuvidParseVideoData(); nSize is payload_size */
+struct NvApiPacketArgs
+{
+    uint32_t flags, reserved;
+    int64_t timestamp;
+};
+
+/** Arguments of cuvidDecodePicture() and of the decode callback; nSize is nBitstreamDataLen */
+struct NvApiPictureArgs
+{
+    int32_t CurrPicIdx;
+    uint32_t nNumSlices, field_pic_flag, bottom_field_flag, second_field, intra_pic_flag, ref_pic_flag, reserved;
+};
+
+/** Arguments of cuvidMapVideoFrame() */
+struct NvApiMapVideoFrameArgs
+{
+    int32_t nPicIdx;
+    uint32_t nPitch, progressive_frame, second_field, top_field_first, unpaired_field;
+};
+
+/** Arguments of cuMemAllocPitch(); nSize is the allocation */
+struct NvApiMemAllocPitchArgs
+{
+    uint64_t WidthInBytes, Height, ElementSizeBytes, Pitch;
+};
+
+/** Arguments of cuMemcpy2DAsync(); nSize is WidthInBytes * Height */
+struct NvApiMemcpy2DArgs
+{
+    uint32_t srcMemoryType, dstMemoryType, WidthInBytes, Height;
+};
+
+/**
+*  @brief Leading arguments of a parser callback: the cuvidParseVideoData() call of the session it
+*  came from, counted from 0. CUVIDEOFORMAT, NvApiPictureArgs or CUVIDPARSERDISPINFO follow.
+*/
+struct NvApiCallbackArgs
+{
+    uint32_t iPacket, reserved;
+};
+
+/*
+*  The other calls record these arguments: nvEncOpenEncodeSession(Ex)() the device type (uint32_t),
+*  nvEncInitializeEncoder() NV_ENC_INITIALIZE_PARAMS followed by NV_ENC_CONFIG, nvEncReconfigureEncoder()
+*  NV_ENC_RECONFIGURE_PARAMS followed by NV_ENC_CONFIG, cuvidGetDecoderCaps() CUVIDDECODECAPS,
+*  cuvidCreateDecoder() CUVIDDECODECREATEINFO; the rest none. Pointers in them are those of the
+*  recording process. The counts the enumeration calls return go in nSize.
+*/
+
+const char *GetApiCallName(NvApiCall eCall);
+/** Tells the calls of NvEncodeAPI from those of NvDecoder */
+inline bool IsEncodeApiCall(int eCall) { return eCall <= NV_API_ENC_RUN_MOTION_ESTIMATION_ONLY; }
+
+/**
+*  @brief Records the NvEncodeAPI and cuvid calls of the NvEncoder and NvDecoder sessions created
+*  between Start() and Stop() into a binary trace, for NvApiReplayer and PrintApiTraceSummary().
+*
+*  Start() puts recording wrappers between the sessions and the driver, with
+*  NvEncoder::SetApiLoader() and NvDecoder::SetApi(), so a session is recorded only if it is
+*  created after Start(). A wrapper takes the time of the call and appends a 32-byte record, with
+*  the few arguments that matter for replay, to a buffer shared by all threads, which costs a lock
+*  and a copy. The buffer goes to the file in 1 MB writes. Sessions may outlive Stop(); their
+*  later calls pass through unrecorded.
+*/
+class NvApiRecorder
+{
+public:
+    /** Returns false if the file cannot be created or recording is on already */
+    static bool Start(const char *szFilePath);
+    /** Returns false if the trace could not be written completely */
+    static bool Stop();
+};
+
+/**
+*  @brief A call of a loaded trace.
+*/
+struct NvApiTraceEvent
+{
+    NvApiTraceRecord rec;
+    /** The arguments, rec.nArgSize bytes inside the trace */
+    const uint8_t *pArg;
+
+    /** Reads a T from the arguments at nOffset; false if they are too short */
+    template<typename T>
+    bool GetArg(T &arg, size_t nOffset = 0) const
+    {
+        if (nOffset + sizeof(T) > rec.nArgSize)
+        {
+            return false;
+        }
+        memcpy(&arg, pArg + nOffset, sizeof(T));
+        return true;
+    }
+};
+
+/**
+*  @brief A trace written by NvApiRecorder, read into memory. The events are in the order they were
+*  recorded, which is the order the calls ended in.
+*/
+class NvApiTrace
+{
+public:
+    /** Returns false with strError if the file is missing, truncated or from another version of the API */
+    bool Load(const char *szFilePath, std::string &strError);
+
+    const std::vector<NvApiTraceEvent> &GetEvents() const { return m_vEvent; }
+    int GetEncodeSessionCount() const { return m_nEncodeSession; }
+    int GetDecodeSessionCount() const { return m_nDecodeSession; }
+    int GetThreadCount() const { return m_nThread; }
+
+private:
+    std::vector<uint8_t> m_vData;
+    std::vector<NvApiTraceEvent> m_vEvent;
+    int m_nEncodeSession = 0, m_nDecodeSession = 0, m_nThread = 0;
+};
+
+/**
+*  @brief Prints, per call, the count, the total, mean and maximum time and the data moved, and per
+*  session the threads it was called from, its span and its frames.
+*/
+void PrintApiTraceSummary(std::ostream &os, const NvApiTrace &trace);
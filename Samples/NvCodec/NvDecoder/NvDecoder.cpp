@@ -14,6 +14,8 @@
 
 #include "nvcuvid.h"
 #include "../Utils/NvCodecUtils.h"
+#include "../Utils/Tracer.h"
+#include "../Utils/NvCudaContext.h"
 #include "NvDecoder/NvDecoder.h"
 
 #define CUDA_DRVAPI_CALL( call )                                                                                                 \
@@ -114,6 +116,23 @@ static unsigned long GetNumDecodeSurfaces(cudaVideoCodec eCodec, unsigned int nW
     return 8;
 }
 
+static const NvDecoderApi *s_pApi = NULL;
+
+const NvDecoderApi &NvDecoderApi::GetDefault()
+{
+    static const NvDecoderApi api = {
+        cuvidCtxLockCreate, cuvidCtxLockDestroy, cuvidCreateVideoParser, cuvidParseVideoData, cuvidDestroyVideoParser,
+        cuvidGetDecoderCaps, cuvidCreateDecoder, cuvidDestroyDecoder, cuvidDecodePicture, cuvidMapVideoFrame,
+        cuvidUnmapVideoFrame, cuMemAlloc, cuMemAllocPitch, cuMemFree, cuMemcpy2DAsync, cuStreamSynchronize
+    };
+    return api;
+}
+
+void NvDecoder::SetApi(const NvDecoderApi *pApi)
+{
+    s_pApi = pApi;
+}
+
 int NvDecoder::HandleVideoSequence(CUVIDEOFORMAT *pVideoFormat)
 {
     m_videoInfo << "Video Input Information" << std::endl
@@ -138,9 +157,11 @@ int NvDecoder::HandleVideoSequence(CUVIDEOFORMAT *pVideoFormat)
     decodecaps.eChromaFormat = pVideoFormat->chroma_format;
     decodecaps.nBitDepthMinus8 = pVideoFormat->bit_depth_luma_minus8; 
 
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
-    NVDEC_API_CALL(cuvidGetDecoderCaps(&decodecaps));
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+    {
+        NvCudaContextScope scope;
+        CUDA_DRVAPI_CALL(scope.Enter(m_cuContext));
+        NVDEC_API_CALL(m_api.pfnGetDecoderCaps(&decodecaps));
+    }
     
     if(!decodecaps.bIsSupported){
         NVDEC_THROW_ERROR("Codec not supported on this GPU", CUDA_ERROR_NOT_SUPPORTED);
@@ -246,24 +267,26 @@ int NvDecoder::HandleVideoSequence(CUVIDEOFORMAT *pVideoFormat)
     ;
     m_videoInfo << std::endl;
 
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
-    NVDEC_API_CALL(cuvidCreateDecoder(&m_hDecoder, &videoDecodeCreateInfo));
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+    NvCudaContextScope scope;
+    CUDA_DRVAPI_CALL(scope.Enter(m_cuContext));
+    NVDEC_API_CALL(m_api.pfnCreateDecoder(&m_hDecoder, &videoDecodeCreateInfo));
     return nDecodeSurface;
 }
 
 int NvDecoder::HandlePictureDecode(CUVIDPICPARAMS *pPicParams) {
+    NVTRACE_SCOPE_ARG("Decode picture", pPicParams->CurrPicIdx);
     if (!m_hDecoder) 
     {
         NVDEC_THROW_ERROR("Decoder not initialized.", CUDA_ERROR_NOT_INITIALIZED);
         return false;
     }
 
-    NVDEC_API_CALL(cuvidDecodePicture(m_hDecoder, pPicParams));
+    NVDEC_API_CALL(m_api.pfnDecodePicture(m_hDecoder, pPicParams));
     return 1;
 }
 
 int NvDecoder::HandlePictureDisplay(CUVIDPARSERDISPINFO *pDispInfo) {
+    NVTRACE_SCOPE_ARG("Display callback", pDispInfo->picture_index);
     CUVIDPROCPARAMS videoProcessingParameters = {};
     videoProcessingParameters.progressive_frame = pDispInfo->progressive_frame;
     videoProcessingParameters.second_field = pDispInfo->repeat_first_field + 1;
@@ -273,7 +296,7 @@ int NvDecoder::HandlePictureDisplay(CUVIDPARSERDISPINFO *pDispInfo) {
 
     CUdeviceptr dpSrcFrame = 0;
     unsigned int nSrcPitch = 0;
-    NVDEC_API_CALL(cuvidMapVideoFrame(m_hDecoder, pDispInfo->picture_index, &dpSrcFrame,
+    NVDEC_API_CALL(m_api.pfnMapVideoFrame(m_hDecoder, pDispInfo->picture_index, &dpSrcFrame,
         &nSrcPitch, &videoProcessingParameters));
     uint8_t *pDecodedFrame = nullptr;
     {
@@ -285,16 +308,16 @@ int NvDecoder::HandlePictureDisplay(CUVIDPARSERDISPINFO *pDispInfo) {
             uint8_t *pFrame = NULL;
             if (m_bUseDeviceFrame)
             {
-                CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
+                NvCudaContextScope scope;
+                CUDA_DRVAPI_CALL(scope.Enter(m_cuContext));
                 if (m_bDeviceFramePitched)
                 {
-                    CUDA_DRVAPI_CALL(cuMemAllocPitch((CUdeviceptr *)&pFrame, &m_nDeviceFramePitch, m_nWidth * (m_nBitDepthMinus8 ? 2 : 1), m_nHeight * 3 / 2, 16));
+                    CUDA_DRVAPI_CALL(m_api.pfnMemAllocPitch((CUdeviceptr *)&pFrame, &m_nDeviceFramePitch, m_nWidth * (m_nBitDepthMinus8 ? 2 : 1), m_nHeight * 3 / 2, 16));
                 }
                 else 
                 {
-                    CUDA_DRVAPI_CALL(cuMemAlloc((CUdeviceptr *)&pFrame, GetFrameSize()));
+                    CUDA_DRVAPI_CALL(m_api.pfnMemAlloc((CUdeviceptr *)&pFrame, GetFrameSize()));
                 }
-                CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
             }
             else 
             {
@@ -305,7 +328,8 @@ int NvDecoder::HandlePictureDisplay(CUVIDPARSERDISPINFO *pDispInfo) {
         pDecodedFrame = m_vpFrame[m_nDecodedFrame - 1];
     }
 
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
+    NvCudaContextScope scope;
+    CUDA_DRVAPI_CALL(scope.Enter(m_cuContext));
     CUDA_MEMCPY2D m = { 0 };
     m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
     m.srcDevice = dpSrcFrame;
@@ -315,31 +339,31 @@ int NvDecoder::HandlePictureDisplay(CUVIDPARSERDISPINFO *pDispInfo) {
     m.dstPitch = m_nDeviceFramePitch ? m_nDeviceFramePitch : m_nWidth * (m_nBitDepthMinus8 ? 2 : 1);
     m.WidthInBytes = m_nWidth * (m_nBitDepthMinus8 ? 2 : 1);
     m.Height = m_nHeight;
-    CUDA_DRVAPI_CALL(cuMemcpy2DAsync(&m, m_cuvidStream));
+    CUDA_DRVAPI_CALL(m_api.pfnMemcpy2DAsync(&m, m_cuvidStream));
     m.srcDevice = (CUdeviceptr)((uint8_t *)dpSrcFrame + m.srcPitch * m_nSurfaceHeight);
     m.dstDevice = (CUdeviceptr)(m.dstHost = pDecodedFrame + m.dstPitch * m_nHeight);
     m.Height = m_nHeight / 2;
-    CUDA_DRVAPI_CALL(cuMemcpy2DAsync(&m, m_cuvidStream));
-    CUDA_DRVAPI_CALL(cuStreamSynchronize(m_cuvidStream));
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+    CUDA_DRVAPI_CALL(m_api.pfnMemcpy2DAsync(&m, m_cuvidStream));
+    CUDA_DRVAPI_CALL(m_api.pfnStreamSynchronize(m_cuvidStream));
+    scope.Leave();
 
     if ((int)m_vTimestamp.size() < m_nDecodedFrame) {
         m_vTimestamp.resize(m_vpFrame.size());
     }
     m_vTimestamp[m_nDecodedFrame - 1] = pDispInfo->timestamp;
 
-    NVDEC_API_CALL(cuvidUnmapVideoFrame(m_hDecoder, dpSrcFrame));
+    NVDEC_API_CALL(m_api.pfnUnmapVideoFrame(m_hDecoder, dpSrcFrame));
     return 1;
 }
 
 NvDecoder::NvDecoder(CUcontext cuContext, int nWidth, int nHeight, bool bUseDeviceFrame, cudaVideoCodec eCodec, std::mutex *pMutex,
     bool bLowLatency, bool bDeviceFramePitched, const Rect *pCropRect, const Dim *pResizeDim) :
-    m_cuContext(cuContext), m_bUseDeviceFrame(bUseDeviceFrame), m_eCodec(eCodec), m_pMutex(pMutex), m_bDeviceFramePitched(bDeviceFramePitched)
+    m_api(s_pApi ? *s_pApi : NvDecoderApi::GetDefault()), m_cuContext(cuContext), m_bUseDeviceFrame(bUseDeviceFrame), m_eCodec(eCodec), m_pMutex(pMutex), m_bDeviceFramePitched(bDeviceFramePitched)
 {
     if (pCropRect) m_cropRect = *pCropRect;
     if (pResizeDim) m_resizeDim = *pResizeDim;
 
-    NVDEC_API_CALL(cuvidCtxLockCreate(&m_ctxLock, cuContext));
+    NVDEC_API_CALL(m_api.pfnCtxLockCreate(&m_ctxLock, cuContext));
 
     CUVIDPARSERPARAMS videoParserParameters = {};
     videoParserParameters.CodecType = eCodec;
@@ -350,22 +374,24 @@ NvDecoder::NvDecoder(CUcontext cuContext, int nWidth, int nHeight, bool bUseDevi
     videoParserParameters.pfnDecodePicture = HandlePictureDecodeProc;
     videoParserParameters.pfnDisplayPicture = HandlePictureDisplayProc;
     if (m_pMutex) m_pMutex->lock();
-    NVDEC_API_CALL(cuvidCreateVideoParser(&m_hParser, &videoParserParameters));
+    NVDEC_API_CALL(m_api.pfnCreateVideoParser(&m_hParser, &videoParserParameters));
     if (m_pMutex) m_pMutex->unlock();
 }
 
 NvDecoder::~NvDecoder() {
 
-    cuCtxPushCurrent(m_cuContext);
-    cuCtxPopCurrent(NULL);
+    {
+        NvCudaContextScope scope;
+        scope.Enter(m_cuContext);
+    }
 
     if (m_hParser) {
-        cuvidDestroyVideoParser(m_hParser);
+        m_api.pfnDestroyVideoParser(m_hParser);
     }
 
     if (m_hDecoder) {
         if (m_pMutex) m_pMutex->lock();
-        cuvidDestroyDecoder(m_hDecoder);
+        m_api.pfnDestroyDecoder(m_hDecoder);
         if (m_pMutex) m_pMutex->unlock();
     }
 
@@ -379,9 +405,11 @@ NvDecoder::~NvDecoder() {
         if (m_bUseDeviceFrame)
         {
             if (m_pMutex) m_pMutex->lock();
-            cuCtxPushCurrent(m_cuContext);
-            cuMemFree((CUdeviceptr)pFrame);
-            cuCtxPopCurrent(NULL);
+            {
+                NvCudaContextScope scope;
+                scope.Enter(m_cuContext);
+                m_api.pfnMemFree((CUdeviceptr)pFrame);
+            }
             if (m_pMutex) m_pMutex->unlock();
         }
         else
@@ -389,7 +417,7 @@ NvDecoder::~NvDecoder() {
             delete[] pFrame;
         }
     }
-    cuvidCtxLockDestroy(m_ctxLock);
+    m_api.pfnCtxLockDestroy(m_ctxLock);
 }
 
 bool NvDecoder::Decode(const uint8_t *pData, int nSize, uint8_t ***pppFrame, int *pnFrameReturned, uint32_t flags, int64_t **ppTimestamp, int64_t timestamp, CUstream stream)
@@ -410,8 +438,9 @@ bool NvDecoder::Decode(const uint8_t *pData, int nSize, uint8_t ***pppFrame, int
         packet.flags |= CUVID_PKT_ENDOFSTREAM;
     }
     m_cuvidStream = stream;
+    NVTRACE_SCOPE_ARG("Decode submit", nSize);
     if (m_pMutex) m_pMutex->lock();
-    NVDEC_API_CALL(cuvidParseVideoData(m_hParser, &packet));
+    NVDEC_API_CALL(m_api.pfnParseVideoData(m_hParser, &packet));
     if (m_pMutex) m_pMutex->unlock();
     m_cuvidStream = 0;
 
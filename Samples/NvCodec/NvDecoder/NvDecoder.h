@@ -77,6 +77,32 @@ struct Dim {
     int w, h;
 };
 
+/**
+* @brief The cuvid and CUDA driver calls NvDecoder makes, as a table of function pointers, so that
+* they can be interposed on or served by a fake backend, as NvApiTrace does. GetDefault() holds
+* the driver's own functions.
+*/
+struct NvDecoderApi {
+    decltype(&cuvidCtxLockCreate) pfnCtxLockCreate;
+    decltype(&cuvidCtxLockDestroy) pfnCtxLockDestroy;
+    decltype(&cuvidCreateVideoParser) pfnCreateVideoParser;
+    decltype(&cuvidParseVideoData) pfnParseVideoData;
+    decltype(&cuvidDestroyVideoParser) pfnDestroyVideoParser;
+    decltype(&cuvidGetDecoderCaps) pfnGetDecoderCaps;
+    decltype(&cuvidCreateDecoder) pfnCreateDecoder;
+    decltype(&cuvidDestroyDecoder) pfnDestroyDecoder;
+    decltype(&cuvidDecodePicture) pfnDecodePicture;
+    decltype(&cuvidMapVideoFrame) pfnMapVideoFrame;
+    decltype(&cuvidUnmapVideoFrame) pfnUnmapVideoFrame;
+    decltype(&cuMemAlloc) pfnMemAlloc;
+    decltype(&cuMemAllocPitch) pfnMemAllocPitch;
+    decltype(&cuMemFree) pfnMemFree;
+    decltype(&cuMemcpy2DAsync) pfnMemcpy2DAsync;
+    decltype(&cuStreamSynchronize) pfnStreamSynchronize;
+
+    static const NvDecoderApi &GetDefault();
+};
+
 /**
 * @brief Base class for decoder interface.
 */
@@ -92,6 +118,13 @@ public:
         bool bLowLatency = false, bool bDeviceFramePitched = false, const Rect *pCropRect = NULL, const Dim *pResizeDim = NULL);
     ~NvDecoder();
 
+    /**
+    *  @brief  This function sets the calls made by the decoders created from then on; NULL restores
+    *  NvDecoderApi::GetDefault(). It must not race with the creation of a decoder, and pApi must
+    *  outlive the decoders that use it.
+    */
+    static void SetApi(const NvDecoderApi *pApi);
+
     /**
     *  @brief  This function is used to get the current CUDA context.
     */
@@ -186,6 +219,7 @@ private:
     int HandlePictureDisplay(CUVIDPARSERDISPINFO *pDispInfo);
 
 private:
+    NvDecoderApi m_api;
     CUcontext m_cuContext = NULL;
     CUvideoctxlock m_ctxLock;
     std::mutex *m_pMutex;
@@ -12,7 +12,11 @@
 #ifndef WIN32
 #include <dlfcn.h>
 #endif
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include "NvEncoder/NvEncoder.h"
+#include "../Utils/Tracer.h"
 
 #ifndef _WIN32
 #include <cstring>
@@ -55,7 +59,25 @@ NvEncoder::NvEncoder(NV_ENC_DEVICE_TYPE eDeviceType, void *pDevice, uint32_t nWi
     m_hEncoder = hEncoder;
 }
 
+static NvEncoder::NvEncodeApiLoader s_pfnApiLoader = NULL;
+
+void NvEncoder::SetApiLoader(NvEncodeApiLoader pfnLoader)
+{
+    s_pfnApiLoader = pfnLoader;
+}
+
 void NvEncoder::LoadNvEncApi()
+{
+    m_nvenc = { NV_ENCODE_API_FUNCTION_LIST_VER };
+    if (s_pfnApiLoader)
+    {
+        NVENC_API_CALL(s_pfnApiLoader(&m_nvenc));
+        return;
+    }
+    m_hModule = LoadNvEncApiLibrary(&m_nvenc);
+}
+
+void *NvEncoder::LoadNvEncApiLibrary(NV_ENCODE_API_FUNCTION_LIST *pFunctionList)
 {
 #if defined(_WIN32)
 #if defined(_WIN64)
@@ -72,8 +94,6 @@ void NvEncoder::LoadNvEncApi()
         NVENC_THROW_ERROR("NVENC library file is not found. Please ensure NV driver is installed", NV_ENC_ERR_NO_ENCODE_DEVICE);
     }
 
-    m_hModule = hModule;
-
     typedef NVENCSTATUS(NVENCAPI *NvEncodeAPIGetMaxSupportedVersion_Type)(uint32_t*);
 #if defined(_WIN32)
     NvEncodeAPIGetMaxSupportedVersion_Type NvEncodeAPIGetMaxSupportedVersion = (NvEncodeAPIGetMaxSupportedVersion_Type)GetProcAddress(hModule, "NvEncodeAPIGetMaxSupportedVersion");
@@ -86,6 +106,7 @@ void NvEncoder::LoadNvEncApi()
     NVENC_API_CALL(NvEncodeAPIGetMaxSupportedVersion(&version));
     if (currentVersion > version)
     {
+        FreeNvEncApiLibrary(hModule);
         NVENC_THROW_ERROR("Current Driver Version does not support this NvEncodeAPI version, please upgrade driver", NV_ENC_ERR_INVALID_VERSION);
     }
 
@@ -98,26 +119,38 @@ void NvEncoder::LoadNvEncApi()
 
     if (!NvEncodeAPICreateInstance)
     {
+        FreeNvEncApiLibrary(hModule);
         NVENC_THROW_ERROR("Cannot find NvEncodeAPICreateInstance() entry in NVENC library", NV_ENC_ERR_NO_ENCODE_DEVICE);
     }
 
-    m_nvenc = { NV_ENCODE_API_FUNCTION_LIST_VER };
-    NVENC_API_CALL(NvEncodeAPICreateInstance(&m_nvenc));
+    NVENCSTATUS nvStatus = NvEncodeAPICreateInstance(pFunctionList);
+    if (nvStatus != NV_ENC_SUCCESS)
+    {
+        FreeNvEncApiLibrary(hModule);
+        NVENC_THROW_ERROR("NvEncodeAPICreateInstance failed", nvStatus);
+    }
+    return hModule;
 }
 
-NvEncoder::~NvEncoder()
+void NvEncoder::FreeNvEncApiLibrary(void *hModule)
 {
-    DestroyHWEncoder();
-
-    if (m_hModule)
+    if (!hModule)
     {
+        return;
+    }
 #if defined(_WIN32)
-        FreeLibrary((HMODULE)m_hModule);
+    FreeLibrary((HMODULE)hModule);
 #else
-        dlclose(m_hModule);
+    dlclose(hModule);
 #endif
-        m_hModule = nullptr;
-    }
+}
+
+NvEncoder::~NvEncoder()
+{
+    DestroyHWEncoder();
+
+    FreeNvEncApiLibrary(m_hModule);
+    m_hModule = nullptr;
 }
 
 void NvEncoder::CreateDefaultEncoderParams(NV_ENC_INITIALIZE_PARAMS* pIntializeParams, GUID codecGuid, GUID presetGuid)
@@ -383,12 +416,36 @@ void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_P
     {
         NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
     }
+    DoEncode(MapNextInputBuffer(), vPacket, pPicParams);
+}
+
+void NvEncoder::EncodeFrameSlices(const NvEncSliceSink &sliceSink, NV_ENC_PIC_PARAMS *pPicParams)
+{
+    if (!IsHWEncoderInitialized())
+    {
+        NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
+    }
+    if (!m_initializeParams.enableSubFrameWrite || !m_initializeParams.reportSliceOffsets || m_initializeParams.enableEncodeAsync)
+    {
+        NVENC_THROW_ERROR("Slice output requires enableSubFrameWrite, reportSliceOffsets and synchronous mode", NV_ENC_ERR_INVALID_CALL);
+    }
+    if (!IsZeroDelay())
+    {
+        NVENC_THROW_ERROR("Slice output requires a session without output delay", NV_ENC_ERR_INVALID_CALL);
+    }
+    SubmitPicture(MapNextInputBuffer(), pPicParams);
+    GetEncodedSlices(sliceSink);
+}
+
+NV_ENC_INPUT_PTR NvEncoder::MapNextInputBuffer()
+{
     int i = m_iToSend % m_nEncoderBuffer;
+    WaitForInputReady(i);
     NV_ENC_MAP_INPUT_RESOURCE mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
     mapInputResource.registeredResource = m_vRegisteredResources[i];
     NVENC_API_CALL(m_nvenc.nvEncMapInputResource(m_hEncoder, &mapInputResource));
     m_vMappedInputBuffers[i] = mapInputResource.mappedResource;
-    DoEncode(m_vMappedInputBuffers[i], vPacket, pPicParams);
+    return m_vMappedInputBuffers[i];
 }
 
 void NvEncoder::RunMotionEstimation(std::vector<uint8_t> &mvData)
@@ -400,6 +457,7 @@ void NvEncoder::RunMotionEstimation(std::vector<uint8_t> &mvData)
     }
 
     const uint32_t i = m_iToSend % m_nEncoderBuffer;
+    WaitForInputReady(i);
 
     NV_ENC_MAP_INPUT_RESOURCE mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
     mapInputResource.registeredResource = m_vRegisteredResources[i];
@@ -434,11 +492,22 @@ void NvEncoder::GetSequenceParams(std::vector<uint8_t> &seqParams)
 
 void NvEncoder::DoEncode(NV_ENC_INPUT_PTR inputBuffer, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams)
 {
+    SubmitPicture(inputBuffer, pPicParams);
+    GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, true);
+}
+
+void NvEncoder::SubmitPicture(NV_ENC_INPUT_PTR inputBuffer, NV_ENC_PIC_PARAMS *pPicParams)
+{
+    NVTRACE_SCOPE_ARG("Encode submit", m_iToSend);
     NV_ENC_PIC_PARAMS picParams = {};
     if (pPicParams)
     {
         picParams = *pPicParams;
     }
+    else
+    {
+        picParams.inputTimeStamp = m_iToSend;
+    }
     picParams.version = NV_ENC_PIC_PARAMS_VER;
     picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
     picParams.inputBuffer = inputBuffer;
@@ -450,8 +519,8 @@ void NvEncoder::DoEncode(NV_ENC_INPUT_PTR inputBuffer, std::vector<std::vector<u
     NVENCSTATUS nvStatus = m_nvenc.nvEncEncodePicture(m_hEncoder, &picParams);
     if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT)
     {
+        m_dqInputTimeStamp.push_back((int64_t)picParams.inputTimeStamp);
         m_iToSend++;
-        GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, true);
     }
     else
     {
@@ -478,8 +547,10 @@ void NvEncoder::GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer,
 {
     unsigned i = 0;
     int iEnd = bOutputDelay ? m_iToSend - m_nOutputDelay : m_iToSend;
+    m_vPacketInfo.clear();
     for (; m_iGot < iEnd; m_iGot++)
     {
+        NVTRACE_SCOPE_ARG("Lock bitstream", m_iGot);
         WaitForCompletionEvent(m_iGot % m_nEncoderBuffer);
         NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
         lockBitstreamData.outputBitstream = vOutputBuffer[m_iGot % m_nEncoderBuffer];
@@ -494,20 +565,144 @@ void NvEncoder::GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer,
         vPacket[i].clear();
         vPacket[i].insert(vPacket[i].end(), &pData[0], &pData[lockBitstreamData.bitstreamSizeInBytes]);
         i++;
+        AddPacketInfo(lockBitstreamData);
 
         NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
 
-        if (m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer])
+        UnmapCompletedInput(m_iGot % m_nEncoderBuffer);
+    }
+}
+
+void NvEncoder::UnmapCompletedInput(int iBuffer)
+{
+    if (m_vMappedInputBuffers[iBuffer])
+    {
+        NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[iBuffer]));
+        m_vMappedInputBuffers[iBuffer] = nullptr;
+    }
+
+    if (m_bMotionEstimationOnly && m_vMappedRefBuffers[iBuffer])
+    {
+        NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedRefBuffers[iBuffer]));
+        m_vMappedRefBuffers[iBuffer] = nullptr;
+    }
+}
+
+void NvEncoder::GetEncodedSlices(const NvEncSliceSink &sliceSink)
+{
+    if (m_iGot == m_iToSend)
+    {
+        return;
+    }
+    int iBuffer = m_iGot % m_nEncoderBuffer;
+    NVTRACE_SCOPE_ARG("Lock bitstream slices", m_iGot);
+
+    // The offset array must be able to hold one entry per macroblock
+    uint32_t nMaxSlice = ((m_nMaxEncodeWidth + 15) / 16) * ((m_nMaxEncodeHeight + 15) / 16);
+    if (m_vSliceOffsets.size() < nMaxSlice)
+    {
+        m_vSliceOffsets.resize(nMaxSlice);
+    }
+
+    uint32_t nSliceDone = 0, nByteDone = 0;
+    auto DeliverSlices = [&](const NV_ENC_LOCK_BITSTREAM &lockBitstreamData, bool bFrameDone)
+    {
+        const uint8_t *pData = (const uint8_t *)lockBitstreamData.bitstreamBufferPtr;
+        // With sub-frame write, numSlices and bitstreamSizeInBytes cover the slices completed so far
+        for (; nSliceDone < lockBitstreamData.numSlices; nSliceDone++)
         {
-            NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer]));
-            m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer] = nullptr;
+            bool bLast = nSliceDone + 1 == lockBitstreamData.numSlices;
+            uint32_t nEnd = bLast ? lockBitstreamData.bitstreamSizeInBytes : m_vSliceOffsets[nSliceDone + 1];
+            if (nEnd > nByteDone)
+            {
+                sliceSink(pData + nByteDone, nEnd - nByteDone, nSliceDone);
+            }
+            nByteDone = (std::max)(nByteDone, nEnd);
+        }
+        if (bFrameDone && lockBitstreamData.bitstreamSizeInBytes > nByteDone)
+        {
+            // Trailing data not covered by the reported slices goes with the last slice
+            sliceSink(pData + nByteDone, lockBitstreamData.bitstreamSizeInBytes - nByteDone, nSliceDone ? nSliceDone - 1 : 0);
+            nByteDone = lockBitstreamData.bitstreamSizeInBytes;
         }
+    };
 
-        if (m_bMotionEstimationOnly && m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer])
+    // Poll without blocking while the hardware is still writing slices. hwEncodeStatus
+    // becomes 2 once the whole picture is done; give up polling after the same 20s the
+    // asynchronous path waits for and fall back to a blocking lock.
+    auto tStart = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - tStart < std::chrono::seconds(20))
+    {
+        NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+        lockBitstreamData.outputBitstream = m_vBitstreamOutputBuffer[iBuffer];
+        lockBitstreamData.sliceOffsets = m_vSliceOffsets.data();
+        lockBitstreamData.doNotWait = true;
+        NVENCSTATUS nvStatus = m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData);
+        if (nvStatus == NV_ENC_ERR_LOCK_BUSY)
         {
-            NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer]));
-            m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer] = nullptr;
+            std::this_thread::yield();
+            continue;
         }
+        if (nvStatus != NV_ENC_SUCCESS)
+        {
+            NVENC_THROW_ERROR("nvEncLockBitstream API failed", nvStatus);
+        }
+        bool bFrameDone = lockBitstreamData.hwEncodeStatus == 2;
+        DeliverSlices(lockBitstreamData, false);
+        NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
+        if (bFrameDone)
+        {
+            break;
+        }
+        std::this_thread::yield();
+    }
+
+    // Returns immediately if the frame is complete; delivers whatever is left
+    NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+    lockBitstreamData.outputBitstream = m_vBitstreamOutputBuffer[iBuffer];
+    lockBitstreamData.sliceOffsets = m_vSliceOffsets.data();
+    NVENC_API_CALL(m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData));
+    DeliverSlices(lockBitstreamData, true);
+    m_vPacketInfo.clear();
+    AddPacketInfo(lockBitstreamData);
+    NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
+
+    UnmapCompletedInput(iBuffer);
+    m_iGot++;
+}
+
+void NvEncoder::AddPacketInfo(const NV_ENC_LOCK_BITSTREAM &lockBitstreamData)
+{
+    NvEncPacketInfo info = {};
+    info.nPts = (int64_t)lockBitstreamData.outputTimeStamp;
+    info.ePictureType = lockBitstreamData.pictureType;
+
+    // Packets come out in decode order. With at most nReorder B-frames in a row, packet #i is
+    // never presented before input #(i - nReorder), so that input's timestamp is a decode
+    // timestamp that increases and stays <= pts. The first packets extrapolate backwards.
+    int32_t nReorder = (std::max)((int32_t)m_encodeConfig.frameIntervalP - 1, 0);
+    int32_t iInput = m_iGot - nReorder;
+    int32_t nInput = (int32_t)m_dqInputTimeStamp.size();
+    if (iInput >= m_iFirstInputTimeStamp && iInput < m_iFirstInputTimeStamp + nInput)
+    {
+        info.nDts = m_dqInputTimeStamp[iInput - m_iFirstInputTimeStamp];
+    }
+    else if (iInput < 0 && nInput)
+    {
+        int64_t nInterval = nInput > 1 ? m_dqInputTimeStamp[1] - m_dqInputTimeStamp[0] : 1;
+        info.nDts = m_dqInputTimeStamp[0] + iInput * nInterval;
+    }
+    else
+    {
+        info.nDts = info.nPts;
+    }
+    m_vPacketInfo.push_back(info);
+
+    // The next packet looks up input #(m_iGot + 1 - nReorder)
+    while (!m_dqInputTimeStamp.empty() && m_iFirstInputTimeStamp < m_iGot + 1 - nReorder)
+    {
+        m_dqInputTimeStamp.pop_front();
+        m_iFirstInputTimeStamp++;
     }
 }
 
@@ -520,6 +715,8 @@ bool NvEncoder::Reconfigure(const NV_ENC_RECONFIGURE_PARAMS *pReconfigureParams)
     {
         memcpy(&m_encodeConfig, pReconfigureParams->reInitEncodeParams.encodeConfig, sizeof(m_encodeConfig));
     }
+    // Don't keep a pointer to the caller's config, which may not outlive this call
+    m_initializeParams.encodeConfig = &m_encodeConfig;
 
     m_nWidth = m_initializeParams.encodeWidth;
     m_nHeight = m_initializeParams.encodeHeight;
@@ -716,32 +913,38 @@ uint32_t NvEncoder::GetChromaPitch(const NV_ENC_BUFFER_FORMAT bufferFormat,const
 
 void NvEncoder::GetChromaSubPlaneOffsets(const NV_ENC_BUFFER_FORMAT bufferFormat, const uint32_t pitch, const uint32_t height, std::vector<uint32_t>& chromaOffsets)
 {
-    chromaOffsets.clear();
+    uint32_t offsets[2];
+    uint32_t numChromaPlanes = GetChromaSubPlaneOffsets(bufferFormat, pitch, height, offsets);
+    chromaOffsets.assign(offsets, offsets + numChromaPlanes);
+}
+
+uint32_t NvEncoder::GetChromaSubPlaneOffsets(const NV_ENC_BUFFER_FORMAT bufferFormat, const uint32_t pitch, const uint32_t height, uint32_t chromaOffsets[2])
+{
     switch (bufferFormat)
     {
     case NV_ENC_BUFFER_FORMAT_NV12:
     case NV_ENC_BUFFER_FORMAT_YUV420_10BIT:
-        chromaOffsets.push_back(pitch * height);
-        return;
+        chromaOffsets[0] = pitch * height;
+        return 1;
     case NV_ENC_BUFFER_FORMAT_YV12:
     case NV_ENC_BUFFER_FORMAT_IYUV:
-        chromaOffsets.push_back(pitch * height);
-        chromaOffsets.push_back(chromaOffsets[0] + (NvEncoder::GetChromaPitch(bufferFormat, pitch) * GetChromaHeight(bufferFormat, height)));
-        return;
+        chromaOffsets[0] = pitch * height;
+        chromaOffsets[1] = chromaOffsets[0] + (NvEncoder::GetChromaPitch(bufferFormat, pitch) * GetChromaHeight(bufferFormat, height));
+        return 2;
     case NV_ENC_BUFFER_FORMAT_YUV444:
     case NV_ENC_BUFFER_FORMAT_YUV444_10BIT:
-        chromaOffsets.push_back(pitch * height);
-        chromaOffsets.push_back(chromaOffsets[0] + (pitch * height));
-        return;
+        chromaOffsets[0] = pitch * height;
+        chromaOffsets[1] = chromaOffsets[0] + (pitch * height);
+        return 2;
     case NV_ENC_BUFFER_FORMAT_ARGB:
     case NV_ENC_BUFFER_FORMAT_ARGB10:
     case NV_ENC_BUFFER_FORMAT_AYUV:
     case NV_ENC_BUFFER_FORMAT_ABGR:
     case NV_ENC_BUFFER_FORMAT_ABGR10:
-        return;
+        return 0;
     default:
         NVENC_THROW_ERROR("Invalid Buffer format", NV_ENC_ERR_INVALID_PARAM);
-        return;
+        return 0;
     }
 }
 
@@ -12,6 +12,7 @@
 #pragma once
 
 #include <vector>
+#include <deque>
 #include "nvEncodeAPI.h"
 #include <stdint.h>
 #include <mutex>
@@ -19,6 +20,7 @@
 #include <iostream>
 #include <sstream>
 #include <string.h>
+#include <functional>
 
 /**
 * @brief Exception class for error reporting from NvEncodeAPI calls.
@@ -79,6 +81,25 @@ struct NvEncInputFrame
     NV_ENC_INPUT_RESOURCE_TYPE resourceType;
 };
 
+/**
+* @brief Timing and picture type of one encoded packet. Timestamps are in the units of
+* NV_ENC_PIC_PARAMS::inputTimeStamp; without picture parameters the frame index is used.
+*/
+struct NvEncPacketInfo
+{
+    /** Presentation timestamp: the inputTimeStamp of the frame */
+    int64_t nPts;
+    /** Decode timestamp; not greater than nPts, and lower only when B-frames reorder the output */
+    int64_t nDts;
+    NV_ENC_PIC_TYPE ePictureType;
+};
+
+/**
+* @brief Receives the bitstream of one slice; slices of a frame are delivered in order.
+* The data is only valid for the duration of the call.
+*/
+typedef std::function<void(const uint8_t *pSlice, uint32_t nSliceSize, uint32_t iSlice)> NvEncSliceSink;
+
 /**
 * @brief Shared base class for different encoder interfaces.
 */
@@ -125,6 +146,17 @@ public:
     */
     void EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
 
+    /**
+    *  @brief  This function is used to encode a frame and return its bitstream slice by slice.
+    *  Unlike EncodeFrame(), each slice is handed to sliceSink as soon as the hardware has
+    *  written it, so the first bytes of a frame can be sent before the rest is encoded.
+    *  The function returns once the whole frame has been delivered. The session must be
+    *  created with several slices per picture, NV_ENC_INITIALIZE_PARAMS::enableSubFrameWrite
+    *  and ::reportSliceOffsets set, ::enableEncodeAsync cleared, and without output delay
+    *  (no B-frames, no lookahead, nExtraOutputDelay = 0).
+    */
+    void EncodeFrameSlices(const NvEncSliceSink &sliceSink, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
+
     /**
     *  @brief  This function to flush the encoder queue.
     *  The encoder might be queuing frames for B picture encoding or lookahead;
@@ -134,6 +166,14 @@ public:
     */
     void EndEncode(std::vector<std::vector<uint8_t>> &vPacket);
 
+    /**
+    *  @brief  This function is used to get the timestamps and picture types of the packets
+    *          returned by the last EncodeFrame(), EncodeFrameSlices() or EndEncode() call.
+    *  The entries are in the same order as the packets. Muxers need them because packets come
+    *  out in decode order, which differs from presentation order when B-frames are used.
+    */
+    const std::vector<NvEncPacketInfo> &GetPacketInfo() const { return m_vPacketInfo; }
+
     /**
     *  @brief  This function is used to query hardware encoder capabilities.
     *  Applications can call this function to query capabilities like maximum encode
@@ -222,6 +262,13 @@ public:
     */
     static void GetChromaSubPlaneOffsets(const NV_ENC_BUFFER_FORMAT bufferFormat, const uint32_t pitch,
                                         const uint32_t height, std::vector<uint32_t>& chromaOffsets);
+
+    /**
+    *  @brief This a static function to get chroma offsets for YUV planar formats without allocating.
+    *  Returns the number of chroma planes written to chromaOffsets.
+    */
+    static uint32_t GetChromaSubPlaneOffsets(const NV_ENC_BUFFER_FORMAT bufferFormat, const uint32_t pitch,
+                                        const uint32_t height, uint32_t chromaOffsets[2]);
     /**
     *  @brief This a static function to get the chroma plane pitch for YUV planar formats.
     */
@@ -249,6 +296,30 @@ public:
     */
     static uint32_t GetWidthInBytes(const NV_ENC_BUFFER_FORMAT bufferFormat, const uint32_t width);
 
+    /**
+    *  @brief Function that fills in the NvEncodeAPI function list, with the signature of NvEncodeAPICreateInstance().
+    */
+    typedef NVENCSTATUS (NVENCAPI *NvEncodeApiLoader)(NV_ENCODE_API_FUNCTION_LIST *pFunctionList);
+
+    /**
+    *  @brief This a static function to set the loader of the function list of the encoders created
+    *  from then on, in place of the NvEncodeAPI library; NULL restores the library. NvApiTrace uses
+    *  it to interpose on the API and to run encoders against a fake backend. It must not race with
+    *  the creation of an encoder.
+    */
+    static void SetApiLoader(NvEncodeApiLoader pfnLoader);
+
+    /**
+    *  @brief This a static function to load the NvEncodeAPI library and fill in pFunctionList from it.
+    *  It returns the handle of the library, for FreeNvEncApiLibrary(). Loaders use it to reach the real API.
+    */
+    static void *LoadNvEncApiLibrary(NV_ENCODE_API_FUNCTION_LIST *pFunctionList);
+
+    /**
+    *  @brief This a static function to release a library loaded by LoadNvEncApiLibrary().
+    */
+    static void FreeNvEncApiLibrary(void *hModule);
+
 protected:
 
     /**
@@ -308,7 +379,8 @@ private:
     bool IsZeroDelay() { return m_nOutputDelay == 0; }
 
     /**
-    *  @brief This is a private function which is used to load the encode api shared library.
+    *  @brief This is a private function which is used to load the encode api shared library,
+    *  or the function list of the loader set with SetApiLoader().
     */
     void LoadNvEncApi();
 
@@ -318,6 +390,17 @@ private:
     */
     void DoEncode(NV_ENC_INPUT_PTR inputBuffer, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams);
 
+    /**
+    *  @brief This is a private function which is used to submit one picture to the
+    *         NVENC hardware without retrieving any output.
+    */
+    void SubmitPicture(NV_ENC_INPUT_PTR inputBuffer, NV_ENC_PIC_PARAMS *pPicParams);
+
+    /**
+    *  @brief This is a private function which is used to map the next input buffer for encoding.
+    */
+    NV_ENC_INPUT_PTR MapNextInputBuffer();
+
     /**
     *  @brief This is a private function which is used to submit the encode
     *         commands to the NVENC hardware for ME only mode.
@@ -332,6 +415,25 @@ private:
     */
     void GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay);
 
+    /**
+    *  @brief This is a private function which is used to read back the oldest pending
+    *         frame slice by slice while it is being encoded.
+    *  This is called by EncodeFrameSlices() function.
+    */
+    void GetEncodedSlices(const NvEncSliceSink &sliceSink);
+
+    /**
+    *  @brief This is a private function which is used to record the timestamps of the
+    *         packet of frame m_iGot, which has just been locked.
+    */
+    void AddPacketInfo(const NV_ENC_LOCK_BITSTREAM &lockBitstreamData);
+
+    /**
+    *  @brief This is a private function which is used to unmap the input buffers
+    *         of a frame whose output has been retrieved.
+    */
+    void UnmapCompletedInput(int iBuffer);
+
     /**
     *  @brief This is a private function which is used to initialize MV output buffers.
     *  This is only used in ME-only Mode.
@@ -362,6 +464,13 @@ private:
     */
     virtual void ReleaseInputBuffers() = 0;
 
+    /**
+    *  @brief This is a virtual function which is used to wait until an input buffer may be read by the encoder.
+    *  It is called before an input buffer is mapped for encoding. Derived classes that fill input
+    *  buffers asynchronously override it; the default implementation does nothing.
+    */
+    virtual void WaitForInputReady(int iInputBuffer) {}
+
 protected:
     bool m_bMotionEstimationOnly = false;
     void *m_hEncoder = nullptr;
@@ -385,6 +494,7 @@ private:
     std::vector<NV_ENC_OUTPUT_PTR> m_vBitstreamOutputBuffer;
     std::vector<NV_ENC_OUTPUT_PTR> m_vMVDataOutputBuffer;
     std::vector<void *> m_vpCompletionEvent;
+    std::vector<uint32_t> m_vSliceOffsets;
     uint32_t m_nMaxEncodeWidth = 0;
     uint32_t m_nMaxEncodeHeight = 0;
     void* m_hModule = nullptr;
@@ -392,4 +502,8 @@ private:
     int32_t m_iGot = 0;
     int32_t m_nEncoderBuffer = 0;
     int32_t m_nOutputDelay = 0;
+    std::vector<NvEncPacketInfo> m_vPacketInfo;
+    /** inputTimeStamp of the frames from m_iFirstInputTimeStamp on, kept until their decode time is taken */
+    std::deque<int64_t> m_dqInputTimeStamp;
+    int32_t m_iFirstInputTimeStamp = 0;
 };
@@ -10,6 +10,7 @@
 */
 
 #include "NvEncoder/NvEncoderCuda.h"
+#include "../Utils/NvCudaContext.h"
 
 #define CUDA_DRVAPI_CALL( call )                                                                                                 \
     do                                                                                                                           \
@@ -59,7 +60,8 @@ void NvEncoderCuda::AllocateInputBuffers(int32_t numInputBuffers)
 
     for (int count = 0; count < numCount; count++)
     {
-        CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
+        NvCudaContextScope scope;
+        CUDA_DRVAPI_CALL(scope.Enter(m_cuContext));
         std::vector<void*> inputFrames;
         for (int i = 0; i < numInputBuffers; i++)
         {
@@ -73,7 +75,7 @@ void NvEncoderCuda::AllocateInputBuffers(int32_t numInputBuffers)
                 GetMaxEncodeHeight() + chromaHeight, 16));
             inputFrames.push_back((void*)pDeviceFrame);
         }
-        CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+        scope.Leave();
 
         RegisterResources(inputFrames,
             NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
@@ -104,7 +106,8 @@ void NvEncoderCuda::ReleaseCudaResources()
 
     UnregisterResources();
 
-    cuCtxPushCurrent(m_cuContext);
+    NvCudaContextScope scope;
+    scope.Enter(m_cuContext);
 
     for (uint32_t i = 0; i < m_vInputFrames.size(); ++i)
     {
@@ -124,7 +127,24 @@ void NvEncoderCuda::ReleaseCudaResources()
     }
     m_vReferenceFrames.clear();
 
-    cuCtxPopCurrent(NULL);
+    for (uint32_t i = 0; i < m_vpStagingBuffer.size(); ++i)
+    {
+        if (m_vUploadPending[i])
+        {
+            cuEventSynchronize(m_vUploadEvent[i]);
+        }
+        if (m_vpStagingBuffer[i])
+        {
+            cuMemFreeHost(m_vpStagingBuffer[i]);
+        }
+        cuEventDestroy(m_vUploadEvent[i]);
+    }
+    m_vpStagingBuffer.clear();
+    m_vStagingSize.clear();
+    m_vUploadEvent.clear();
+    m_vUploadPending.clear();
+
+    scope.Leave();
     m_cuContext = nullptr;
 }
 
@@ -141,7 +161,8 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
     uint32_t numChromaPlanes,
     bool bUnAlignedDeviceCopy)
 {
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(device));
+    NvCudaContextScope scope;
+    CUDA_DRVAPI_CALL(scope.Enter(device));
 
     uint32_t srcPitch = nSrcPitch ? nSrcPitch : NvEncoder::GetWidthInBytes(pixelFormat, width);
     CUDA_MEMCPY2D m = { 0 };
@@ -169,7 +190,7 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
         CUDA_DRVAPI_CALL(cuMemcpy2D(&m));
     }
 
-    std::vector<uint32_t> srcChromaOffsets;
+    uint32_t srcChromaOffsets[2];
     NvEncoder::GetChromaSubPlaneOffsets(pixelFormat, srcPitch, height, srcChromaOffsets);
     uint32_t chromaHeight = NvEncoder::GetChromaHeight(pixelFormat, height);
     uint32_t destChromaPitch = NvEncoder::GetChromaPitch(pixelFormat, dstPitch);
@@ -204,7 +225,6 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
             }
         }
     }
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
 }
 
 void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
@@ -221,7 +241,8 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
     uint32_t numChromaPlanes,
     bool bUnAlignedDeviceCopy)
 {
-    CUDA_DRVAPI_CALL(cuCtxPushCurrent(device));
+    NvCudaContextScope scope;
+    CUDA_DRVAPI_CALL(scope.Enter(device));
 
     uint32_t srcPitch = nSrcPitch ? nSrcPitch : NvEncoder::GetWidthInBytes(pixelFormat, width);
     CUDA_MEMCPY2D m = { 0 };
@@ -249,7 +270,7 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
         CUDA_DRVAPI_CALL(cuMemcpy2D(&m));
     }
 
-    std::vector<uint32_t> srcChromaOffsets;
+    uint32_t srcChromaOffsets[2];
     NvEncoder::GetChromaSubPlaneOffsets(pixelFormat, srcPitch, height, srcChromaOffsets);
     uint32_t chromaHeight = NvEncoder::GetChromaHeight(pixelFormat, height);
     uint32_t srcChromaPitch = NvEncoder::GetChromaPitch(pixelFormat, srcPitch);
@@ -283,5 +304,141 @@ void NvEncoderCuda::CopyToDeviceFrame(CUcontext device,
             }
         }
     }
-    CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+}
+
+void NvEncoderCuda::CopyToDeviceFrameAsync(CUcontext device,
+    const void* pSrcFrame,
+    uint32_t nSrcPitch,
+    CUdeviceptr pDstFrame,
+    uint32_t dstPitch,
+    int width,
+    int height,
+    CUmemorytype srcMemoryType,
+    NV_ENC_BUFFER_FORMAT pixelFormat,
+    const uint32_t dstChromaOffsets[],
+    uint32_t numChromaPlanes,
+    CUstream cuStream,
+    CUevent completionEvent)
+{
+    NvCudaContextScope scope;
+    CUDA_DRVAPI_CALL(scope.Enter(device));
+
+    uint32_t srcPitch = nSrcPitch ? nSrcPitch : NvEncoder::GetWidthInBytes(pixelFormat, width);
+    uint32_t srcChromaOffsets[2];
+    NvEncoder::GetChromaSubPlaneOffsets(pixelFormat, srcPitch, height, srcChromaOffsets);
+    uint32_t chromaHeight = NvEncoder::GetChromaHeight(pixelFormat, height);
+
+    // Plane 0 is luma (or the packed RGB plane), followed by up to two chroma planes
+    for (uint32_t i = 0; i <= numChromaPlanes; ++i)
+    {
+        if (i && !chromaHeight)
+        {
+            break;
+        }
+        const uint8_t *pSrcPlane = (const uint8_t *)pSrcFrame + (i ? srcChromaOffsets[i - 1] : 0);
+        CUDA_MEMCPY2D m = { 0 };
+        m.srcMemoryType = srcMemoryType;
+        if (srcMemoryType == CU_MEMORYTYPE_HOST)
+        {
+            m.srcHost = pSrcPlane;
+        }
+        else
+        {
+            m.srcDevice = (CUdeviceptr)pSrcPlane;
+        }
+        m.srcPitch = i ? NvEncoder::GetChromaPitch(pixelFormat, srcPitch) : srcPitch;
+        m.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+        m.dstDevice = pDstFrame + (i ? dstChromaOffsets[i - 1] : 0);
+        m.dstPitch = i ? NvEncoder::GetChromaPitch(pixelFormat, dstPitch) : dstPitch;
+        m.WidthInBytes = i ? NvEncoder::GetChromaWidthInBytes(pixelFormat, width) : NvEncoder::GetWidthInBytes(pixelFormat, width);
+        m.Height = i ? chromaHeight : height;
+        CUDA_DRVAPI_CALL(cuMemcpy2DAsync(&m, cuStream));
+    }
+    if (completionEvent)
+    {
+        CUDA_DRVAPI_CALL(cuEventRecord(completionEvent, cuStream));
+    }
+}
+
+void NvEncoderCuda::CopyToNextInputFrameAsync(const void* pSrcFrame, uint32_t nSrcPitch, CUmemorytype srcMemoryType,
+    CUstream cuStream)
+{
+    if (!IsHWEncoderInitialized())
+    {
+        NVENC_THROW_ERROR("Encoder intialization failed", NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
+    }
+
+    const NvEncInputFrame *pInputFrame = GetNextInputFrame();
+    int i = (int)(pInputFrame - m_vInputFrames.data());
+    if (m_vUploadEvent.size() != m_vInputFrames.size())
+    {
+        NvCudaContextScope scope;
+        CUDA_DRVAPI_CALL(scope.Enter(m_cuContext));
+        m_vpStagingBuffer.resize(m_vInputFrames.size(), nullptr);
+        m_vStagingSize.resize(m_vInputFrames.size(), 0);
+        m_vUploadPending.resize(m_vInputFrames.size(), false);
+        while (m_vUploadEvent.size() < m_vInputFrames.size())
+        {
+            CUevent cuEvent = NULL;
+            CUDA_DRVAPI_CALL(cuEventCreate(&cuEvent, CU_EVENT_DISABLE_TIMING));
+            m_vUploadEvent.push_back(cuEvent);
+        }
+    }
+
+    int width = GetEncodeWidth(), height = GetEncodeHeight();
+    NV_ENC_BUFFER_FORMAT pixelFormat = GetPixelFormat();
+    uint32_t srcPitch = nSrcPitch ? nSrcPitch : GetWidthInBytes(pixelFormat, width);
+    const void *pUploadSrc = pSrcFrame;
+    if (srcMemoryType == CU_MEMORYTYPE_HOST)
+    {
+        uint32_t srcChromaOffsets[2];
+        uint32_t numChromaPlanes = GetChromaSubPlaneOffsets(pixelFormat, srcPitch, height, srcChromaOffsets);
+        size_t nFrameSize = numChromaPlanes
+            ? srcChromaOffsets[numChromaPlanes - 1] + (size_t)GetChromaPitch(pixelFormat, srcPitch) * GetChromaHeight(pixelFormat, height)
+            : (size_t)srcPitch * height;
+
+        // The staging buffer must not be overwritten while an earlier transfer still reads it
+        WaitForInputReady(i);
+        if (m_vStagingSize[i] < nFrameSize)
+        {
+            NvCudaContextScope scope;
+            CUDA_DRVAPI_CALL(scope.Enter(m_cuContext));
+            if (m_vpStagingBuffer[i])
+            {
+                CUDA_DRVAPI_CALL(cuMemFreeHost(m_vpStagingBuffer[i]));
+                m_vpStagingBuffer[i] = nullptr;
+                m_vStagingSize[i] = 0;
+            }
+            CUDA_DRVAPI_CALL(cuMemAllocHost(&m_vpStagingBuffer[i], nFrameSize));
+            m_vStagingSize[i] = nFrameSize;
+        }
+        memcpy(m_vpStagingBuffer[i], pSrcFrame, nFrameSize);
+        pUploadSrc = m_vpStagingBuffer[i];
+    }
+
+    CopyToDeviceFrameAsync(m_cuContext, pUploadSrc, srcPitch,
+        (CUdeviceptr)pInputFrame->inputPtr,
+        pInputFrame->pitch,
+        width,
+        height,
+        srcMemoryType,
+        pixelFormat,
+        pInputFrame->chromaOffsets,
+        pInputFrame->numChromaPlanes,
+        cuStream,
+        m_vUploadEvent[i]);
+    m_vUploadPending[i] = true;
+}
+
+void NvEncoderCuda::WaitForInputReady(int iInputBuffer)
+{
+    if (iInputBuffer >= (int)m_vUploadPending.size() || !m_vUploadPending[iInputBuffer])
+    {
+        return;
+    }
+    NvCudaContextScope scope;
+    CUDA_DRVAPI_CALL(scope.Enter(m_cuContext));
+    CUDA_DRVAPI_CALL(cuEventSynchronize(m_vUploadEvent[iInputBuffer]));
+    scope.Leave();
+    m_vUploadPending[iInputBuffer] = false;
 }
@@ -63,6 +63,38 @@ public:
         uint32_t dstChromaPitch,
         uint32_t numChromaPlanes,
         bool bUnAlignedDeviceCopy = false);
+
+    /**
+    *  @brief This is a static function to copy input data to device memory asynchronously.
+    *  All plane copies are queued on cuStream back to back without waiting for them, and
+    *  completionEvent (if not NULL) is recorded after the last one. The source must be device
+    *  memory or page-locked host memory; copies from pageable memory are not asynchronous.
+    *  This function assumes YUV plane is a single contiguous memory segment.
+    */
+    static void CopyToDeviceFrameAsync(CUcontext device,
+        const void* pSrcFrame,
+        uint32_t nSrcPitch,
+        CUdeviceptr pDstFrame,
+        uint32_t dstPitch,
+        int width,
+        int height,
+        CUmemorytype srcMemoryType,
+        NV_ENC_BUFFER_FORMAT pixelFormat,
+        const uint32_t dstChromaOffsets[],
+        uint32_t numChromaPlanes,
+        CUstream cuStream,
+        CUevent completionEvent = NULL);
+
+    /**
+    *  @brief This function is used to upload a frame into the next input buffer asynchronously.
+    *  Host frames are first copied into a page-locked staging buffer owned by the encoder (one per
+    *  input buffer) and then transferred on cuStream, so the call returns without waiting for the
+    *  transfer, which overlaps with the encoding of earlier frames. EncodeFrame() waits for the
+    *  transfer of the frame it submits. The frame is expected at the current encode resolution.
+    */
+    void CopyToNextInputFrameAsync(const void* pSrcFrame, uint32_t nSrcPitch, CUmemorytype srcMemoryType,
+        CUstream cuStream);
+
 private:
     /**
     *  @brief This function is used to allocate input buffers for encoding.
@@ -75,6 +107,12 @@ private:
     *  This function is an override of virtual function NvEncoder::ReleaseInputBuffers().
     */
     virtual void ReleaseInputBuffers() override;
+
+    /**
+    *  @brief This function is used to wait for a pending asynchronous upload into an input buffer.
+    *  This function is an override of virtual function NvEncoder::WaitForInputReady().
+    */
+    virtual void WaitForInputReady(int iInputBuffer) override;
 private:
     /**
     *  @brief This is a private function to release CUDA device memory used for encoding.
@@ -83,4 +121,9 @@ private:
 private:
     size_t m_cudaPitch = 0;
     CUcontext m_cuContext;
+    /** Page-locked staging buffers and upload completion events, one per input buffer */
+    std::vector<void *> m_vpStagingBuffer;
+    std::vector<size_t> m_vStagingSize;
+    std::vector<CUevent> m_vUploadEvent;
+    std::vector<bool> m_vUploadPending;
 };
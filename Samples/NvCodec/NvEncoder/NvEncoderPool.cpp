@@ -0,0 +1,234 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <algorithm>
+#include "NvEncoder/NvEncoderPool.h"
+
+NvEncoderPool::NvEncoderPool(CUcontext cuContext, int nMaxIdle, int nMaxIdlePerKey) :
+    m_cuContext(cuContext),
+    m_nMaxIdle(nMaxIdle),
+    m_nMaxIdlePerKey(nMaxIdlePerKey),
+    m_nCreated(0),
+    m_nReused(0)
+{
+    if (!m_cuContext)
+    {
+        NVENC_THROW_ERROR("Invalid Cuda Context", NV_ENC_ERR_INVALID_DEVICE);
+    }
+}
+
+NvEncoderPool::~NvEncoderPool()
+{
+    Trim(0);
+}
+
+bool NvEncoderPool::Key::operator==(const Key &other) const
+{
+    return !memcmp(&encodeGUID, &other.encodeGUID, sizeof(GUID))
+        && eBufferFormat == other.eBufferFormat
+        && nMaxWidth == other.nMaxWidth
+        && nMaxHeight == other.nMaxHeight
+        && nFrameIntervalP == other.nFrameIntervalP
+        && nLookaheadDepth == other.nLookaheadDepth
+        && nExtraOutputDelay == other.nExtraOutputDelay;
+}
+
+NvEncoderPool::Key NvEncoderPool::MakeKey(const NV_ENC_INITIALIZE_PARAMS *pEncodeParams, NV_ENC_BUFFER_FORMAT eBufferFormat,
+    uint32_t nExtraOutputDelay)
+{
+    Key key;
+    key.encodeGUID = pEncodeParams->encodeGUID;
+    key.eBufferFormat = eBufferFormat;
+    key.nMaxWidth = (std::max)(pEncodeParams->maxEncodeWidth, pEncodeParams->encodeWidth);
+    key.nMaxHeight = (std::max)(pEncodeParams->maxEncodeHeight, pEncodeParams->encodeHeight);
+    key.nFrameIntervalP = pEncodeParams->encodeConfig->frameIntervalP;
+    key.nLookaheadDepth = pEncodeParams->encodeConfig->rcParams.lookaheadDepth;
+    key.nExtraOutputDelay = nExtraOutputDelay;
+    return key;
+}
+
+NvEncoderPool::NvEncoderPtr NvEncoderPool::Acquire(const NV_ENC_INITIALIZE_PARAMS *pEncodeParams, NV_ENC_BUFFER_FORMAT eBufferFormat,
+    uint32_t nExtraOutputDelay, Spare *pSpare)
+{
+    if (!pEncodeParams || !pEncodeParams->encodeConfig)
+    {
+        NVENC_THROW_ERROR("Both pEncodeParams and pEncodeParams->encodeConfig can't be NULL", NV_ENC_ERR_INVALID_PTR);
+    }
+
+    Key key = MakeKey(pEncodeParams, eBufferFormat, nExtraOutputDelay);
+    NV_ENC_INITIALIZE_PARAMS initializeParams = *pEncodeParams;
+    initializeParams.maxEncodeWidth = key.nMaxWidth;
+    initializeParams.maxEncodeHeight = key.nMaxHeight;
+
+    NvEncoderCuda *pEnc = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = std::find_if(m_lEntry.begin(), m_lEntry.end(), [&key](const Entry &e) { return e.key == key; });
+        if (it != m_lEntry.end())
+        {
+            pEnc = it->pEnc;
+            m_lEntry.erase(it);
+        }
+    }
+
+    if (pEnc)
+    {
+        if (pSpare)
+        {
+            pSpare->pEnc.reset();
+        }
+        NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+        reconfigureParams.reInitEncodeParams = initializeParams;
+        reconfigureParams.resetEncoder = 1;
+        reconfigureParams.forceIDR = 1;
+        try
+        {
+            pEnc->Reconfigure(&reconfigureParams);
+            m_nReused++;
+            return MakeLease(key, pEnc);
+        }
+        catch (const NVENCException &)
+        {
+            // The new parameters need a different session layout; fall back to a fresh one
+            DestroySession(pEnc);
+        }
+    }
+
+    std::unique_ptr<NvEncoderCuda> pNewEnc;
+    if (pSpare && pSpare->pEnc)
+    {
+        if (pSpare->nWidth == key.nMaxWidth && pSpare->nHeight == key.nMaxHeight
+            && pSpare->eBufferFormat == eBufferFormat && pSpare->nExtraOutputDelay == nExtraOutputDelay)
+        {
+            pNewEnc = std::move(pSpare->pEnc);
+        }
+        else
+        {
+            // Closed before the new session is opened, so the caller never holds two
+            pSpare->pEnc.reset();
+        }
+    }
+    if (!pNewEnc)
+    {
+        pNewEnc.reset(new NvEncoderCuda(m_cuContext, key.nMaxWidth, key.nMaxHeight, eBufferFormat, nExtraOutputDelay));
+    }
+    pNewEnc->CreateEncoder(&initializeParams);
+    m_nCreated++;
+    return MakeLease(key, pNewEnc.release());
+}
+
+void NvEncoderPool::CreateDefaultEncoderParams(NV_ENC_INITIALIZE_PARAMS *pEncodeParams, GUID codecGuid, GUID presetGuid,
+    uint32_t nWidth, uint32_t nHeight, NV_ENC_BUFFER_FORMAT eBufferFormat, Spare &spare, uint32_t nExtraOutputDelay)
+{
+    spare.pEnc.reset();
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = std::find_if(m_lEntry.begin(), m_lEntry.end(),
+            [eBufferFormat](const Entry &e) { return e.key.eBufferFormat == eBufferFormat; });
+        if (it != m_lEntry.end())
+        {
+            // The defaults depend on the session only through its dimensions, which are replaced
+            it->pEnc->CreateDefaultEncoderParams(pEncodeParams, codecGuid, presetGuid);
+            pEncodeParams->encodeWidth = pEncodeParams->darWidth = pEncodeParams->maxEncodeWidth = nWidth;
+            pEncodeParams->encodeHeight = pEncodeParams->darHeight = pEncodeParams->maxEncodeHeight = nHeight;
+            return;
+        }
+    }
+
+    spare.pEnc.reset(new NvEncoderCuda(m_cuContext, nWidth, nHeight, eBufferFormat, nExtraOutputDelay));
+    spare.nWidth = nWidth;
+    spare.nHeight = nHeight;
+    spare.eBufferFormat = eBufferFormat;
+    spare.nExtraOutputDelay = nExtraOutputDelay;
+    spare.pEnc->CreateDefaultEncoderParams(pEncodeParams, codecGuid, presetGuid);
+}
+
+void NvEncoderPool::Discard(NvEncoderPtr &pEnc)
+{
+    NvEncoderCuda *p = pEnc.release();
+    if (p)
+    {
+        DestroySession(p);
+    }
+}
+
+NvEncoderPool::NvEncoderPtr NvEncoderPool::MakeLease(const Key &key, NvEncoderCuda *pEnc)
+{
+    return NvEncoderPtr(pEnc, [this, key](NvEncoderCuda *pEnc) { Release(key, pEnc); });
+}
+
+void NvEncoderPool::Release(const Key &key, NvEncoderCuda *pEnc)
+{
+    if (!pEnc)
+    {
+        return;
+    }
+
+    std::vector<NvEncoderCuda *> vEvicted;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_lEntry.push_front(Entry{key, pEnc});
+
+        // Evict least recently used sessions of this configuration first, then overall
+        int nSameKey = 0;
+        for (auto it = m_lEntry.begin(); it != m_lEntry.end();)
+        {
+            if (it->key == key && ++nSameKey > m_nMaxIdlePerKey)
+            {
+                vEvicted.push_back(it->pEnc);
+                it = m_lEntry.erase(it);
+                continue;
+            }
+            ++it;
+        }
+        while ((int)m_lEntry.size() > m_nMaxIdle)
+        {
+            vEvicted.push_back(m_lEntry.back().pEnc);
+            m_lEntry.pop_back();
+        }
+    }
+
+    // Destroying a session may take a while, so do it outside the lock
+    for (NvEncoderCuda *pEvicted : vEvicted)
+    {
+        DestroySession(pEvicted);
+    }
+}
+
+void NvEncoderPool::Trim(int nMaxIdle)
+{
+    std::vector<NvEncoderCuda *> vEvicted;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        while ((int)m_lEntry.size() > (std::max)(nMaxIdle, 0))
+        {
+            vEvicted.push_back(m_lEntry.back().pEnc);
+            m_lEntry.pop_back();
+        }
+    }
+
+    for (NvEncoderCuda *pEvicted : vEvicted)
+    {
+        DestroySession(pEvicted);
+    }
+}
+
+int NvEncoderPool::GetIdleCount()
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return (int)m_lEntry.size();
+}
+
+void NvEncoderPool::DestroySession(NvEncoderCuda *pEnc)
+{
+    pEnc->DestroyEncoder();
+    delete pEnc;
+}
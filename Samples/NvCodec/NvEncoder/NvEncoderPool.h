@@ -0,0 +1,145 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include <cuda.h>
+#include "NvEncoderCuda.h"
+
+/**
+*  @brief Pool of initialized CUDA encoder sessions.
+*  Opening a session, allocating and registering its input buffers and creating its
+*  bitstream buffers and completion events is expensive compared with encoding a short
+*  clip. The pool keeps finished sessions alive and hands them out again after resetting
+*  them with Reconfigure() and a forced IDR, so consecutive clips only pay that cost once.
+*
+*  Sessions are interchangeable when they agree on codec, input buffer format, maximum
+*  dimensions and the parameters that size the internal buffer ring (B-frame interval and
+*  lookahead depth); those cannot be changed by Reconfigure(). Everything else (resolution
+*  up to the maximum, rate control, GOP length, etc.) is taken from the parameters passed
+*  to Acquire(). If the driver rejects the reconfiguration, a new session is created instead.
+*  The parameters can be started with CreateDefaultEncoderParams() of the pool, which needs no
+*  session of the caller.
+*/
+class NvEncoderPool
+{
+public:
+    using NvEncoderPtr = std::unique_ptr<NvEncoderCuda, std::function<void(NvEncoderCuda*)>>;
+
+    /**
+    *  @brief A session opened by CreateDefaultEncoderParams() and not initialized yet.
+    *  It belongs to the caller, who hands it on to Acquire(); the session is closed if the
+    *  Spare is destroyed instead.
+    */
+    class Spare
+    {
+    private:
+        friend class NvEncoderPool;
+        std::unique_ptr<NvEncoderCuda> pEnc;
+        uint32_t nWidth = 0, nHeight = 0;
+        NV_ENC_BUFFER_FORMAT eBufferFormat = NV_ENC_BUFFER_FORMAT_UNDEFINED;
+        uint32_t nExtraOutputDelay = 0;
+    };
+
+    /**
+    *  @brief NvEncoderPool constructor.
+    *  nMaxIdle limits the number of idle sessions kept in total, nMaxIdlePerKey the number
+    *  of idle sessions kept for one configuration. The least recently used idle session is
+    *  destroyed when a limit would be exceeded. Note that GeForce GPUs only allow a small
+    *  number of concurrent sessions, idle ones included.
+    */
+    NvEncoderPool(CUcontext cuContext, int nMaxIdle = 4, int nMaxIdlePerKey = 2);
+
+    /**
+    *  @brief NvEncoderPool destructor.
+    *  All sessions handed out by Acquire() must have been released before.
+    */
+    ~NvEncoderPool();
+
+    /**
+    *  @brief This function returns an initialized encoder session for the given parameters.
+    *  The session is returned to the pool when the returned pointer is destroyed; the
+    *  application must call EndEncode() before that. The first frame encoded after
+    *  Acquire() is always an IDR. pEncodeParams->encodeConfig must not be NULL.
+    *  A session in pSpare is initialized if no idle one fits, and closed otherwise.
+    */
+    NvEncoderPtr Acquire(const NV_ENC_INITIALIZE_PARAMS *pEncodeParams, NV_ENC_BUFFER_FORMAT eBufferFormat,
+        uint32_t nExtraOutputDelay = 3, Spare *pSpare = nullptr);
+
+    /**
+    *  @brief This function fills pEncodeParams as NvEncoder::CreateDefaultEncoderParams() does for
+    *  a session of nWidth x nHeight in eBufferFormat, for the caller to adjust before Acquire().
+    *  An idle session of that format answers the preset query. If there is none, a new session is
+    *  opened for it and left in spare, for the caller to pass to Acquire() with the same output delay,
+    *  so that the caller never holds more than one session.
+    */
+    void CreateDefaultEncoderParams(NV_ENC_INITIALIZE_PARAMS *pEncodeParams, GUID codecGuid, GUID presetGuid,
+        uint32_t nWidth, uint32_t nHeight, NV_ENC_BUFFER_FORMAT eBufferFormat, Spare &spare, uint32_t nExtraOutputDelay = 3);
+
+    /**
+    *  @brief This function destroys a session handed out by Acquire() instead of returning it to
+    *  the pool, for sessions left without EndEncode(), after an error say.
+    */
+    static void Discard(NvEncoderPtr &pEnc);
+
+    /**
+    *  @brief This function destroys idle sessions until at most nMaxIdle remain.
+    */
+    void Trim(int nMaxIdle = 0);
+
+    int GetIdleCount();
+    int GetCreatedCount() const { return m_nCreated; }
+    int GetReusedCount() const { return m_nReused; }
+
+private:
+    struct Key
+    {
+        GUID encodeGUID;
+        NV_ENC_BUFFER_FORMAT eBufferFormat;
+        uint32_t nMaxWidth, nMaxHeight;
+        int32_t nFrameIntervalP;
+        uint16_t nLookaheadDepth;
+        uint32_t nExtraOutputDelay;
+
+        bool operator==(const Key &other) const;
+    };
+
+    struct Entry
+    {
+        Key key;
+        NvEncoderCuda *pEnc;
+    };
+
+    static Key MakeKey(const NV_ENC_INITIALIZE_PARAMS *pEncodeParams, NV_ENC_BUFFER_FORMAT eBufferFormat,
+        uint32_t nExtraOutputDelay);
+
+    /**
+    *  @brief Puts a released session back on the idle list, evicting sessions over the limits.
+    */
+    void Release(const Key &key, NvEncoderCuda *pEnc);
+    static void DestroySession(NvEncoderCuda *pEnc);
+
+    NvEncoderPtr MakeLease(const Key &key, NvEncoderCuda *pEnc);
+
+private:
+    CUcontext m_cuContext;
+    int m_nMaxIdle, m_nMaxIdlePerKey;
+    /** Idle sessions, most recently used first */
+    std::list<Entry> m_lEntry;
+    std::mutex m_mtx;
+    std::atomic<int> m_nCreated, m_nReused;
+};
@@ -0,0 +1,520 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <stdio.h>
+#include "NvDecoder/NvDecoder.h"
+#include "NvEncoder/NvEncoderCuda.h"
+#include "NvTranscoder/NvAbrTranscoder.h"
+#include "../Utils/NvCodecUtils.h"
+#include "../Utils/NvEncoderCLIOptions.h"
+#include "../Utils/NvPipeline.h"
+#include "../Utils/FFmpegDemuxer.h"
+
+static double SecondsSince(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+bool ParseAbrLadder(const std::string &strSpec, const std::string &strEncoderOptions, std::vector<NvAbrRung> &vRung)
+{
+    std::vector<NvAbrRung> v;
+    std::istringstream ssSpec(strSpec);
+    std::string strItem;
+    while (std::getline(ssSpec, strItem, ','))
+    {
+        std::istringstream ssItem(strItem);
+        std::string strField;
+        NvAbrRung rung;
+        rung.strEncoderOptions = strEncoderOptions;
+        if (!std::getline(ssItem, strField, ':') || sscanf(strField.c_str(), "%dx%d", &rung.nWidth, &rung.nHeight) != 2
+            || rung.nWidth <= 0 || rung.nHeight <= 0)
+        {
+            return false;
+        }
+        while (std::getline(ssItem, strField, ':'))
+        {
+            std::transform(strField.begin(), strField.end(), strField.begin(), tolower);
+            if (strField == "h264" || strField == "hevc")
+            {
+                rung.strCodec = strField;
+                continue;
+            }
+            double r = 0;
+            char szSuffix[2] = "";
+            int n = sscanf(strField.c_str(), "%lf%1s", &r, szSuffix);
+            if (n < 1 || r <= 0)
+            {
+                return false;
+            }
+            if (n == 2)
+            {
+                if (szSuffix[0] == 'k')
+                {
+                    r *= 1000;
+                }
+                else if (szSuffix[0] == 'm')
+                {
+                    r *= 1000000;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            rung.nBitrate = (uint32_t)r;
+        }
+        v.push_back(rung);
+    }
+    if (v.empty())
+    {
+        return false;
+    }
+    vRung = v;
+    return true;
+}
+
+void NvAbrFileSink::OnStart(int iRung, const NvAbrRung &rung)
+{
+    std::string strCodec = rung.strCodec;
+    if (strCodec.empty())
+    {
+        strCodec = NvEncoderInitParam(rung.strEncoderOptions.c_str()).IsCodecHEVC() ? "hevc" : "h264";
+    }
+    std::ostringstream oss;
+    oss << m_strPrefix << "_" << rung.nWidth << "x" << rung.nHeight << "_" << iRung << "." << strCodec;
+    std::unique_ptr<std::ofstream> pOut(new std::ofstream(oss.str(), std::ios::out | std::ios::binary));
+    if (!*pOut)
+    {
+        throw std::invalid_argument("Unable to open output file: " + oss.str());
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if ((int)m_vpOut.size() <= iRung)
+    {
+        m_vpOut.resize(iRung + 1);
+    }
+    m_vpOut[iRung] = std::move(pOut);
+}
+
+void NvAbrFileSink::OnPacket(int iRung, const uint8_t *pData, int nSize, const NvEncPacketInfo &info)
+{
+    std::ofstream *pOut;
+    {
+        // The vector is only resized by OnStart(), which is done before the first packet
+        std::lock_guard<std::mutex> lock(m_mtx);
+        pOut = m_vpOut[iRung].get();
+    }
+    pOut->write(reinterpret_cast<const char*>(pData), nSize);
+}
+
+void NvAbrFileSink::OnEnd(int iRung)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_vpOut[iRung].reset();
+}
+
+/**
+*  @brief A frame in device memory: a decoded frame locked in the decoder, or a pooled frame of a
+*  rung. The deleter of the shared pointer gives it back; pParent keeps the frame it was resized
+*  from alive, so the credit of the decoded frame only returns once the whole cascade is done.
+*/
+struct NvAbrTranscoder::Frame
+{
+    Frame(uint8_t *dpFrame, int nPitch, int nWidth, int nHeight, FramePtr pParent) :
+        dpFrame(dpFrame), nPitch(nPitch), nWidth(nWidth), nHeight(nHeight), pParent(pParent) {}
+
+    uint8_t *dpFrame;
+    int nPitch, nWidth, nHeight;
+    FramePtr pParent;
+};
+
+struct NvAbrTranscoder::Rung
+{
+    using NvEncoderPtr = std::unique_ptr<NvEncoderCuda, std::function<void(NvEncoderCuda*)>>;
+
+    Rung(CUcontext cuContext) : cuContext(cuContext) {}
+    ~Rung()
+    {
+        if (vdpAll.empty())
+        {
+            return;
+        }
+        cuCtxPushCurrent(cuContext);
+        for (CUdeviceptr dpFrame : vdpAll)
+        {
+            cuMemFree(dpFrame);
+        }
+        cuCtxPopCurrent(NULL);
+    }
+
+    CUcontext cuContext;
+    NvEncoderPtr pEnc;
+    std::vector<int> vChild;
+    NvPipeline::Stage *pStage = NULL;
+
+    std::mutex mtxPool;
+    std::vector<CUdeviceptr> vdpFree, vdpAll;
+    size_t nPoolPitch = 0;
+};
+
+NvAbrTranscoder::NvAbrTranscoder(CUcontext cuContext, const std::vector<NvAbrRung> &vRung, int nWorker, int nFrameInFlight) :
+    m_cuContext(cuContext),
+    m_vRung(vRung),
+    m_nWorker(nWorker),
+    m_nFrameInFlight((std::max)(nFrameInFlight, 1))
+{
+    if (!m_cuContext)
+    {
+        NVENC_THROW_ERROR("Invalid Cuda Context", NV_ENC_ERR_INVALID_DEVICE);
+    }
+    if (m_vRung.empty())
+    {
+        NVENC_THROW_ERROR("The ladder has no rung", NV_ENC_ERR_INVALID_PARAM);
+    }
+    m_vParent.assign(m_vRung.size(), -1);
+    m_vMetrics.resize(m_vRung.size());
+}
+
+NvAbrTranscoder::~NvAbrTranscoder()
+{
+}
+
+std::vector<int> NvAbrTranscoder::BuildCascade(const std::vector<NvAbrRung> &vRung, int nSrcWidth, int nSrcHeight)
+{
+    int n = (int)vRung.size();
+    std::vector<int> vParent(n, -1);
+    for (int i = 0; i < n; i++)
+    {
+        int64_t nBestArea = INT64_MAX;
+        for (int j = 0; j < n; j++)
+        {
+            const NvAbrRung &src = vRung[j], &dst = vRung[i];
+            if (j == i || src.nWidth > nSrcWidth || src.nHeight > nSrcHeight
+                || src.nWidth < dst.nWidth || src.nHeight < dst.nHeight)
+            {
+                continue;
+            }
+            // Equal rungs point to the first of them, which keeps the graph free of cycles
+            if (src.nWidth == dst.nWidth && src.nHeight == dst.nHeight && j > i)
+            {
+                continue;
+            }
+            int64_t nArea = (int64_t)src.nWidth * src.nHeight;
+            if (nArea < nBestArea)
+            {
+                nBestArea = nArea;
+                vParent[i] = j;
+            }
+        }
+    }
+    return vParent;
+}
+
+int NvAbrTranscoder::Transcode(FFmpegDemuxer *pDemuxer, NvAbrSink *pSink)
+{
+    m_bOut10 = pDemuxer->GetBitDepth() > 8;
+    m_vParent = BuildCascade(m_vRung, pDemuxer->GetWidth(), pDemuxer->GetHeight());
+    m_vMetrics.assign(m_vRung.size(), NvAbrRungMetrics());
+    int nFrame = 0;
+    try
+    {
+        CreateEncoders(m_bOut10 ? NV_ENC_BUFFER_FORMAT_YUV420_10BIT : NV_ENC_BUFFER_FORMAT_NV12);
+        nFrame = RunPipeline(pDemuxer, pSink);
+    }
+    catch (...)
+    {
+        m_vpRung.clear();
+        throw;
+    }
+    m_vpRung.clear();
+    return nFrame;
+}
+
+void NvAbrTranscoder::CreateEncoders(NV_ENC_BUFFER_FORMAT eFormat)
+{
+    m_vpRung.clear();
+    for (int i = 0; i < (int)m_vRung.size(); i++)
+    {
+        m_vpRung.emplace_back(new Rung(m_cuContext));
+    }
+    for (int i = 0; i < (int)m_vRung.size(); i++)
+    {
+        const NvAbrRung &rung = m_vRung[i];
+        if (m_vParent[i] >= 0)
+        {
+            m_vpRung[m_vParent[i]]->vChild.push_back(i);
+        }
+
+        std::string strParam = rung.strEncoderOptions;
+        if (!rung.strCodec.empty())
+        {
+            strParam += " -codec " + rung.strCodec;
+        }
+        NvEncoderInitParam initParam(strParam.c_str());
+
+        m_vpRung[i]->pEnc = Rung::NvEncoderPtr(new NvEncoderCuda(m_cuContext, rung.nWidth, rung.nHeight, eFormat),
+            [](NvEncoderCuda *pEnc)
+        {
+            pEnc->DestroyEncoder();
+            delete pEnc;
+        });
+        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        initializeParams.encodeConfig = &encodeConfig;
+        m_vpRung[i]->pEnc->CreateDefaultEncoderParams(&initializeParams, initParam.GetEncodeGUID(), initParam.GetPresetGUID());
+        initParam.SetInitParams(&initializeParams, eFormat);
+        if (rung.nBitrate)
+        {
+            NV_ENC_RC_PARAMS &rc = encodeConfig.rcParams;
+            if (rc.rateControlMode == NV_ENC_PARAMS_RC_CONSTQP)
+            {
+                rc.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+            }
+            rc.averageBitRate = rung.nBitrate;
+            if (rc.maxBitRate)
+            {
+                rc.maxBitRate = (std::max)(rc.maxBitRate, rung.nBitrate);
+            }
+        }
+        m_vpRung[i]->pEnc->CreateEncoder(&initializeParams);
+        m_vMetrics[i].fps = initializeParams.frameRateDen ? (double)initializeParams.frameRateNum / initializeParams.frameRateDen : 0;
+    }
+}
+
+int NvAbrTranscoder::RunPipeline(FFmpegDemuxer *pDemuxer, NvAbrSink *pSink)
+{
+    int nSrcWidth = pDemuxer->GetWidth(), nSrcHeight = pDemuxer->GetHeight();
+    NvDecoder dec(m_cuContext, nSrcWidth, nSrcHeight, true, FFmpeg2NvCodecId(pDemuxer->GetVideoCodec()), NULL, false, true);
+    NvDecoder *pDec = &dec;
+
+    for (int i = 0; i < (int)m_vRung.size(); i++)
+    {
+        pSink->OnStart(i, m_vRung[i]);
+    }
+    m_tStart = std::chrono::steady_clock::now();
+
+    // Declared after the decoder, so that its stages are joined before the decoder goes away
+    NvPipeline pipeline(m_nWorker);
+    std::shared_ptr<NvChannel<int>> pCredit = pipeline.CreateChannel<int>(m_nFrameInFlight);
+    for (int i = 0; i < m_nFrameInFlight; i++)
+    {
+        pCredit->Push(i);
+    }
+    std::vector<int> viRoot;
+    for (int i = 0; i < (int)m_vRung.size(); i++)
+    {
+        std::ostringstream oss;
+        oss << "Encode " << m_vRung[i].nWidth << "x" << m_vRung[i].nHeight << " #" << i;
+        m_vpRung[i]->pStage = &pipeline.AddTaskStage(oss.str());
+        if (m_vParent[i] < 0)
+        {
+            viRoot.push_back(i);
+        }
+    }
+
+    NvPipeline::Stage &decodeStage = pipeline.AddStage("Demux and decode", [&](NvPipeline::Stage &stage)
+    {
+        int nVideoBytes = 0, nFrameReturned = 0;
+        uint8_t *pVideo = NULL, **ppFrame = NULL;
+        do
+        {
+            pDemuxer->Demux(&pVideo, &nVideoBytes);
+            pDec->DecodeLockFrame(pVideo, nVideoBytes, &ppFrame, &nFrameReturned);
+            for (int i = 0; i < nFrameReturned; i++)
+            {
+                int iCredit;
+                if (!stage.Pop(*pCredit, iCredit))
+                {
+                    // An encoder failed and the pipeline was cancelled
+                    pDec->UnlockFrame(&ppFrame[i], nFrameReturned - i);
+                    return;
+                }
+                // The last rung done with the frame unlocks (recycles) it and returns the credit
+                FramePtr pFrame(new Frame(ppFrame[i], pDec->GetDeviceFramePitch(), nSrcWidth, nSrcHeight, nullptr),
+                    [pDec, pCredit, iCredit](Frame *p)
+                {
+                    pDec->UnlockFrame(&p->dpFrame, 1);
+                    int iReturned = iCredit;
+                    pCredit->TryPush(iReturned);
+                    delete p;
+                });
+                for (int iRung : viRoot)
+                {
+                    m_vpRung[iRung]->pStage->Post([this, iRung, pFrame, pSink]() { EncodeRung(iRung, pFrame, pSink); });
+                }
+                stage.AddItem();
+            }
+        } while (nVideoBytes);
+
+        // A rung ends its children once it has posted them all its frames
+        for (int iRung : viRoot)
+        {
+            m_vpRung[iRung]->pStage->Post([this, iRung, pSink]() { EndRung(iRung, pSink); });
+        }
+    });
+
+    pipeline.Wait();
+    m_nDecodedFrame = decodeStage.GetItemCount();
+    m_secTotal = SecondsSince(m_tStart);
+    return (int)m_nDecodedFrame;
+}
+
+NvAbrTranscoder::FramePtr NvAbrTranscoder::GetPooledFrame(int iRung, FramePtr pParent)
+{
+    Rung *pRung = m_vpRung[iRung].get();
+    const NvAbrRung &rung = m_vRung[iRung];
+    CUdeviceptr dpFrame = 0;
+    {
+        std::lock_guard<std::mutex> lock(pRung->mtxPool);
+        if (!pRung->vdpFree.empty())
+        {
+            dpFrame = pRung->vdpFree.back();
+            pRung->vdpFree.pop_back();
+        }
+    }
+    if (!dpFrame)
+    {
+        // Called with the context current; the pool grows to at most the number of frames in flight
+        size_t nPitch = 0;
+        ck(cuMemAllocPitch(&dpFrame, &nPitch, rung.nWidth * (m_bOut10 ? 2 : 1), rung.nHeight + (rung.nHeight + 1) / 2, 16));
+        std::lock_guard<std::mutex> lock(pRung->mtxPool);
+        pRung->vdpAll.push_back(dpFrame);
+        pRung->nPoolPitch = nPitch;
+    }
+    return FramePtr(new Frame((uint8_t *)dpFrame, (int)pRung->nPoolPitch, rung.nWidth, rung.nHeight, pParent), [pRung](Frame *p)
+    {
+        std::lock_guard<std::mutex> lock(pRung->mtxPool);
+        pRung->vdpFree.push_back((CUdeviceptr)p->dpFrame);
+        delete p;
+    });
+}
+
+/**
+*  @brief Scales src into the NV12 or P016 frame at dpDst, or copies it when the sizes match.
+*/
+static void ScaleFrame(uint8_t *dpDst, int nDstPitch, int nDstWidth, int nDstHeight, uint8_t *dpSrc, int nSrcPitch,
+    int nSrcWidth, int nSrcHeight, bool bOut10)
+{
+    if (nDstWidth == nSrcWidth && nDstHeight == nSrcHeight)
+    {
+        CUDA_MEMCPY2D m = { 0 };
+        m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+        m.srcDevice = (CUdeviceptr)dpSrc;
+        m.srcPitch = nSrcPitch;
+        m.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+        m.dstDevice = (CUdeviceptr)dpDst;
+        m.dstPitch = nDstPitch;
+        m.WidthInBytes = nDstWidth * (bOut10 ? 2 : 1);
+        m.Height = nDstHeight + (nDstHeight + 1) / 2;
+        ck(cuMemcpy2D(&m));
+    }
+    else if (bOut10)
+    {
+        ResizeP016(dpDst, nDstPitch, nDstWidth, nDstHeight, dpSrc, nSrcPitch, nSrcWidth, nSrcHeight);
+    }
+    else
+    {
+        ResizeNv12(dpDst, nDstPitch, nDstWidth, nDstHeight, dpSrc, nSrcPitch, nSrcWidth, nSrcHeight);
+    }
+}
+
+void NvAbrTranscoder::EncodeRung(int iRung, FramePtr pSrc, NvAbrSink *pSink)
+{
+    Rung *pRung = m_vpRung[iRung].get();
+    NvAbrRungMetrics &m = m_vMetrics[iRung];
+    NvEncoderCuda *pEnc = pRung->pEnc.get();
+    int nWidth = m_vRung[iRung].nWidth, nHeight = m_vRung[iRung].nHeight;
+
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    ck(cuCtxPushCurrent(m_cuContext));
+    const NvEncInputFrame* encoderInputFrame = pEnc->GetNextInputFrame();
+    uint8_t *dpInput = (uint8_t *)encoderInputFrame->inputPtr;
+    int nInputPitch = (int)encoderInputFrame->pitch;
+    if (pRung->vChild.empty())
+    {
+        ScaleFrame(dpInput, nInputPitch, nWidth, nHeight, pSrc->dpFrame, pSrc->nPitch, pSrc->nWidth, pSrc->nHeight, m_bOut10);
+    }
+    else
+    {
+        // The encoder's input buffer is recycled, so the children read a pooled copy of this rung
+        FramePtr pFrame = GetPooledFrame(iRung, pSrc);
+        ScaleFrame(pFrame->dpFrame, pFrame->nPitch, nWidth, nHeight, pSrc->dpFrame, pSrc->nPitch, pSrc->nWidth, pSrc->nHeight, m_bOut10);
+        for (int iChild : pRung->vChild)
+        {
+            m_vpRung[iChild]->pStage->Post([this, iChild, pFrame, pSink]() { EncodeRung(iChild, pFrame, pSink); });
+        }
+        ScaleFrame(dpInput, nInputPitch, nWidth, nHeight, pFrame->dpFrame, pFrame->nPitch, nWidth, nHeight, m_bOut10);
+    }
+    ck(cuCtxPopCurrent(NULL));
+
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    std::vector<std::vector<uint8_t>> vPacket;
+    pEnc->EncodeFrame(vPacket);
+    m.secResize += std::chrono::duration<double>(t1 - t0).count();
+    m.secEncode += SecondsSince(t1);
+    m.nFrame++;
+    SendPackets(iRung, vPacket, pSink);
+    pRung->pStage->AddItem();
+}
+
+void NvAbrTranscoder::EndRung(int iRung, NvAbrSink *pSink)
+{
+    Rung *pRung = m_vpRung[iRung].get();
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    std::vector<std::vector<uint8_t>> vPacket;
+    pRung->pEnc->EndEncode(vPacket);
+    m_vMetrics[iRung].secEncode += SecondsSince(t0);
+    SendPackets(iRung, vPacket, pSink);
+    pSink->OnEnd(iRung);
+    for (int iChild : pRung->vChild)
+    {
+        m_vpRung[iChild]->pStage->Post([this, iChild, pSink]() { EndRung(iChild, pSink); });
+    }
+}
+
+void NvAbrTranscoder::SendPackets(int iRung, std::vector<std::vector<uint8_t>> &vPacket, NvAbrSink *pSink)
+{
+    NvAbrRungMetrics &m = m_vMetrics[iRung];
+    const std::vector<NvEncPacketInfo> &vInfo = m_vpRung[iRung]->pEnc->GetPacketInfo();
+    for (int i = 0; i < (int)vPacket.size(); i++)
+    {
+        pSink->OnPacket(iRung, vPacket[i].data(), (int)vPacket[i].size(), vInfo[i]);
+        m.nPacket++;
+        m.nByte += vPacket[i].size();
+    }
+    m.secWall = SecondsSince(m_tStart);
+}
+
+void NvAbrTranscoder::PrintMetrics(std::ostream &os) const
+{
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize nPrecision = os.precision();
+    os << std::left << std::setw(6) << "Rung" << std::setw(12) << "Size" << std::setw(10) << "Source"
+        << std::right << std::setw(10) << "Frames" << std::setw(10) << "FPS" << std::setw(14) << "Resize(ms/f)"
+        << std::setw(14) << "Encode(ms/f)" << std::setw(14) << "Target(kbps)" << std::setw(14) << "Actual(kbps)" << std::endl;
+    for (int i = 0; i < (int)m_vRung.size(); i++)
+    {
+        const NvAbrRung &rung = m_vRung[i];
+        const NvAbrRungMetrics &m = m_vMetrics[i];
+        std::string strSize = std::to_string(rung.nWidth) + "x" + std::to_string(rung.nHeight);
+        std::string strSource = m_vParent[i] < 0 ? "decoder" : "rung " + std::to_string(m_vParent[i]);
+        double nFrame = m.nFrame ? (double)m.nFrame : 1;
+        os << std::left << std::setw(6) << i << std::setw(12) << strSize << std::setw(10) << strSource
+            << std::right << std::setw(10) << m.nFrame << std::fixed << std::setprecision(1) << std::setw(10) << m.GetFramesPerSecond()
+            << std::setprecision(3) << std::setw(14) << m.secResize * 1000 / nFrame << std::setw(14) << m.secEncode * 1000 / nFrame
+            << std::setprecision(0) << std::setw(14) << rung.nBitrate / 1000.0 << std::setw(14) << m.GetBitrate() / 1000 << std::endl;
+    }
+    os << "Decoded " << m_nDecodedFrame << " frames in " << std::fixed << std::setprecision(3) << m_secTotal << " s" << std::endl;
+    os.flags(flags);
+    os.precision(nPrecision);
+}
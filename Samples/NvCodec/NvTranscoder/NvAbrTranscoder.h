@@ -0,0 +1,163 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <cuda.h>
+#include "NvEncoder/NvEncoder.h"
+
+class FFmpegDemuxer;
+
+/**
+*  @brief One output of an ABR ladder.
+*/
+struct NvAbrRung
+{
+    int nWidth = 0, nHeight = 0;
+    /** Average bitrate in bits per second; 0 keeps the rate control given by strEncoderOptions */
+    uint32_t nBitrate = 0;
+    /** "h264" or "hevc"; empty means the -codec of strEncoderOptions (H.264 by default) */
+    std::string strCodec;
+    /** Encoder options in the syntax of NvEncoderInitParam, e.g. "-preset hq -gop 60" */
+    std::string strEncoderOptions;
+};
+
+/**
+*  @brief Parses a ladder such as "1920x1080:6M:hevc,1280x720:3M,640x360:800k:h264" into vRung.
+*  Each rung is WxH, optionally followed by a bitrate (with k or M suffix) and a codec.
+*  strEncoderOptions is copied into every rung. Returns false on a malformed spec.
+*/
+bool ParseAbrLadder(const std::string &strSpec, const std::string &strEncoderOptions, std::vector<NvAbrRung> &vRung);
+
+/**
+*  @brief Receives the packets of every rung.
+*  The calls for one rung come in order, from one thread at a time; the calls for different
+*  rungs may overlap, so a sink that shares state between rungs must lock it.
+*/
+class NvAbrSink
+{
+public:
+    virtual ~NvAbrSink() {}
+    /** Called for each rung before its first packet */
+    virtual void OnStart(int iRung, const NvAbrRung &rung) {}
+    /** info carries the pts/dts of the packet in frame units, see NvEncoder::GetPacketInfo() */
+    virtual void OnPacket(int iRung, const uint8_t *pData, int nSize, const NvEncPacketInfo &info) = 0;
+    /** Called for each rung after its last packet */
+    virtual void OnEnd(int iRung) {}
+};
+
+/**
+*  @brief Writes each rung to an elementary stream file named <prefix>_<W>x<H>_<index>.<codec>.
+*/
+class NvAbrFileSink : public NvAbrSink
+{
+public:
+    NvAbrFileSink(const std::string &strPrefix) : m_strPrefix(strPrefix) {}
+
+    void OnStart(int iRung, const NvAbrRung &rung);
+    void OnPacket(int iRung, const uint8_t *pData, int nSize, const NvEncPacketInfo &info);
+    void OnEnd(int iRung);
+
+private:
+    std::string m_strPrefix;
+    std::mutex m_mtx;
+    std::vector<std::unique_ptr<std::ofstream>> m_vpOut;
+};
+
+/**
+*  @brief Throughput of one rung. The times are summed over the rung's tasks; secWall runs
+*  from the start of the transcode to the rung's last packet.
+*/
+struct NvAbrRungMetrics
+{
+    uint64_t nFrame = 0, nPacket = 0, nByte = 0;
+    double secResize = 0, secEncode = 0, secWall = 0;
+    /** Frame rate of the encoded stream, used to turn the bytes into a bitrate */
+    double fps = 0;
+
+    double GetFramesPerSecond() const { return secWall > 0 ? nFrame / secWall : 0; }
+    double GetBitrate() const { return nFrame ? nByte * 8.0 * fps / nFrame : 0; }
+};
+
+/**
+*  @brief Decodes one input once and encodes it at every rung of an ABR ladder.
+*
+*  Each decoded frame is shared by reference count: it stays locked in the decoder until every
+*  rung that reads it is done, and at most nFrameInFlight decoded frames are out at once, so the
+*  slowest encoder throttles decoding. Rungs are resized in cascade: a rung is scaled from the
+*  smallest larger rung (see BuildCascade()) rather than from the decoded frame, which cuts the
+*  resize cost of a deep ladder and keeps the filter footprint small. A rung that feeds others
+*  resizes into a pooled frame, which in turn holds a reference to its own source.
+*
+*  Every encoder is a task stage of an NvPipeline, so the ladder runs on nWorker threads however
+*  many rungs it has, and every encoder still sees its frames in order.
+*/
+class NvAbrTranscoder
+{
+public:
+    /**
+    *  @brief NvAbrTranscoder constructor. nWorker = 0 uses one worker per core.
+    */
+    NvAbrTranscoder(CUcontext cuContext, const std::vector<NvAbrRung> &vRung, int nWorker = 0, int nFrameInFlight = 8);
+    ~NvAbrTranscoder();
+
+    /**
+    *  @brief This function transcodes the whole input and returns the number of frames decoded.
+    *  It creates the decoder and the encoders, and destroys them before it returns. Errors of
+    *  any stage are thrown as NVENCException, NVDECException or std::exception.
+    */
+    int Transcode(FFmpegDemuxer *pDemuxer, NvAbrSink *pSink);
+
+    /**
+    *  @brief Returns, for each rung, the rung it is resized from, or -1 for the decoded frame.
+    *  The source is the smallest rung at least as large in both dimensions, and never a rung
+    *  larger than the decoded frame. Of equal rungs, the first one is the source of the others.
+    */
+    static std::vector<int> BuildCascade(const std::vector<NvAbrRung> &vRung, int nSrcWidth, int nSrcHeight);
+
+    const std::vector<NvAbrRungMetrics> &GetMetrics() const { return m_vMetrics; }
+    /** Valid after Transcode() */
+    int GetParentRung(int iRung) const { return m_vParent[iRung]; }
+    void PrintMetrics(std::ostream &os) const;
+
+private:
+    struct Frame;
+    using FramePtr = std::shared_ptr<Frame>;
+    struct Rung;
+
+    void CreateEncoders(NV_ENC_BUFFER_FORMAT eFormat);
+    int RunPipeline(FFmpegDemuxer *pDemuxer, NvAbrSink *pSink);
+    void EncodeRung(int iRung, FramePtr pSrc, NvAbrSink *pSink);
+    void EndRung(int iRung, NvAbrSink *pSink);
+    void SendPackets(int iRung, std::vector<std::vector<uint8_t>> &vPacket, NvAbrSink *pSink);
+    /** Takes a frame of the rung's pool, allocating one when the pool is empty */
+    FramePtr GetPooledFrame(int iRung, FramePtr pParent);
+
+private:
+    CUcontext m_cuContext;
+    std::vector<NvAbrRung> m_vRung;
+    int m_nWorker, m_nFrameInFlight;
+    std::vector<int> m_vParent;
+    std::vector<std::unique_ptr<Rung>> m_vpRung;
+    std::vector<NvAbrRungMetrics> m_vMetrics;
+    bool m_bOut10 = false;
+    std::chrono::steady_clock::time_point m_tStart;
+    uint64_t m_nDecodedFrame = 0;
+    double m_secTotal = 0;
+};
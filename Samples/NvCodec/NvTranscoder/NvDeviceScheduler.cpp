@@ -0,0 +1,233 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <algorithm>
+#include "NvDecoder/NvDecoder.h"
+#include "NvTranscoder/NvDeviceScheduler.h"
+
+NvFakeDeviceInventory::NvFakeDeviceInventory(int nDevice, int nMaxDecodeSession, int nMaxEncodeSession, size_t nMemory)
+{
+    for (int i = 0; i < nDevice; i++)
+    {
+        NvDeviceInfo info;
+        info.iGpu = i;
+        info.strName = "Fake GPU " + std::to_string(i);
+        info.nMaxDecodeSession = nMaxDecodeSession;
+        info.nMaxEncodeSession = nMaxEncodeSession;
+        info.nMemory = nMemory;
+        m_vDevice.push_back(info);
+    }
+}
+
+NvCudaDeviceInventory::NvCudaDeviceInventory(const std::vector<int> &vGpu, int nMaxDecodeSession, int nMaxEncodeSession)
+{
+    int nGpu = 0;
+    NVDEC_API_CALL(cuDeviceGetCount(&nGpu));
+    std::vector<int> vOrdinal = vGpu;
+    if (vOrdinal.empty())
+    {
+        for (int i = 0; i < nGpu; i++)
+        {
+            vOrdinal.push_back(i);
+        }
+    }
+    try
+    {
+        for (int iGpu : vOrdinal)
+        {
+            if (iGpu < 0 || iGpu >= nGpu)
+            {
+                std::ostringstream err;
+                err << "GPU ordinal " << iGpu << " out of range. Should be within [0, " << nGpu - 1 << "]";
+                NVDEC_THROW_ERROR(err.str(), CUDA_ERROR_INVALID_DEVICE);
+            }
+            CUdevice cuDevice = 0;
+            NVDEC_API_CALL(cuDeviceGet(&cuDevice, iGpu));
+            char szDeviceName[80];
+            NVDEC_API_CALL(cuDeviceGetName(szDeviceName, sizeof(szDeviceName), cuDevice));
+
+            CUcontext cuContext = NULL;
+            NVDEC_API_CALL(cuCtxCreate(&cuContext, 0, cuDevice));
+            m_vContext.push_back(cuContext);
+            size_t nFree = 0, nTotal = 0;
+            NVDEC_API_CALL(cuMemGetInfo(&nFree, &nTotal));
+            NVDEC_API_CALL(cuCtxPopCurrent(NULL));
+
+            NvDeviceInfo info;
+            info.iGpu = iGpu;
+            info.strName = szDeviceName;
+            info.nMaxDecodeSession = nMaxDecodeSession;
+            info.nMaxEncodeSession = nMaxEncodeSession;
+            info.nMemory = nFree;
+            m_vDevice.push_back(info);
+        }
+    }
+    catch (...)
+    {
+        for (CUcontext cuContext : m_vContext)
+        {
+            cuCtxDestroy(cuContext);
+        }
+        throw;
+    }
+}
+
+NvCudaDeviceInventory::~NvCudaDeviceInventory()
+{
+    for (CUcontext cuContext : m_vContext)
+    {
+        cuCtxDestroy(cuContext);
+    }
+}
+
+NvDeviceScheduler::NvDeviceScheduler(const NvDeviceInventory *pInventory, NvPlacementPolicy ePolicy) : m_ePolicy(ePolicy)
+{
+    for (int i = 0; i < pInventory->GetDeviceCount(); i++)
+    {
+        m_vDevice.push_back(pInventory->GetDeviceInfo(i));
+    }
+    m_vLoad.resize(m_vDevice.size());
+}
+
+bool NvDeviceScheduler::Fits(int iDevice, const NvSessionRequest &request) const
+{
+    const NvDeviceInfo &info = m_vDevice[iDevice];
+    const NvDeviceLoad &load = m_vLoad[iDevice];
+    if (info.nMaxDecodeSession >= 0 && load.nDecodeSession + request.nDecodeSession > info.nMaxDecodeSession)
+    {
+        return false;
+    }
+    if (info.nMaxEncodeSession >= 0 && load.nEncodeSession + request.nEncodeSession > info.nMaxEncodeSession)
+    {
+        return false;
+    }
+    if (info.nMemory && load.nMemory + request.nMemory > info.nMemory)
+    {
+        return false;
+    }
+    return true;
+}
+
+double NvDeviceScheduler::GetLoadAfter(int iDevice, const NvSessionRequest &request) const
+{
+    const NvDeviceInfo &info = m_vDevice[iDevice];
+    const NvDeviceLoad &load = m_vLoad[iDevice];
+    double r = 0;
+    if (info.nMaxDecodeSession > 0)
+    {
+        r = (std::max)(r, (double)(load.nDecodeSession + request.nDecodeSession) / info.nMaxDecodeSession);
+    }
+    if (info.nMaxEncodeSession > 0)
+    {
+        r = (std::max)(r, (double)(load.nEncodeSession + request.nEncodeSession) / info.nMaxEncodeSession);
+    }
+    if (info.nMemory)
+    {
+        r = (std::max)(r, (double)(load.nMemory + request.nMemory) / info.nMemory);
+    }
+    return r;
+}
+
+int NvDeviceScheduler::Place(const NvSessionRequest &request)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    int iDevice = -1;
+    if (m_ePolicy == NV_PLACEMENT_AFFINITY && !request.strAffinityKey.empty())
+    {
+        auto it = m_mAffinity.find(request.strAffinityKey);
+        if (it != m_mAffinity.end() && Fits(it->second, request))
+        {
+            iDevice = it->second;
+        }
+    }
+    if (iDevice < 0)
+    {
+        // Least loaded; among equally loaded devices (those without limits, say) the one with the
+        // fewest sessions, then the one that took the fewest requests, so that work spreads out
+        double rBest = 0;
+        for (int i = 0; i < (int)m_vDevice.size(); i++)
+        {
+            if (!Fits(i, request))
+            {
+                continue;
+            }
+            double r = GetLoadAfter(i, request);
+            if (iDevice >= 0)
+            {
+                const NvDeviceLoad &best = m_vLoad[iDevice], &load = m_vLoad[i];
+                int nBestSession = best.nDecodeSession + best.nEncodeSession, nSession = load.nDecodeSession + load.nEncodeSession;
+                if (r > rBest || (r == rBest && (nSession > nBestSession
+                    || (nSession == nBestSession && load.nPlaced >= best.nPlaced))))
+                {
+                    continue;
+                }
+            }
+            iDevice = i;
+            rBest = r;
+        }
+    }
+    if (iDevice < 0)
+    {
+        return -1;
+    }
+    if (!request.strAffinityKey.empty())
+    {
+        m_mAffinity[request.strAffinityKey] = iDevice;
+    }
+    NvDeviceLoad &load = m_vLoad[iDevice];
+    load.nDecodeSession += request.nDecodeSession;
+    load.nEncodeSession += request.nEncodeSession;
+    load.nMemory += request.nMemory;
+    load.nPlaced++;
+    return iDevice;
+}
+
+void NvDeviceScheduler::Release(int iDevice, const NvSessionRequest &request)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    NvDeviceLoad &load = m_vLoad[iDevice];
+    load.nDecodeSession -= request.nDecodeSession;
+    load.nEncodeSession -= request.nEncodeSession;
+    load.nMemory -= request.nMemory;
+}
+
+NvDeviceLoad NvDeviceScheduler::GetLoad(int iDevice) const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_vLoad[iDevice];
+}
+
+void NvDeviceScheduler::PrintLoad(std::ostream &os) const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    for (size_t i = 0; i < m_vDevice.size(); i++)
+    {
+        const NvDeviceInfo &info = m_vDevice[i];
+        const NvDeviceLoad &load = m_vLoad[i];
+        os << "GPU " << info.iGpu << " (" << info.strName << "): " << load.nPlaced << " placed, "
+            << load.nDecodeSession << " decode";
+        if (info.nMaxDecodeSession >= 0)
+        {
+            os << "/" << info.nMaxDecodeSession;
+        }
+        os << " and " << load.nEncodeSession << " encode";
+        if (info.nMaxEncodeSession >= 0)
+        {
+            os << "/" << info.nMaxEncodeSession;
+        }
+        os << " sessions";
+        if (info.nMemory)
+        {
+            os << ", " << (load.nMemory >> 20) << "/" << (info.nMemory >> 20) << " MB";
+        }
+        os << std::endl;
+    }
+}
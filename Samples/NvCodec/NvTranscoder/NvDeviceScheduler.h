@@ -0,0 +1,181 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <cuda.h>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+*  @brief What the scheduler knows of a GPU. A limit of 0 means the GPU has no such engine, and
+*  -1 that the number of sessions is not limited.
+*/
+struct NvDeviceInfo
+{
+    int iGpu = 0;
+    std::string strName;
+    int nMaxDecodeSession = -1, nMaxEncodeSession = -1;
+    /** Device memory the sessions may take, in bytes; 0 if not tracked */
+    size_t nMemory = 0;
+};
+
+/**
+*  @brief The GPUs sessions can be placed on. The scheduler only reads the inventory, so the
+*  simulated runs of AppTransBatch give it a NvFakeDeviceInventory and the real ones a
+*  NvCudaDeviceInventory.
+*/
+class NvDeviceInventory
+{
+public:
+    virtual ~NvDeviceInventory() {}
+    virtual int GetDeviceCount() const = 0;
+    virtual NvDeviceInfo GetDeviceInfo(int iDevice) const = 0;
+};
+
+/**
+*  @brief A fixed list of devices, for simulated runs of the placement.
+*/
+class NvFakeDeviceInventory : public NvDeviceInventory
+{
+public:
+    NvFakeDeviceInventory(const std::vector<NvDeviceInfo> &vDevice) : m_vDevice(vDevice) {}
+    /** nDevice identical devices, numbered from 0 */
+    NvFakeDeviceInventory(int nDevice, int nMaxDecodeSession, int nMaxEncodeSession, size_t nMemory = 0);
+
+    int GetDeviceCount() const { return (int)m_vDevice.size(); }
+    NvDeviceInfo GetDeviceInfo(int iDevice) const { return m_vDevice[iDevice]; }
+
+private:
+    std::vector<NvDeviceInfo> m_vDevice;
+};
+
+/**
+*  @brief The CUDA devices of the system, or those of vGpu. Every device gets one context,
+*  created here and shared by all the sessions placed on it, as NvDecoder and NvEncoderCuda
+*  allow. The memory of a device is what was free after its context was created.
+*/
+class NvCudaDeviceInventory : public NvDeviceInventory
+{
+public:
+    /** nMaxDecodeSession and nMaxEncodeSession apply to every device; cuInit() must have been called */
+    NvCudaDeviceInventory(const std::vector<int> &vGpu = std::vector<int>(), int nMaxDecodeSession = -1,
+        int nMaxEncodeSession = -1);
+    ~NvCudaDeviceInventory();
+
+    int GetDeviceCount() const { return (int)m_vDevice.size(); }
+    NvDeviceInfo GetDeviceInfo(int iDevice) const { return m_vDevice[iDevice]; }
+    CUcontext GetContext(int iDevice) const { return m_vContext[iDevice]; }
+
+private:
+    std::vector<NvDeviceInfo> m_vDevice;
+    std::vector<CUcontext> m_vContext;
+};
+
+enum NvPlacementPolicy
+{
+    /** The device whose busiest resource would be least used, counting the new sessions */
+    NV_PLACEMENT_LEAST_LOADED,
+    /** The device that last took a request with the same affinity key, if it has room; otherwise least loaded */
+    NV_PLACEMENT_AFFINITY,
+};
+
+/**
+*  @brief Sessions to open on one device. A transcode asks for a decoder and an encoder in one
+*  request, so that both land on the same device and frames never cross the bus.
+*/
+struct NvSessionRequest
+{
+    int nDecodeSession = 1, nEncodeSession = 1;
+    /** Device memory the sessions are expected to take, in bytes */
+    size_t nMemory = 0;
+    /** Requests with the same key (the renditions of one source, say) are kept together by NV_PLACEMENT_AFFINITY */
+    std::string strAffinityKey;
+};
+
+struct NvDeviceLoad
+{
+    int nDecodeSession = 0, nEncodeSession = 0;
+    size_t nMemory = 0;
+    /** Requests placed on the device so far, including those released since */
+    uint64_t nPlaced = 0;
+};
+
+/**
+*  @brief Places decode and encode sessions on the devices of an inventory and keeps count of
+*  the sessions and memory each device holds.
+*
+*  Place() reserves the sessions of a request on the device the policy picks, among those that
+*  have room for all of it, and Release() gives them back. Neither touches CUDA, so the policy
+*  can be exercised with a fake inventory. The sessions themselves are created by the caller on
+*  the device Place() returned. A request that fits on no device is refused with -1, and the
+*  caller waits or retries; devices are never oversubscribed.
+*/
+class NvDeviceScheduler
+{
+public:
+    NvDeviceScheduler(const NvDeviceInventory *pInventory, NvPlacementPolicy ePolicy = NV_PLACEMENT_LEAST_LOADED);
+
+    /**
+    *  @brief This function reserves the sessions and memory of request on a device and returns
+    *  the index of the device in the inventory, or -1 if no device has room for them.
+    */
+    int Place(const NvSessionRequest &request);
+    /** Gives back what Place() reserved for request on iDevice */
+    void Release(int iDevice, const NvSessionRequest &request);
+
+    NvDeviceLoad GetLoad(int iDevice) const;
+    int GetDeviceCount() const { return (int)m_vDevice.size(); }
+    void PrintLoad(std::ostream &os) const;
+
+private:
+    bool Fits(int iDevice, const NvSessionRequest &request) const;
+    /** Fraction of the busiest resource of iDevice once request is added */
+    double GetLoadAfter(int iDevice, const NvSessionRequest &request) const;
+
+private:
+    NvPlacementPolicy m_ePolicy;
+    std::vector<NvDeviceInfo> m_vDevice;
+    std::vector<NvDeviceLoad> m_vLoad;
+    std::map<std::string, int> m_mAffinity;
+    mutable std::mutex m_mtx;
+};
+
+/**
+*  @brief Holds the sessions of a request for as long as it lives. iDevice is -1 if the request
+*  did not fit anywhere.
+*/
+class NvDevicePlacement
+{
+public:
+    NvDevicePlacement(NvDeviceScheduler *pScheduler, const NvSessionRequest &request)
+        : m_pScheduler(pScheduler), m_request(request), m_iDevice(pScheduler->Place(request)) {}
+    ~NvDevicePlacement()
+    {
+        if (m_iDevice >= 0)
+        {
+            m_pScheduler->Release(m_iDevice, m_request);
+        }
+    }
+    NvDevicePlacement(const NvDevicePlacement &) = delete;
+    NvDevicePlacement &operator=(const NvDevicePlacement &) = delete;
+
+    int GetDevice() const { return m_iDevice; }
+
+private:
+    NvDeviceScheduler *m_pScheduler;
+    NvSessionRequest m_request;
+    int m_iDevice;
+};
@@ -0,0 +1,482 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <thread>
+#include "NvDecoder/NvDecoder.h"
+#include "NvEncoder/NvEncoder.h"
+#include "NvTranscoder/NvJobRunner.h"
+#include "../Utils/NvCodecUtils.h"
+
+static double SecondsSince(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+/** Error messages on one line, for the journal and the summary */
+static std::string OneLine(std::string str)
+{
+    std::replace(str.begin(), str.end(), '\n', ' ');
+    std::replace(str.begin(), str.end(), '\r', ' ');
+    std::replace(str.begin(), str.end(), '\t', ' ');
+    str.erase(str.find_last_not_of(' ') + 1);
+    return str;
+}
+
+static bool FileExists(const std::string &strPath)
+{
+    return std::ifstream(strPath).good();
+}
+
+bool ParseJobManifest(std::istream &is, const std::string &strDefaultOptions, std::vector<NvTranscodeJob> &vJob,
+    std::string &strError)
+{
+    std::vector<NvTranscodeJob> v;
+    std::map<std::string, int> mOutputLine;
+    std::string strLine;
+    for (int iLine = 1; std::getline(is, strLine); iLine++)
+    {
+        std::vector<std::string> vToken;
+        size_t i = 0;
+        while (true)
+        {
+            i = strLine.find_first_not_of(" \t\r", i);
+            if (i == std::string::npos || (vToken.empty() && strLine[i] == '#'))
+            {
+                break;
+            }
+            if (strLine[i] == '"')
+            {
+                size_t iEnd = strLine.find('"', i + 1);
+                if (iEnd == std::string::npos)
+                {
+                    strError = "Line " + std::to_string(iLine) + ": unterminated quote";
+                    return false;
+                }
+                vToken.push_back(strLine.substr(i + 1, iEnd - i - 1));
+                i = iEnd + 1;
+            }
+            else
+            {
+                size_t iEnd = strLine.find_first_of(" \t\r", i);
+                vToken.push_back(strLine.substr(i, iEnd == std::string::npos ? std::string::npos : iEnd - i));
+                i = iEnd;
+            }
+        }
+        if (vToken.empty())
+        {
+            continue;
+        }
+        if (vToken.size() < 2)
+        {
+            strError = "Line " + std::to_string(iLine) + ": expected an input and an output";
+            return false;
+        }
+        NvTranscodeJob job;
+        job.strInput = vToken[0];
+        job.strOutput = vToken[1];
+        job.strEncoderOptions = strDefaultOptions;
+        for (size_t k = 2; k < vToken.size(); k++)
+        {
+            job.strEncoderOptions += " " + vToken[k];
+        }
+        job.iLine = iLine;
+        auto it = mOutputLine.find(job.strOutput);
+        if (it != mOutputLine.end())
+        {
+            strError = "Line " + std::to_string(iLine) + ": " + job.strOutput + " is also the output of line " + std::to_string(it->second);
+            return false;
+        }
+        mOutputLine[job.strOutput] = iLine;
+        v.push_back(job);
+    }
+    vJob.swap(v);
+    return true;
+}
+
+int NvSimulatedTranscodeBackend::Transcode(const NvTranscodeJob &job, const std::string &strOutputPath)
+{
+    bool bTransient;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        // The decoder is created first, as in a real transcode
+        m_nPeakDecode = (std::max)((int)m_nPeakDecode, ++m_nDecode);
+        if (m_nDecode > m_nDecodeCapacity)
+        {
+            m_nDecode--;
+            throw NVDECException::makeNVDECException("Simulated decoder creation failure", CUDA_ERROR_OUT_OF_MEMORY,
+                __FUNCTION__, __FILE__, __LINE__);
+        }
+        m_nPeakEncode = (std::max)((int)m_nPeakEncode, ++m_nEncode);
+        if (m_nEncode > m_nEncodeCapacity)
+        {
+            m_nEncode--;
+            m_nDecode--;
+            throw NVENCException::makeNVENCException("Simulated encode session limit", NV_ENC_ERR_ENCODER_BUSY,
+                __FUNCTION__, __FILE__, __LINE__);
+        }
+        bTransient = std::uniform_real_distribution<double>(0, 1)(m_rng) < m_fTransientFailure;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(bTransient ? m_msPerJob / 2 : m_msPerJob));
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_nEncode--;
+        m_nDecode--;
+    }
+    if (bTransient)
+    {
+        throw NVENCException::makeNVENCException("Simulated out of memory", NV_ENC_ERR_OUT_OF_MEMORY,
+            __FUNCTION__, __FILE__, __LINE__);
+    }
+    if (job.strInput.find("fail") != std::string::npos)
+    {
+        throw std::runtime_error("Simulated failure of " + job.strInput);
+    }
+    std::ofstream fpOut(strOutputPath, std::ios::out | std::ios::binary);
+    fpOut << "Simulated transcode of " << job.strInput << " with options:" << job.strEncoderOptions << std::endl;
+    if (!fpOut)
+    {
+        throw std::runtime_error("Unable to write " + strOutputPath);
+    }
+    return 0;
+}
+
+NvJobRunner::NvJobRunner(NvTranscodeBackend *pBackend, const NvJobRunnerParams &params)
+    : m_pBackend(pBackend), m_params(params)
+{
+    m_params.nDecodeSession = (std::max)(m_params.nDecodeSession, 1);
+    m_params.nEncodeSession = (std::max)(m_params.nEncodeSession, 1);
+    m_nDecodeLimit = m_params.nDecodeSession;
+    m_nEncodeLimit = m_params.nEncodeSession;
+}
+
+bool NvJobRunner::IsRetryable(std::exception_ptr ex, bool &bEncode, std::string &strError)
+{
+    try
+    {
+        std::rethrow_exception(ex);
+    }
+    catch (const NVENCException &e)
+    {
+        strError = OneLine(e.getErrorString());
+        bEncode = true;
+        return e.getErrorCode() == NV_ENC_ERR_ENCODER_BUSY || e.getErrorCode() == NV_ENC_ERR_OUT_OF_MEMORY;
+    }
+    catch (const NVDECException &e)
+    {
+        strError = OneLine(e.getErrorString());
+        bEncode = false;
+        return e.getErrorCode() == CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    catch (const std::exception &e)
+    {
+        strError = OneLine(e.what());
+    }
+    catch (...)
+    {
+        strError = "Unknown error";
+    }
+    return false;
+}
+
+int NvJobRunner::Run(const std::vector<NvTranscodeJob> &vJob)
+{
+    m_vResult.assign(vJob.size(), NvJobResult());
+    m_iNextJob = 0;
+    m_ex = nullptr;
+    if (!m_params.strJournal.empty())
+    {
+        if (m_params.bResume)
+        {
+            LoadJournal(vJob);
+        }
+        m_pJournal.reset(new std::ofstream(m_params.strJournal, m_params.bResume ? std::ios::app : std::ios::trunc));
+        if (!*m_pJournal)
+        {
+            throw std::invalid_argument("Unable to open journal " + m_params.strJournal);
+        }
+    }
+
+    int nPending = (int)std::count_if(m_vResult.begin(), m_vResult.end(),
+        [](const NvJobResult &r) { return r.eStatus == NV_JOB_PENDING; });
+    // Twice the sessions, so that jobs waiting out a backoff do not leave sessions idle
+    int nWorker = (std::min)(2 * (std::min)(m_params.nDecodeSession, m_params.nEncodeSession), nPending);
+    std::vector<std::thread> vth;
+    for (int i = 0; i < nWorker; i++)
+    {
+        vth.push_back(std::thread(&NvJobRunner::WorkerProc, this, std::cref(vJob)));
+    }
+    for (std::thread &th : vth)
+    {
+        th.join();
+    }
+    m_pJournal.reset();
+    if (m_ex)
+    {
+        std::rethrow_exception(m_ex);
+    }
+    return (int)std::count_if(m_vResult.begin(), m_vResult.end(),
+        [](const NvJobResult &r) { return r.eStatus == NV_JOB_FAILED; });
+}
+
+void NvJobRunner::WorkerProc(const std::vector<NvTranscodeJob> &vJob)
+{
+    while (true)
+    {
+        size_t iJob;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            while (m_iNextJob < vJob.size() && m_vResult[m_iNextJob].eStatus != NV_JOB_PENDING)
+            {
+                m_iNextJob++;
+            }
+            if (m_ex || m_iNextJob == vJob.size())
+            {
+                return;
+            }
+            iJob = m_iNextJob++;
+        }
+        try
+        {
+            RunJob(vJob[iJob], m_vResult[iJob]);
+            WriteJournal(vJob[iJob], m_vResult[iJob]);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            if (!m_ex)
+            {
+                m_ex = std::current_exception();
+            }
+            return;
+        }
+    }
+}
+
+void NvJobRunner::RunJob(const NvTranscodeJob &job, NvJobResult &result)
+{
+    std::string strPart = job.strOutput + ".part";
+    while (true)
+    {
+        result.nAttempt++;
+        Acquire();
+        LOG(INFO) << "Job of line " << job.iLine << ": " << job.strInput << " -> " << job.strOutput
+            << (result.nAttempt > 1 ? ", attempt " + std::to_string(result.nAttempt) : std::string());
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        std::exception_ptr ex;
+        try
+        {
+            result.nFrame = m_pBackend->Transcode(job, strPart);
+        }
+        catch (...)
+        {
+            ex = std::current_exception();
+        }
+        result.sec += SecondsSince(t0);
+        if (!ex)
+        {
+            Release(true);
+            // The output appears complete or not at all, so that a resumed run can trust it
+            remove(job.strOutput.c_str());
+            if (rename(strPart.c_str(), job.strOutput.c_str()))
+            {
+                result.eStatus = NV_JOB_FAILED;
+                result.strError = "Unable to rename " + strPart + " to " + job.strOutput;
+            }
+            else
+            {
+                result.eStatus = NV_JOB_DONE;
+                result.strError.clear();
+            }
+            return;
+        }
+
+        bool bEncode = false;
+        bool bRetry = IsRetryable(ex, bEncode, result.strError);
+        if (bRetry)
+        {
+            Throttle(bEncode);
+        }
+        Release(false);
+        remove(strPart.c_str());
+        if (!bRetry || result.nAttempt > m_params.nMaxRetry)
+        {
+            LOG(ERROR) << "Job of line " << job.iLine << " failed: " << result.strError;
+            result.eStatus = NV_JOB_FAILED;
+            return;
+        }
+        int msWait = m_params.msBackoff;
+        for (int i = 1; i < result.nAttempt && msWait < m_params.msMaxBackoff; i++)
+        {
+            msWait *= 2;
+        }
+        msWait = (std::min)(msWait, m_params.msMaxBackoff);
+        LOG(WARNING) << "Job of line " << job.iLine << " is retried in " << msWait << " ms: " << result.strError;
+        std::this_thread::sleep_for(std::chrono::milliseconds(msWait));
+    }
+}
+
+void NvJobRunner::Acquire()
+{
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_cvSession.wait(lock, [this] { return m_nSession < (std::min)(m_nDecodeLimit, m_nEncodeLimit); });
+    m_nSession++;
+}
+
+void NvJobRunner::Release(bool bDone)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_nSession--;
+        // A limit that was lowered goes up by one for every round of jobs that complete within it
+        if (bDone && ++m_nDoneSinceThrottle >= (std::min)(m_nDecodeLimit, m_nEncodeLimit))
+        {
+            m_nDecodeLimit = (std::min)(m_nDecodeLimit + 1, m_params.nDecodeSession);
+            m_nEncodeLimit = (std::min)(m_nEncodeLimit + 1, m_params.nEncodeSession);
+            m_nDoneSinceThrottle = 0;
+        }
+    }
+    m_cvSession.notify_all();
+}
+
+void NvJobRunner::Throttle(bool bEncode)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    int &nLimit = bEncode ? m_nEncodeLimit : m_nDecodeLimit;
+    int nLimitOld = nLimit;
+    nLimit = (std::max)(1, (std::min)(nLimit, m_nSession - 1));
+    m_nDoneSinceThrottle = 0;
+    if (nLimit != nLimitOld)
+    {
+        LOG(WARNING) << (bEncode ? "Encode" : "Decode") << " session limit lowered to " << nLimit;
+    }
+}
+
+void NvJobRunner::GetSessionLimits(int &nDecodeSession, int &nEncodeSession) const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    nDecodeSession = m_nDecodeLimit;
+    nEncodeSession = m_nEncodeLimit;
+}
+
+/* The journal has one line per finished job, appended in the order the jobs finish:
+   done|failed <TAB> output <TAB> frames <TAB> attempts <TAB> seconds <TAB> error.
+   The last line of a job counts; a job is done only if its output still exists. */
+void NvJobRunner::LoadJournal(const std::vector<NvTranscodeJob> &vJob)
+{
+    std::ifstream fpJournal(m_params.strJournal);
+    if (!fpJournal)
+    {
+        return;
+    }
+    std::map<std::string, size_t> mJob;
+    for (size_t i = 0; i < vJob.size(); i++)
+    {
+        mJob[vJob[i].strOutput] = i;
+    }
+    std::string strLine;
+    while (std::getline(fpJournal, strLine))
+    {
+        std::vector<std::string> vField;
+        std::istringstream ss(strLine);
+        std::string strField;
+        while (std::getline(ss, strField, '\t'))
+        {
+            vField.push_back(strField);
+        }
+        if (vField.size() < 3)
+        {
+            continue;
+        }
+        auto it = mJob.find(vField[1]);
+        if (it == mJob.end())
+        {
+            continue;
+        }
+        NvJobResult &result = m_vResult[it->second];
+        if (vField[0] == "done")
+        {
+            result.eStatus = NV_JOB_SKIPPED;
+            result.nFrame = atoi(vField[2].c_str());
+        }
+        else
+        {
+            result.eStatus = NV_JOB_PENDING;
+        }
+    }
+    int nSkipped = 0;
+    for (size_t i = 0; i < vJob.size(); i++)
+    {
+        if (m_vResult[i].eStatus == NV_JOB_SKIPPED && !FileExists(vJob[i].strOutput))
+        {
+            m_vResult[i] = NvJobResult();
+        }
+        nSkipped += m_vResult[i].eStatus == NV_JOB_SKIPPED;
+    }
+    LOG(INFO) << "Resuming: " << nSkipped << " of " << vJob.size() << " jobs done in earlier runs";
+}
+
+void NvJobRunner::WriteJournal(const NvTranscodeJob &job, const NvJobResult &result)
+{
+    if (!m_pJournal)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mtxJournal);
+    *m_pJournal << (result.eStatus == NV_JOB_DONE ? "done" : "failed") << '\t' << job.strOutput << '\t' << result.nFrame
+        << '\t' << result.nAttempt << '\t' << std::fixed << std::setprecision(3) << result.sec << '\t' << result.strError
+        << std::endl;
+    if (!*m_pJournal)
+    {
+        throw std::runtime_error("Unable to write journal " + m_params.strJournal);
+    }
+}
+
+void NvJobRunner::PrintSummary(std::ostream &os, const std::vector<NvTranscodeJob> &vJob) const
+{
+    static const char *aszStatus[] = {"pending", "skipped", "done", "failed"};
+    int anStatus[4] = {0, 0, 0, 0};
+    int nRetry = 0;
+    double sec = 0;
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize nPrecision = os.precision();
+    os << std::left << std::setw(8) << "Line" << std::setw(10) << "Status" << std::right << std::setw(10) << "Attempts"
+        << std::setw(10) << "Frames" << std::setw(10) << "Time(s)" << "  Output" << std::endl;
+    for (size_t i = 0; i < vJob.size() && i < m_vResult.size(); i++)
+    {
+        const NvJobResult &r = m_vResult[i];
+        anStatus[r.eStatus]++;
+        nRetry += (std::max)(r.nAttempt - 1, 0);
+        sec += r.sec;
+        os << std::left << std::setw(8) << vJob[i].iLine << std::setw(10) << aszStatus[r.eStatus] << std::right
+            << std::setw(10) << r.nAttempt << std::setw(10) << r.nFrame
+            << std::fixed << std::setprecision(2) << std::setw(10) << r.sec << "  " << vJob[i].strOutput;
+        if (r.eStatus == NV_JOB_FAILED)
+        {
+            os << ": " << r.strError;
+        }
+        os << std::endl;
+    }
+    int nDecodeLimit, nEncodeLimit;
+    GetSessionLimits(nDecodeLimit, nEncodeLimit);
+    os << "Jobs done: " << anStatus[NV_JOB_DONE] << ", skipped: " << anStatus[NV_JOB_SKIPPED]
+        << ", failed: " << anStatus[NV_JOB_FAILED] << ", not run: " << anStatus[NV_JOB_PENDING]
+        << ", retries: " << nRetry << ", session time: " << std::fixed << std::setprecision(2) << sec << " s" << std::endl
+        << "Session limits at the end: " << nDecodeLimit << " decode (of " << m_params.nDecodeSession << "), "
+        << nEncodeLimit << " encode (of " << m_params.nEncodeSession << ")" << std::endl;
+    os.flags(flags);
+    os.precision(nPrecision);
+}
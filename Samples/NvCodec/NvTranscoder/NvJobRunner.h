@@ -0,0 +1,178 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+*  @brief One transcode of a manifest: an input file to an elementary stream file.
+*/
+struct NvTranscodeJob
+{
+    std::string strInput, strOutput;
+    /** Encoder options in the syntax of NvEncoderInitParam, e.g. "-codec hevc -preset hq" */
+    std::string strEncoderOptions;
+    /** Line of the manifest, for messages */
+    int iLine = 0;
+};
+
+/**
+*  @brief Parses a job manifest: one job per line, "input output [encoder options]". Paths with
+*  spaces are double-quoted; blank lines and lines starting with # are skipped. strDefaultOptions
+*  goes in front of the options of every job, so a job's own options override it. Outputs must be
+*  unique, since they identify the jobs in the journal. Returns false with strError on a bad line.
+*/
+bool ParseJobManifest(std::istream &is, const std::string &strDefaultOptions, std::vector<NvTranscodeJob> &vJob,
+    std::string &strError);
+
+/**
+*  @brief Runs one job. Called concurrently from several threads, each call holding one decode
+*  and one encode session of the runner. Errors are thrown as NVENCException, NVDECException or
+*  std::exception; see NvJobRunner for the ones that are retried.
+*/
+class NvTranscodeBackend
+{
+public:
+    virtual ~NvTranscodeBackend() {}
+    /** Transcodes job into strOutputPath (a temporary file of the runner) and returns the frame count */
+    virtual int Transcode(const NvTranscodeJob &job, const std::string &strOutputPath) = 0;
+};
+
+/**
+*  @brief Stands in for the GPU to test the runner and tune its limits: a job takes msPerJob,
+*  and the hardware has room for nEncodeCapacity encode and nDecodeCapacity decode sessions.
+*  A job beyond them fails the way the drivers fail, with NV_ENC_ERR_ENCODER_BUSY or with
+*  CUDA_ERROR_OUT_OF_MEMORY from the decoder, and any job fails with NV_ENC_ERR_OUT_OF_MEMORY
+*  with probability fTransientFailure. Jobs whose input contains "fail" always fail, for errors
+*  that no retry fixes. The output file holds a line describing the job.
+*/
+class NvSimulatedTranscodeBackend : public NvTranscodeBackend
+{
+public:
+    NvSimulatedTranscodeBackend(int nEncodeCapacity, int nDecodeCapacity, int msPerJob, double fTransientFailure = 0,
+        uint32_t nSeed = 1)
+        : m_nEncodeCapacity(nEncodeCapacity), m_nDecodeCapacity(nDecodeCapacity), m_msPerJob(msPerJob),
+        m_fTransientFailure(fTransientFailure), m_rng(nSeed) {}
+
+    int Transcode(const NvTranscodeJob &job, const std::string &strOutputPath);
+
+    /** Most sessions asked for at once, including those that were refused */
+    int GetPeakEncodeSessions() const { return m_nPeakEncode; }
+    int GetPeakDecodeSessions() const { return m_nPeakDecode; }
+
+private:
+    int m_nEncodeCapacity, m_nDecodeCapacity, m_msPerJob;
+    double m_fTransientFailure;
+    std::mutex m_mtx;
+    std::mt19937 m_rng;
+    int m_nEncode = 0, m_nDecode = 0;
+    std::atomic<int> m_nPeakEncode{0}, m_nPeakDecode{0};
+};
+
+struct NvJobRunnerParams
+{
+    /** Sessions the runner opens at once; a job holds one of each while it runs */
+    int nDecodeSession = 2, nEncodeSession = 2;
+    /** Retries of a job that failed for lack of sessions or memory */
+    int nMaxRetry = 5;
+    /** Wait before the first retry, doubled with every retry up to msMaxBackoff */
+    int msBackoff = 500, msMaxBackoff = 30000;
+    /** Progress file; empty runs without one */
+    std::string strJournal;
+    /** Skip the jobs the journal records as done, rather than start the journal over */
+    bool bResume = false;
+};
+
+enum NvJobStatus
+{
+    NV_JOB_PENDING,
+    /** Done in an earlier run, according to the journal */
+    NV_JOB_SKIPPED,
+    NV_JOB_DONE,
+    NV_JOB_FAILED,
+};
+
+struct NvJobResult
+{
+    NvJobStatus eStatus = NV_JOB_PENDING;
+    int nAttempt = 0, nFrame = 0;
+    double sec = 0;
+    std::string strError;
+};
+
+/**
+*  @brief Runs the jobs of a manifest on a backend, within a number of concurrent decode and
+*  encode sessions.
+*
+*  Admission control: a job starts only when a decode and an encode session are both free, and
+*  takes them together, so no job holds one session while it waits for the other. Jobs that fail
+*  with NV_ENC_ERR_ENCODER_BUSY, NV_ENC_ERR_OUT_OF_MEMORY or CUDA_ERROR_OUT_OF_MEMORY are retried
+*  after a backoff. Such a failure means the GPU has fewer sessions than configured (other
+*  processes use it too), so the limit of that kind of session drops to what was running besides
+*  the failed job. It grows back by one whenever as many jobs as the limit have completed.
+*
+*  Each finished job is appended to the journal and flushed, and the output is written to a
+*  temporary file that is renamed when the job is done, so a runner that is killed can resume
+*  with the jobs it had not finished.
+*/
+class NvJobRunner
+{
+public:
+    NvJobRunner(NvTranscodeBackend *pBackend, const NvJobRunnerParams &params);
+
+    /**
+    *  @brief This function runs every job and returns the number that failed. It throws
+    *  std::exception if the journal cannot be read or written.
+    */
+    int Run(const std::vector<NvTranscodeJob> &vJob);
+
+    const std::vector<NvJobResult> &GetResults() const { return m_vResult; }
+    /** The session limits after the last job, lowered if the GPU refused sessions */
+    void GetSessionLimits(int &nDecodeSession, int &nEncodeSession) const;
+    void PrintSummary(std::ostream &os, const std::vector<NvTranscodeJob> &vJob) const;
+
+    /** Tells a failure that may pass once other sessions end; bEncode tells which kind of session ran short */
+    static bool IsRetryable(std::exception_ptr ex, bool &bEncode, std::string &strError);
+
+private:
+    void WorkerProc(const std::vector<NvTranscodeJob> &vJob);
+    void RunJob(const NvTranscodeJob &job, NvJobResult &result);
+    void Acquire();
+    void Release(bool bDone);
+    /** Called with a session of each kind held by the failed job */
+    void Throttle(bool bEncode);
+    void LoadJournal(const std::vector<NvTranscodeJob> &vJob);
+    void WriteJournal(const NvTranscodeJob &job, const NvJobResult &result);
+
+private:
+    NvTranscodeBackend *m_pBackend;
+    NvJobRunnerParams m_params;
+    std::vector<NvJobResult> m_vResult;
+    size_t m_iNextJob = 0;
+    mutable std::mutex m_mtx;
+    std::condition_variable m_cvSession;
+    int m_nDecodeLimit, m_nEncodeLimit, m_nSession = 0, m_nDoneSinceThrottle = 0;
+    std::mutex m_mtxJournal;
+    std::unique_ptr<std::ofstream> m_pJournal;
+    std::exception_ptr m_ex;
+};
@@ -11,62 +11,20 @@
 
 #include <stdint.h>
 #include <cuda_runtime.h>
-
-typedef enum ColorSpaceStandard {
-    ColorSpaceStandard_BT709 = 0, 
-    ColorSpaceStandard_BT601 = 2, 
-    ColorSpaceStandard_BT2020 = 4
-} ColorSpaceStandard;
+#include "ColorSpace.h"
 
 __constant__ float matYuv2Rgb[3][3];
 __constant__ float matRgb2Yuv[3][3];
 
-void inline GetConstants(int iMatrix, float &wr, float &wb, int &black, int &white, int &max) {
-    // Default is BT709
-    wr = 0.2126f; wb = 0.0722f;
-    black = 16; white = 235;
-    max = 255;
-    if (iMatrix == ColorSpaceStandard_BT601) {
-        wr = 0.2990f; wb = 0.1140f;
-    } else if (iMatrix == ColorSpaceStandard_BT2020) {
-        wr = 0.2627f; wb = 0.0593f;
-        // 10-bit only
-        black = 64 << 6; white = 940 << 6;
-        max = (1 << 16) - 1;
-    }
-}
-
 void SetMatYuv2Rgb(int iMatrix) {
-    float wr, wb;
-    int black, white, max;
-    GetConstants(iMatrix, wr, wb, black, white, max);
-    float mat[3][3] = {
-        1.0f, 0.0f, (1.0f - wr) / 0.5f,
-        1.0f, -wb * (1.0f - wb) / 0.5f / (1 - wb - wr), -wr * (1 - wr) / 0.5f / (1 - wb - wr),
-        1.0f, (1.0f - wb) / 0.5f, 0.0f,
-    };
-    for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 3; j++) {
-            mat[i][j] = (float)(1.0 * max / (white - black) * mat[i][j]);
-        }
-    }
+    float mat[3][3];
+    GetMatYuv2Rgb(iMatrix, mat);
     cudaMemcpyToSymbol(matYuv2Rgb, mat, sizeof(mat));
 }
 
 void SetMatRgb2Yuv(int iMatrix) {
-    float wr, wb;
-    int black, white, max;
-    GetConstants(iMatrix, wr, wb, black, white, max);
-    float mat[3][3] = {
-        wr, 1.0f - wb - wr, wb,
-        -0.5f * wr / (1.0f - wb), -0.5f * (1 - wb - wr) / (1.0f - wb), 0.5f,
-        0.5f, -0.5f * (1.0f - wb - wr) / (1.0f - wr), -0.5f * wb / (1.0f - wr),
-    };
-    for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 3; j++) {
-            mat[i][j] = (float)(1.0 * (white - black) / max * mat[i][j]);
-        }
-    }
+    float mat[3][3];
+    GetMatRgb2Yuv(iMatrix, mat);
     cudaMemcpyToSymbol(matRgb2Yuv, mat, sizeof(mat));
 }
 
@@ -0,0 +1,71 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+/**
+* @brief YUV <-> RGB matrix setup shared by the CUDA kernels in ColorSpace.cu and the host
+* conversions in ColorSpaceConverter.h, so both sides use the same coefficients.
+*/
+typedef enum ColorSpaceStandard {
+    ColorSpaceStandard_BT709 = 0,
+    ColorSpaceStandard_BT601 = 2,
+    ColorSpaceStandard_BT2020 = 4
+} ColorSpaceStandard;
+
+inline void GetColorSpaceConstants(int iMatrix, float &wr, float &wb, int &black, int &white, int &max) {
+    // Default is BT709
+    wr = 0.2126f; wb = 0.0722f;
+    black = 16; white = 235;
+    max = 255;
+    if (iMatrix == ColorSpaceStandard_BT601) {
+        wr = 0.2990f; wb = 0.1140f;
+    } else if (iMatrix == ColorSpaceStandard_BT2020) {
+        wr = 0.2627f; wb = 0.0593f;
+        // 10-bit only
+        black = 64 << 6; white = 940 << 6;
+        max = (1 << 16) - 1;
+    }
+}
+
+/** Rows produce R, G, B from (Y - low, U - mid, V - mid) */
+inline void GetMatYuv2Rgb(int iMatrix, float mat[3][3]) {
+    float wr, wb;
+    int black, white, max;
+    GetColorSpaceConstants(iMatrix, wr, wb, black, white, max);
+    float m[3][3] = {
+        1.0f, 0.0f, (1.0f - wr) / 0.5f,
+        1.0f, -wb * (1.0f - wb) / 0.5f / (1 - wb - wr), -wr * (1 - wr) / 0.5f / (1 - wb - wr),
+        1.0f, (1.0f - wb) / 0.5f, 0.0f,
+    };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            mat[i][j] = (float)(1.0 * max / (white - black) * m[i][j]);
+        }
+    }
+}
+
+/** Rows produce Y - low, U - mid, V - mid from (R, G, B) */
+inline void GetMatRgb2Yuv(int iMatrix, float mat[3][3]) {
+    float wr, wb;
+    int black, white, max;
+    GetColorSpaceConstants(iMatrix, wr, wb, black, white, max);
+    float m[3][3] = {
+        wr, 1.0f - wb - wr, wb,
+        -0.5f * wr / (1.0f - wb), -0.5f * (1 - wb - wr) / (1.0f - wb), 0.5f,
+        0.5f, -0.5f * (1.0f - wb - wr) / (1.0f - wr), -0.5f * wb / (1.0f - wr),
+    };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            mat[i][j] = (float)(1.0 * (white - black) / max * m[i][j]);
+        }
+    }
+}
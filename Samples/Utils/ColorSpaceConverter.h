@@ -0,0 +1,521 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include "ColorSpace.h"
+#include "YuvConverter.h"
+
+/**
+* @brief Host versions of the ColorSpace.cu conversions.
+*
+* The scalar kernels repeat the GPU arithmetic (single precision, same operation order,
+* clamp and truncation), so they are the reference the SIMD kernels are checked against.
+* 8-bit YUV input uses 16-bit fixed point (Q13 coefficients, madd/vmlal) in the AVX2 and
+* NEON kernels, which is within 1 LSB of the GPU. 16-bit data would need more than 16-bit
+* lanes for 1 LSB accuracy, so those kernels use the same single-precision arithmetic as
+* the GPU in 8 lanes instead. SSE2 has no kernels of its own and runs the scalar code.
+*/
+enum ColorSpaceRgbLayout {
+    /** 8 bits per channel, B G R A (A = 0, as written by the GPU kernels) */
+    COLOR_SPACE_BGRA32 = 0,
+    /** 16 bits per channel, B G R A */
+    COLOR_SPACE_BGRA64,
+    /** Three 8-bit planes B, G, R, each nHeight rows of the given pitch */
+    COLOR_SPACE_BGR_PLANAR,
+};
+
+/** Coefficients of a GetMatYuv2Rgb() matrix in Q13 with the 8-bit offsets folded into a bias */
+struct ColorSpaceFixedMat {
+    static const int nFractionBits = 13;
+    int16_t cy;
+    int16_t acu[3], acv[3];
+    int32_t aBias[3];
+
+    static ColorSpaceFixedMat FromYuv2Rgb(const float mat[3][3]) {
+        ColorSpaceFixedMat f;
+        f.cy = (int16_t)lrintf(mat[0][0] * (1 << nFractionBits));
+        for (int i = 0; i < 3; i++) {
+            f.acu[i] = (int16_t)lrintf(mat[i][1] * (1 << nFractionBits));
+            f.acv[i] = (int16_t)lrintf(mat[i][2] * (1 << nFractionBits));
+            f.aBias[i] = -16 * f.cy - 128 * (f.acu[i] + f.acv[i]);
+        }
+        return f;
+    }
+};
+
+inline void StoreRgbPixel(uint8_t *pDst, size_t nPlane, int x, ColorSpaceRgbLayout eLayout, int nBit, const int aRgb[3]) {
+    switch (eLayout) {
+    case COLOR_SPACE_BGRA32:
+        for (int i = 0; i < 3; i++) {
+            pDst[x * 4 + i] = (uint8_t)(nBit == 16 ? aRgb[2 - i] >> 8 : aRgb[2 - i]);
+        }
+        pDst[x * 4 + 3] = 0;
+        break;
+    case COLOR_SPACE_BGRA64:
+        for (int i = 0; i < 3; i++) {
+            ((uint16_t *)pDst)[x * 4 + i] = (uint16_t)(nBit == 8 ? aRgb[2 - i] << 8 : aRgb[2 - i]);
+        }
+        ((uint16_t *)pDst)[x * 4 + 3] = 0;
+        break;
+    case COLOR_SPACE_BGR_PLANAR:
+        for (int i = 0; i < 3; i++) {
+            pDst[nPlane * i + x] = (uint8_t)(nBit == 16 ? aRgb[2 - i] >> 8 : aRgb[2 - i]);
+        }
+        break;
+    }
+}
+
+/** One luma row from column iBegin to nWidth (even); pUV is the chroma row shared by two luma rows */
+template<typename YuvUnit>
+inline void YuvToRgbRowScalar(const YuvUnit *pY, const YuvUnit *pUV, int iBegin, int nWidth, const float mat[3][3],
+    ColorSpaceRgbLayout eLayout, uint8_t *pDst, size_t nPlane) {
+    const int nBit = sizeof(YuvUnit) * 8, low = 1 << (nBit - 4), mid = 1 << (nBit - 1);
+    const float maxf = (1 << nBit) - 1.0f;
+    for (int x = iBegin; x < nWidth; x++) {
+        float fy = (float)((int)pY[x] - low), fu = (float)((int)pUV[x & ~1] - mid), fv = (float)((int)pUV[x | 1] - mid);
+        int aRgb[3];
+        for (int i = 0; i < 3; i++) {
+            float f = mat[i][0] * fy + mat[i][1] * fu + mat[i][2] * fv;
+            aRgb[i] = (int)(f < 0.0f ? 0.0f : (f > maxf ? maxf : f));
+        }
+        StoreRgbPixel(pDst, nPlane, x, eLayout, nBit, aRgb);
+    }
+}
+
+/** Two RGB rows to two luma rows and one chroma row, from column iBegin to nWidth (even) */
+inline void Bgra64ToP016RowScalar(const uint16_t *pRgb0, const uint16_t *pRgb1, uint16_t *pY0, uint16_t *pY1, uint16_t *pUV,
+    int iBegin, int nWidth, const float mat[3][3]) {
+    const int low = 1 << 12, mid = 1 << 15;
+    for (int x = iBegin; x < nWidth; x += 2) {
+        const uint16_t *ap[4] = {pRgb0 + x * 4, pRgb0 + x * 4 + 4, pRgb1 + x * 4, pRgb1 + x * 4 + 4};
+        uint16_t *apY[4] = {pY0 + x, pY0 + x + 1, pY1 + x, pY1 + x + 1};
+        int aSum[3] = {0, 0, 0};
+        for (int k = 0; k < 4; k++) {
+            float r = ap[k][2], g = ap[k][1], b = ap[k][0];
+            *apY[k] = (uint16_t)(mat[0][0] * r + mat[0][1] * g + mat[0][2] * b + low);
+            aSum[0] += ap[k][2];
+            aSum[1] += ap[k][1];
+            aSum[2] += ap[k][0];
+        }
+        float r = (float)(aSum[0] / 4), g = (float)(aSum[1] / 4), b = (float)(aSum[2] / 4);
+        pUV[x] = (uint16_t)(mat[1][0] * r + mat[1][1] * g + mat[1][2] * b + mid);
+        pUV[x + 1] = (uint16_t)(mat[2][0] * r + mat[2][1] * g + mat[2][2] * b + mid);
+    }
+}
+
+#if defined(YUV_SIMD_X86)
+/** 16 pixels as 16-bit B, G, R lanes in pixel order */
+YUV_TARGET_AVX2 inline void StoreRgb16Avx2(__m256i b, __m256i g, __m256i r, ColorSpaceRgbLayout eLayout, uint8_t *pDst, size_t nPlane) {
+    const __m256i zero = _mm256_setzero_si256();
+    switch (eLayout) {
+    case COLOR_SPACE_BGRA32: {
+        __m256i bg = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b), _mm256_packus_epi16(g, g));
+        __m256i ra = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r), zero);
+        // Lane 0 holds pixels 0-7 and lane 1 pixels 8-15 of each unpack result
+        __m256i p0 = _mm256_unpacklo_epi16(bg, ra), p1 = _mm256_unpackhi_epi16(bg, ra);
+        _mm256_storeu_si256((__m256i *)pDst, _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256((__m256i *)(pDst + 32), _mm256_permute2x128_si256(p0, p1, 0x31));
+        break;
+    }
+    case COLOR_SPACE_BGRA64: {
+        const __m256i max8 = _mm256_set1_epi16(255);
+        b = _mm256_slli_epi16(_mm256_min_epi16(_mm256_max_epi16(b, zero), max8), 8);
+        g = _mm256_slli_epi16(_mm256_min_epi16(_mm256_max_epi16(g, zero), max8), 8);
+        r = _mm256_slli_epi16(_mm256_min_epi16(_mm256_max_epi16(r, zero), max8), 8);
+        __m256i bgLo = _mm256_unpacklo_epi16(b, g), bgHi = _mm256_unpackhi_epi16(b, g);
+        __m256i raLo = _mm256_unpacklo_epi16(r, zero), raHi = _mm256_unpackhi_epi16(r, zero);
+        __m256i q0 = _mm256_unpacklo_epi32(bgLo, raLo), q1 = _mm256_unpackhi_epi32(bgLo, raLo);
+        __m256i q2 = _mm256_unpacklo_epi32(bgHi, raHi), q3 = _mm256_unpackhi_epi32(bgHi, raHi);
+        _mm256_storeu_si256((__m256i *)pDst, _mm256_permute2x128_si256(q0, q1, 0x20));
+        _mm256_storeu_si256((__m256i *)(pDst + 32), _mm256_permute2x128_si256(q2, q3, 0x20));
+        _mm256_storeu_si256((__m256i *)(pDst + 64), _mm256_permute2x128_si256(q0, q1, 0x31));
+        _mm256_storeu_si256((__m256i *)(pDst + 96), _mm256_permute2x128_si256(q2, q3, 0x31));
+        break;
+    }
+    case COLOR_SPACE_BGR_PLANAR:
+        _mm_storeu_si128((__m128i *)pDst, _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(b, b), 0x08)));
+        _mm_storeu_si128((__m128i *)(pDst + nPlane), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(g, g), 0x08)));
+        _mm_storeu_si128((__m128i *)(pDst + nPlane * 2), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(r, r), 0x08)));
+        break;
+    }
+}
+
+/** 8-bit YUV, 16 pixels per step in Q13 fixed point; returns the number of pixels converted */
+YUV_TARGET_AVX2 inline int Nv12ToRgbRowAvx2(const uint8_t *pY, const uint8_t *pUV, int nWidth, const ColorSpaceFixedMat &f,
+    ColorSpaceRgbLayout eLayout, uint8_t *pDst, size_t nPlane) {
+    const __m256i zero = _mm256_setzero_si256();
+    // (cy, 0) pairs multiply (y, 0) pairs; (cu, cv) pairs multiply (u, v) pairs
+    const __m256i cy = _mm256_set1_epi32((uint16_t)f.cy);
+    __m256i acuv[3], aBias[3];
+    for (int i = 0; i < 3; i++) {
+        acuv[i] = _mm256_set1_epi32((int32_t)((uint32_t)(uint16_t)f.acu[i] | (uint32_t)(uint16_t)f.acv[i] << 16));
+        aBias[i] = _mm256_set1_epi32(f.aBias[i]);
+    }
+    const int nPixelSize = eLayout == COLOR_SPACE_BGRA32 ? 4 : eLayout == COLOR_SPACE_BGRA64 ? 8 : 1;
+    int x = 0;
+    for (; x + 16 <= nWidth; x += 16) {
+        __m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(pY + x)));
+        __m256i uv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(pUV + x)));
+        // unpacklo/hi give pixels 0-3 / 4-7 in lane 0 and 8-11 / 12-15 in lane 1
+        __m256i lumaLo = _mm256_madd_epi16(_mm256_unpacklo_epi16(y, zero), cy);
+        __m256i lumaHi = _mm256_madd_epi16(_mm256_unpackhi_epi16(y, zero), cy);
+        __m256i a[3];
+        for (int i = 0; i < 3; i++) {
+            // One value per chroma pair, duplicated to match the luma order above
+            __m256i c = _mm256_add_epi32(_mm256_madd_epi16(uv, acuv[i]), aBias[i]);
+            __m256i lo = _mm256_srai_epi32(_mm256_add_epi32(lumaLo, _mm256_unpacklo_epi32(c, c)), ColorSpaceFixedMat::nFractionBits);
+            __m256i hi = _mm256_srai_epi32(_mm256_add_epi32(lumaHi, _mm256_unpackhi_epi32(c, c)), ColorSpaceFixedMat::nFractionBits);
+            a[i] = _mm256_packs_epi32(lo, hi);
+        }
+        StoreRgb16Avx2(a[2], a[1], a[0], eLayout, pDst + (size_t)x * nPixelSize, nPlane);
+    }
+    return x;
+}
+
+/** 16-bit YUV, 8 pixels per step in single precision; returns the number of pixels converted */
+YUV_TARGET_AVX2 inline int P016ToRgbRowAvx2(const uint16_t *pY, const uint16_t *pUV, int nWidth, const float mat[3][3],
+    ColorSpaceRgbLayout eLayout, uint8_t *pDst, size_t nPlane) {
+    const __m256 low = _mm256_set1_ps(1 << 12), mid = _mm256_set1_ps(1 << 15), maxf = _mm256_set1_ps(65535.0f), zerof = _mm256_setzero_ps();
+    const __m256i iu = _mm256_setr_epi32(0, 0, 2, 2, 4, 4, 6, 6), iv = _mm256_setr_epi32(1, 1, 3, 3, 5, 5, 7, 7);
+    __m256 am[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            am[i][j] = _mm256_set1_ps(mat[i][j]);
+        }
+    }
+    const int nPixelSize = eLayout == COLOR_SPACE_BGRA32 ? 4 : eLayout == COLOR_SPACE_BGRA64 ? 8 : 1;
+    int x = 0;
+    for (; x + 8 <= nWidth; x += 8) {
+        __m256 fy = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(pY + x)))), low);
+        __m256i uv = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(pUV + x)));
+        __m256 fu = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_permutevar8x32_epi32(uv, iu)), mid);
+        __m256 fv = _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_permutevar8x32_epi32(uv, iv)), mid);
+        __m256i a[3];
+        for (int i = 0; i < 3; i++) {
+            __m256 f = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(am[i][0], fy), _mm256_mul_ps(am[i][1], fu)), _mm256_mul_ps(am[i][2], fv));
+            a[i] = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(f, zerof), maxf));
+        }
+        uint8_t *p = pDst + (size_t)x * nPixelSize;
+        switch (eLayout) {
+        case COLOR_SPACE_BGRA32: {
+            __m256i v = _mm256_or_si256(_mm256_srli_epi32(a[2], 8),
+                _mm256_or_si256(_mm256_and_si256(a[1], _mm256_set1_epi32(0xff00)), _mm256_slli_epi32(_mm256_srli_epi32(a[0], 8), 16)));
+            _mm256_storeu_si256((__m256i *)p, v);
+            break;
+        }
+        case COLOR_SPACE_BGRA64: {
+            __m256i bg = _mm256_or_si256(a[2], _mm256_slli_epi32(a[1], 16));
+            __m256i q0 = _mm256_unpacklo_epi32(bg, a[0]), q1 = _mm256_unpackhi_epi32(bg, a[0]);
+            _mm256_storeu_si256((__m256i *)p, _mm256_permute2x128_si256(q0, q1, 0x20));
+            _mm256_storeu_si256((__m256i *)(p + 32), _mm256_permute2x128_si256(q0, q1, 0x31));
+            break;
+        }
+        case COLOR_SPACE_BGR_PLANAR: {
+            const __m256i gather = _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1);
+            for (int i = 0; i < 3; i++) {
+                __m256i v = _mm256_packus_epi32(_mm256_srli_epi32(a[2 - i], 8), _mm256_srli_epi32(a[2 - i], 8));
+                v = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(v, v), gather);
+                _mm_storel_epi64((__m128i *)(p + nPlane * i), _mm256_castsi256_si128(v));
+            }
+            break;
+        }
+        }
+    }
+    return x;
+}
+
+/** 4 BGRA64 pixels per vector to 32-bit B, G, R lanes of 8 pixels */
+YUV_TARGET_AVX2 inline void LoadBgra64Avx2(const uint16_t *p, __m256i &b, __m256i &g, __m256i &r) {
+    const __m256i mask = _mm256_set1_epi32(0xffff), split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)p), v1 = _mm256_loadu_si256((const __m256i *)(p + 16));
+    // Each pixel is (b | g << 16, r | a << 16); gather b and r, then g
+    __m256i br0 = _mm256_permutevar8x32_epi32(_mm256_and_si256(v0, mask), split), br1 = _mm256_permutevar8x32_epi32(_mm256_and_si256(v1, mask), split);
+    __m256i ga0 = _mm256_permutevar8x32_epi32(_mm256_srli_epi32(v0, 16), split), ga1 = _mm256_permutevar8x32_epi32(_mm256_srli_epi32(v1, 16), split);
+    b = _mm256_permute2x128_si256(br0, br1, 0x20);
+    r = _mm256_permute2x128_si256(br0, br1, 0x31);
+    g = _mm256_permute2x128_si256(ga0, ga1, 0x20);
+}
+
+YUV_TARGET_AVX2 inline __m256 MulRowAvx2(const __m256 am[3], __m256 r, __m256 g, __m256 b, __m256 offset) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(am[0], r), _mm256_mul_ps(am[1], g)), _mm256_mul_ps(am[2], b)), offset);
+}
+
+/** 8 pixels of two rows per step; returns the number of pixels converted */
+YUV_TARGET_AVX2 inline int Bgra64ToP016RowAvx2(const uint16_t *pRgb0, const uint16_t *pRgb1, uint16_t *pY0, uint16_t *pY1, uint16_t *pUV,
+    int nWidth, const float mat[3][3]) {
+    const __m256 low = _mm256_set1_ps(1 << 12), mid = _mm256_set1_ps(1 << 15);
+    const __m256i gather = _mm256_setr_epi32(0, 1, 4, 5, 0, 1, 4, 5);
+    __m256 am[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            am[i][j] = _mm256_set1_ps(mat[i][j]);
+        }
+    }
+    int x = 0;
+    for (; x + 8 <= nWidth; x += 8) {
+        __m256i b0, g0, r0, b1, g1, r1;
+        LoadBgra64Avx2(pRgb0 + x * 4, b0, g0, r0);
+        LoadBgra64Avx2(pRgb1 + x * 4, b1, g1, r1);
+        __m256i y0 = _mm256_cvttps_epi32(MulRowAvx2(am[0], _mm256_cvtepi32_ps(r0), _mm256_cvtepi32_ps(g0), _mm256_cvtepi32_ps(b0), low));
+        __m256i y1 = _mm256_cvttps_epi32(MulRowAvx2(am[0], _mm256_cvtepi32_ps(r1), _mm256_cvtepi32_ps(g1), _mm256_cvtepi32_ps(b1), low));
+        _mm_storeu_si128((__m128i *)(pY0 + x), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(y0, y0), 0x08)));
+        _mm_storeu_si128((__m128i *)(pY1 + x), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(y1, y1), 0x08)));
+
+        // 2x2 sums; hadd leaves the four chroma samples in elements 0, 1, 4, 5
+        __m256i rs = _mm256_add_epi32(r0, r1), gs = _mm256_add_epi32(g0, g1), bs = _mm256_add_epi32(b0, b1);
+        __m256 r = _mm256_cvtepi32_ps(_mm256_srli_epi32(_mm256_hadd_epi32(rs, rs), 2));
+        __m256 g = _mm256_cvtepi32_ps(_mm256_srli_epi32(_mm256_hadd_epi32(gs, gs), 2));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_srli_epi32(_mm256_hadd_epi32(bs, bs), 2));
+        __m256i u = _mm256_cvttps_epi32(MulRowAvx2(am[1], r, g, b, mid)), v = _mm256_cvttps_epi32(MulRowAvx2(am[2], r, g, b, mid));
+        __m256i uv = _mm256_permutevar8x32_epi32(_mm256_or_si256(u, _mm256_slli_epi32(v, 16)), gather);
+        _mm_storeu_si128((__m128i *)(pUV + x), _mm256_castsi256_si128(uv));
+    }
+    return x;
+}
+#endif
+
+#if defined(YUV_SIMD_NEON)
+inline void StoreRgb8Neon(uint8x8_t b, uint8x8_t g, uint8x8_t r, ColorSpaceRgbLayout eLayout, uint8_t *pDst, size_t nPlane) {
+    switch (eLayout) {
+    case COLOR_SPACE_BGRA32: {
+        uint8x8x4_t bgra = {{b, g, r, vdup_n_u8(0)}};
+        vst4_u8(pDst, bgra);
+        break;
+    }
+    case COLOR_SPACE_BGRA64: {
+        uint16x8x4_t bgra = {{vshll_n_u8(b, 8), vshll_n_u8(g, 8), vshll_n_u8(r, 8), vdupq_n_u16(0)}};
+        vst4q_u16((uint16_t *)pDst, bgra);
+        break;
+    }
+    case COLOR_SPACE_BGR_PLANAR:
+        vst1_u8(pDst, b);
+        vst1_u8(pDst + nPlane, g);
+        vst1_u8(pDst + nPlane * 2, r);
+        break;
+    }
+}
+
+/** 8-bit YUV, 8 pixels per step in Q13 fixed point; returns the number of pixels converted */
+inline int Nv12ToRgbRowNeon(const uint8_t *pY, const uint8_t *pUV, int nWidth, const ColorSpaceFixedMat &f,
+    ColorSpaceRgbLayout eLayout, uint8_t *pDst, size_t nPlane) {
+    const int nPixelSize = eLayout == COLOR_SPACE_BGRA32 ? 4 : eLayout == COLOR_SPACE_BGRA64 ? 8 : 1;
+    int x = 0;
+    for (; x + 8 <= nWidth; x += 8) {
+        // Wrap-around of the unsigned subtraction leaves the right signed values
+        int16x8_t y = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(pY + x), vdup_n_u8(16)));
+        uint8x8_t uvRaw = vld1_u8(pUV + x);
+        uint8x8x2_t uv = vuzp_u8(uvRaw, uvRaw);
+        int16x8_t u = vreinterpretq_s16_u16(vsubl_u8(vzip_u8(uv.val[0], uv.val[0]).val[0], vdup_n_u8(128)));
+        int16x8_t v = vreinterpretq_s16_u16(vsubl_u8(vzip_u8(uv.val[1], uv.val[1]).val[0], vdup_n_u8(128)));
+        uint8x8_t a[3];
+        for (int i = 0; i < 3; i++) {
+            int32x4_t lo = vmull_n_s16(vget_low_s16(y), f.cy), hi = vmull_n_s16(vget_high_s16(y), f.cy);
+            lo = vmlal_n_s16(vmlal_n_s16(lo, vget_low_s16(u), f.acu[i]), vget_low_s16(v), f.acv[i]);
+            hi = vmlal_n_s16(vmlal_n_s16(hi, vget_high_s16(u), f.acu[i]), vget_high_s16(v), f.acv[i]);
+            a[i] = vqmovun_s16(vcombine_s16(vqshrn_n_s32(lo, ColorSpaceFixedMat::nFractionBits), vqshrn_n_s32(hi, ColorSpaceFixedMat::nFractionBits)));
+        }
+        StoreRgb8Neon(a[2], a[1], a[0], eLayout, pDst + (size_t)x * nPixelSize, nPlane);
+    }
+    return x;
+}
+
+inline float32x4_t MulRowNeon(const float *m, float32x4_t a, float32x4_t b, float32x4_t c) {
+    return vaddq_f32(vaddq_f32(vmulq_n_f32(a, m[0]), vmulq_n_f32(b, m[1])), vmulq_n_f32(c, m[2]));
+}
+
+/** 16-bit YUV, 8 pixels per step in single precision; returns the number of pixels converted */
+inline int P016ToRgbRowNeon(const uint16_t *pY, const uint16_t *pUV, int nWidth, const float mat[3][3],
+    ColorSpaceRgbLayout eLayout, uint8_t *pDst, size_t nPlane) {
+    const float32x4_t low = vdupq_n_f32(1 << 12), mid = vdupq_n_f32(1 << 15), maxf = vdupq_n_f32(65535.0f), zerof = vdupq_n_f32(0.0f);
+    const int nPixelSize = eLayout == COLOR_SPACE_BGRA32 ? 4 : eLayout == COLOR_SPACE_BGRA64 ? 8 : 1;
+    int x = 0;
+    for (; x + 8 <= nWidth; x += 8) {
+        uint16x8_t y = vld1q_u16(pY + x), uvRaw = vld1q_u16(pUV + x);
+        uint16x8x2_t uv = vuzpq_u16(uvRaw, uvRaw);
+        uint16x8_t u = vzipq_u16(uv.val[0], uv.val[0]).val[0], v = vzipq_u16(uv.val[1], uv.val[1]).val[0];
+        uint16x8_t a[3];
+        for (int i = 0; i < 3; i++) {
+            uint16x4_t half[2];
+            for (int h = 0; h < 2; h++) {
+                uint16x4_t yh = h ? vget_high_u16(y) : vget_low_u16(y), uh = h ? vget_high_u16(u) : vget_low_u16(u), vh = h ? vget_high_u16(v) : vget_low_u16(v);
+                float32x4_t fy = vsubq_f32(vcvtq_f32_u32(vmovl_u16(yh)), low);
+                float32x4_t fu = vsubq_f32(vcvtq_f32_u32(vmovl_u16(uh)), mid), fv = vsubq_f32(vcvtq_f32_u32(vmovl_u16(vh)), mid);
+                float32x4_t f = vminq_f32(vmaxq_f32(MulRowNeon(mat[i], fy, fu, fv), zerof), maxf);
+                half[h] = vmovn_u32(vcvtq_u32_f32(f));
+            }
+            a[i] = vcombine_u16(half[0], half[1]);
+        }
+        uint8_t *p = pDst + (size_t)x * nPixelSize;
+        if (eLayout == COLOR_SPACE_BGRA64) {
+            uint16x8x4_t bgra = {{a[2], a[1], a[0], vdupq_n_u16(0)}};
+            vst4q_u16((uint16_t *)p, bgra);
+        } else {
+            StoreRgb8Neon(vshrn_n_u16(a[2], 8), vshrn_n_u16(a[1], 8), vshrn_n_u16(a[0], 8), eLayout, p, nPlane);
+        }
+    }
+    return x;
+}
+
+/** 8 pixels of two rows per step; returns the number of pixels converted */
+inline int Bgra64ToP016RowNeon(const uint16_t *pRgb0, const uint16_t *pRgb1, uint16_t *pY0, uint16_t *pY1, uint16_t *pUV,
+    int nWidth, const float mat[3][3]) {
+    const float32x4_t low = vdupq_n_f32(1 << 12), mid = vdupq_n_f32(1 << 15);
+    int x = 0;
+    for (; x + 8 <= nWidth; x += 8) {
+        uint16x8x4_t p0 = vld4q_u16(pRgb0 + x * 4), p1 = vld4q_u16(pRgb1 + x * 4);
+        const uint16x8x4_t *ap[2] = {&p0, &p1};
+        uint16_t *apY[2] = {pY0 + x, pY1 + x};
+        for (int k = 0; k < 2; k++) {
+            uint16x4_t half[2];
+            for (int h = 0; h < 2; h++) {
+                float32x4_t c[3];
+                for (int i = 0; i < 3; i++) {
+                    uint16x8_t ch = ap[k]->val[2 - i];
+                    c[i] = vcvtq_f32_u32(vmovl_u16(h ? vget_high_u16(ch) : vget_low_u16(ch)));
+                }
+                half[h] = vmovn_u32(vcvtq_u32_f32(vaddq_f32(MulRowNeon(mat[0], c[0], c[1], c[2]), low)));
+            }
+            vst1q_u16(apY[k], vcombine_u16(half[0], half[1]));
+        }
+        // 2x2 averages of R, G, B
+        float32x4_t c[3];
+        for (int i = 0; i < 3; i++) {
+            uint16x8_t ch0 = p0.val[2 - i], ch1 = p1.val[2 - i];
+            uint32x4_t lo = vaddl_u16(vget_low_u16(ch0), vget_low_u16(ch1)), hi = vaddl_u16(vget_high_u16(ch0), vget_high_u16(ch1));
+            uint32x4_t s = vcombine_u32(vpadd_u32(vget_low_u32(lo), vget_high_u32(lo)), vpadd_u32(vget_low_u32(hi), vget_high_u32(hi)));
+            c[i] = vcvtq_f32_u32(vshrq_n_u32(s, 2));
+        }
+        uint16x4x2_t uv = {{
+            vmovn_u32(vcvtq_u32_f32(vaddq_f32(MulRowNeon(mat[1], c[0], c[1], c[2]), mid))),
+            vmovn_u32(vcvtq_u32_f32(vaddq_f32(MulRowNeon(mat[2], c[0], c[1], c[2]), mid))),
+        }};
+        vst2_u16(pUV + x, uv);
+    }
+    return x;
+}
+#endif
+
+/**
+* @brief Host implementation of the ColorSpace.cu conversions with the same signatures and
+* defaults, except that the pointers are host memory. Pitches are in bytes. As on the GPU,
+* an odd last column or row is not converted.
+*
+* Conversions are split into bands of row pairs over nThread threads; the threads are
+* created once in the constructor.
+*/
+class ColorSpaceConverter {
+public:
+    ColorSpaceConverter(int nThread = 1, YuvSimdLevel eLevel = GetYuvSimdLevel()) : eLevel(eLevel), runner(nThread) {}
+
+    void Nv12ToBgra32(const uint8_t *pNv12, int nNv12Pitch, uint8_t *pBgra, int nBgraPitch, int nWidth, int nHeight, int iMatrix = 0) {
+        YuvToRgb<uint8_t>(pNv12, nNv12Pitch, pBgra, nBgraPitch, nWidth, nHeight, iMatrix, COLOR_SPACE_BGRA32);
+    }
+    void Nv12ToBgra64(const uint8_t *pNv12, int nNv12Pitch, uint8_t *pBgra, int nBgraPitch, int nWidth, int nHeight, int iMatrix = 0) {
+        YuvToRgb<uint8_t>(pNv12, nNv12Pitch, pBgra, nBgraPitch, nWidth, nHeight, iMatrix, COLOR_SPACE_BGRA64);
+    }
+    void P016ToBgra32(const uint8_t *pP016, int nP016Pitch, uint8_t *pBgra, int nBgraPitch, int nWidth, int nHeight, int iMatrix = 4) {
+        YuvToRgb<uint16_t>(pP016, nP016Pitch, pBgra, nBgraPitch, nWidth, nHeight, iMatrix, COLOR_SPACE_BGRA32);
+    }
+    void P016ToBgra64(const uint8_t *pP016, int nP016Pitch, uint8_t *pBgra, int nBgraPitch, int nWidth, int nHeight, int iMatrix = 4) {
+        YuvToRgb<uint16_t>(pP016, nP016Pitch, pBgra, nBgraPitch, nWidth, nHeight, iMatrix, COLOR_SPACE_BGRA64);
+    }
+    void Nv12ToBgrPlanar(const uint8_t *pNv12, int nNv12Pitch, uint8_t *pBgrp, int nBgrpPitch, int nWidth, int nHeight, int iMatrix = 0) {
+        YuvToRgb<uint8_t>(pNv12, nNv12Pitch, pBgrp, nBgrpPitch, nWidth, nHeight, iMatrix, COLOR_SPACE_BGR_PLANAR);
+    }
+    void P016ToBgrPlanar(const uint8_t *pP016, int nP016Pitch, uint8_t *pBgrp, int nBgrpPitch, int nWidth, int nHeight, int iMatrix = 4) {
+        YuvToRgb<uint16_t>(pP016, nP016Pitch, pBgrp, nBgrpPitch, nWidth, nHeight, iMatrix, COLOR_SPACE_BGR_PLANAR);
+    }
+
+    void Bgra64ToP016(const uint8_t *pBgra, int nBgraPitch, uint8_t *pP016, int nP016Pitch, int nWidth, int nHeight, int iMatrix = 4) {
+        NVTRACE_SCOPE("Color conversion");
+        float mat[3][3];
+        GetMatRgb2Yuv(iMatrix, mat);
+        int nEvenWidth = nWidth & ~1;
+        runner.Run(nHeight / 2, [&](int iBegin, int iEnd) {
+            for (int j = iBegin; j < iEnd; j++) {
+                const uint16_t *pRgb0 = (const uint16_t *)(pBgra + (size_t)j * 2 * nBgraPitch);
+                const uint16_t *pRgb1 = (const uint16_t *)(pBgra + ((size_t)j * 2 + 1) * nBgraPitch);
+                uint16_t *pY0 = (uint16_t *)(pP016 + (size_t)j * 2 * nP016Pitch);
+                uint16_t *pY1 = (uint16_t *)(pP016 + ((size_t)j * 2 + 1) * nP016Pitch);
+                uint16_t *pUV = (uint16_t *)(pP016 + ((size_t)nHeight + j) * nP016Pitch);
+                int x = 0;
+#if defined(YUV_SIMD_X86)
+                if (eLevel == YUV_SIMD_AVX2) {
+                    x = Bgra64ToP016RowAvx2(pRgb0, pRgb1, pY0, pY1, pUV, nEvenWidth, mat);
+                }
+#elif defined(YUV_SIMD_NEON)
+                if (eLevel == YUV_SIMD_NEON) {
+                    x = Bgra64ToP016RowNeon(pRgb0, pRgb1, pY0, pY1, pUV, nEvenWidth, mat);
+                }
+#endif
+                Bgra64ToP016RowScalar(pRgb0, pRgb1, pY0, pY1, pUV, x, nEvenWidth, mat);
+            }
+        });
+    }
+
+private:
+    template<typename YuvUnit>
+    void YuvToRgb(const uint8_t *pYuv, int nYuvPitch, uint8_t *pRgb, int nRgbPitch, int nWidth, int nHeight, int iMatrix,
+        ColorSpaceRgbLayout eLayout) {
+        NVTRACE_SCOPE("Color conversion");
+        float mat[3][3];
+        GetMatYuv2Rgb(iMatrix, mat);
+        ColorSpaceFixedMat f = ColorSpaceFixedMat::FromYuv2Rgb(mat);
+        size_t nPlane = (size_t)nRgbPitch * nHeight;
+        int nEvenWidth = nWidth & ~1;
+        runner.Run(nHeight / 2, [&](int iBegin, int iEnd) {
+            for (int j = iBegin; j < iEnd; j++) {
+                const YuvUnit *pUV = (const YuvUnit *)(pYuv + ((size_t)nHeight + j) * nYuvPitch);
+                for (int k = 0; k < 2; k++) {
+                    int y = j * 2 + k;
+                    const YuvUnit *pY = (const YuvUnit *)(pYuv + (size_t)y * nYuvPitch);
+                    uint8_t *pDst = pRgb + (size_t)y * nRgbPitch;
+                    int x = RowSimd(pY, pUV, nEvenWidth, mat, f, eLayout, pDst, nPlane);
+                    YuvToRgbRowScalar(pY, pUV, x, nEvenWidth, mat, eLayout, pDst, nPlane);
+                }
+            }
+        });
+    }
+
+    int RowSimd(const uint8_t *pY, const uint8_t *pUV, int nWidth, const float[3][3], const ColorSpaceFixedMat &f,
+        ColorSpaceRgbLayout eLayout, uint8_t *pDst, size_t nPlane) const {
+#if defined(YUV_SIMD_X86)
+        if (eLevel == YUV_SIMD_AVX2) {
+            return Nv12ToRgbRowAvx2(pY, pUV, nWidth, f, eLayout, pDst, nPlane);
+        }
+#elif defined(YUV_SIMD_NEON)
+        if (eLevel == YUV_SIMD_NEON) {
+            return Nv12ToRgbRowNeon(pY, pUV, nWidth, f, eLayout, pDst, nPlane);
+        }
+#endif
+        return 0;
+    }
+
+    int RowSimd(const uint16_t *pY, const uint16_t *pUV, int nWidth, const float mat[3][3], const ColorSpaceFixedMat &,
+        ColorSpaceRgbLayout eLayout, uint8_t *pDst, size_t nPlane) const {
+#if defined(YUV_SIMD_X86)
+        if (eLevel == YUV_SIMD_AVX2) {
+            return P016ToRgbRowAvx2(pY, pUV, nWidth, mat, eLayout, pDst, nPlane);
+        }
+#elif defined(YUV_SIMD_NEON)
+        if (eLevel == YUV_SIMD_NEON) {
+            return P016ToRgbRowNeon(pY, pUV, nWidth, mat, eLayout, pDst, nPlane);
+        }
+#endif
+        return 0;
+    }
+
+    YuvSimdLevel eLevel;
+    YuvBandRunner runner;
+};
@@ -16,6 +16,7 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 }
 #include "NvCodecUtils.h"
+#include "Tracer.h"
 
 class FFmpegDemuxer {
 private:
@@ -160,6 +161,7 @@ public:
         if (!fmtc) {
             return false;
         }
+        NVTRACE_SCOPE("Demux");
 
         *pnVideoBytes = 0;
 
@@ -0,0 +1,406 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+#pragma once
+
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+};
+#include "Logger.h"
+#include "NalUnitParser.h"
+#include "NvPipeline.h"
+
+extern simplelogger::Logger *logger;
+
+enum SegmentFormat {
+    /** MPEG-TS segments; every segment starts with PAT/PMT and an IDR picture */
+    SEGMENT_FORMAT_TS,
+    /** Fragmented MP4: an init segment (ftyp+moov) followed by moof+mdat media segments */
+    SEGMENT_FORMAT_FMP4,
+};
+
+/**
+* @brief Cuts an H.264/HEVC elementary stream into segments of about secTargetDuration at
+* IDR/IRAP pictures and keeps a rolling HLS playlist (playlist.m3u8) of the last nPlaylistSize
+* segments in szOutDir. Segments are named segment_00000.ts (or .m4s, with init.mp4 for fMP4).
+*
+* The muxer writes into memory buffers taken from a preallocated pool; a finished segment is
+* queued to a background thread that writes the file, updates the playlist and returns the
+* buffer to the pool. Write() therefore never waits for the disk, not even at a rollover. Files
+* and the playlist are written under a temporary name and renamed, so readers never see them
+* half-written. Segments that left the playlist are deleted once they are nPlaylistSize segments
+* behind it, unless bDeleteOld is false.
+*
+* Timestamps are in units of 1/nFps, as returned by NvEncoder::GetPacketInfo(). Packets before
+* the first random access point are dropped. The encoder must insert an IDR at least every
+* secTargetDuration (set its GOP length accordingly), or segments get longer.
+*/
+class FFmpegSegmenter {
+public:
+    FFmpegSegmenter(AVCodecID eCodecId, int nWidth, int nHeight, int nFps, const char *szOutDir,
+        SegmentFormat eFormat = SEGMENT_FORMAT_TS, double secTargetDuration = 4.0, int nPlaylistSize = 5,
+        bool bDeleteOld = true, int nSegmentBufferSize = 4 << 20, int nPreallocatedBuffer = 4)
+        : eCodecId(eCodecId), nWidth(nWidth), nHeight(nHeight), nFps(nFps), strOutDir(szOutDir), eFormat(eFormat),
+        secTargetDuration(secTargetDuration), nPlaylistSize((std::max)(nPlaylistSize, 1)), bDeleteOld(bDeleteOld),
+        nSegmentBufferSize(nSegmentBufferSize), parser(eCodecId == AV_CODEC_ID_HEVC), jobChannel(256) {
+        if (!strOutDir.empty() && strOutDir.back() != '/' && strOutDir.back() != '\\') {
+            strOutDir += '/';
+        }
+        MakeDirectory(szOutDir);
+        for (int i = 0; i < nPreallocatedBuffer; i++) {
+            vpFreeBuffer.push_back(NewBuffer());
+        }
+        thIo = std::thread(&FFmpegSegmenter::IoProc, this);
+    }
+    ~FFmpegSegmenter() {
+        Close();
+    }
+
+    bool Write(const uint8_t *pData, int nBytes, int64_t nPts, int64_t nDts) {
+        if (bClosed || bFailed) {
+            return false;
+        }
+        bool bKey = parser.ContainsRandomAccessPoint(pData, nBytes);
+        if (!oc) {
+            if (!bKey) {
+                // A segment must start with a random access point
+                return true;
+            }
+            if (!Open(pData, nBytes)) {
+                bFailed = true;
+                return false;
+            }
+            StartSegment(nPts);
+        } else if (bKey && nPts - nSegmentStartPts >= (int64_t)(secTargetDuration * nFps + 0.5)) {
+            FinishSegment(nPts);
+            StartSegment(nPts);
+        }
+        nLastPts = (std::max)(nLastPts, nPts);
+
+        AVPacket pkt = {0};
+        av_init_packet(&pkt);
+        pkt.pts = av_rescale_q(nPts, AVRational {1, nFps}, vs->time_base);
+        pkt.dts = av_rescale_q(nDts, AVRational {1, nFps}, vs->time_base);
+        pkt.duration = av_rescale_q(1, AVRational {1, nFps}, vs->time_base);
+        pkt.stream_index = vs->index;
+        pkt.data = (uint8_t *)pData;
+        pkt.size = nBytes;
+        if (bKey) {
+            pkt.flags |= AV_PKT_FLAG_KEY;
+        }
+        if (av_write_frame(oc, &pkt) < 0) {
+            LOG(ERROR) << "FFMPEG: Error while writing video frame";
+            return false;
+        }
+        return true;
+    }
+
+    /** Writes the last segment, ends the playlist and waits for the I/O thread; called by the destructor */
+    void Close() {
+        if (bClosed) {
+            return;
+        }
+        bClosed = true;
+        if (oc) {
+            if (!bFailed) {
+                // Flushing the muxer also writes the PES packets that mpegts still holds
+                FinishSegment(nLastPts + 1);
+                // The trailer (mfra for fMP4) does not belong to any segment
+                bDiscard = true;
+                av_write_trailer(oc);
+            }
+            if (oc->pb) {
+                avio_flush(oc->pb);
+                av_freep(&oc->pb->buffer);
+                avio_context_free(&oc->pb);
+            }
+            avformat_free_context(oc);
+            oc = NULL;
+        }
+        Job job;
+        job.eType = Job::END;
+        jobChannel.Push(std::move(job));
+        jobChannel.Close();
+        thIo.join();
+    }
+
+    /** Segments handed to the I/O thread, and buffers allocated beyond the pool because it fell behind */
+    void GetStats(int &nSegment, int &nExtraBuffer) {
+        std::lock_guard<std::mutex> lock(mtxBuffer);
+        nSegment = iSegment;
+        nExtraBuffer = this->nExtraBuffer;
+    }
+
+private:
+    typedef std::unique_ptr<std::vector<uint8_t>> Buffer;
+
+    struct Job {
+        enum {SEGMENT, INIT, END} eType = SEGMENT;
+        Buffer pBuffer;
+        int iSegment = 0;
+        double secDuration = 0;
+    };
+
+    bool Open(const uint8_t *pData, int nBytes) {
+        av_register_all();
+        AVOutputFormat *fmt = av_guess_format(eFormat == SEGMENT_FORMAT_TS ? "mpegts" : "mp4", NULL, NULL);
+        if (!fmt || !(oc = avformat_alloc_context())) {
+            LOG(ERROR) << "FFMPEG: Could not create the muxer";
+            return false;
+        }
+        oc->oformat = fmt;
+        vs = avformat_new_stream(oc, NULL);
+        if (!vs) {
+            LOG(ERROR) << "FFMPEG: Could not alloc video stream";
+            return false;
+        }
+        vs->id = 0;
+        vs->time_base = AVRational {1, nFps};
+        AVCodecParameters *vpar = vs->codecpar;
+        vpar->codec_id = eCodecId;
+        vpar->codec_type = AVMEDIA_TYPE_VIDEO;
+        vpar->width = nWidth;
+        vpar->height = nHeight;
+        if (eFormat == SEGMENT_FORMAT_FMP4) {
+            // The sample description needs the parameter sets; the muxer converts them from Annex-B
+            std::vector<uint8_t> vExtra;
+            parser.ForEach(pData, nBytes, [&](const NalUnitParser::NalUnit &nal) {
+                if (parser.IsParameterSet(nal.nType)) {
+                    vExtra.insert(vExtra.end(), nal.pStart, nal.pStart + nal.nSize);
+                }
+                return true;
+            });
+            if (vExtra.empty()) {
+                LOG(ERROR) << "No parameter sets before the first keyframe; fragmented MP4 needs them";
+                return false;
+            }
+            vpar->extradata = (uint8_t *)av_mallocz(vExtra.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+            memcpy(vpar->extradata, vExtra.data(), vExtra.size());
+            vpar->extradata_size = (int)vExtra.size();
+        }
+
+        // The muxer writes into pCurrent through this context; a segment is cut by flushing it
+        const int nAvioBuffer = 64 * 1024;
+        uint8_t *pAvioBuffer = (uint8_t *)av_malloc(nAvioBuffer);
+        oc->pb = pAvioBuffer ? avio_alloc_context(pAvioBuffer, nAvioBuffer, 1, this, NULL, WritePacket, NULL) : NULL;
+        if (!oc->pb) {
+            av_free(pAvioBuffer);
+            LOG(ERROR) << "FFMPEG: Could not allocate AVIO context";
+            return false;
+        }
+        oc->flush_packets = 0;
+
+        AVDictionary *opts = NULL;
+        if (eFormat == SEGMENT_FORMAT_FMP4) {
+            // Fragments are cut only where we flush the muxer
+            av_dict_set(&opts, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+        }
+        pCurrent = TakeBuffer();
+        int ret = avformat_write_header(oc, &opts);
+        av_dict_free(&opts);
+        if (ret < 0) {
+            LOG(ERROR) << "FFMPEG: avformat_write_header error!";
+            return false;
+        }
+        if (eFormat == SEGMENT_FORMAT_FMP4) {
+            avio_flush(oc->pb);
+            Job job;
+            job.eType = Job::INIT;
+            job.pBuffer = std::move(pCurrent);
+            jobChannel.Push(std::move(job));
+            pCurrent = TakeBuffer();
+        }
+        return true;
+    }
+
+    void StartSegment(int64_t nPts) {
+        nSegmentStartPts = nPts;
+        if (!pCurrent) {
+            pCurrent = TakeBuffer();
+        }
+    }
+
+    void FinishSegment(int64_t nEndPts) {
+        // Push out what the muxer holds; with frag_custom this closes the fragment
+        av_write_frame(oc, NULL);
+        avio_flush(oc->pb);
+        if (eFormat == SEGMENT_FORMAT_TS) {
+            // Next segment starts with its own PAT/PMT, so it can be played on its own
+            av_opt_set(oc->priv_data, "mpegts_flags", "+resend_headers", 0);
+        }
+        Job job;
+        job.pBuffer = std::move(pCurrent);
+        job.secDuration = (double)(nEndPts - nSegmentStartPts) / nFps;
+        {
+            std::lock_guard<std::mutex> lock(mtxBuffer);
+            job.iSegment = iSegment++;
+        }
+        jobChannel.Push(std::move(job));
+    }
+
+    static int WritePacket(void *opaque, uint8_t *pBuf, int nBuf) {
+        FFmpegSegmenter *pThis = (FFmpegSegmenter *)opaque;
+        if (!pThis->bDiscard && pThis->pCurrent) {
+            pThis->pCurrent->insert(pThis->pCurrent->end(), pBuf, pBuf + nBuf);
+        }
+        return nBuf;
+    }
+
+    Buffer NewBuffer() {
+        Buffer pBuffer(new std::vector<uint8_t>);
+        pBuffer->reserve(nSegmentBufferSize);
+        return pBuffer;
+    }
+    Buffer TakeBuffer() {
+        std::lock_guard<std::mutex> lock(mtxBuffer);
+        if (vpFreeBuffer.empty()) {
+            // The I/O thread is behind; growing the pool beats stalling the encoder
+            nExtraBuffer++;
+            return NewBuffer();
+        }
+        Buffer pBuffer = std::move(vpFreeBuffer.back());
+        vpFreeBuffer.pop_back();
+        return pBuffer;
+    }
+    void ReturnBuffer(Buffer pBuffer) {
+        pBuffer->clear();
+        std::lock_guard<std::mutex> lock(mtxBuffer);
+        vpFreeBuffer.push_back(std::move(pBuffer));
+    }
+
+    void IoProc() {
+        Tracer::Get().SetThreadName("Segment writer");
+        struct Entry {
+            int iSegment;
+            double secDuration;
+        };
+        std::deque<Entry> dqPlaylist;
+        std::deque<int> dqExpired;
+        double secMaxDuration = secTargetDuration;
+        Job job;
+        while (jobChannel.Pop(job)) {
+            NVTRACE_SCOPE("Write segment");
+            if (job.eType == Job::INIT) {
+                WriteFile("init.mp4", *job.pBuffer);
+                ReturnBuffer(std::move(job.pBuffer));
+                continue;
+            }
+            if (job.eType == Job::SEGMENT) {
+                WriteFile(GetSegmentName(job.iSegment), *job.pBuffer);
+                ReturnBuffer(std::move(job.pBuffer));
+                dqPlaylist.push_back(Entry {job.iSegment, job.secDuration});
+                secMaxDuration = (std::max)(secMaxDuration, job.secDuration);
+                if ((int)dqPlaylist.size() > nPlaylistSize) {
+                    dqExpired.push_back(dqPlaylist.front().iSegment);
+                    dqPlaylist.pop_front();
+                }
+            }
+
+            std::ostringstream oss;
+            oss << "#EXTM3U\n"
+                << "#EXT-X-VERSION:" << (eFormat == SEGMENT_FORMAT_TS ? 3 : 7) << "\n"
+                << "#EXT-X-TARGETDURATION:" << (int)std::ceil(secMaxDuration) << "\n"
+                << "#EXT-X-MEDIA-SEQUENCE:" << (dqPlaylist.empty() ? 0 : dqPlaylist.front().iSegment) << "\n";
+            if (eFormat == SEGMENT_FORMAT_FMP4) {
+                oss << "#EXT-X-MAP:URI=\"init.mp4\"\n";
+            }
+            oss.setf(std::ios::fixed);
+            oss.precision(3);
+            for (const Entry &e : dqPlaylist) {
+                oss << "#EXTINF:" << e.secDuration << ",\n" << GetSegmentName(e.iSegment) << "\n";
+            }
+            if (job.eType == Job::END) {
+                oss << "#EXT-X-ENDLIST\n";
+            }
+            std::string str = oss.str();
+            WriteFile("playlist.m3u8", std::vector<uint8_t>(str.begin(), str.end()));
+
+            // Players that loaded an older playlist may still fetch these for a while
+            while (bDeleteOld && (int)dqExpired.size() > nPlaylistSize) {
+                remove((strOutDir + GetSegmentName(dqExpired.front())).c_str());
+                dqExpired.pop_front();
+            }
+        }
+    }
+
+    std::string GetSegmentName(int iSegment) const {
+        char szName[32];
+        sprintf(szName, "segment_%05d.%s", iSegment, eFormat == SEGMENT_FORMAT_TS ? "ts" : "m4s");
+        return szName;
+    }
+
+    void WriteFile(const std::string &strName, const std::vector<uint8_t> &vData) {
+        std::string strPath = strOutDir + strName, strTemp = strPath + ".tmp";
+        FILE *fp = fopen(strTemp.c_str(), "wb");
+        if (!fp) {
+            LOG(ERROR) << "Unable to write " << strTemp;
+            return;
+        }
+        bool bOk = fwrite(vData.data(), 1, vData.size(), fp) == vData.size();
+        bOk = fclose(fp) == 0 && bOk;
+#ifdef _WIN32
+        // rename() does not replace an existing file on Windows
+        remove(strPath.c_str());
+#endif
+        if (!bOk || rename(strTemp.c_str(), strPath.c_str()) != 0) {
+            LOG(ERROR) << "Unable to write " << strPath;
+        }
+    }
+
+    static void MakeDirectory(const char *szDir) {
+        struct stat st;
+        if (stat(szDir, &st) == 0) {
+            return;
+        }
+#ifdef _WIN32
+        _mkdir(szDir);
+#else
+        mkdir(szDir, 0755);
+#endif
+    }
+
+    AVCodecID eCodecId;
+    int nWidth, nHeight, nFps;
+    std::string strOutDir;
+    SegmentFormat eFormat;
+    double secTargetDuration;
+    int nPlaylistSize;
+    bool bDeleteOld;
+    int nSegmentBufferSize;
+    NalUnitParser parser;
+
+    AVFormatContext *oc = NULL;
+    AVStream *vs = NULL;
+    bool bClosed = false, bFailed = false, bDiscard = false;
+    int64_t nSegmentStartPts = 0, nLastPts = 0;
+    /** The segment being muxed; owned by the thread calling Write() */
+    Buffer pCurrent;
+
+    std::mutex mtxBuffer;
+    std::vector<Buffer> vpFreeBuffer;
+    int iSegment = 0, nExtraBuffer = 0;
+    NvChannel<Job> jobChannel;
+    std::thread thIo;
+};
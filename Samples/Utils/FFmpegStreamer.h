@@ -18,17 +18,35 @@ extern "C" {
 #include <libswresample/swresample.h>
 };
 #include "Logger.h"
+#include "NalUnitParser.h"
 
 extern simplelogger::Logger *logger;
 
+/**
+* @brief Muxes an H.264/HEVC elementary stream into MPEG-TS and writes it to a file or URL.
+*
+* With nAvioBufferSize = 0 every packet is written and flushed at once, which suits live
+* streaming. With nAvioBufferSize > 0 packets go through av_interleaved_write_frame() and reach
+* the output in chunks of nAvioBufferSize bytes, so a recording costs far fewer write calls. For
+* packet protocols (UDP, RTP) the protocol's packet size is kept as the chunk size.
+*
+* Keyframes are found by parsing the NAL units of each packet (IDR for H.264, any IRAP picture
+* for HEVC). Timestamps are in units of 1/nFps; pass the encoder's pts and dts (see
+* NvEncoder::GetPacketInfo()) when B-frames are enabled.
+*/
 class FFmpegStreamer {
 private:
     AVFormatContext *oc = NULL;
     AVStream *vs = NULL;
     int nFps = 0;
+    NalUnitParser parser;
+    bool bBuffered = false, bHeaderWritten = false;
+    /** Buffered mode over a stream protocol: oc->pb is our buffer in front of pbOut, which writes straight through */
+    AVIOContext *pbOut = NULL;
 
 public:
-    FFmpegStreamer(AVCodecID eCodecId, int nWidth, int nHeight, int nFps, const char *szInFilePath) : nFps(nFps) {
+    FFmpegStreamer(AVCodecID eCodecId, int nWidth, int nHeight, int nFps, const char *szInFilePath, int nAvioBufferSize = 0)
+        : nFps(nFps), parser(eCodecId == AV_CODEC_ID_HEVC), bBuffered(nAvioBufferSize > 0) {
         av_register_all();
         avformat_network_init();
         oc = avformat_alloc_context();
@@ -56,6 +74,7 @@ public:
             return;
         }
         vs->id = 0;
+        vs->time_base = AVRational {1, nFps};
 
         // Set video parameters
         AVCodecParameters *vpar = vs->codecpar;
@@ -65,46 +84,119 @@ public:
         vpar->height = nHeight;
 
         // Every thing is ready. Now open the output stream.
-        if (avio_open(&oc->pb, oc->filename, AVIO_FLAG_WRITE) < 0) {
-            LOG(ERROR) << "FFMPEG: Could not open " << oc->filename;
-            return ;
+        if (!bBuffered) {
+            if (avio_open(&oc->pb, oc->filename, AVIO_FLAG_WRITE) < 0) {
+                LOG(ERROR) << "FFMPEG: Could not open " << oc->filename;
+                return;
+            }
+        } else if (!OpenBuffered(nAvioBufferSize)) {
+            return;
         }
 
         // Write the container header
-        if (avformat_write_header(oc, NULL)) {
+        if (avformat_write_header(oc, NULL) < 0) {
             LOG(ERROR) << "FFMPEG: avformat_write_header error!";
             return;
         }
+        bHeaderWritten = true;
     }
     ~FFmpegStreamer() {
         if (oc) {
-            av_write_trailer(oc);
-            avio_close(oc->pb);
+            if (bHeaderWritten) {
+                av_write_trailer(oc);
+            }
+            if (pbOut) {
+                avio_flush(oc->pb);
+                av_freep(&oc->pb->buffer);
+                avio_context_free(&oc->pb);
+                avio_closep(&pbOut);
+            } else {
+                avio_closep(&oc->pb);
+            }
             avformat_free_context(oc);
         }
     }
 
+    /** For streams without B-frames: the frame index nPts serves as dts too */
     bool Stream(uint8_t *pData, int nBytes, int nPts) {
+        return Stream(pData, nBytes, (int64_t)nPts, (int64_t)nPts);
+    }
+
+    bool Stream(uint8_t *pData, int nBytes, int64_t nPts, int64_t nDts) {
+        if (!bHeaderWritten) {
+            return false;
+        }
         AVPacket pkt = {0};
         av_init_packet(&pkt);
-        pkt.pts = av_rescale_q(nPts++, AVRational {1, nFps}, vs->time_base);
-        // No B-frames
-        pkt.dts = pkt.pts;
+        pkt.pts = av_rescale_q(nPts, AVRational {1, nFps}, vs->time_base);
+        pkt.dts = av_rescale_q(nDts, AVRational {1, nFps}, vs->time_base);
+        pkt.duration = av_rescale_q(1, AVRational {1, nFps}, vs->time_base);
         pkt.stream_index = vs->index;
         pkt.data = pData;
         pkt.size = nBytes;
 
-        if(!memcmp(pData, "\x00\x00\x00\x01\x67", 5)) {
+        if (parser.ContainsRandomAccessPoint(pData, nBytes)) {
             pkt.flags |= AV_PKT_FLAG_KEY;
         }
 
         // Write the compressed frame into the output
-        int ret = av_write_frame(oc, &pkt);
-        av_write_frame(oc, NULL);
+        int ret;
+        if (bBuffered) {
+            // Copies the packet, since it is not reference counted
+            ret = av_interleaved_write_frame(oc, &pkt);
+        } else {
+            ret = av_write_frame(oc, &pkt);
+            av_write_frame(oc, NULL);
+        }
         if (ret < 0) {
             LOG(ERROR) << "FFMPEG: Error while writing video frame";
+            return false;
         }
 
         return true;
     }
+
+private:
+    bool OpenBuffered(int nAvioBufferSize) {
+        // The muxer must not flush after each packet; that is the default for unseekable outputs
+        oc->flush_packets = 0;
+        if (avio_open(&pbOut, oc->filename, AVIO_FLAG_WRITE | AVIO_FLAG_DIRECT) < 0) {
+            LOG(ERROR) << "FFMPEG: Could not open " << oc->filename;
+            return false;
+        }
+        if (pbOut->max_packet_size) {
+            // A packet protocol sends every write as one datagram; keep its own buffering
+            avio_closep(&pbOut);
+            if (avio_open(&oc->pb, oc->filename, AVIO_FLAG_WRITE) < 0) {
+                LOG(ERROR) << "FFMPEG: Could not open " << oc->filename;
+                return false;
+            }
+            return true;
+        }
+        uint8_t *pBuffer = (uint8_t *)av_malloc(nAvioBufferSize);
+        oc->pb = pBuffer ? avio_alloc_context(pBuffer, nAvioBufferSize, 1, pbOut, NULL, WritePacket, Seek) : NULL;
+        if (!oc->pb) {
+            LOG(ERROR) << "FFMPEG: Could not allocate an AVIO buffer of " << nAvioBufferSize << " bytes";
+            av_free(pBuffer);
+            avio_closep(&pbOut);
+            return false;
+        }
+        oc->pb->seekable = pbOut->seekable;
+        return true;
+    }
+
+    static int WritePacket(void *opaque, uint8_t *pBuf, int nBuf) {
+        AVIOContext *pbOut = (AVIOContext *)opaque;
+        // Written with a single call, since pbOut was opened with AVIO_FLAG_DIRECT
+        avio_write(pbOut, pBuf, nBuf);
+        return pbOut->error < 0 ? pbOut->error : nBuf;
+    }
+
+    static int64_t Seek(void *opaque, int64_t nOffset, int whence) {
+        AVIOContext *pbOut = (AVIOContext *)opaque;
+        if (whence & AVSEEK_SIZE) {
+            return avio_size(pbOut);
+        }
+        return avio_seek(pbOut, nOffset, whence & ~AVSEEK_FORCE);
+    }
 };
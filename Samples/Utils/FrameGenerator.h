@@ -0,0 +1,411 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "NvEncoder/nvEncodeAPI.h"
+#include "YuvConverter.h"
+
+struct FrameGeneratorParams {
+    /** Frames per scene; each scene has its own gradient, colors and text position. 0 means a single scene */
+    int nSceneLength = 0;
+    /** Amplitude of the uniform noise in bits of an 8-bit sample: 0 is none, 8 is white noise over the full range */
+    int nNoiseBits = 2;
+    /** Motion of the gradient in pixels per frame */
+    int nGradientSpeed = 4;
+    /** Motion of the text banner in pixels per frame, right to left */
+    int nTextSpeed = 8;
+    std::string strText = "NVIDIA VIDEO CODEC SDK";
+    /** Draws the frame index in the top-left corner */
+    bool bFrameNumber = true;
+    uint32_t nSeed = 1;
+};
+
+/**
+* @brief Renders parametric test video in any NV_ENC_BUFFER_FORMAT: a moving luma gradient
+* over chroma ramps, uniform noise of configurable amplitude, a scrolling text banner, the frame
+* index and scene cuts at a fixed interval. Frame i depends only on the parameters and i, so
+* runs are reproducible and frames can be rendered in any order.
+*
+* Frames are written to host memory in the layout NvEncoder uses for its input buffers (planes
+* one after another, 10-bit samples MSB-aligned in 16 bits); with the default pitch and even
+* dimensions the size is NvEncoder::GetFrameSize(). To feed a device encoder, render into a host buffer and upload it
+* with NvEncoderCuda::CopyToDeviceFrame(). Rendering a 1080p frame takes a few milliseconds per
+* thread, so throughput benchmarks should render a set of frames up front and cycle through them.
+*
+* Content is produced in 10-bit BT.601 limited-range YUV 4:4:4 and then converted to the target
+* format. Not thread-safe; use one generator per thread.
+*/
+class FrameGenerator {
+public:
+    FrameGenerator(int nWidth, int nHeight, NV_ENC_BUFFER_FORMAT eFormat,
+        const FrameGeneratorParams &params = FrameGeneratorParams(), int nThread = 1)
+        : nWidth(nWidth), nHeight(nHeight), eFormat(eFormat), params(params), runner(nThread),
+        vY((size_t)nWidth * nHeight), vU(vY.size()), vV(vY.size()) {
+        this->params.nNoiseBits = (std::min)((std::max)(params.nNoiseBits, 0), 8);
+        nScale = (std::max)(nHeight / 180, 1);
+    }
+
+    static bool IsFormatSupported(NV_ENC_BUFFER_FORMAT eFormat) {
+        switch (eFormat) {
+        case NV_ENC_BUFFER_FORMAT_NV12:
+        case NV_ENC_BUFFER_FORMAT_YV12:
+        case NV_ENC_BUFFER_FORMAT_IYUV:
+        case NV_ENC_BUFFER_FORMAT_YUV444:
+        case NV_ENC_BUFFER_FORMAT_YUV420_10BIT:
+        case NV_ENC_BUFFER_FORMAT_YUV444_10BIT:
+        case NV_ENC_BUFFER_FORMAT_ARGB:
+        case NV_ENC_BUFFER_FORMAT_ARGB10:
+        case NV_ENC_BUFFER_FORMAT_AYUV:
+        case NV_ENC_BUFFER_FORMAT_ABGR:
+        case NV_ENC_BUFFER_FORMAT_ABGR10:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    /** Bytes of a frame with the default pitch */
+    int GetFrameSize() const {
+        return GetFrameSize(GetDefaultPitch());
+    }
+
+    /** Renders frame iFrame into pFrame; nPitch is the luma pitch in bytes, 0 for the packed layout */
+    void Generate(int iFrame, uint8_t *pFrame, int nPitch = 0) {
+        if (!IsFormatSupported(eFormat)) {
+            return;
+        }
+        NVTRACE_SCOPE_ARG("Generate frame", iFrame);
+        Render(iFrame);
+        Pack(pFrame, nPitch ? nPitch : GetDefaultPitch());
+    }
+
+private:
+    struct Scene {
+        int ax, ay;
+        int nPeriod;
+        int uBase, vBase;
+        int yText;
+    };
+
+    static uint32_t Hash(uint32_t a, uint32_t b) {
+        uint32_t h = a * 0x9E3779B1u ^ (b + 0x7F4A7C15u + (a << 6) + (a >> 2));
+        h ^= h >> 16;
+        h *= 0x85EBCA6Bu;
+        h ^= h >> 13;
+        h *= 0xC2B2AE35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    Scene GetScene(int iScene) const {
+        static const int aDirection[8][2] = {{1, 0}, {1, 1}, {0, 1}, {-1, 1}, {2, 1}, {1, 2}, {-2, 1}, {1, -2}};
+        uint32_t h = Hash(params.nSeed, iScene);
+        Scene scene;
+        scene.ax = aDirection[h % 8][0];
+        scene.ay = aDirection[h % 8][1];
+        scene.nPeriod = 64 << ((h >> 3) % 3);
+        scene.uBase = 256 + (int)((h >> 5) % 512);
+        scene.vBase = 256 + (int)((h >> 14) % 512);
+        int nBanner = 9 * nScale;
+        scene.yText = (std::max)(nHeight - nBanner, 0) * (1 + (int)((h >> 23) % 3)) / 4;
+        return scene;
+    }
+
+    void Render(int iFrame) {
+        Scene scene = GetScene(params.nSceneLength > 0 ? iFrame / params.nSceneLength : 0);
+        int nShift = iFrame * params.nGradientSpeed;
+        int nNoiseMask = (1 << params.nNoiseBits) - 1;
+        uint32_t nFrameSeed = Hash(params.nSeed ^ 0x5A5A5A5Au, iFrame);
+
+        char szFrame[16];
+        sprintf(szFrame, "%08d", iFrame);
+        int nCell = 6 * nScale;
+        int nTextWidth = (int)params.strText.size() * nCell;
+        int xText = nWidth - (int)((int64_t)iFrame * params.nTextSpeed % (nWidth + nTextWidth + 1));
+
+        // One period of the triangle wave; the period is a power of two, so the phase is a mask
+        int nPhaseMask = 2 * scene.nPeriod - 1;
+        vGradient.resize(2 * scene.nPeriod);
+        for (int i = 0; i < 2 * scene.nPeriod; i++) {
+            int nTri = i < scene.nPeriod ? i : 2 * scene.nPeriod - i;
+            vGradient[i] = 64 + nTri * (940 - 64) / scene.nPeriod;
+        }
+        vRampU.resize(nWidth);
+        for (int x = 0; x < nWidth; x++) {
+            vRampU[x] = scene.uBase + x * 128 / nWidth - 64;
+        }
+
+        runner.Run(nHeight, [&](int iBegin, int iEnd) {
+            for (int y = iBegin; y < iEnd; y++) {
+                uint16_t *pY = &vY[(size_t)y * nWidth], *pU = &vU[(size_t)y * nWidth], *pV = &vV[(size_t)y * nWidth];
+                uint32_t r = Hash(nFrameSeed, y) | 1;
+                int v = scene.vBase + y * 128 / nHeight - 64;
+                int nPos = y * scene.ay + nShift;
+                for (int x = 0; x < nWidth; x++, nPos += scene.ax) {
+                    int aSample[3] = {vGradient[nPos & nPhaseMask], vRampU[x], v};
+                    if (nNoiseMask) {
+                        // xorshift32; bytes 0-2 are the noise of Y, U and V
+                        r ^= r << 13;
+                        r ^= r >> 17;
+                        r ^= r << 5;
+                        for (int c = 0; c < 3; c++) {
+                            aSample[c] += (((int)(r >> (8 * c)) & nNoiseMask) - (nNoiseMask >> 1)) * 4;
+                        }
+                    }
+                    pY[x] = (uint16_t)(std::min)((std::max)(aSample[0], 0), 1023);
+                    pU[x] = (uint16_t)(std::min)((std::max)(aSample[1], 0), 1023);
+                    pV[x] = (uint16_t)(std::min)((std::max)(aSample[2], 0), 1023);
+                }
+                if (y >= scene.yText && y < scene.yText + 9 * nScale) {
+                    std::fill(pY, pY + nWidth, (uint16_t)128);
+                    std::fill(pU, pU + nWidth, (uint16_t)512);
+                    std::fill(pV, pV + nWidth, (uint16_t)512);
+                    DrawTextRow(params.strText.c_str(), xText, y - scene.yText - nScale, pY, pU, pV);
+                }
+                if (params.bFrameNumber && y >= nScale && y < 10 * nScale) {
+                    int nBox = (std::min)(nWidth, (8 * 6 + 2) * nScale);
+                    std::fill(pY, pY + nBox, (uint16_t)128);
+                    std::fill(pU, pU + nBox, (uint16_t)512);
+                    std::fill(pV, pV + nBox, (uint16_t)512);
+                    DrawTextRow(szFrame, nScale, y - 2 * nScale, pY, pU, pV);
+                }
+            }
+        });
+    }
+
+    /** Draws row iRow (in pixels, 0 at the top of the glyphs) of szText starting at column x0 */
+    void DrawTextRow(const char *szText, int x0, int iRow, uint16_t *pY, uint16_t *pU, uint16_t *pV) const {
+        if (iRow < 0 || iRow >= 7 * nScale) {
+            return;
+        }
+        int iGlyphRow = iRow / nScale, nCell = 6 * nScale;
+        for (int i = 0; szText[i]; i++) {
+            int xCell = x0 + i * nCell;
+            if (xCell >= nWidth) {
+                break;
+            }
+            if (xCell + nCell <= 0) {
+                continue;
+            }
+            uint8_t nBits = GetGlyph(szText[i])[iGlyphRow];
+            for (int x = (std::max)(xCell, 0); x < (std::min)(xCell + 5 * nScale, nWidth); x++) {
+                if (nBits & (0x10 >> ((x - xCell) / nScale))) {
+                    pY[x] = 900;
+                    pU[x] = pV[x] = 512;
+                }
+            }
+        }
+    }
+
+    /** 5x7 glyphs, one byte per row with the leftmost pixel in bit 4; lower case is drawn as upper case */
+    static const uint8_t *GetGlyph(char c) {
+        static const char szChar[] = " -.:0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        static const uint8_t aGlyph[][7] = {
+            {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00},
+            {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C}, {0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00},
+            {0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E}, {0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E},
+            {0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F}, {0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E},
+            {0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02}, {0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E},
+            {0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E}, {0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08},
+            {0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E}, {0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C},
+            {0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11}, {0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E},
+            {0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E}, {0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C},
+            {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F}, {0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10},
+            {0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F}, {0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11},
+            {0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E}, {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C},
+            {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F},
+            {0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11}, {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11},
+            {0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, {0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10},
+            {0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D}, {0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11},
+            {0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E}, {0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04},
+            {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E}, {0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04},
+            {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A}, {0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11},
+            {0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04}, {0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F},
+        };
+        if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+        const char *p = c ? strchr(szChar, c) : NULL;
+        return aGlyph[p ? p - szChar : 0];
+    }
+
+    int GetDefaultPitch() const {
+        switch (eFormat) {
+        case NV_ENC_BUFFER_FORMAT_YUV420_10BIT:
+        case NV_ENC_BUFFER_FORMAT_YUV444_10BIT:
+            return nWidth * 2;
+        case NV_ENC_BUFFER_FORMAT_ARGB:
+        case NV_ENC_BUFFER_FORMAT_ARGB10:
+        case NV_ENC_BUFFER_FORMAT_AYUV:
+        case NV_ENC_BUFFER_FORMAT_ABGR:
+        case NV_ENC_BUFFER_FORMAT_ABGR10:
+            return nWidth * 4;
+        default:
+            return nWidth;
+        }
+    }
+
+    int GetFrameSize(int nPitch) const {
+        switch (eFormat) {
+        case NV_ENC_BUFFER_FORMAT_NV12:
+        case NV_ENC_BUFFER_FORMAT_YUV420_10BIT:
+            return nPitch * (nHeight + (nHeight + 1) / 2);
+        case NV_ENC_BUFFER_FORMAT_YV12:
+        case NV_ENC_BUFFER_FORMAT_IYUV:
+            return nPitch * nHeight + 2 * ((nPitch + 1) / 2) * ((nHeight + 1) / 2);
+        case NV_ENC_BUFFER_FORMAT_YUV444:
+        case NV_ENC_BUFFER_FORMAT_YUV444_10BIT:
+            return nPitch * nHeight * 3;
+        default:
+            return nPitch * nHeight;
+        }
+    }
+
+    /** Average of the 2x2 block of full-resolution chroma at chroma sample (x, y) */
+    static int Subsample(const std::vector<uint16_t> &v, int nWidth, int nHeight, int x, int y) {
+        int x0 = 2 * x, x1 = (std::min)(2 * x + 1, nWidth - 1), y0 = 2 * y, y1 = (std::min)(2 * y + 1, nHeight - 1);
+        return (v[(size_t)y0 * nWidth + x0] + v[(size_t)y0 * nWidth + x1] + v[(size_t)y1 * nWidth + x0]
+            + v[(size_t)y1 * nWidth + x1] + 2) >> 2;
+    }
+
+    /** BT.601 limited range to full range RGB, all 10-bit */
+    static void YuvToRgb(int y, int u, int v, int &r, int &g, int &b) {
+        int c = 298 * (y - 64), d = u - 512, e = v - 512;
+        r = (std::min)((std::max)((c + 409 * e + 128) >> 8, 0), 1023);
+        g = (std::min)((std::max)((c - 100 * d - 208 * e + 128) >> 8, 0), 1023);
+        b = (std::min)((std::max)((c + 516 * d + 128) >> 8, 0), 1023);
+    }
+
+    void Pack(uint8_t *pFrame, int nPitch) {
+        int nChromaWidth = (nWidth + 1) / 2, nChromaHeight = (nHeight + 1) / 2;
+        bool b420 = eFormat == NV_ENC_BUFFER_FORMAT_NV12 || eFormat == NV_ENC_BUFFER_FORMAT_YV12
+            || eFormat == NV_ENC_BUFFER_FORMAT_IYUV || eFormat == NV_ENC_BUFFER_FORMAT_YUV420_10BIT;
+        runner.Run(nHeight, [&](int iBegin, int iEnd) {
+            for (int y = iBegin; y < iEnd; y++) {
+                const uint16_t *pY = &vY[(size_t)y * nWidth], *pU = &vU[(size_t)y * nWidth], *pV = &vV[(size_t)y * nWidth];
+                uint8_t *pRow = pFrame + (size_t)y * nPitch;
+                uint8_t *pChroma = pFrame + (size_t)nPitch * nHeight;
+                switch (eFormat) {
+                case NV_ENC_BUFFER_FORMAT_NV12:
+                case NV_ENC_BUFFER_FORMAT_YV12:
+                case NV_ENC_BUFFER_FORMAT_IYUV:
+                    for (int x = 0; x < nWidth; x++) {
+                        pRow[x] = (uint8_t)(pY[x] >> 2);
+                    }
+                    break;
+                case NV_ENC_BUFFER_FORMAT_YUV444:
+                    for (int x = 0; x < nWidth; x++) {
+                        pRow[x] = (uint8_t)(pY[x] >> 2);
+                        pChroma[(size_t)y * nPitch + x] = (uint8_t)(pU[x] >> 2);
+                        pChroma[((size_t)nHeight + y) * nPitch + x] = (uint8_t)(pV[x] >> 2);
+                    }
+                    break;
+                case NV_ENC_BUFFER_FORMAT_YUV420_10BIT:
+                    for (int x = 0; x < nWidth; x++) {
+                        ((uint16_t *)pRow)[x] = (uint16_t)(pY[x] << 6);
+                    }
+                    break;
+                case NV_ENC_BUFFER_FORMAT_YUV444_10BIT:
+                    for (int x = 0; x < nWidth; x++) {
+                        ((uint16_t *)pRow)[x] = (uint16_t)(pY[x] << 6);
+                        ((uint16_t *)(pChroma + (size_t)y * nPitch))[x] = (uint16_t)(pU[x] << 6);
+                        ((uint16_t *)(pChroma + ((size_t)nHeight + y) * nPitch))[x] = (uint16_t)(pV[x] << 6);
+                    }
+                    break;
+                case NV_ENC_BUFFER_FORMAT_AYUV:
+                    // Word-ordered A8Y8U8V8: V is the lowest byte
+                    for (int x = 0; x < nWidth; x++) {
+                        uint8_t *p = pRow + 4 * x;
+                        p[0] = (uint8_t)(pV[x] >> 2);
+                        p[1] = (uint8_t)(pU[x] >> 2);
+                        p[2] = (uint8_t)(pY[x] >> 2);
+                        p[3] = 0xFF;
+                    }
+                    break;
+                default:
+                    for (int x = 0; x < nWidth; x++) {
+                        int r, g, b;
+                        YuvToRgb(pY[x], pU[x], pV[x], r, g, b);
+                        uint8_t *p = pRow + 4 * x;
+                        switch (eFormat) {
+                        case NV_ENC_BUFFER_FORMAT_ARGB:
+                            p[0] = (uint8_t)(b >> 2); p[1] = (uint8_t)(g >> 2); p[2] = (uint8_t)(r >> 2); p[3] = 0xFF;
+                            break;
+                        case NV_ENC_BUFFER_FORMAT_ABGR:
+                            p[0] = (uint8_t)(r >> 2); p[1] = (uint8_t)(g >> 2); p[2] = (uint8_t)(b >> 2); p[3] = 0xFF;
+                            break;
+                        case NV_ENC_BUFFER_FORMAT_ARGB10:
+                            SetWord(p, 3u << 30 | (uint32_t)r << 20 | (uint32_t)g << 10 | (uint32_t)b);
+                            break;
+                        default:
+                            SetWord(p, 3u << 30 | (uint32_t)b << 20 | (uint32_t)g << 10 | (uint32_t)r);
+                            break;
+                        }
+                    }
+                    break;
+                }
+                if (!b420 || y >= nChromaHeight) {
+                    continue;
+                }
+                // Chroma row y of the 4:2:0 formats
+                if (eFormat == NV_ENC_BUFFER_FORMAT_NV12 || eFormat == NV_ENC_BUFFER_FORMAT_YUV420_10BIT) {
+                    uint8_t *pUV = pChroma + (size_t)y * nPitch;
+                    // Interleaved chroma of an odd width does not fit the luma pitch; its last sample is dropped
+                    int nSampleBytes = eFormat == NV_ENC_BUFFER_FORMAT_NV12 ? 1 : 2;
+                    for (int x = 0; x < (std::min)(nChromaWidth, nPitch / nSampleBytes / 2); x++) {
+                        int u = Subsample(vU, nWidth, nHeight, x, y), v = Subsample(vV, nWidth, nHeight, x, y);
+                        if (eFormat == NV_ENC_BUFFER_FORMAT_NV12) {
+                            pUV[2 * x] = (uint8_t)(u >> 2);
+                            pUV[2 * x + 1] = (uint8_t)(v >> 2);
+                        } else {
+                            ((uint16_t *)pUV)[2 * x] = (uint16_t)(u << 6);
+                            ((uint16_t *)pUV)[2 * x + 1] = (uint16_t)(v << 6);
+                        }
+                    }
+                } else {
+                    // IYUV has U first, YV12 has V first
+                    int nChromaPitch = (nPitch + 1) / 2;
+                    uint8_t *p0 = pChroma + (size_t)y * nChromaPitch;
+                    uint8_t *p1 = pChroma + ((size_t)nChromaHeight + y) * nChromaPitch;
+                    uint8_t *pDstU = eFormat == NV_ENC_BUFFER_FORMAT_IYUV ? p0 : p1;
+                    uint8_t *pDstV = eFormat == NV_ENC_BUFFER_FORMAT_IYUV ? p1 : p0;
+                    for (int x = 0; x < nChromaWidth; x++) {
+                        pDstU[x] = (uint8_t)(Subsample(vU, nWidth, nHeight, x, y) >> 2);
+                        pDstV[x] = (uint8_t)(Subsample(vV, nWidth, nHeight, x, y) >> 2);
+                    }
+                }
+            }
+        });
+    }
+
+    static void SetWord(uint8_t *p, uint32_t n) {
+        p[0] = (uint8_t)n;
+        p[1] = (uint8_t)(n >> 8);
+        p[2] = (uint8_t)(n >> 16);
+        p[3] = (uint8_t)(n >> 24);
+    }
+
+    int nWidth, nHeight;
+    NV_ENC_BUFFER_FORMAT eFormat;
+    FrameGeneratorParams params;
+    int nScale;
+    YuvBandRunner runner;
+    /** The frame in 10-bit YUV 4:4:4 before packing */
+    std::vector<uint16_t> vY, vU, vV;
+    std::vector<int> vGradient, vRampU;
+};
@@ -16,6 +16,15 @@
 #include <string>
 #include <sstream>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #ifdef _WIN32
@@ -52,13 +61,15 @@ public:
         return l >= level;
     }
     char* GetLead(LogLevel l, const char *szFile, int nLine, const char *szFunc) {
+        return GetLead(l, time(NULL));
+    }
+    char* GetLead(LogLevel l, time_t t) {
         if (l < TRACE || l > FATAL) {
             sprintf(szLead, "[?????] ");
             return szLead;
         }
         const char *szLevels[] = {"TRACE", "INFO", "WARN", "ERROR", "FATAL"};
         if (bPrintTimeStamp) {
-            time_t t = time(NULL);
             struct tm *ptm = localtime(&t);
             sprintf(szLead, "[%-5s][%02d:%02d:%02d] ", 
                 szLevels[l], ptm->tm_hour, ptm->tm_min, ptm->tm_sec);
@@ -73,6 +84,18 @@ public:
     void LeaveCriticalSection() {
         mtx.unlock();
     }
+    /** Starts one record; the caller writes the message to the returned stream, then calls EndRecord() */
+    virtual std::ostream& BeginRecord(LogLevel l, const char *szFile, int nLine, const char *szFunc) {
+        EnterCriticalSection();
+        std::ostream &os = GetStream();
+        os << GetLead(l, szFile, nLine, szFunc);
+        return os;
+    }
+    virtual void EndRecord(LogLevel l) {
+        GetStream() << std::endl;
+        FlushStream();
+        LeaveCriticalSection();
+    }
 private:
     LogLevel level;
     char szLead[80];
@@ -80,6 +103,293 @@ private:
     std::mutex mtx;
 };
 
+/**
+* @brief Logger that keeps formatting and I/O off the logging threads. Every thread writes its
+* message into its own stream buffer and copies it into its own single-producer ring of
+* fixed-size slots; no lock is taken and nothing is allocated once the thread's ring exists.
+* A background thread drains the rings in time-stamp order, adds the lead and writes the
+* records to the sink logger. A full ring makes its thread wait for the background thread
+* rather than drop records.
+*
+* Records reach the sink within a few milliseconds; ERROR and FATAL wake the background thread
+* at once, FATAL waits until it is written, and pending records are flushed at exit().
+*/
+class AsyncLogger : public Logger {
+public:
+    AsyncLogger(Logger *pSink, LogLevel level, bool bPrintTimeStamp, int nRingSlot)
+        : Logger(level, bPrintTimeStamp), pSink(pSink), id(NewId()) {
+        this->nRingSlot = 1;
+        while (this->nRingSlot < (uint64_t)nRingSlot) {
+            this->nRingSlot <<= 1;
+        }
+        thWriter = std::thread(&AsyncLogger::WriterProc, this);
+        Registry &r = GetRegistry();
+        std::lock_guard<std::mutex> lock(r.mtx);
+        r.vpLogger.push_back(this);
+    }
+    ~AsyncLogger() {
+        {
+            Registry &r = GetRegistry();
+            std::lock_guard<std::mutex> lock(r.mtx);
+            for (size_t i = 0; i < r.vpLogger.size(); i++) {
+                if (r.vpLogger[i] == this) {
+                    r.vpLogger.erase(r.vpLogger.begin() + i);
+                    break;
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtxWriter);
+            bQuit = true;
+        }
+        cvWriter.notify_one();
+        thWriter.join();
+    }
+    std::ostream& GetStream() {
+        return GetRing()->os;
+    }
+    std::ostream& BeginRecord(LogLevel l, const char *szFile, int nLine, const char *szFunc) {
+        Ring *pRing = GetRing();
+        pRing->buf.Reset();
+        pRing->os.flags(pRing->fmtFlags);
+        pRing->os.precision(pRing->nPrecision);
+        pRing->os.fill(' ');
+        pRing->os.clear();
+        return pRing->os;
+    }
+    void EndRecord(LogLevel l) {
+        Ring *pRing = GetRing();
+        int64_t nTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        const char *p = pRing->buf.Data();
+        uint64_t nSize = pRing->buf.Size();
+        // Long messages span several slots; a message longer than the whole ring is cut
+        uint64_t nSlot = (std::min)((nSize + sizeof(Slot::szText) - 1) / sizeof(Slot::szText), nRingSlot);
+        nSlot = (std::max)(nSlot, (uint64_t)1);
+        uint64_t iWrite = pRing->iWrite.load(std::memory_order_relaxed);
+        while (iWrite + nSlot - pRing->iRead.load(std::memory_order_acquire) > nRingSlot) {
+            WakeWriter();
+            std::this_thread::yield();
+        }
+        for (uint64_t i = 0; i < nSlot; i++) {
+            Slot &slot = pRing->vSlot[(iWrite + i) & (nRingSlot - 1)];
+            uint64_t nLength = (std::min)(nSize, (uint64_t)sizeof(slot.szText));
+            slot.nTime = nTime;
+            slot.level = l;
+            slot.nLength = (uint16_t)nLength;
+            slot.bContinued = i + 1 < nSlot;
+            memcpy(slot.szText, p, nLength);
+            p += nLength;
+            nSize -= nLength;
+        }
+        // All slots of the record become visible to the writer together
+        pRing->iWrite.store(iWrite + nSlot, std::memory_order_release);
+        if (l >= FATAL) {
+            Flush();
+        } else if (l >= ERROR || iWrite + nSlot - pRing->iRead.load(std::memory_order_relaxed) > nRingSlot / 2) {
+            WakeWriter();
+        }
+    }
+    /** Returns once every record logged before the call has been written to the sink */
+    void Flush() {
+        std::unique_lock<std::mutex> lock(mtxWriter);
+        uint64_t iRequest = ++iFlushRequest;
+        cvWriter.notify_one();
+        cvFlushed.wait(lock, [&] { return iFlushDone >= iRequest; });
+    }
+
+private:
+    struct Slot {
+        /** Microseconds since the epoch */
+        int64_t nTime;
+        LogLevel level;
+        uint16_t nLength;
+        /** The message goes on in the next slot */
+        bool bContinued;
+        char szText[232];
+    };
+
+    /** Stream buffer that grows as needed and is reused by all records of one thread */
+    class RecordBuf : public std::streambuf {
+    public:
+        RecordBuf() : vBuf(256) {
+            Reset();
+        }
+        void Reset() {
+            setp(vBuf.data(), vBuf.data() + vBuf.size());
+        }
+        const char *Data() const {
+            return pbase();
+        }
+        uint64_t Size() const {
+            return pptr() - pbase();
+        }
+    protected:
+        int_type overflow(int_type c) {
+            std::ptrdiff_t n = pptr() - pbase();
+            vBuf.resize(vBuf.size() * 2);
+            setp(vBuf.data(), vBuf.data() + vBuf.size());
+            pbump((int)n);
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+    private:
+        std::vector<char> vBuf;
+    };
+
+    struct Ring {
+        Ring(uint64_t nSlot) : vSlot(nSlot), os(&buf) {
+            fmtFlags = os.flags();
+            nPrecision = os.precision();
+        }
+        std::vector<Slot> vSlot;
+        // Producer and writer indices on separate cache lines
+        std::atomic<uint64_t> iWrite{0};
+        char pad[64];
+        std::atomic<uint64_t> iRead{0};
+        RecordBuf buf;
+        std::ostream os;
+        std::ios::fmtflags fmtFlags;
+        std::streamsize nPrecision;
+    };
+
+    struct Registry {
+        std::mutex mtx;
+        std::vector<AsyncLogger *> vpLogger;
+    };
+
+    void WakeWriter() {
+        // Without the mutex a wake-up can be missed; the writer then runs at its next timeout
+        if (!bWakeup.exchange(true, std::memory_order_relaxed)) {
+            cvWriter.notify_one();
+        }
+    }
+
+    static Registry &GetRegistry() {
+        static Registry r;
+        static bool bAtExit = (atexit(FlushAll), true);
+        (void)bAtExit;
+        return r;
+    }
+
+    static void FlushAll() {
+        Registry &r = GetRegistry();
+        std::lock_guard<std::mutex> lock(r.mtx);
+        for (AsyncLogger *pLogger : r.vpLogger) {
+            pLogger->Flush();
+        }
+    }
+
+    static uint64_t NewId() {
+        static std::atomic<uint64_t> idNext(1);
+        return idNext++;
+    }
+
+    Ring *GetRing() {
+        // Fast path: the ring this thread used last, as long as it belongs to this logger
+        struct Cache {
+            uint64_t idLogger;
+            Ring *pRing;
+        };
+        static thread_local Cache cache = {0, NULL};
+        if (cache.idLogger == id) {
+            return cache.pRing;
+        }
+        std::lock_guard<std::mutex> lock(mtxRing);
+        std::unique_ptr<Ring> &pRing = mRing[std::this_thread::get_id()];
+        if (!pRing) {
+            pRing.reset(new Ring(nRingSlot));
+        }
+        cache.idLogger = id;
+        cache.pRing = pRing.get();
+        return pRing.get();
+    }
+
+    /** Writes all published records, oldest first across rings; returns false if there were none */
+    bool Drain() {
+        std::vector<Ring *> vpRing;
+        {
+            std::lock_guard<std::mutex> lock(mtxRing);
+            for (auto &it : mRing) {
+                vpRing.push_back(it.second.get());
+            }
+        }
+        std::vector<uint64_t> viRead(vpRing.size()), viEnd(vpRing.size());
+        for (size_t i = 0; i < vpRing.size(); i++) {
+            viRead[i] = vpRing[i]->iRead.load(std::memory_order_relaxed);
+            viEnd[i] = vpRing[i]->iWrite.load(std::memory_order_acquire);
+        }
+        bool bAny = false;
+        while (true) {
+            int iBest = -1;
+            for (size_t i = 0; i < vpRing.size(); i++) {
+                if (viRead[i] != viEnd[i] && (iBest < 0
+                    || vpRing[i]->vSlot[viRead[i] & (nRingSlot - 1)].nTime < vpRing[iBest]->vSlot[viRead[iBest] & (nRingSlot - 1)].nTime)) {
+                    iBest = (int)i;
+                }
+            }
+            if (iBest < 0) {
+                break;
+            }
+            Ring *pRing = vpRing[iBest];
+            const Slot *pSlot = &pRing->vSlot[viRead[iBest] & (nRingSlot - 1)];
+            std::ostream &os = pSink->GetStream();
+            os << GetLead(pSlot->level, (time_t)(pSlot->nTime / 1000000));
+            while (true) {
+                os.write(pSlot->szText, pSlot->nLength);
+                viRead[iBest]++;
+                if (!pSlot->bContinued) {
+                    break;
+                }
+                pSlot = &pRing->vSlot[viRead[iBest] & (nRingSlot - 1)];
+            }
+            os << '\n';
+            pSink->FlushStream();
+            pRing->iRead.store(viRead[iBest], std::memory_order_release);
+            bAny = true;
+        }
+        if (bAny) {
+            pSink->GetStream().flush();
+        }
+        return bAny;
+    }
+
+    void WriterProc() {
+        std::unique_lock<std::mutex> lock(mtxWriter);
+        while (true) {
+            cvWriter.wait_for(lock, std::chrono::milliseconds(10), [this] {
+                return bQuit || iFlushRequest != iFlushDone || bWakeup.load(std::memory_order_relaxed);
+            });
+            bWakeup.store(false, std::memory_order_relaxed);
+            uint64_t iRequest = iFlushRequest;
+            bool bStop = bQuit;
+            lock.unlock();
+            while (Drain()) {
+            }
+            lock.lock();
+            iFlushDone = iRequest;
+            cvFlushed.notify_all();
+            if (bStop) {
+                break;
+            }
+        }
+    }
+
+    std::unique_ptr<Logger> pSink;
+    const uint64_t id;
+    uint64_t nRingSlot;
+    std::mutex mtxRing;
+    std::map<std::thread::id, std::unique_ptr<Ring>> mRing;
+    std::thread thWriter;
+    std::mutex mtxWriter;
+    std::condition_variable cvWriter, cvFlushed;
+    bool bQuit = false;
+    std::atomic<bool> bWakeup{false};
+    uint64_t iFlushRequest = 0, iFlushDone = 0;
+};
+
 class LoggerFactory {
 public:
     static Logger* CreateFileLogger(std::string strFilePath, 
@@ -94,6 +404,11 @@ public:
             bool bPrintTimeStamp = true) {
         return new UdpLogger(szHost, uPort, level, bPrintTimeStamp);
     }
+    /** Formats and writes records on a background thread into pSink, which it takes ownership of */
+    static Logger* CreateAsyncLogger(Logger *pSink, LogLevel level = INFO, 
+            bool bPrintTimeStamp = true, int nRingSlot = 1024) {
+        return new AsyncLogger(pSink, level, bPrintTimeStamp, nRingSlot);
+    }
 private:
     LoggerFactory() {}
 
@@ -201,20 +516,17 @@ public:
         if (!pLogger->ShouldLogFor(level)) {
             return;
         }
-        pLogger->EnterCriticalSection();
-        pLogger->GetStream() << pLogger->GetLead(level, szFile, nLine, szFunc);
+        pStream = &pLogger->BeginRecord(level, szFile, nLine, szFunc);
     }
     ~LogTransaction() {
         if (!pLogger) {
             std::cout << std::endl;
             return;
         }
-        if (!pLogger->ShouldLogFor(level)) {
+        if (!pStream) {
             return;
         }
-        pLogger->GetStream() << std::endl;
-        pLogger->FlushStream();
-        pLogger->LeaveCriticalSection();
+        pLogger->EndRecord(level);
         if (level == FATAL) {
             exit(1);
         }
@@ -223,18 +535,37 @@ public:
         if (!pLogger) {
             return std::cout;
         }
-        if (!pLogger->ShouldLogFor(level)) {
-            return ossNull;
+        if (!pStream) {
+            // A stream without a buffer ignores everything written to it
+            static thread_local std::ostream osNull(NULL);
+            return osNull;
         }
-        return pLogger->GetStream();
+        return *pStream;
     }
 private:
     Logger *pLogger;
     LogLevel level;
-    std::ostringstream ossNull;
+    std::ostream *pStream = NULL;
+};
+
+inline bool ShouldLog(Logger *pLogger, LogLevel level) {
+    return !pLogger || pLogger->ShouldLogFor(level);
+}
+
+/** Turns the stream expression in LOG() into void so it can sit in a conditional expression */
+struct LogVoidify {
+    void operator&(std::ostream &) {}
 };
 
 }
 
 extern simplelogger::Logger *logger;
-#define LOG(level) simplelogger::LogTransaction(logger, level, __FILE__, __LINE__, __FUNCTION__).GetStream()
+
+// Records below LOG_MIN_LEVEL are removed at compile time, e.g. -DLOG_MIN_LEVEL=WARNING.
+// Records below the logger's level only cost a level check: the message is not evaluated.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL TRACE
+#endif
+#define LOG(level) \
+    ((level) < LOG_MIN_LEVEL || !simplelogger::ShouldLog(logger, level)) ? (void)0 : \
+    simplelogger::LogVoidify() & simplelogger::LogTransaction(logger, level, __FILE__, __LINE__, __FUNCTION__).GetStream()
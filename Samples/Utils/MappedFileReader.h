@@ -0,0 +1,294 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "Logger.h"
+
+extern simplelogger::Logger *logger;
+
+/**
+* @brief Read-only memory mapping of a whole file with a 64-bit size. Nothing is read up front;
+* pages come in on first access or through Prefetch(), and Evict() drops them from the
+* mapping again so long files can be streamed with bounded resident memory. The mapping
+* needs a 64-bit address space for files beyond a few GB.
+*/
+class MappedFileReader {
+public:
+    MappedFileReader(const char *szFileName, bool bHugePage = true) {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        nPageSize = info.dwPageSize;
+        hFile = CreateFileA(szFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        LARGE_INTEGER size;
+        if (hFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(hFile, &size)) {
+            LOG(ERROR) << "Unable to open input file: " << szFileName;
+            return;
+        }
+        nSize = size.QuadPart;
+#else
+        nPageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+        fd = open(szFileName, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            LOG(ERROR) << "Unable to open input file: " << szFileName;
+            return;
+        }
+        nSize = (uint64_t)st.st_size;
+#endif
+        if (!nSize) {
+            LOG(ERROR) << "Input file is empty: " << szFileName;
+            return;
+        }
+        if (nSize > (uint64_t)SIZE_MAX) {
+            LOG(ERROR) << "Input file does not fit in the address space: " << szFileName;
+            return;
+        }
+#ifdef _WIN32
+        // Large pages are not available for file mappings on Windows; bHugePage has no effect
+        hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        pData = hMapping ? (uint8_t *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+        void *p = mmap(NULL, (size_t)nSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        pData = p == MAP_FAILED ? NULL : (uint8_t *)p;
+        if (pData) {
+            madvise(pData, (size_t)nSize, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+            // Honored only by kernels with huge page support for read-only file mappings; a hint otherwise
+            if (bHugePage) {
+                madvise(pData, (size_t)nSize, MADV_HUGEPAGE);
+            }
+#endif
+        }
+#endif
+        if (!pData) {
+            LOG(ERROR) << "Failed to map input file: " << szFileName;
+        }
+    }
+    ~MappedFileReader() {
+#ifdef _WIN32
+        if (pData) {
+            UnmapViewOfFile(pData);
+        }
+        if (hMapping) {
+            CloseHandle(hMapping);
+        }
+        if (hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(hFile);
+        }
+#else
+        if (pData) {
+            munmap(pData, (size_t)nSize);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+
+    bool IsOpen() const {
+        return pData != NULL;
+    }
+    /** Valid for the lifetime of the reader; the pages are read-only */
+    uint8_t *GetData() const {
+        return pData;
+    }
+    uint64_t GetSize() const {
+        return nSize;
+    }
+
+    /**
+    *  @brief Starts reading [nOffset, nOffset + nLength) into memory. With bWait the call
+    *  touches every page and returns once the range is resident; without it the kernel
+    *  reads ahead in the background (a no-op on Windows).
+    */
+    void Prefetch(uint64_t nOffset, uint64_t nLength, bool bWait) {
+        if (!ClampRange(nOffset, nLength)) {
+            return;
+        }
+        uint64_t nBegin = nOffset / nPageSize * nPageSize;
+#ifndef _WIN32
+        madvise(pData + nBegin, (size_t)(nOffset + nLength - nBegin), MADV_WILLNEED);
+#endif
+        if (bWait) {
+            volatile uint8_t sum = 0;
+            for (uint64_t i = nBegin; i < nOffset + nLength; i += nPageSize) {
+                sum += pData[i];
+            }
+        }
+    }
+
+    /** Drops the whole pages inside [nOffset, nOffset + nLength) from the mapping; they are read again if touched */
+    void Evict(uint64_t nOffset, uint64_t nLength) {
+        if (!ClampRange(nOffset, nLength)) {
+            return;
+        }
+        uint64_t nBegin = (nOffset + nPageSize - 1) / nPageSize * nPageSize, nEnd = (nOffset + nLength) / nPageSize * nPageSize;
+        if (nEnd <= nBegin) {
+            return;
+        }
+#ifdef _WIN32
+        // Unlocking pages that are not locked removes them from the working set
+        VirtualUnlock(pData + nBegin, (SIZE_T)(nEnd - nBegin));
+#else
+        madvise(pData + nBegin, (size_t)(nEnd - nBegin), MADV_DONTNEED);
+#endif
+    }
+
+private:
+    bool ClampRange(uint64_t nOffset, uint64_t &nLength) const {
+        if (!pData || nOffset >= nSize) {
+            return false;
+        }
+        nLength = (std::min)(nLength, nSize - nOffset);
+        return nLength != 0;
+    }
+
+    uint8_t *pData = NULL;
+    uint64_t nSize = 0;
+    uint64_t nPageSize = 4096;
+#ifdef _WIN32
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    HANDLE hMapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+/**
+* @brief Streams fixed-size frames out of a mapped raw file. A background thread keeps the
+* nPrefetchFrame frames after the last requested one resident and evicts frames that fell more
+* than nPrefetchFrame behind it, so memory stays bounded however long the file is. Any frame
+* can be requested at any time; the window only decides whether it is already in memory.
+* Jumping outside the window (for example looping back to frame 0) restarts it there.
+*/
+class FrameWindowReader {
+public:
+    FrameWindowReader(const char *szFileName, uint64_t nFrameSize, int nPrefetchFrame = 16)
+        : file(szFileName), nFrameSize(nFrameSize), nPrefetchFrame((std::max)(nPrefetchFrame, 1)) {
+        if (file.IsOpen() && nFrameSize) {
+            nFrame = file.GetSize() / nFrameSize;
+            thPrefetch = std::thread(&FrameWindowReader::PrefetchProc, this);
+        }
+    }
+    ~FrameWindowReader() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            bQuit = true;
+        }
+        cv.notify_one();
+        if (thPrefetch.joinable()) {
+            thPrefetch.join();
+        }
+    }
+
+    bool IsOpen() const {
+        return file.IsOpen();
+    }
+    /** Whole frames in the file; a partial frame at the end is ignored */
+    uint64_t GetFrameCount() const {
+        return nFrame;
+    }
+
+    /** Returns NULL past the last frame */
+    uint8_t *GetFrame(uint64_t iFrame) {
+        if (iFrame >= nFrame) {
+            return NULL;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (iFrame >= iWindowBegin && iFrame < iPrefetched) {
+                nHit++;
+            } else {
+                nMiss++;
+            }
+            iCurrent = iFrame;
+        }
+        cv.notify_one();
+        return file.GetData() + iFrame * nFrameSize;
+    }
+
+    /** Requests that found their frame already prefetched, and those that did not */
+    void GetPrefetchStats(uint64_t &nHit, uint64_t &nMiss) {
+        std::lock_guard<std::mutex> lock(mtx);
+        nHit = this->nHit;
+        nMiss = this->nMiss;
+    }
+
+private:
+    void PrefetchProc() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            cv.wait(lock, [this] { return bQuit || IsWorkPending(); });
+            if (bQuit) {
+                break;
+            }
+            uint64_t iEvictBegin = 0, iEvictEnd = 0;
+            if (iCurrent < iWindowBegin || iCurrent > iPrefetched) {
+                iEvictBegin = iWindowBegin;
+                iEvictEnd = iPrefetched;
+                iWindowBegin = iPrefetched = iCurrent;
+                iGeneration++;
+            } else if (iCurrent > iWindowBegin + nPrefetchFrame) {
+                iEvictBegin = iWindowBegin;
+                iEvictEnd = iWindowBegin = iCurrent - nPrefetchFrame;
+            }
+            uint64_t iTarget = iPrefetched, iTargetGeneration = iGeneration;
+            bool bPrefetch = iPrefetched < GetPrefetchEnd();
+
+            lock.unlock();
+            if (iEvictEnd > iEvictBegin) {
+                file.Evict(iEvictBegin * nFrameSize, (iEvictEnd - iEvictBegin) * nFrameSize);
+            }
+            if (bPrefetch) {
+                file.Prefetch(iTarget * nFrameSize, nFrameSize, true);
+            }
+            lock.lock();
+            if (bPrefetch && iGeneration == iTargetGeneration && iPrefetched == iTarget) {
+                iPrefetched++;
+            }
+        }
+    }
+
+    bool IsWorkPending() const {
+        return iCurrent < iWindowBegin || iCurrent > iPrefetched || iCurrent > iWindowBegin + nPrefetchFrame
+            || iPrefetched < GetPrefetchEnd();
+    }
+
+    uint64_t GetPrefetchEnd() const {
+        return (std::min)(iCurrent + 1 + nPrefetchFrame, nFrame);
+    }
+
+    MappedFileReader file;
+    uint64_t nFrameSize, nFrame = 0;
+    uint64_t nPrefetchFrame;
+    std::thread thPrefetch;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool bQuit = false;
+    /** Frames in [iWindowBegin, iPrefetched) are resident */
+    uint64_t iCurrent = 0, iWindowBegin = 0, iPrefetched = 0, iGeneration = 0;
+    uint64_t nHit = 0, nMiss = 0;
+};
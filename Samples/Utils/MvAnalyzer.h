@@ -0,0 +1,210 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "MvFile.h"
+
+/**
+* @brief Per-frame statistics computed by NvMvAnalyzer. Distances are in luma pixels.
+*/
+struct NvMvFrameStats {
+    /** Global motion as a similarity transform around the frame center */
+    float fGlobalX, fGlobalY;
+    float fZoom;
+    float fRotationDegree;
+    /** Fraction of inter vectors that agree with the global motion model */
+    float fInlierRatio;
+    /** Mean squared residual motion (after removing global motion) per region, raster order */
+    std::vector<float> vRegionEnergy;
+    float fMeanEnergy;
+    float fIntraRatio;
+    /** Mean ME cost per block, 0 if the stream carries no cost */
+    float fMeanCost;
+    /** 0 (no change) to 1 (certain cut) */
+    float fSceneChangeScore;
+    bool bSceneChange;
+};
+
+/**
+* @brief CPU analytics on motion vector fields stored in the .mv layout.
+*
+* Global motion is fitted by least squares to a translation + zoom + rotation model over
+* all 8x8 vectors of inter blocks, then refitted once without the vectors that disagree
+* with the first fit. Region energy measures the motion left after removing global motion,
+* so camera pans do not register as activity. The scene change score combines the share of
+* intra blocks with a jump of the ME cost (or, without cost, of residual motion energy
+* weighted by the share of outliers) relative to a running average of previous frames.
+*
+* Frames must be passed in display order; the analyzer keeps the running averages.
+*/
+class NvMvAnalyzer {
+public:
+    NvMvAnalyzer(const NvMvFileHeader &header, int nRegionX = 4, int nRegionY = 4, float fSceneChangeThreshold = 0.5f)
+        : header(header), nRegionX((std::max)(nRegionX, 1)), nRegionY((std::max)(nRegionY, 1)), fSceneChangeThreshold(fSceneChangeThreshold) {
+        vSample.reserve(header.GetBlockCount() * 4);
+    }
+
+    /** pBlock points to header.GetBlockCount() blocks spaced header.nBlockRecordSize bytes apart */
+    void Analyze(const NvMvBlock *pBlock, NvMvFrameStats &stats) {
+        const float fScale = 1.0f / (1 << header.nMvFractionBits);
+        const float xCenter = header.nWidth / 2.0f, yCenter = header.nHeight / 2.0f;
+
+        vSample.clear();
+        int nIntra = 0;
+        double sumCost = 0;
+        for (uint32_t by = 0; by < header.nBlockY; by++) {
+            for (uint32_t bx = 0; bx < header.nBlockX; bx++) {
+                const NvMvBlock &block = *(const NvMvBlock *)((const uint8_t *)pBlock + ((size_t)by * header.nBlockX + bx) * header.nBlockRecordSize);
+                sumCost += block.nCost;
+                if (block.eType == NV_MV_BLOCK_INTRA) {
+                    nIntra++;
+                    continue;
+                }
+                for (int q = 0; q < 4; q++) {
+                    Sample s;
+                    s.x = bx * 16.0f + (q % 2) * 8 + 4 - xCenter;
+                    s.y = by * 16.0f + (q / 2) * 8 + 4 - yCenter;
+                    s.u = block.aMv[q][0] * fScale;
+                    s.v = block.aMv[q][1] * fScale;
+                    s.bInlier = true;
+                    vSample.push_back(s);
+                }
+            }
+        }
+        size_t nBlock = header.GetBlockCount();
+        stats.fIntraRatio = nBlock ? (float)nIntra / nBlock : 0.0f;
+        stats.fMeanCost = header.bHasCost && nBlock ? (float)(sumCost / nBlock) : 0.0f;
+
+        Model model = Fit();
+        stats.fInlierRatio = 0.0f;
+        if (!vSample.empty()) {
+            // Reject vectors whose residual is well above the typical one, then refit
+            std::vector<float> vResidual(vSample.size());
+            for (size_t i = 0; i < vSample.size(); i++) {
+                vResidual[i] = Residual(model, vSample[i]);
+            }
+            std::vector<float> vSorted(vResidual);
+            std::nth_element(vSorted.begin(), vSorted.begin() + vSorted.size() / 2, vSorted.end());
+            float fThreshold = (std::max)(2.0f * vSorted[vSorted.size() / 2], 1.0f);
+            int nInlier = 0;
+            for (size_t i = 0; i < vSample.size(); i++) {
+                vSample[i].bInlier = vResidual[i] <= fThreshold;
+                nInlier += vSample[i].bInlier;
+            }
+            stats.fInlierRatio = (float)nInlier / vSample.size();
+            if (nInlier) {
+                model = Fit();
+            }
+        }
+        stats.fGlobalX = model.tx;
+        stats.fGlobalY = model.ty;
+        stats.fZoom = 1.0f + model.s;
+        stats.fRotationDegree = (float)(atan(model.r) * 180.0 / 3.14159265358979);
+
+        // Residual energy per region
+        stats.vRegionEnergy.assign(nRegionX * nRegionY, 0.0f);
+        std::vector<int> vCount(nRegionX * nRegionY, 0);
+        double sumEnergy = 0;
+        for (const Sample &s : vSample) {
+            float r = Residual(model, s);
+            int rx = (std::min)((int)((s.x + xCenter) * nRegionX / header.nWidth), nRegionX - 1);
+            int ry = (std::min)((int)((s.y + yCenter) * nRegionY / header.nHeight), nRegionY - 1);
+            stats.vRegionEnergy[ry * nRegionX + rx] += r * r;
+            vCount[ry * nRegionX + rx]++;
+            sumEnergy += r * r;
+        }
+        for (size_t i = 0; i < stats.vRegionEnergy.size(); i++) {
+            if (vCount[i]) {
+                stats.vRegionEnergy[i] /= vCount[i];
+            }
+        }
+        stats.fMeanEnergy = vSample.empty() ? 0.0f : (float)(sumEnergy / vSample.size());
+
+        // Scene change
+        float fActivity = header.bHasCost ? stats.fMeanCost : stats.fMeanEnergy + 1.0f;
+        float fJump = 0.0f;
+        if (nFrame && fActivityAverage > 0.0f && fActivity > fActivityAverage) {
+            fJump = 1.0f - fActivityAverage / fActivity;
+        }
+        if (!header.bHasCost) {
+            fJump *= 1.0f - stats.fInlierRatio;
+        }
+        stats.fSceneChangeScore = (std::max)(stats.fIntraRatio, fJump);
+        stats.bSceneChange = nFrame && stats.fSceneChangeScore >= fSceneChangeThreshold;
+        if (!nFrame || stats.bSceneChange) {
+            // Start over after a cut so the new scene is compared with itself
+            fActivityAverage = fActivity;
+        } else {
+            fActivityAverage = 0.8f * fActivityAverage + 0.2f * fActivity;
+        }
+        nFrame++;
+    }
+
+private:
+    struct Sample {
+        float x, y, u, v;
+        bool bInlier;
+    };
+    /** u = tx + s * x - r * y, v = ty + r * x + s * y */
+    struct Model {
+        float tx, ty, s, r;
+    };
+
+    Model Fit() const {
+        Model m = {0.0f, 0.0f, 0.0f, 0.0f};
+        double sx = 0, sy = 0, su = 0, sv = 0;
+        int n = 0;
+        for (const Sample &s : vSample) {
+            if (s.bInlier) {
+                sx += s.x; sy += s.y; su += s.u; sv += s.v;
+                n++;
+            }
+        }
+        if (!n) {
+            return m;
+        }
+        double mx = sx / n, my = sy / n, mu = su / n, mv = sv / n;
+        // Zoom and rotation are solved on centered coordinates, which decouples them from translation
+        double a = 0, b = 0, d = 0;
+        for (const Sample &s : vSample) {
+            if (s.bInlier) {
+                double x = s.x - mx, y = s.y - my, u = s.u - mu, v = s.v - mv;
+                a += x * u + y * v;
+                b += x * v - y * u;
+                d += x * x + y * y;
+            }
+        }
+        if (d > 0) {
+            m.s = (float)(a / d);
+            m.r = (float)(b / d);
+        }
+        m.tx = (float)(mu - m.s * mx + m.r * my);
+        m.ty = (float)(mv - m.r * mx - m.s * my);
+        return m;
+    }
+
+    static float Residual(const Model &m, const Sample &s) {
+        float du = s.u - (m.tx + m.s * s.x - m.r * s.y);
+        float dv = s.v - (m.ty + m.r * s.x + m.s * s.y);
+        return sqrtf(du * du + dv * dv);
+    }
+
+    NvMvFileHeader header;
+    int nRegionX, nRegionY;
+    float fSceneChangeThreshold;
+    std::vector<Sample> vSample;
+    float fActivityAverage = 0.0f;
+    int nFrame = 0;
+};
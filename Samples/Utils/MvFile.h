@@ -0,0 +1,428 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/**
+* @brief Binary motion vector file layout (.mv).
+*
+* The file is a NvMvFileHeader followed by nFrame fixed-size frame records, so frame i
+* starts at nHeaderSize + i * GetFrameStride() and the whole file can be memory-mapped
+* and indexed directly. A frame record is a NvMvFrameHeader followed by
+* nBlockX * nBlockY NvMvBlock entries in raster order. All fields are little-endian.
+*
+* Both codecs are stored on the same 16x16 grid: every block carries one motion vector
+* per 8x8 quadrant (top-left, top-right, bottom-left, bottom-right), which is lossless for
+* H.264 macroblock partitions. HEVC CUs are walked in z-order and each quadrant takes the
+* vector of the prediction unit covering its center; 8x8 CUs split into smaller prediction
+* units store the average of their vectors.
+*/
+#define NV_MV_FILE_MAGIC "NVMV"
+#define NV_MV_FILE_VERSION 1
+
+enum NvMvCodec {
+    NV_MV_CODEC_H264 = 0,
+    NV_MV_CODEC_HEVC = 1,
+};
+
+enum NvMvBlockType {
+    NV_MV_BLOCK_INTRA = 0,
+    NV_MV_BLOCK_INTER = 1,
+    NV_MV_BLOCK_SKIP = 2,
+};
+
+#pragma pack(push, 1)
+struct NvMvFileHeader {
+    char szMagic[4];
+    uint32_t nVersion;
+    uint32_t nHeaderSize;
+    uint32_t eCodec;
+    uint32_t nWidth, nHeight;
+    uint32_t nBlockSize;
+    uint32_t nBlockX, nBlockY;
+    /** Patched when the writer is closed; readers also bound it by the file size */
+    uint32_t nFrame;
+    uint32_t nBlockRecordSize;
+    /** Motion vectors are in 1/(1 << nMvFractionBits) pel units */
+    uint32_t nMvFractionBits;
+    /** Non-zero if NvMvBlock::nCost is valid (H.264 only) */
+    uint32_t bHasCost;
+    uint32_t reserved[3];
+
+    size_t GetBlockCount() const {
+        return (size_t)nBlockX * nBlockY;
+    }
+    size_t GetFrameStride() const;
+};
+
+struct NvMvFrameHeader {
+    uint32_t iFrame;
+    uint32_t iReferenceFrame;
+};
+
+struct NvMvBlock {
+    /** Quarter pel by default; [quadrant][x, y] */
+    int16_t aMv[4][2];
+    uint8_t eType;
+    /** Native partition: H.264 partitionType or HEVC partitionMode of the first CU */
+    uint8_t nPartition;
+    /** Log2 of the (largest) coding block size covering this block: 4 for H.264 */
+    uint8_t nCuSizeLog2;
+    uint8_t reserved;
+    uint32_t nCost;
+};
+#pragma pack(pop)
+
+inline size_t NvMvFileHeader::GetFrameStride() const {
+    return sizeof(NvMvFrameHeader) + GetBlockCount() * nBlockRecordSize;
+}
+
+inline NvMvFileHeader NvMvMakeFileHeader(NvMvCodec eCodec, uint32_t nWidth, uint32_t nHeight) {
+    NvMvFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.szMagic, NV_MV_FILE_MAGIC, 4);
+    header.nVersion = NV_MV_FILE_VERSION;
+    header.nHeaderSize = sizeof(NvMvFileHeader);
+    header.eCodec = eCodec;
+    header.nWidth = nWidth;
+    header.nHeight = nHeight;
+    header.nBlockSize = 16;
+    header.nBlockX = (nWidth + 15) / 16;
+    header.nBlockY = (nHeight + 15) / 16;
+    header.nBlockRecordSize = sizeof(NvMvBlock);
+    header.nMvFractionBits = 2;
+    header.bHasCost = eCodec == NV_MV_CODEC_H264;
+    return header;
+}
+
+#ifdef _NV_ENCODEAPI_H_
+/**
+* @brief Converts the raw output of NvEncoder::RunMotionEstimation() into the 16x16 block grid
+* described by header. vBlock is resized to header.GetBlockCount().
+*/
+class NvMvFieldConverter {
+public:
+    static void Convert(const NvMvFileHeader &header, const uint8_t *pMvData, size_t nMvData, std::vector<NvMvBlock> &vBlock) {
+        vBlock.resize(header.GetBlockCount());
+        if (header.eCodec == NV_MV_CODEC_H264) {
+            ConvertH264(header, pMvData, nMvData, vBlock.data());
+        } else {
+            ConvertHevc(header, pMvData, nMvData, vBlock.data());
+        }
+    }
+
+private:
+    static void ConvertH264(const NvMvFileHeader &header, const uint8_t *pMvData, size_t nMvData, NvMvBlock *pBlock) {
+        const NV_ENC_H264_MV_DATA *pMb = (const NV_ENC_H264_MV_DATA *)pMvData;
+        size_t n = (std::min)(header.GetBlockCount(), nMvData / sizeof(NV_ENC_H264_MV_DATA));
+        for (size_t i = 0; i < n; i++) {
+            NvMvBlock &block = pBlock[i];
+            for (int q = 0; q < 4; q++) {
+                // partitionType: 0 16x16, 1 8x8, 2 16x8, 3 8x16
+                int iMv = pMb[i].partitionType == 1 ? q : pMb[i].partitionType == 2 ? q / 2 : pMb[i].partitionType == 3 ? q % 2 : 0;
+                block.aMv[q][0] = pMb[i].mv[iMv].mvx;
+                block.aMv[q][1] = pMb[i].mv[iMv].mvy;
+            }
+            // mbType: 0 I, 1 P, 2 IPCM, 3 B
+            block.eType = (pMb[i].mbType == 0 || pMb[i].mbType == 2) ? NV_MV_BLOCK_INTRA : NV_MV_BLOCK_INTER;
+            block.nPartition = pMb[i].partitionType;
+            block.nCuSizeLog2 = 4;
+            block.reserved = 0;
+            block.nCost = pMb[i].mbCost;
+        }
+        for (size_t i = n; i < header.GetBlockCount(); i++) {
+            memset(&pBlock[i], 0, sizeof(NvMvBlock));
+        }
+    }
+
+    /** Index of the PU of a CU of size nSize that covers the point (x, y) relative to the CU */
+    static int GetHevcPu(int ePartitionMode, int nSize, int x, int y) {
+        switch (ePartitionMode) {
+        case 1: return y >= nSize / 2;
+        case 2: return x >= nSize / 2;
+        case 3: return (y >= nSize / 2) * 2 + (x >= nSize / 2);
+        case 4: return y >= nSize / 4;
+        case 5: return y >= nSize * 3 / 4;
+        case 6: return x >= nSize / 4;
+        case 7: return x >= nSize * 3 / 4;
+        default: return 0;
+        }
+    }
+
+    static void ConvertHevc(const NvMvFileHeader &header, const uint8_t *pMvData, size_t nMvData, NvMvBlock *pBlock) {
+        const int nCtbSize = 32;
+        // Work on the 8x8 grid first; an 8x8 cell maps to one quadrant of a 16x16 block
+        int nCellX = header.nBlockX * 2, nCellY = header.nBlockY * 2;
+        struct Cell {
+            int16_t mv[2];
+            uint8_t eType, nPartition, nCuSizeLog2;
+        };
+        Cell empty = {{0, 0}, NV_MV_BLOCK_SKIP, 0, 0};
+        std::vector<Cell> vCell(nCellX * nCellY, empty);
+
+        const NV_ENC_HEVC_MV_DATA *pCu = (const NV_ENC_HEVC_MV_DATA *)pMvData;
+        const NV_ENC_HEVC_MV_DATA *pCuEnd = pCu + nMvData / sizeof(NV_ENC_HEVC_MV_DATA);
+        int nCtbX = (header.nWidth + nCtbSize - 1) / nCtbSize, nCtbY = (header.nHeight + nCtbSize - 1) / nCtbSize;
+        for (int iCtb = 0; iCtb < nCtbX * nCtbY && pCu < pCuEnd; iCtb++) {
+            int x0 = (iCtb % nCtbX) * nCtbSize / 8, y0 = (iCtb / nCtbX) * nCtbSize / 8;
+            // z-order index of the next CU within the CTB, in 8x8 units
+            int z = 0;
+            bool bLast = false;
+            while (!bLast && pCu < pCuEnd) {
+                bLast = pCu->lastCUInCTB != 0;
+                int nSize8 = (std::min)(1 << pCu->cuSize, nCtbSize / 8);
+                // De-interleave the z-order index into cell coordinates
+                int xCu = 0, yCu = 0;
+                for (int b = 0; b < 4; b++) {
+                    xCu |= ((z >> (2 * b)) & 1) << b;
+                    yCu |= ((z >> (2 * b + 1)) & 1) << b;
+                }
+                int nPu = pCu->partitionMode == 0 ? 1 : pCu->partitionMode == 3 ? 4 : 2;
+                for (int dy = 0; dy < nSize8; dy++) {
+                    for (int dx = 0; dx < nSize8; dx++) {
+                        int x = x0 + xCu + dx, y = y0 + yCu + dy;
+                        if (x >= nCellX || y >= nCellY) {
+                            continue;
+                        }
+                        Cell &cell = vCell[y * nCellX + x];
+                        if (nSize8 == 1 && nPu > 1) {
+                            // An 8x8 CU split into smaller PUs: keep the average
+                            int sx = 0, sy = 0;
+                            for (int i = 0; i < nPu; i++) {
+                                sx += pCu->mv[i].mvx;
+                                sy += pCu->mv[i].mvy;
+                            }
+                            cell.mv[0] = (int16_t)(sx / nPu);
+                            cell.mv[1] = (int16_t)(sy / nPu);
+                        } else {
+                            int iPu = GetHevcPu(pCu->partitionMode, nSize8 * 8, dx * 8 + 4, dy * 8 + 4);
+                            cell.mv[0] = pCu->mv[iPu].mvx;
+                            cell.mv[1] = pCu->mv[iPu].mvy;
+                        }
+                        // cuType: 0 I, 1 P, 2 Skip
+                        cell.eType = pCu->cuType == 0 ? NV_MV_BLOCK_INTRA : pCu->cuType == 2 ? NV_MV_BLOCK_SKIP : NV_MV_BLOCK_INTER;
+                        cell.nPartition = pCu->partitionMode;
+                        cell.nCuSizeLog2 = (uint8_t)(3 + pCu->cuSize);
+                    }
+                }
+                z += nSize8 * nSize8;
+                pCu++;
+            }
+        }
+
+        for (uint32_t by = 0; by < header.nBlockY; by++) {
+            for (uint32_t bx = 0; bx < header.nBlockX; bx++) {
+                NvMvBlock &block = pBlock[by * header.nBlockX + bx];
+                memset(&block, 0, sizeof(block));
+                block.eType = NV_MV_BLOCK_SKIP;
+                for (int q = 0; q < 4; q++) {
+                    const Cell &cell = vCell[(by * 2 + q / 2) * nCellX + bx * 2 + q % 2];
+                    block.aMv[q][0] = cell.mv[0];
+                    block.aMv[q][1] = cell.mv[1];
+                    // Intra wins over inter, inter over skip
+                    if (q == 0 || cell.eType < block.eType) {
+                        block.eType = cell.eType;
+                    }
+                    if (cell.nCuSizeLog2 > block.nCuSizeLog2) {
+                        block.nCuSizeLog2 = cell.nCuSizeLog2;
+                        block.nPartition = cell.nPartition;
+                    }
+                }
+            }
+        }
+    }
+};
+#endif
+
+/**
+* @brief Writes a .mv file frame by frame. The frame count in the header is filled in by Close().
+*/
+class NvMvFileWriter {
+public:
+    NvMvFileWriter(const char *szFilePath, const NvMvFileHeader &header) : header(header) {
+        fpOut.open(szFilePath, std::ios::out | std::ios::binary);
+        if (!fpOut) {
+            std::ostringstream err;
+            err << "Unable to open output file: " << szFilePath << std::endl;
+            throw std::invalid_argument(err.str());
+        }
+        this->header.nFrame = 0;
+        fpOut.write(reinterpret_cast<const char *>(&this->header), sizeof(NvMvFileHeader));
+    }
+    ~NvMvFileWriter() {
+        Close();
+    }
+
+    void WriteFrame(uint32_t iFrame, uint32_t iReferenceFrame, const NvMvBlock *pBlock) {
+        NvMvFrameHeader frameHeader = {iFrame, iReferenceFrame};
+        fpOut.write(reinterpret_cast<const char *>(&frameHeader), sizeof(frameHeader));
+        fpOut.write(reinterpret_cast<const char *>(pBlock), header.GetBlockCount() * sizeof(NvMvBlock));
+        header.nFrame++;
+    }
+
+    void Close() {
+        if (!fpOut.is_open()) {
+            return;
+        }
+        fpOut.seekp(0);
+        fpOut.write(reinterpret_cast<const char *>(&header), sizeof(NvMvFileHeader));
+        fpOut.close();
+    }
+
+    uint32_t GetFrameCount() const {
+        return header.nFrame;
+    }
+
+private:
+    NvMvFileHeader header;
+    std::ofstream fpOut;
+};
+
+/**
+* @brief Read-only memory mapping of a .mv file. Frames are accessed in place without copying.
+*/
+class NvMvFileReader {
+public:
+    NvMvFileReader(const char *szFilePath) {
+#ifdef _WIN32
+        hFile = CreateFileA(szFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        LARGE_INTEGER size;
+        if (hFile != INVALID_HANDLE_VALUE && GetFileSizeEx(hFile, &size)) {
+            nSize = (size_t)size.QuadPart;
+            hMapping = nSize ? CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+            if (hMapping) {
+                pBuf = (const uint8_t *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            }
+        }
+#else
+        fd = open(szFilePath, O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            nSize = (size_t)st.st_size;
+            void *p = mmap(NULL, nSize, PROT_READ, MAP_SHARED, fd, 0);
+            pBuf = p == MAP_FAILED ? NULL : (const uint8_t *)p;
+        }
+#endif
+        if (!pBuf) {
+            Release();
+            std::ostringstream err;
+            err << "Unable to map motion vector file: " << szFilePath << std::endl;
+            throw std::invalid_argument(err.str());
+        }
+
+        const NvMvFileHeader *pHeader = (const NvMvFileHeader *)pBuf;
+        if (nSize < sizeof(NvMvFileHeader) || memcmp(pHeader->szMagic, NV_MV_FILE_MAGIC, 4)
+            || pHeader->nVersion != NV_MV_FILE_VERSION || pHeader->nHeaderSize < sizeof(NvMvFileHeader)
+            || pHeader->nBlockRecordSize < sizeof(NvMvBlock) || nSize < pHeader->nHeaderSize) {
+            Release();
+            std::ostringstream err;
+            err << "Not a motion vector file: " << szFilePath << std::endl;
+            throw std::invalid_argument(err.str());
+        }
+        header = *pHeader;
+        // A writer that did not finish leaves nFrame at 0; trust the file size in that case
+        size_t nAvailable = (nSize - header.nHeaderSize) / header.GetFrameStride();
+        if (!header.nFrame || header.nFrame > nAvailable) {
+            header.nFrame = (uint32_t)nAvailable;
+        }
+    }
+    ~NvMvFileReader() {
+        Release();
+    }
+
+    const NvMvFileHeader &GetHeader() const {
+        return header;
+    }
+    uint32_t GetFrameCount() const {
+        return header.nFrame;
+    }
+    const NvMvFrameHeader *GetFrameHeader(uint32_t i) const {
+        return (const NvMvFrameHeader *)(pBuf + header.nHeaderSize + i * header.GetFrameStride());
+    }
+    /** Blocks are nBlockRecordSize apart; use GetBlock() if that may exceed sizeof(NvMvBlock) */
+    const NvMvBlock *GetBlocks(uint32_t i) const {
+        return (const NvMvBlock *)((const uint8_t *)GetFrameHeader(i) + sizeof(NvMvFrameHeader));
+    }
+    const NvMvBlock &GetBlock(uint32_t i, uint32_t x, uint32_t y) const {
+        return *(const NvMvBlock *)((const uint8_t *)GetBlocks(i) + ((size_t)y * header.nBlockX + x) * header.nBlockRecordSize);
+    }
+
+private:
+    void Release() {
+#ifdef _WIN32
+        if (pBuf) UnmapViewOfFile(pBuf);
+        if (hMapping) CloseHandle(hMapping);
+        if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+        hMapping = NULL;
+        hFile = INVALID_HANDLE_VALUE;
+#else
+        if (pBuf) munmap((void *)pBuf, nSize);
+        if (fd >= 0) close(fd);
+        fd = -1;
+#endif
+        pBuf = NULL;
+    }
+
+    NvMvFileHeader header;
+    const uint8_t *pBuf = NULL;
+    size_t nSize = 0;
+#ifdef _WIN32
+    HANDLE hFile = INVALID_HANDLE_VALUE, hMapping = NULL;
+#else
+    int fd = -1;
+#endif
+};
+
+/**
+* @brief Writes the frames of a .mv file as text, one line per block. This is meant for inspection
+* only; the text is many times larger than the binary file and slow to produce.
+*/
+inline void NvMvWriteText(const NvMvFileReader &reader, std::ostream &os) {
+    const NvMvFileHeader &header = reader.GetHeader();
+    os << "# codec=" << (header.eCodec == NV_MV_CODEC_H264 ? "h264" : "hevc") << " size=" << header.nWidth << "x" << header.nHeight
+        << " blocks=" << header.nBlockX << "x" << header.nBlockY << " frames=" << header.nFrame << std::endl;
+    for (uint32_t i = 0; i < reader.GetFrameCount(); i++) {
+        const NvMvFrameHeader *pFrameHeader = reader.GetFrameHeader(i);
+        os << "Motion Vectors for input frame = " << pFrameHeader->iFrame << ", reference frame = " << pFrameHeader->iReferenceFrame << std::endl;
+        os << "block, x, y, type, partition, cuSizeLog2, "
+            << "MV[0].x, MV[0].y, MV[1].x, MV[1].y, MV[2].x, MV[2].y, MV[3].x, MV[3].y" << (header.bHasCost ? ", cost" : "") << std::endl;
+        for (uint32_t y = 0; y < header.nBlockY; y++) {
+            for (uint32_t x = 0; x < header.nBlockX; x++) {
+                const NvMvBlock &block = reader.GetBlock(i, x, y);
+                os << y * header.nBlockX + x << ", " << x << ", " << y << ", " << (int)block.eType << ", " << (int)block.nPartition << ", " << (int)block.nCuSizeLog2;
+                for (int q = 0; q < 4; q++) {
+                    os << ", " << block.aMv[q][0] << ", " << block.aMv[q][1];
+                }
+                if (header.bHasCost) {
+                    os << ", " << block.nCost;
+                }
+                os << "\n";
+            }
+        }
+    }
+}
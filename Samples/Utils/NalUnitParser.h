@@ -0,0 +1,106 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <vector>
+
+/**
+* @brief Minimal Annex-B byte stream walker for H.264 and HEVC elementary streams.
+*
+* NVENC emits each frame as one or more NAL units, each prefixed with a 3 or 4 byte
+* start code. This helper splits such a buffer into NAL units and classifies them,
+* which is all the splicing/muxing code needs (no slice header parsing).
+*/
+class NalUnitParser {
+public:
+    struct NalUnit {
+        /** Start of the NAL unit including its start code */
+        const uint8_t *pStart;
+        /** Size of the NAL unit including its start code */
+        size_t nSize;
+        /** Offset of the NAL unit header within pStart */
+        size_t nHeaderOffset;
+        int nType;
+    };
+
+    NalUnitParser(bool bHevc) : bHevc(bHevc) {}
+
+    /** Walks all NAL units in pBuf; stops early if func returns false */
+    void ForEach(const uint8_t *pBuf, size_t nBuf, std::function<bool(const NalUnit &)> func) const {
+        size_t iStart = FindStartCode(pBuf, nBuf, 0);
+        while (iStart < nBuf) {
+            size_t iPayload = iStart + 3;
+            size_t iNext = FindStartCode(pBuf, nBuf, iPayload);
+            // A zero byte right before the next 3-byte start code belongs to that start code
+            size_t iEnd = iNext;
+            if (iNext < nBuf && iNext > iPayload && pBuf[iNext - 1] == 0) {
+                iEnd = iNext - 1;
+            }
+            // Include a leading zero byte of a 4-byte start code
+            size_t iBegin = (iStart > 0 && pBuf[iStart - 1] == 0) ? iStart - 1 : iStart;
+            NalUnit nal = {pBuf + iBegin, iEnd - iBegin, iPayload - iBegin, -1};
+            if (iPayload < iEnd) {
+                nal.nType = GetNalType(pBuf[iPayload]);
+            }
+            if (!func(nal)) {
+                return;
+            }
+            iStart = iNext;
+        }
+    }
+
+    int GetNalType(uint8_t nalHeader) const {
+        return bHevc ? (nalHeader >> 1) & 0x3f : nalHeader & 0x1f;
+    }
+
+    /** SPS/PPS for H.264; VPS/SPS/PPS for HEVC */
+    bool IsParameterSet(int nType) const {
+        return bHevc ? (nType >= 32 && nType <= 34) : (nType == 7 || nType == 8);
+    }
+
+    /** IDR for H.264; any IRAP picture (BLA/IDR/CRA) for HEVC */
+    bool IsRandomAccessPoint(int nType) const {
+        return bHevc ? (nType >= 16 && nType <= 23) : nType == 5;
+    }
+
+    bool IsVcl(int nType) const {
+        return bHevc ? nType < 32 : (nType >= 1 && nType <= 5);
+    }
+
+    /** True if the access unit in pBuf contains a random access picture */
+    bool ContainsRandomAccessPoint(const uint8_t *pBuf, size_t nBuf) const {
+        bool bFound = false;
+        ForEach(pBuf, nBuf, [&](const NalUnit &nal) {
+            bFound = IsRandomAccessPoint(nal.nType);
+            return !bFound;
+        });
+        return bFound;
+    }
+
+private:
+    /** Returns index of the first byte of the next 00 00 01 sequence at or after i, or nBuf */
+    static size_t FindStartCode(const uint8_t *pBuf, size_t nBuf, size_t i) {
+        for (; i + 2 < nBuf; i++) {
+            if (pBuf[i + 2] > 1) {
+                i += 2;
+            } else if (pBuf[i] == 0 && pBuf[i + 1] == 0 && pBuf[i + 2] == 1) {
+                return i;
+            }
+        }
+        return nBuf;
+    }
+
+    bool bHevc;
+};
@@ -17,6 +17,13 @@
 #include <stdint.h>
 #include <string.h>
 #include "Logger.h"
+#include "MappedFileReader.h"
+#ifndef __CUDACC__
+// Host SIMD code; keep it away from nvcc
+#include "YuvConverter.h"
+// Task pool, channels and pipeline stages to build sample pipelines on instead of NvThread and polling
+#include "NvPipeline.h"
+#endif
 #include <thread>
 
 extern simplelogger::Logger *logger;
@@ -154,118 +161,33 @@ private:
 #define _stricmp strcasecmp
 #endif
 
+/**
+* @brief Gives access to a whole input file through a read-only memory mapping, so files of any
+* size work, including raw files beyond 4 GB. With bPreload every page is read in the
+* constructor, for measurements that must not see disk reads; otherwise pages come in on first
+* access, helped by read-ahead. FrameWindowReader in MappedFileReader.h streams long raw files
+* with bounded memory instead.
+*/
 class BufferedFileReader {
 public:
-    BufferedFileReader(const char *szFileName, bool bPartial = false) {
-        struct stat st;
-
-        if (stat(szFileName, &st) != 0) {
-            return;
-        }
-        
-        nSize = st.st_size;
-        while (nSize) {
-            try {
-                pBuf = new uint8_t[nSize];
-                if (nSize != st.st_size) {
-                    LOG(WARNING) << "File is too large - only " << std::setprecision(4) << 100.0 * nSize / (uint32_t)st.st_size << "% is loaded"; 
-                }
-                break;
-            } catch(std::bad_alloc) {
-                if (!bPartial) {
-                    LOG(ERROR) << "Failed to allocate memory in BufferedReader";
-                    return;
-                }
-                nSize = (uint32_t)(nSize * 0.9);
-            }
-        }
-
-        std::ifstream fpIn(szFileName, std::ifstream::in | std::ifstream::binary);
-        if (!fpIn)
-        {
-            LOG(ERROR) << "Unable to open input file: " << szFileName;
-            return;
-        }
-
-        std::streamsize nRead = fpIn.read(reinterpret_cast<char*>(pBuf), nSize).gcount();
-        fpIn.close();
-
-        assert(nRead == nSize);
-    }
-    ~BufferedFileReader() {
-        if (pBuf) {
-            delete[] pBuf;
+    BufferedFileReader(const char *szFileName, bool bPreload = false) : file(szFileName) {
+        if (file.IsOpen()) {
+            file.Prefetch(0, file.GetSize(), bPreload);
         }
     }
-    bool GetBuffer(uint8_t **ppBuf, uint32_t *pnSize) {
-        if (!pBuf) {
+    /** The buffer is read-only and valid for the lifetime of the reader */
+    bool GetBuffer(uint8_t **ppBuf, uint64_t *pnSize) {
+        if (!file.IsOpen()) {
             return false;
         }
 
-        *ppBuf = pBuf;
-        *pnSize = nSize;
+        *ppBuf = file.GetData();
+        *pnSize = file.GetSize();
         return true;
     }
 
 private:
-    uint8_t *pBuf = NULL;
-    uint32_t nSize = 0;
-};
-
-template<typename T>
-class YuvConverter {
-public:
-    YuvConverter(int nWidth, int nHeight) : nWidth(nWidth), nHeight(nHeight) {
-        pQuad = new T[nWidth * nHeight / 4];
-    }
-    ~YuvConverter() {
-        delete pQuad;
-    }
-    void PlanarToUVInterleaved(T *pFrame, int nPitch = 0) {
-        if (nPitch == 0) {
-            nPitch = nWidth;
-        }
-        T *puv = pFrame + nPitch * nHeight;
-        if (nPitch == nWidth) {
-            memcpy(pQuad, puv, nWidth * nHeight / 4 * sizeof(T));
-        } else {
-            for (int i = 0; i < nHeight / 2; i++) {
-                memcpy(pQuad + nWidth / 2 * i, puv + nPitch / 2 * i, nWidth / 2 * sizeof(T));
-            }
-        }
-        T *pv = puv + (nPitch / 2) * (nHeight / 2);
-        for (int y = 0; y < nHeight / 2; y++) {
-            for (int x = 0; x < nWidth / 2; x++) {
-                puv[y * nPitch + x * 2] = pQuad[y * nWidth / 2 + x];
-                puv[y * nPitch + x * 2 + 1] = pv[y * nPitch / 2 + x];
-            }
-        }
-    }
-    void UVInterleavedToPlanar(T *pFrame, int nPitch = 0) {
-        if (nPitch == 0) {
-            nPitch = nWidth;
-        }
-        T *puv = pFrame + nPitch * nHeight, 
-            *pu = puv, 
-            *pv = puv + nPitch * nHeight / 4;
-        for (int y = 0; y < nHeight / 2; y++) {
-            for (int x = 0; x < nWidth / 2; x++) {
-                pu[y * nPitch / 2 + x] = puv[y * nPitch + x * 2];
-                pQuad[y * nWidth / 2 + x] = puv[y * nPitch + x * 2 + 1];
-            }
-        }
-        if (nPitch == nWidth) {
-            memcpy(pv, pQuad, nWidth * nHeight / 4 * sizeof(T));
-        } else {
-            for (int i = 0; i < nHeight / 2; i++) {
-                memcpy(pv + nPitch / 2 * i, pQuad + nWidth / 2 * i, nWidth / 2 * sizeof(T));
-            }
-        }
-    }
-
-private:
-    T *pQuad;
-    int nWidth, nHeight;
+    MappedFileReader file;
 };
 
 class StopWatch {
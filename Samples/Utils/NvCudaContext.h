@@ -0,0 +1,210 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <cuda.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "NvCodecUtils.h"
+
+/**
+* @brief Makes a context current for a scope, as a cuCtxPushCurrent()/cuCtxPopCurrent() pair does,
+* but makes neither call when the context is current already: inside another scope of the same
+* context, or on a thread that made it current with Bind(). Every thread remembers the context it
+* made current, so the check itself costs no driver call.
+*
+* What a thread remembers is right as long as it changes contexts only through scopes and Bind().
+* A thread that never calls Bind() pushes in its outermost scope, as before, so only a thread that
+* binds must not push or set other contexts by itself.
+*/
+class NvCudaContextScope {
+public:
+    struct Stats {
+        /** Scopes that pushed and popped, and scopes that found their context current */
+        uint64_t nPush = 0, nSkip = 0;
+    };
+
+    NvCudaContextScope() {}
+    ~NvCudaContextScope() {
+        Leave();
+    }
+    NvCudaContextScope(const NvCudaContextScope &) = delete;
+    NvCudaContextScope &operator=(const NvCudaContextScope &) = delete;
+
+    /** Makes cuContext current until the scope ends; returns the error of cuCtxPushCurrent(), if any */
+    CUresult Enter(CUcontext cuContext) {
+        Leave();
+        if (cuContext == Current()) {
+            GetThreadStats().nSkip++;
+            return CUDA_SUCCESS;
+        }
+        CUresult e = cuCtxPushCurrent(cuContext);
+        if (e != CUDA_SUCCESS) {
+            return e;
+        }
+        bPushed = true;
+        cuPrevious = Current();
+        Current() = cuContext;
+        GetThreadStats().nPush++;
+        return CUDA_SUCCESS;
+    }
+
+    /** Ends the scope early */
+    void Leave() {
+        if (!bPushed) {
+            return;
+        }
+        cuCtxPopCurrent(NULL);
+        Current() = cuPrevious;
+        bPushed = false;
+    }
+
+    /** Makes cuContext current for the calling thread, outside of any scope, until the next Bind() */
+    static CUresult Bind(CUcontext cuContext) {
+        CUresult e = cuCtxSetCurrent(cuContext);
+        Current() = e == CUDA_SUCCESS ? cuContext : NULL;
+        return e;
+    }
+
+    /** Counts of the calling thread */
+    static Stats &GetThreadStats() {
+        thread_local Stats stats;
+        return stats;
+    }
+
+    /** Nanoseconds a cuCtxPushCurrent()/cuCtxPopCurrent() pair of cuContext takes on the calling thread */
+    static double MeasurePushPop(CUcontext cuContext, int nIter = 100000) {
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < nIter; i++) {
+            cuCtxPushCurrent(cuContext);
+            cuCtxPopCurrent(NULL);
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::nano>(t1 - t0).count() / (std::max)(nIter, 1);
+    }
+
+private:
+    static CUcontext &Current() {
+        thread_local CUcontext cuContext = NULL;
+        return cuContext;
+    }
+
+    bool bPushed = false;
+    CUcontext cuPrevious = NULL;
+};
+
+/**
+* @brief A stream and an event on a context, for the CUDA work of one session. The decoder and
+* the encoder of a transcode share one, so the encoder's upload of a decoded frame is queued
+* behind the decoder's copy into it, and the decoder's next copy into a recycled frame behind the
+* upload, without either side waiting. Work of other sessions on the same context does not
+* serialize with it as it would on the default stream.
+*/
+class NvCudaStream {
+public:
+    NvCudaStream(CUcontext cuContext) : cuContext(cuContext) {
+        NvCudaContextScope scope;
+        ck(scope.Enter(cuContext));
+        ck(cuStreamCreate(&cuStream, CU_STREAM_NON_BLOCKING));
+        ck(cuEventCreate(&cuEvent, CU_EVENT_DISABLE_TIMING));
+    }
+    ~NvCudaStream() {
+        NvCudaContextScope scope;
+        scope.Enter(cuContext);
+        if (cuEvent) {
+            cuEventDestroy(cuEvent);
+        }
+        if (cuStream) {
+            cuStreamDestroy(cuStream);
+        }
+    }
+    NvCudaStream(const NvCudaStream &) = delete;
+    NvCudaStream &operator=(const NvCudaStream &) = delete;
+
+    CUcontext GetContext() {
+        return cuContext;
+    }
+    CUstream GetStream() {
+        return cuStream;
+    }
+    CUevent GetEvent() {
+        return cuEvent;
+    }
+    /** Waits for the work queued on the stream so far */
+    void Synchronize() {
+        NvCudaContextScope scope;
+        ck(scope.Enter(cuContext));
+        ck(cuEventRecord(cuEvent, cuStream));
+        ck(cuEventSynchronize(cuEvent));
+    }
+
+private:
+    CUcontext cuContext;
+    CUstream cuStream = NULL;
+    CUevent cuEvent = NULL;
+};
+
+/**
+* @brief Hands out the primary context of each GPU, the one context the driver keeps per device
+* and shares with the CUDA runtime, instead of a context created per thread or per session. Each
+* is retained on first use and released with the manager. Sessions on the same GPU share the
+* context and get a stream of their own from CreateStream(). Threads that work on one context
+* only should Bind() it, after which the context switches inside NvDecoder and NvEncoderCuda
+* cost nothing.
+*/
+class NvCudaContextManager {
+public:
+    /** nFlags (CU_CTX_SCHED_BLOCKING_SYNC, say) apply to the primary contexts not yet in use elsewhere */
+    NvCudaContextManager(unsigned nFlags = 0) : nFlags(nFlags) {}
+    ~NvCudaContextManager() {
+        for (auto &it : mContext) {
+            cuDevicePrimaryCtxRelease(it.second.first);
+        }
+    }
+    NvCudaContextManager(const NvCudaContextManager &) = delete;
+    NvCudaContextManager &operator=(const NvCudaContextManager &) = delete;
+
+    /** The primary context of GPU iGpu; NULL if it cannot be had */
+    CUcontext GetContext(int iGpu) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = mContext.find(iGpu);
+        if (it != mContext.end()) {
+            return it->second.second;
+        }
+        CUdevice cuDevice = 0;
+        CUcontext cuContext = NULL;
+        if (!ck(cuDeviceGet(&cuDevice, iGpu))) {
+            return NULL;
+        }
+        // Fails harmlessly if the context is active already, in which case its flags stay
+        cuDevicePrimaryCtxSetFlags(cuDevice, nFlags);
+        if (!ck(cuDevicePrimaryCtxRetain(&cuContext, cuDevice))) {
+            return NULL;
+        }
+        mContext[iGpu] = std::make_pair(cuDevice, cuContext);
+        return cuContext;
+    }
+
+    /** A stream of its own for a session (or a transcode) on GPU iGpu */
+    std::unique_ptr<NvCudaStream> CreateStream(int iGpu) {
+        return std::unique_ptr<NvCudaStream>(new NvCudaStream(GetContext(iGpu)));
+    }
+
+private:
+    unsigned nFlags;
+    std::mutex mtx;
+    std::map<int, std::pair<CUdevice, CUcontext>> mContext;
+};
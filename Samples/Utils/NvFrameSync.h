@@ -0,0 +1,328 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "NvPipeline.h"
+
+/** How a source filled its slot of a frame set */
+enum FrameSlotState {
+    /** The source's frame for this key */
+    FRAME_SLOT_NEW,
+    /** The source had no frame for this key (dropped, late or ended); its previous frame is repeated */
+    FRAME_SLOT_REPEATED,
+    /** The source had no frame for this key and nothing to repeat; the slot holds T() */
+    FRAME_SLOT_MISSING,
+};
+
+/**
+* @brief One frame of every source, aligned on nKey.
+*/
+template<class T>
+struct NvFrameSet {
+    int64_t nKey = 0;
+    std::vector<T> vFrame;
+    std::vector<FrameSlotState> vState;
+};
+
+struct NvFrameSyncParams {
+    /** Frames queued per source before its producer blocks */
+    int nQueueSize = 4;
+    /** Keys no further apart than this belong to the same set, for pts that jitter between sources */
+    int64_t nTolerance = 0;
+    /** Repeat the last frame of a source that has none for a key; needs a copyable T (a shared_ptr, say) */
+    bool bRepeatMissing = true;
+    /** End at the first source that ends, rather than run on until the last one ends */
+    bool bStopAtFirstEnd = false;
+    /** Give up on a stalled source after this many milliseconds and emit the set without it; 0 waits */
+    int msMaxWait = 0;
+};
+
+/**
+* @brief Aligns the frames of N producers (decoders, typically) by frame index or pts, and hands
+* a consumer (a compositor) one complete NvFrameSet at a time.
+*
+* Every source has its own bounded queue and condition variable. A set for the smallest queued
+* key is ready once every live source has a frame queued; sources whose head frame has a larger
+* key have dropped this one, and get their previous frame or an empty slot. Frames that arrive
+* for a key already emitted, or out of order, are dropped. The consumer is woken only when the
+* last empty queue of a live source gets a frame, not on every push, so a wall of 64 tiles costs
+* one wake-up per set instead of 64.
+*
+* Each frame is destroyed by the sync (when dropped or at Close()) or by the consumer (when the
+* next set is popped), never while the lock is held, so a deleter may call back into a decoder.
+*/
+template<class T>
+class NvFrameSync : public NvChannelBase {
+public:
+    struct SourceStats {
+        uint64_t nFrame = 0, nRepeated = 0, nMissing = 0, nDropped = 0;
+        int nMaxDepth = 0;
+    };
+
+    NvFrameSync(int nSource, const NvFrameSyncParams &params = NvFrameSyncParams()) : params(params),
+        nEmptyLive((std::max)(nSource, 1)) {
+        this->params.nQueueSize = (std::max)(params.nQueueSize, 1);
+        for (int i = 0; i < (std::max)(nSource, 1); i++) {
+            vpSource.emplace_back(new Source);
+        }
+    }
+
+    int GetSourceCount() const {
+        return (int)vpSource.size();
+    }
+
+    /** Queues the next frame of iSource, keyed by its frame index (dropped frames still count) */
+    bool Push(int iSource, T frame, bool *pbBlocked = NULL) {
+        int64_t nKey;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            nKey = vpSource[iSource]->nNextIndex++;
+        }
+        return Push(iSource, nKey, std::move(frame), pbBlocked);
+    }
+
+    /** Marks the next frame index of iSource as used by a dropped frame, so that the index keys stay aligned */
+    void Skip(int iSource) {
+        std::lock_guard<std::mutex> lock(mtx);
+        vpSource[iSource]->nNextIndex++;
+    }
+
+    /**
+    * Queues a frame of iSource with key nKey (a pts, say); keys of one source must increase. Blocks
+    * while the source's queue is full. Returns false once the sync is closed or finished, in which
+    * case frame has been released.
+    */
+    bool Push(int iSource, int64_t nKey, T frame, bool *pbBlocked = NULL) {
+        std::unique_lock<std::mutex> lock(mtx);
+        Source &s = *vpSource[iSource];
+        bool bBlocked = !bClosed && (int)s.q.size() >= params.nQueueSize;
+        if (bBlocked) {
+            s.cvNotFull.wait(lock, [&] { return bClosed || (int)s.q.size() < params.nQueueSize; });
+        }
+        if (pbBlocked) {
+            *pbBlocked = bBlocked;
+        }
+        if (bClosed || s.bEnded) {
+            lock.unlock();
+            return false;
+        }
+        if ((bStarted && nKey <= nLastKey + params.nTolerance) || (s.bPushed && nKey <= s.nLastPushed)) {
+            // Late for its set, or out of order; released once the lock is gone
+            s.stats.nDropped++;
+            lock.unlock();
+            return true;
+        }
+        s.bPushed = true;
+        s.nLastPushed = nKey;
+        bool bWasEmpty = s.q.empty();
+        s.q.push_back(Entry{nKey, std::move(frame)});
+        s.stats.nMaxDepth = (std::max)(s.stats.nMaxDepth, (int)s.q.size());
+        if (bWasEmpty && --nEmptyLive == 0 && bWaiting) {
+            lock.unlock();
+            cvReady.notify_one();
+        }
+        return true;
+    }
+
+    /** iSource delivers no more frames; what it queued is still used */
+    void End(int iSource) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Source &s = *vpSource[iSource];
+            if (s.bEnded) {
+                return;
+            }
+            s.bEnded = true;
+            if (s.q.empty()) {
+                nEmptyLive--;
+            }
+        }
+        cvReady.notify_one();
+    }
+
+    /**
+    * Waits for the next complete set; set's previous frames are released at the end of the call,
+    * outside the lock. Returns false once the sync is closed, or every source (the first one, with
+    * bStopAtFirstEnd) has ended and drained.
+    */
+    bool Pop(NvFrameSet<T> &set) {
+        std::vector<T> vRelease;
+        vRelease.swap(set.vFrame);
+        std::unique_lock<std::mutex> lock(mtx);
+        std::chrono::steady_clock::time_point tDeadline = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds(params.msMaxWait);
+        while (!bClosed) {
+            if (nEmptyLive == 0) {
+                if (IsFinished()) {
+                    break;
+                }
+                Emit(set, vRelease);
+                return true;
+            }
+            bWaiting = true;
+            if (!params.msMaxWait) {
+                cvReady.wait(lock, [this] { return bClosed || nEmptyLive == 0; });
+            } else if (!cvReady.wait_until(lock, tDeadline, [this] { return bClosed || nEmptyLive == 0; })) {
+                bWaiting = false;
+                if (HasFrame()) {
+                    // A live source has stalled; the others should not wait for it any longer
+                    Emit(set, vRelease);
+                    return true;
+                }
+                tDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(params.msMaxWait);
+            }
+            bWaiting = false;
+        }
+        CloseLocked(vRelease);
+        lock.unlock();
+        NotifyAll();
+        return false;
+    }
+
+    /** Ends the stream at once: blocked producers and the consumer return false, and queued frames are released */
+    void Close() {
+        std::vector<T> vRelease;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            CloseLocked(vRelease);
+        }
+        NotifyAll();
+    }
+
+    uint64_t GetSetCount() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return nSet;
+    }
+    std::vector<SourceStats> GetStats() {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<SourceStats> vStats;
+        for (std::unique_ptr<Source> &pSource : vpSource) {
+            vStats.push_back(pSource->stats);
+        }
+        return vStats;
+    }
+
+private:
+    struct Entry {
+        int64_t nKey;
+        T frame;
+    };
+    struct Source {
+        std::deque<Entry> q;
+        std::condition_variable cvNotFull;
+        T last = T();
+        bool bHasLast = false, bEnded = false, bPushed = false;
+        int64_t nNextIndex = 0, nLastPushed = 0;
+        SourceStats stats;
+    };
+
+    bool HasFrame() const {
+        for (const std::unique_ptr<Source> &pSource : vpSource) {
+            if (!pSource->q.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Called with every live source holding a frame */
+    bool IsFinished() const {
+        bool bAllDrained = true;
+        for (const std::unique_ptr<Source> &pSource : vpSource) {
+            bool bDrained = pSource->bEnded && pSource->q.empty();
+            if (bDrained && params.bStopAtFirstEnd) {
+                return true;
+            }
+            bAllDrained = bAllDrained && bDrained;
+        }
+        return bAllDrained;
+    }
+
+    /** Takes the set of the smallest queued key; nEmptyLive is 0 or the wait timed out */
+    void Emit(NvFrameSet<T> &set, std::vector<T> &vRelease) {
+        int64_t nKey = INT64_MAX;
+        for (std::unique_ptr<Source> &pSource : vpSource) {
+            if (!pSource->q.empty()) {
+                nKey = (std::min)(nKey, pSource->q.front().nKey);
+            }
+        }
+        int n = (int)vpSource.size();
+        set.nKey = nKey;
+        set.vFrame.resize(n);
+        set.vState.resize(n);
+        for (int i = 0; i < n; i++) {
+            Source &s = *vpSource[i];
+            if (!s.q.empty() && s.q.front().nKey <= nKey + params.nTolerance) {
+                set.vFrame[i] = std::move(s.q.front().frame);
+                set.vState[i] = FRAME_SLOT_NEW;
+                s.q.pop_front();
+                s.stats.nFrame++;
+                if (params.bRepeatMissing) {
+                    vRelease.push_back(std::move(s.last));
+                    s.last = set.vFrame[i];
+                    s.bHasLast = true;
+                }
+                if (s.q.empty() && !s.bEnded) {
+                    nEmptyLive++;
+                }
+                s.cvNotFull.notify_one();
+            } else if (s.bHasLast) {
+                set.vFrame[i] = s.last;
+                set.vState[i] = FRAME_SLOT_REPEATED;
+                s.stats.nRepeated++;
+            } else {
+                set.vFrame[i] = T();
+                set.vState[i] = FRAME_SLOT_MISSING;
+                s.stats.nMissing++;
+            }
+        }
+        nLastKey = nKey;
+        bStarted = true;
+        nSet++;
+    }
+
+    void CloseLocked(std::vector<T> &vRelease) {
+        bClosed = true;
+        for (std::unique_ptr<Source> &pSource : vpSource) {
+            for (Entry &e : pSource->q) {
+                vRelease.push_back(std::move(e.frame));
+            }
+            pSource->q.clear();
+            vRelease.push_back(std::move(pSource->last));
+            pSource->bHasLast = false;
+        }
+    }
+
+    void NotifyAll() {
+        cvReady.notify_all();
+        for (std::unique_ptr<Source> &pSource : vpSource) {
+            pSource->cvNotFull.notify_all();
+        }
+    }
+
+    NvFrameSyncParams params;
+    std::vector<std::unique_ptr<Source>> vpSource;
+    std::mutex mtx;
+    std::condition_variable cvReady;
+    /** Sources that have not ended and have nothing queued; a set is ready when it drops to 0 */
+    int nEmptyLive;
+    bool bWaiting = false, bClosed = false, bStarted = false;
+    int64_t nLastKey = 0;
+    uint64_t nSet = 0;
+};
@@ -0,0 +1,717 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Logger.h"
+#include "Tracer.h"
+
+extern simplelogger::Logger *logger;
+
+/**
+* @brief Lets a pipeline close every channel at once, whatever the element type.
+*/
+class NvChannelBase {
+public:
+    virtual ~NvChannelBase() {}
+    virtual void Close() = 0;
+};
+
+/**
+* @brief Bounded FIFO between threads. Push() blocks while the channel is full and Pop() while it
+* is empty; both wake up as soon as the other side makes room or data, instead of polling. Close()
+* ends the stream: Push() then fails at once, and Pop() returns what is left before failing, so
+* consumers can tell end of stream from a value. Any number of producers and consumers may share
+* a channel.
+*/
+template<class T>
+class NvChannel : public NvChannelBase {
+public:
+    NvChannel(int nCapacity) : nCapacity((std::max)(nCapacity, 1)) {}
+
+    /** Returns false if the channel was closed before t could be queued; pbBlocked tells whether the call had to wait */
+    bool Push(T t, bool *pbBlocked = NULL) {
+        std::unique_lock<std::mutex> lock(mtx);
+        bool bBlocked = !bClosed && (int)q.size() >= nCapacity;
+        if (bBlocked) {
+            cvNotFull.wait(lock, [this] { return bClosed || (int)q.size() < nCapacity; });
+        }
+        if (pbBlocked) {
+            *pbBlocked = bBlocked;
+        }
+        if (bClosed) {
+            return false;
+        }
+        q.push_back(std::move(t));
+        nMaxDepth = (std::max)(nMaxDepth, (int)q.size());
+        lock.unlock();
+        cvNotEmpty.notify_one();
+        return true;
+    }
+    /** Queues t only if that needs no waiting; t is left untouched on failure */
+    bool TryPush(T &t) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (bClosed || (int)q.size() >= nCapacity) {
+            return false;
+        }
+        q.push_back(std::move(t));
+        nMaxDepth = (std::max)(nMaxDepth, (int)q.size());
+        lock.unlock();
+        cvNotEmpty.notify_one();
+        return true;
+    }
+
+    /** Returns false once the channel is closed and drained */
+    bool Pop(T &t, bool *pbBlocked = NULL) {
+        std::unique_lock<std::mutex> lock(mtx);
+        bool bBlocked = !bClosed && q.empty();
+        if (bBlocked) {
+            cvNotEmpty.wait(lock, [this] { return bClosed || !q.empty(); });
+        }
+        if (pbBlocked) {
+            *pbBlocked = bBlocked;
+        }
+        if (q.empty()) {
+            return false;
+        }
+        t = std::move(q.front());
+        q.pop_front();
+        lock.unlock();
+        cvNotFull.notify_one();
+        return true;
+    }
+    bool TryPop(T &t) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (q.empty()) {
+            return false;
+        }
+        t = std::move(q.front());
+        q.pop_front();
+        lock.unlock();
+        cvNotFull.notify_one();
+        return true;
+    }
+
+    void Close() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            bClosed = true;
+        }
+        cvNotEmpty.notify_all();
+        cvNotFull.notify_all();
+    }
+    bool IsClosed() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return bClosed;
+    }
+    int GetSize() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return (int)q.size();
+    }
+    int GetCapacity() const {
+        return nCapacity;
+    }
+    /** Most elements ever queued at once; a channel that is always full points at a slow consumer */
+    int GetMaxDepth() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return nMaxDepth;
+    }
+
+private:
+    const int nCapacity;
+    std::deque<T> q;
+    std::mutex mtx;
+    std::condition_variable cvNotEmpty, cvNotFull;
+    bool bClosed = false;
+    int nMaxDepth = 0;
+};
+
+/**
+* @brief Fixed set of worker threads with one task deque each. A worker runs the newest task of
+* its own deque first, which keeps the data of the task that spawned it in cache, and when it
+* runs dry steals the oldest task of another worker. Tasks submitted from outside the pool are
+* spread round-robin. Idle workers sleep on a condition variable, so an idle pool costs nothing.
+*
+* Tasks should not block for long on other tasks; use NvTaskGroup::Wait(), which runs queued
+* tasks while it waits. The destructor runs every task still queued before it joins the workers.
+*/
+class NvTaskPool {
+public:
+    NvTaskPool(int nWorker = 0) {
+        if (nWorker <= 0) {
+            nWorker = (std::max)((int)std::thread::hardware_concurrency(), 1);
+        }
+        for (int i = 0; i < nWorker; i++) {
+            vpWorker.emplace_back(new Worker);
+        }
+        for (int i = 0; i < nWorker; i++) {
+            vpWorker[i]->th = std::thread(&NvTaskPool::WorkerProc, this, i);
+        }
+    }
+    ~NvTaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtxSleep);
+            bQuit = true;
+        }
+        cvSleep.notify_all();
+        for (std::unique_ptr<Worker> &pWorker : vpWorker) {
+            pWorker->th.join();
+        }
+    }
+
+    int GetWorkerCount() const {
+        return (int)vpWorker.size();
+    }
+
+    void Submit(std::function<void()> task) {
+        CurrentWorker &current = GetCurrentWorker();
+        int iWorker = current.pPool == this ? current.iWorker : (int)(iNextWorker++ % vpWorker.size());
+        {
+            std::lock_guard<std::mutex> lock(vpWorker[iWorker]->mtx);
+            vpWorker[iWorker]->dqTask.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtxSleep);
+            nPending++;
+        }
+        cvSleep.notify_one();
+    }
+
+    /** Runs one queued task on the calling thread; returns false if there was none */
+    bool RunPendingTask() {
+        CurrentWorker &current = GetCurrentWorker();
+        std::function<void()> task;
+        if (!Take(current.pPool == this ? current.iWorker : -1, task)) {
+            return false;
+        }
+        Run(task);
+        return true;
+    }
+
+    /** Tasks run so far, and how many of them a worker took from another worker's deque */
+    void GetStats(uint64_t &nExecuted, uint64_t &nStolen) const {
+        nExecuted = this->nExecuted.load();
+        nStolen = this->nStolen.load();
+    }
+
+private:
+    struct Worker {
+        std::mutex mtx;
+        std::deque<std::function<void()>> dqTask;
+        std::thread th;
+    };
+    struct CurrentWorker {
+        NvTaskPool *pPool;
+        int iWorker;
+    };
+
+    static CurrentWorker &GetCurrentWorker() {
+        static thread_local CurrentWorker current = {NULL, -1};
+        return current;
+    }
+
+    /** iSelf is the caller's own deque, or -1 for a thread outside the pool */
+    bool Take(int iSelf, std::function<void()> &task) {
+        int n = (int)vpWorker.size();
+        if (iSelf >= 0) {
+            std::lock_guard<std::mutex> lock(vpWorker[iSelf]->mtx);
+            if (!vpWorker[iSelf]->dqTask.empty()) {
+                task = std::move(vpWorker[iSelf]->dqTask.back());
+                vpWorker[iSelf]->dqTask.pop_back();
+                return Taken();
+            }
+        }
+        for (int k = 1; k <= n; k++) {
+            int iVictim = ((iSelf < 0 ? 0 : iSelf) + k) % n;
+            if (iVictim == iSelf) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(vpWorker[iVictim]->mtx);
+            if (!vpWorker[iVictim]->dqTask.empty()) {
+                task = std::move(vpWorker[iVictim]->dqTask.front());
+                vpWorker[iVictim]->dqTask.pop_front();
+                nStolen++;
+                return Taken();
+            }
+        }
+        return false;
+    }
+    bool Taken() {
+        std::lock_guard<std::mutex> lock(mtxSleep);
+        nPending--;
+        return true;
+    }
+
+    void Run(std::function<void()> &task) {
+        try {
+            task();
+        } catch (const std::exception &ex) {
+            // Nobody waits on a bare task; NvTaskGroup and NvTaskStrand catch before this
+            LOG(ERROR) << "Unhandled exception in task: " << ex.what();
+        } catch (...) {
+            LOG(ERROR) << "Unhandled exception in task";
+        }
+        task = nullptr;
+        nExecuted++;
+    }
+
+    void WorkerProc(int iWorker) {
+        CurrentWorker &current = GetCurrentWorker();
+        current.pPool = this;
+        current.iWorker = iWorker;
+        std::function<void()> task;
+        while (true) {
+            if (Take(iWorker, task)) {
+                Run(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mtxSleep);
+            cvSleep.wait(lock, [this] { return bQuit || nPending > 0; });
+            if (bQuit && nPending == 0) {
+                break;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> vpWorker;
+    std::atomic<uint64_t> iNextWorker{0};
+    std::mutex mtxSleep;
+    std::condition_variable cvSleep;
+    /** Tasks queued in any deque; guarded by mtxSleep so that no wake-up is lost */
+    int nPending = 0;
+    bool bQuit = false;
+    std::atomic<uint64_t> nExecuted{0}, nStolen{0};
+};
+
+/**
+* @brief Fork-join on an NvTaskPool: Run() any number of tasks, then Wait() for all of them.
+* Wait() runs queued tasks on the calling thread before it blocks, and rethrows the first
+* exception a task threw.
+*/
+class NvTaskGroup {
+public:
+    NvTaskGroup(NvTaskPool &pool) : pool(pool) {}
+    ~NvTaskGroup() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return nOutstanding == 0; });
+    }
+
+    void Run(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            nOutstanding++;
+        }
+        pool.Submit([this, task]() {
+            std::exception_ptr ex;
+            try {
+                task();
+            } catch (...) {
+                ex = std::current_exception();
+            }
+            // Notify under the lock: the group may be destroyed as soon as Wait() sees zero
+            std::lock_guard<std::mutex> lock(mtx);
+            if (ex && !this->ex) {
+                this->ex = ex;
+            }
+            if (--nOutstanding == 0) {
+                cv.notify_all();
+            }
+        });
+    }
+
+    void Wait() {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (nOutstanding == 0) {
+                    break;
+                }
+            }
+            if (!pool.RunPendingTask()) {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this] { return nOutstanding == 0; });
+                break;
+            }
+        }
+        std::exception_ptr ex;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            std::swap(ex, this->ex);
+        }
+        if (ex) {
+            std::rethrow_exception(ex);
+        }
+    }
+
+private:
+    NvTaskPool &pool;
+    std::mutex mtx;
+    std::condition_variable cv;
+    int nOutstanding = 0;
+    std::exception_ptr ex;
+};
+
+/**
+* @brief Runs the tasks posted to it one at a time and in order, on whichever pool worker is
+* free. This is how a stateful object that is not thread-safe, such as an encoder session,
+* shares the pool: many strands can make progress on few workers, and an idle strand holds no
+* thread. Once a task throws, the tasks after it are dropped without running (their captures
+* are still released) and Wait() rethrows the exception.
+*/
+class NvTaskStrand {
+public:
+    NvTaskStrand(NvTaskPool &pool) : pool(pool) {}
+    ~NvTaskStrand() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return !bScheduled; });
+    }
+
+    void Post(std::function<void()> task) {
+        bool bSchedule;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            qTask.push_back(std::move(task));
+            bSchedule = !bScheduled;
+            bScheduled = true;
+        }
+        if (bSchedule) {
+            pool.Submit([this]() { RunOne(); });
+        }
+    }
+
+    /** Waits until every posted task has run */
+    void Wait() {
+        std::exception_ptr ex;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this] { return !bScheduled; });
+            std::swap(ex, this->ex);
+        }
+        if (ex) {
+            std::rethrow_exception(ex);
+        }
+    }
+
+private:
+    void RunOne() {
+        std::function<void()> task;
+        bool bFailed;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            task = std::move(qTask.front());
+            qTask.pop_front();
+            bFailed = ex != nullptr;
+        }
+        std::exception_ptr ex;
+        if (!bFailed) {
+            try {
+                task();
+            } catch (...) {
+                ex = std::current_exception();
+            }
+        }
+        task = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (ex && !this->ex) {
+                this->ex = ex;
+            }
+            if (qTask.empty()) {
+                bScheduled = false;
+                cv.notify_all();
+                return;
+            }
+        }
+        // Requeue rather than loop, so that other strands get their turn on this worker
+        pool.Submit([this]() { RunOne(); });
+    }
+
+    NvTaskPool &pool;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> qTask;
+    bool bScheduled = false;
+    std::exception_ptr ex;
+};
+
+/**
+* @brief Time accounting of one pipeline stage. Busy time is wall time minus the time spent
+* blocked on input and output channels; for a task stage it is the time its tasks ran.
+*/
+struct NvStageMetrics {
+    std::string strName;
+    uint64_t nItem = 0;
+    double secWall = 0, secBusy = 0, secInputWait = 0, secOutputWait = 0;
+};
+
+/**
+* @brief Runs a processing graph made of stages connected by NvChannels, and measures each stage.
+*
+* A thread stage (AddStage) owns a thread for its whole life and suits loops that block in
+* driver calls, like demux/decode. A task stage (AddTaskStage) is an NvTaskStrand on the
+* pipeline's work-stealing pool: its tasks run in order but borrow a worker only while they
+* run, so many light stages (one per encoder of a ladder, say) share a few threads.
+*
+* If a stage throws, the pipeline closes every channel made by CreateChannel(), so the other
+* stages see end of stream instead of blocking forever, and Wait() rethrows the first exception.
+* Stage threads are named after their stage in the Tracer, and waits on channels show up in
+* the trace as "Wait for input" and "Wait for output". Stages are added from one thread.
+*/
+class NvPipeline {
+public:
+    class Stage {
+    public:
+        /** Pop()/Push() of the channel, with the blocked time charged to this stage */
+        template<class T>
+        bool Pop(NvChannel<T> &channel, T &t) {
+            int64_t t0 = Tracer::Get().Now();
+            bool bBlocked = false;
+            bool bOk = channel.Pop(t, &bBlocked);
+            if (bBlocked) {
+                Blocked("Wait for input", t0, nInputWaitNs);
+            }
+            return bOk;
+        }
+        template<class T>
+        bool Push(NvChannel<T> &channel, T t) {
+            int64_t t0 = Tracer::Get().Now();
+            bool bBlocked = false;
+            bool bOk = channel.Push(std::move(t), &bBlocked);
+            if (bBlocked) {
+                Blocked("Wait for output", t0, nOutputWaitNs);
+            }
+            return bOk;
+        }
+
+        /** Counts items (frames, packets) for the throughput figures */
+        void AddItem(uint64_t n = 1) {
+            nItem += n;
+        }
+        uint64_t GetItemCount() const {
+            return nItem;
+        }
+
+        /** Task stages only: queues task behind the ones posted before */
+        void Post(std::function<void()> task) {
+            pStrand->Post([this, task]() {
+                int64_t t0 = Tracer::Get().Now();
+                try {
+                    task();
+                } catch (...) {
+                    Done();
+                    pipeline.Cancel();
+                    throw;
+                }
+                nBusyNs += Tracer::Get().Now() - t0;
+                Done();
+            });
+        }
+
+        const std::string &GetName() const {
+            return strName;
+        }
+        NvPipeline &GetPipeline() {
+            return pipeline;
+        }
+
+    private:
+        friend class NvPipeline;
+        Stage(NvPipeline &pipeline, const std::string &strName) : pipeline(pipeline), strName(strName),
+            tBegin(Tracer::Get().Now()) {}
+
+        void Blocked(const char *szName, int64_t t0, std::atomic<int64_t> &nWaitNs) {
+            int64_t t1 = Tracer::Get().Now();
+            nWaitNs += t1 - t0;
+            if (Tracer::Get().IsEnabled()) {
+                Tracer::Get().Record(szName, t0, t1);
+            }
+        }
+        void Done() {
+            tEnd = Tracer::Get().Now();
+        }
+
+        NvPipeline &pipeline;
+        std::string strName;
+        std::unique_ptr<NvTaskStrand> pStrand;
+        std::atomic<uint64_t> nItem{0};
+        std::atomic<int64_t> nInputWaitNs{0}, nOutputWaitNs{0}, nBusyNs{0};
+        int64_t tBegin;
+        std::atomic<int64_t> tEnd{-1};
+    };
+
+    /** nWorker sizes the task pool, which is only started by the first task stage; 0 means one per core */
+    NvPipeline(int nWorker = 0) : nWorker(nWorker) {}
+    /** A pipeline destroyed while running (Wait() skipped on an error path) is cancelled first */
+    ~NvPipeline() {
+        Cancel();
+        Join();
+    }
+
+    template<class T>
+    std::shared_ptr<NvChannel<T>> CreateChannel(int nCapacity) {
+        std::shared_ptr<NvChannel<T>> pChannel(new NvChannel<T>(nCapacity));
+        std::lock_guard<std::mutex> lock(mtx);
+        vpChannel.push_back(pChannel);
+        if (bCancelled) {
+            pChannel->Close();
+        }
+        return pChannel;
+    }
+
+    /** Lets Cancel() close a channel made elsewhere, such as an NvFrameSync */
+    void Attach(std::shared_ptr<NvChannelBase> pChannel) {
+        std::lock_guard<std::mutex> lock(mtx);
+        vpChannel.push_back(pChannel);
+        if (bCancelled) {
+            pChannel->Close();
+        }
+    }
+
+    /** Starts func(stage) on a new thread */
+    Stage &AddStage(const std::string &strName, std::function<void(Stage &)> func) {
+        vpStage.emplace_back(new Stage(*this, strName));
+        Stage *pStage = vpStage.back().get();
+        vth.push_back(std::thread([this, pStage, func]() {
+            Tracer::Get().SetThreadName(pStage->strName);
+            try {
+                func(*pStage);
+            } catch (...) {
+                SetException(std::current_exception());
+                Cancel();
+            }
+            pStage->Done();
+        }));
+        return *pStage;
+    }
+
+    /** Returns a stage that runs the tasks given to its Post() */
+    Stage &AddTaskStage(const std::string &strName) {
+        if (!pPool) {
+            pPool.reset(new NvTaskPool(nWorker));
+        }
+        vpStage.emplace_back(new Stage(*this, strName));
+        vpStage.back()->pStrand.reset(new NvTaskStrand(*pPool));
+        return *vpStage.back();
+    }
+
+    /** Closes all channels; stages blocked on them return, and new pushes fail */
+    void Cancel() {
+        std::lock_guard<std::mutex> lock(mtx);
+        bCancelled = true;
+        for (std::shared_ptr<NvChannelBase> &pChannel : vpChannel) {
+            pChannel->Close();
+        }
+    }
+
+    /** Waits until every stage has finished and rethrows the first exception of any stage */
+    void Wait() {
+        Join();
+        std::exception_ptr ex;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            std::swap(ex, this->ex);
+        }
+        if (ex) {
+            std::rethrow_exception(ex);
+        }
+    }
+
+    std::vector<NvStageMetrics> GetMetrics() const {
+        std::vector<NvStageMetrics> vMetrics;
+        int64_t tNow = Tracer::Get().Now();
+        for (const std::unique_ptr<Stage> &pStage : vpStage) {
+            NvStageMetrics m;
+            m.strName = pStage->strName;
+            m.nItem = pStage->nItem;
+            int64_t tEnd = pStage->tEnd;
+            m.secWall = ((tEnd < 0 ? tNow : tEnd) - pStage->tBegin) / 1.0e9;
+            m.secInputWait = pStage->nInputWaitNs / 1.0e9;
+            m.secOutputWait = pStage->nOutputWaitNs / 1.0e9;
+            m.secBusy = pStage->pStrand ? pStage->nBusyNs / 1.0e9
+                : (std::max)(m.secWall - m.secInputWait - m.secOutputWait, 0.0);
+            vMetrics.push_back(m);
+        }
+        return vMetrics;
+    }
+
+    /** One line per stage; the stage with the highest busy share is the bottleneck */
+    void PrintMetrics(std::ostream &os) const {
+        std::ios::fmtflags flags = os.flags();
+        std::streamsize nPrecision = os.precision();
+        os << std::left << std::setw(24) << "Stage" << std::right << std::setw(10) << "Items"
+            << std::setw(10) << "Wall(s)" << std::setw(10) << "Busy(s)" << std::setw(8) << "Busy%"
+            << std::setw(12) << "InWait(s)" << std::setw(12) << "OutWait(s)" << std::setw(12) << "Items/s" << std::endl;
+        for (const NvStageMetrics &m : GetMetrics()) {
+            os << std::left << std::setw(24) << m.strName << std::right << std::setw(10) << m.nItem
+                << std::fixed << std::setprecision(3)
+                << std::setw(10) << m.secWall << std::setw(10) << m.secBusy
+                << std::setprecision(1) << std::setw(8) << (m.secWall > 0 ? m.secBusy * 100 / m.secWall : 0)
+                << std::setprecision(3) << std::setw(12) << m.secInputWait << std::setw(12) << m.secOutputWait
+                << std::setprecision(1) << std::setw(12) << (m.secWall > 0 ? m.nItem / m.secWall : 0)
+                << std::endl;
+        }
+        if (pPool) {
+            uint64_t nExecuted = 0, nStolen = 0;
+            pPool->GetStats(nExecuted, nStolen);
+            os << "Task pool: " << pPool->GetWorkerCount() << " workers, " << nExecuted << " tasks, " << nStolen << " stolen" << std::endl;
+        }
+        os.flags(flags);
+        os.precision(nPrecision);
+    }
+
+private:
+    void SetException(std::exception_ptr ex) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!this->ex) {
+            this->ex = ex;
+        }
+    }
+
+    void Join() {
+        for (std::thread &th : vth) {
+            if (th.joinable()) {
+                th.join();
+            }
+        }
+        for (std::unique_ptr<Stage> &pStage : vpStage) {
+            if (pStage->pStrand) {
+                try {
+                    pStage->pStrand->Wait();
+                } catch (...) {
+                    SetException(std::current_exception());
+                }
+            }
+        }
+    }
+
+    int nWorker;
+    std::unique_ptr<NvTaskPool> pPool;
+    std::vector<std::unique_ptr<Stage>> vpStage;
+    std::vector<std::thread> vth;
+    std::mutex mtx;
+    std::vector<std::shared_ptr<NvChannelBase>> vpChannel;
+    bool bCancelled = false;
+    std::exception_ptr ex;
+};
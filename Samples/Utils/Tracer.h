@@ -0,0 +1,213 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+* @brief Process-wide recorder of timed spans, written out as Chrome trace JSON that
+* chrome://tracing and ui.perfetto.dev load directly. Every thread appends to its own buffer of
+* fixed-size chunks, so recording takes no lock except when a chunk fills up. Spans of one
+* thread nest by time, which gives the call hierarchy; spans of all threads share one
+* timeline, which shows where a pipeline stage waits for another.
+*
+* Tracing is off until Start(). While off, a span costs one relaxed atomic load; building with
+* NVTRACE_DISABLE removes the spans altogether. Span names must outlive the tracer, which
+* string literals do.
+*/
+class Tracer {
+public:
+    static Tracer &Get() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    void Start() {
+        bEnabled.store(true, std::memory_order_relaxed);
+    }
+    void Stop() {
+        bEnabled.store(false, std::memory_order_relaxed);
+    }
+    bool IsEnabled() const {
+        return bEnabled.load(std::memory_order_relaxed);
+    }
+
+    /** Nanoseconds since the tracer was created */
+    int64_t Now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    /** Labels the calling thread's row in the trace */
+    void SetThreadName(const std::string &strName) {
+        ThreadBuffer *pBuffer = GetThreadBuffer();
+        std::lock_guard<std::mutex> lock(pBuffer->mtx);
+        pBuffer->strName = strName;
+    }
+
+    /** Records a finished span on the calling thread; nArg is shown with the span when bArg is set */
+    void Record(const char *szName, int64_t tBegin, int64_t tEnd, int64_t nArg = 0, bool bArg = false) {
+        ThreadBuffer *pBuffer = GetThreadBuffer();
+        Chunk *pChunk = pBuffer->pCurrent;
+        int n = pChunk->nEvent.load(std::memory_order_relaxed);
+        if (n == Chunk::nCapacity) {
+            std::lock_guard<std::mutex> lock(pBuffer->mtx);
+            pBuffer->vpChunk.emplace_back(new Chunk);
+            pChunk = pBuffer->pCurrent = pBuffer->vpChunk.back().get();
+            n = 0;
+        }
+        Event &e = pChunk->aEvent[n];
+        e.szName = szName;
+        e.tBegin = tBegin;
+        e.tEnd = tEnd;
+        e.nArg = nArg;
+        e.bArg = bArg;
+        pChunk->nEvent.store(n + 1, std::memory_order_release);
+    }
+
+    /** Writes the spans recorded so far; threads may keep recording meanwhile */
+    bool WriteChromeTrace(const char *szFilePath) {
+        FILE *fp = fopen(szFilePath, "w");
+        if (!fp) {
+            return false;
+        }
+        fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        bool bFirst = true;
+        std::lock_guard<std::mutex> lockRegistry(mtxRegistry);
+        for (size_t iThread = 0; iThread < vpThreadBuffer.size(); iThread++) {
+            ThreadBuffer *pBuffer = vpThreadBuffer[iThread].get();
+            std::lock_guard<std::mutex> lock(pBuffer->mtx);
+            if (!pBuffer->strName.empty()) {
+                fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    bFirst ? "" : ",\n", (int)iThread, Escape(pBuffer->strName.c_str()).c_str());
+                bFirst = false;
+            }
+            for (const std::unique_ptr<Chunk> &pChunk : pBuffer->vpChunk) {
+                int n = pChunk->nEvent.load(std::memory_order_acquire);
+                for (int i = 0; i < n; i++) {
+                    const Event &e = pChunk->aEvent[i];
+                    fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                        bFirst ? "" : ",\n", Escape(e.szName).c_str(), (int)iThread, e.tBegin / 1000.0, (e.tEnd - e.tBegin) / 1000.0);
+                    if (e.bArg) {
+                        fprintf(fp, ",\"args\":{\"value\":%lld}", (long long)e.nArg);
+                    }
+                    fprintf(fp, "}");
+                    bFirst = false;
+                }
+            }
+        }
+        fprintf(fp, "\n]}\n");
+        return fclose(fp) == 0;
+    }
+
+private:
+    struct Event {
+        const char *szName;
+        int64_t tBegin, tEnd;
+        int64_t nArg;
+        bool bArg;
+    };
+
+    struct Chunk {
+        static const int nCapacity = 4096;
+        Event aEvent[nCapacity];
+        std::atomic<int> nEvent{0};
+    };
+
+    struct ThreadBuffer {
+        ThreadBuffer() {
+            vpChunk.emplace_back(new Chunk);
+            pCurrent = vpChunk.back().get();
+        }
+        /** Guards vpChunk and strName against the writer; the owning thread alone appends events */
+        std::mutex mtx;
+        std::vector<std::unique_ptr<Chunk>> vpChunk;
+        Chunk *pCurrent;
+        std::string strName;
+    };
+
+    Tracer() : t0(std::chrono::steady_clock::now()) {}
+
+    ThreadBuffer *GetThreadBuffer() {
+        // Buffers stay with the tracer after their thread exits, so its spans can still be written
+        static thread_local ThreadBuffer *pBuffer = NULL;
+        if (!pBuffer) {
+            std::lock_guard<std::mutex> lock(mtxRegistry);
+            vpThreadBuffer.emplace_back(new ThreadBuffer);
+            pBuffer = vpThreadBuffer.back().get();
+        }
+        return pBuffer;
+    }
+
+    static std::string Escape(const char *sz) {
+        std::string str;
+        for (; *sz; sz++) {
+            if (*sz == '"' || *sz == '\\') {
+                str += '\\';
+            }
+            str += (unsigned char)*sz < 0x20 ? ' ' : *sz;
+        }
+        return str;
+    }
+
+    std::atomic<bool> bEnabled{false};
+    std::chrono::steady_clock::time_point t0;
+    std::mutex mtxRegistry;
+    std::vector<std::unique_ptr<ThreadBuffer>> vpThreadBuffer;
+};
+
+/**
+* @brief Records the span from construction to destruction, if tracing was on when it started.
+*/
+class TraceSpan {
+public:
+    TraceSpan(const char *szName) : szName(szName) {
+        if (Tracer::Get().IsEnabled()) {
+            tBegin = Tracer::Get().Now();
+        }
+    }
+    TraceSpan(const char *szName, int64_t nArg) : szName(szName), nArg(nArg), bArg(true) {
+        if (Tracer::Get().IsEnabled()) {
+            tBegin = Tracer::Get().Now();
+        }
+    }
+    ~TraceSpan() {
+        if (tBegin >= 0) {
+            Tracer &tracer = Tracer::Get();
+            tracer.Record(szName, tBegin, tracer.Now(), nArg, bArg);
+        }
+    }
+
+private:
+    const char *szName;
+    int64_t tBegin = -1;
+    int64_t nArg = 0;
+    bool bArg = false;
+};
+
+#ifdef NVTRACE_DISABLE
+#define NVTRACE_SCOPE(szName)
+#define NVTRACE_SCOPE_ARG(szName, nArg)
+#else
+#define NVTRACE_CONCAT_(a, b) a##b
+#define NVTRACE_CONCAT(a, b) NVTRACE_CONCAT_(a, b)
+/** Traces the rest of the enclosing scope under szName */
+#define NVTRACE_SCOPE(szName) TraceSpan NVTRACE_CONCAT(traceSpan, __LINE__)(szName)
+/** Same as NVTRACE_SCOPE, with an integer (frame index, size...) attached to the span */
+#define NVTRACE_SCOPE_ARG(szName, nArg) TraceSpan NVTRACE_CONCAT(traceSpan, __LINE__)(szName, (int64_t)(nArg))
+#endif
@@ -0,0 +1,544 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include "YuvConverter.h"
+
+/**
+* @brief Full-reference quality metrics (PSNR, SSIM, MS-SSIM) for planar host frames.
+*
+* SSIM follows the common 8x8 window / stride 4 formulation (as in libvpx and FFmpeg):
+* sums are gathered per 4x4 block and every window combines 2x2 neighboring blocks.
+* MS-SSIM uses the same windows over five dyadic scales of the luma plane with the
+* weights from Wang et al. The sum-of-squared-error and the 4x4 block statistics kernels
+* have scalar, SSE2, AVX2 and NEON versions selected at run time, and every stage is split
+* into row bands over a YuvBandRunner.
+*
+* The SIMD kernels compute in 16/32-bit integer lanes, so they are used for 16-bit samples
+* only when the effective bit depth allows it (up to 14 bits for SSE, 12 bits for SSIM);
+* deeper samples take the scalar path.
+*/
+enum VideoMetricMask {
+    VIDEO_METRIC_PSNR = 1,
+    VIDEO_METRIC_SSIM = 2,
+    VIDEO_METRIC_MS_SSIM = 4,
+    VIDEO_METRIC_ALL = 7,
+};
+
+struct VideoMetricsResult {
+    /** Per plane: Y, U, V */
+    int64_t anSse[3];
+    int64_t anSample[3];
+    double adPsnr[3];
+    double dPsnr;
+    double adSsim[3];
+    /** Average over all samples of the three planes */
+    double dSsim;
+    /** Luma only */
+    double dMsSsim;
+};
+
+/** PSNR for sse over n samples; identical planes are reported as dMaxPsnr */
+inline double VideoMetricsPsnr(int64_t sse, int64_t n, int nMaxValue, double dMaxPsnr = 100.0) {
+    if (sse <= 0 || n <= 0) {
+        return dMaxPsnr;
+    }
+    return (std::min)(10.0 * log10((double)nMaxValue * nMaxValue * n / sse), dMaxPsnr);
+}
+
+/** Sums over a 4x4 block: a, b, a * a + b * b, a * b */
+struct VideoMetricsBlockStat {
+    int64_t s1, s2, ss, s12;
+};
+
+template<typename T>
+inline int64_t SseRowScalar(const T *p0, const T *p1, int n, int nShift) {
+    int64_t sum = 0;
+    for (int x = 0; x < n; x++) {
+        int64_t d = (int64_t)(p0[x] >> nShift) - (p1[x] >> nShift);
+        sum += d * d;
+    }
+    return sum;
+}
+
+template<typename T>
+inline void BlockStatRowScalar(const T *p0, int nPitch0, const T *p1, int nPitch1, int iBlockBegin, int nBlock, int nShift,
+    VideoMetricsBlockStat *pStat) {
+    for (int i = iBlockBegin; i < nBlock; i++) {
+        VideoMetricsBlockStat s = {0, 0, 0, 0};
+        for (int y = 0; y < 4; y++) {
+            for (int x = i * 4; x < i * 4 + 4; x++) {
+                int64_t a = p0[y * nPitch0 + x] >> nShift, b = p1[y * nPitch1 + x] >> nShift;
+                s.s1 += a;
+                s.s2 += b;
+                s.ss += a * a + b * b;
+                s.s12 += a * b;
+            }
+        }
+        pStat[i] = s;
+    }
+}
+
+#if defined(YUV_SIMD_X86)
+YUV_TARGET_SSE2 inline __m128i LoadSamples16Sse2(const uint8_t *p, __m128i) {
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), _mm_setzero_si128());
+}
+
+YUV_TARGET_SSE2 inline __m128i LoadSamples16Sse2(const uint16_t *p, __m128i shift) {
+    return _mm_srl_epi16(_mm_loadu_si128((const __m128i *)p), shift);
+}
+
+/** 8 samples per step; squared differences are summed pairwise in 32 bits and widened every step */
+template<typename T>
+YUV_TARGET_SSE2 inline int64_t SseRowSse2(const T *p0, const T *p1, int n, int nShift) {
+    const __m128i zero = _mm_setzero_si128(), shift = _mm_cvtsi32_si128(nShift);
+    __m128i acc = zero;
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i d = _mm_sub_epi16(LoadSamples16Sse2(p0 + x, shift), LoadSamples16Sse2(p1 + x, shift));
+        __m128i s = _mm_madd_epi16(d, d);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(s, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(s, zero));
+    }
+    int64_t a[2];
+    _mm_storeu_si128((__m128i *)a, acc);
+    return a[0] + a[1] + SseRowScalar(p0 + x, p1 + x, n - x, nShift);
+}
+
+/** 2 blocks (8 samples) per step */
+template<typename T>
+YUV_TARGET_SSE2 inline void BlockStatRowSse2(const T *p0, int nPitch0, const T *p1, int nPitch1, int nBlock, int nShift,
+    VideoMetricsBlockStat *pStat) {
+    const __m128i ones = _mm_set1_epi16(1), shift = _mm_cvtsi32_si128(nShift);
+    int i = 0;
+    for (; i + 2 <= nBlock; i += 2) {
+        __m128i s1 = _mm_setzero_si128(), s2 = s1, ss = s1, s12 = s1;
+        for (int y = 0; y < 4; y++) {
+            __m128i a = LoadSamples16Sse2(p0 + y * nPitch0 + i * 4, shift), b = LoadSamples16Sse2(p1 + y * nPitch1 + i * 4, shift);
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(a, ones));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(b, ones));
+            ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(a, a), _mm_madd_epi16(b, b)));
+            s12 = _mm_add_epi32(s12, _mm_madd_epi16(a, b));
+        }
+        // Each 32-bit lane holds two columns; lanes 0+1 and 2+3 form the two blocks
+        int32_t a1[4], a2[4], ass[4], a12[4];
+        _mm_storeu_si128((__m128i *)a1, s1);
+        _mm_storeu_si128((__m128i *)a2, s2);
+        _mm_storeu_si128((__m128i *)ass, ss);
+        _mm_storeu_si128((__m128i *)a12, s12);
+        for (int k = 0; k < 2; k++) {
+            VideoMetricsBlockStat &s = pStat[i + k];
+            s.s1 = a1[k * 2] + a1[k * 2 + 1];
+            s.s2 = a2[k * 2] + a2[k * 2 + 1];
+            s.ss = ass[k * 2] + ass[k * 2 + 1];
+            s.s12 = a12[k * 2] + a12[k * 2 + 1];
+        }
+    }
+    BlockStatRowScalar(p0, nPitch0, p1, nPitch1, i, nBlock, nShift, pStat);
+}
+
+YUV_TARGET_AVX2 inline __m256i LoadSamples16Avx2(const uint8_t *p, __m128i) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+
+YUV_TARGET_AVX2 inline __m256i LoadSamples16Avx2(const uint16_t *p, __m128i shift) {
+    return _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)p), shift);
+}
+
+template<typename T>
+YUV_TARGET_AVX2 inline int64_t SseRowAvx2(const T *p0, const T *p1, int n, int nShift) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m128i shift = _mm_cvtsi32_si128(nShift);
+    __m256i acc = zero;
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i d = _mm256_sub_epi16(LoadSamples16Avx2(p0 + x, shift), LoadSamples16Avx2(p1 + x, shift));
+        __m256i s = _mm256_madd_epi16(d, d);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(s, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(s, zero));
+    }
+    int64_t a[4];
+    _mm256_storeu_si256((__m256i *)a, acc);
+    return a[0] + a[1] + a[2] + a[3] + SseRowSse2(p0 + x, p1 + x, n - x, nShift);
+}
+
+/** 4 blocks (16 samples) per step */
+template<typename T>
+YUV_TARGET_AVX2 inline void BlockStatRowAvx2(const T *p0, int nPitch0, const T *p1, int nPitch1, int nBlock, int nShift,
+    VideoMetricsBlockStat *pStat) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m128i shift = _mm_cvtsi32_si128(nShift);
+    int i = 0;
+    for (; i + 4 <= nBlock; i += 4) {
+        __m256i s1 = _mm256_setzero_si256(), s2 = s1, ss = s1, s12 = s1;
+        for (int y = 0; y < 4; y++) {
+            __m256i a = LoadSamples16Avx2(p0 + y * nPitch0 + i * 4, shift), b = LoadSamples16Avx2(p1 + y * nPitch1 + i * 4, shift);
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(a, ones));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(b, ones));
+            ss = _mm256_add_epi32(ss, _mm256_add_epi32(_mm256_madd_epi16(a, a), _mm256_madd_epi16(b, b)));
+            s12 = _mm256_add_epi32(s12, _mm256_madd_epi16(a, b));
+        }
+        int32_t a1[8], a2[8], ass[8], a12[8];
+        _mm256_storeu_si256((__m256i *)a1, s1);
+        _mm256_storeu_si256((__m256i *)a2, s2);
+        _mm256_storeu_si256((__m256i *)ass, ss);
+        _mm256_storeu_si256((__m256i *)a12, s12);
+        for (int k = 0; k < 4; k++) {
+            VideoMetricsBlockStat &s = pStat[i + k];
+            s.s1 = a1[k * 2] + a1[k * 2 + 1];
+            s.s2 = a2[k * 2] + a2[k * 2 + 1];
+            s.ss = ass[k * 2] + ass[k * 2 + 1];
+            s.s12 = a12[k * 2] + a12[k * 2 + 1];
+        }
+    }
+    BlockStatRowSse2(p0 + i * 4, nPitch0, p1 + i * 4, nPitch1, nBlock - i, nShift, pStat + i);
+}
+#endif
+
+#if defined(YUV_SIMD_NEON)
+inline uint16x8_t LoadSamples16Neon(const uint8_t *p, int16x8_t) {
+    return vmovl_u8(vld1_u8(p));
+}
+
+inline uint16x8_t LoadSamples16Neon(const uint16_t *p, int16x8_t shift) {
+    return vshlq_u16(vld1q_u16(p), shift);
+}
+
+inline uint32_t HorizontalAddNeon(uint32x4_t v) {
+    uint32x2_t s = vadd_u32(vget_low_u32(v), vget_high_u32(v));
+    return vget_lane_u32(vpadd_u32(s, s), 0);
+}
+
+template<typename T>
+inline int64_t SseRowNeon(const T *p0, const T *p1, int n, int nShift) {
+    const int16x8_t shift = vdupq_n_s16((int16_t)-nShift);
+    int64x2_t acc = vdupq_n_s64(0);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(LoadSamples16Neon(p0 + x, shift)), vreinterpretq_s16_u16(LoadSamples16Neon(p1 + x, shift)));
+        int32x4_t s = vmull_s16(vget_low_s16(d), vget_low_s16(d));
+        s = vmlal_s16(s, vget_high_s16(d), vget_high_s16(d));
+        acc = vpadalq_s32(acc, s);
+    }
+    return vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1) + SseRowScalar(p0 + x, p1 + x, n - x, nShift);
+}
+
+/** 2 blocks (8 samples) per step */
+template<typename T>
+inline void BlockStatRowNeon(const T *p0, int nPitch0, const T *p1, int nPitch1, int nBlock, int nShift,
+    VideoMetricsBlockStat *pStat) {
+    const int16x8_t shift = vdupq_n_s16((int16_t)-nShift);
+    int i = 0;
+    for (; i + 2 <= nBlock; i += 2) {
+        uint32x4_t s1 = vdupq_n_u32(0), s2 = s1, ssLo = s1, ssHi = s1, s12Lo = s1, s12Hi = s1;
+        for (int y = 0; y < 4; y++) {
+            uint16x8_t a = LoadSamples16Neon(p0 + y * nPitch0 + i * 4, shift), b = LoadSamples16Neon(p1 + y * nPitch1 + i * 4, shift);
+            s1 = vpadalq_u16(s1, a);
+            s2 = vpadalq_u16(s2, b);
+            ssLo = vmlal_u16(vmlal_u16(ssLo, vget_low_u16(a), vget_low_u16(a)), vget_low_u16(b), vget_low_u16(b));
+            ssHi = vmlal_u16(vmlal_u16(ssHi, vget_high_u16(a), vget_high_u16(a)), vget_high_u16(b), vget_high_u16(b));
+            s12Lo = vmlal_u16(s12Lo, vget_low_u16(a), vget_low_u16(b));
+            s12Hi = vmlal_u16(s12Hi, vget_high_u16(a), vget_high_u16(b));
+        }
+        VideoMetricsBlockStat &s0 = pStat[i], &s1Stat = pStat[i + 1];
+        s0.s1 = vgetq_lane_u32(s1, 0) + vgetq_lane_u32(s1, 1);
+        s1Stat.s1 = vgetq_lane_u32(s1, 2) + vgetq_lane_u32(s1, 3);
+        s0.s2 = vgetq_lane_u32(s2, 0) + vgetq_lane_u32(s2, 1);
+        s1Stat.s2 = vgetq_lane_u32(s2, 2) + vgetq_lane_u32(s2, 3);
+        s0.ss = HorizontalAddNeon(ssLo);
+        s1Stat.ss = HorizontalAddNeon(ssHi);
+        s0.s12 = HorizontalAddNeon(s12Lo);
+        s1Stat.s12 = HorizontalAddNeon(s12Hi);
+    }
+    BlockStatRowScalar(p0, nPitch0, p1, nPitch1, i, nBlock, nShift, pStat);
+}
+#endif
+
+template<typename T>
+class VideoMetrics {
+public:
+    /**
+    *  @brief VideoMetrics constructor.
+    *  nBitDepth is the number of significant bits after samples are shifted right by nShift
+    *  (e.g. 10 and 6 for P010 data). Scratch memory is allocated here, not per frame.
+    */
+    VideoMetrics(int nWidth, int nHeight, bool bYuv444 = false, int nBitDepth = sizeof(T) * 8, int nShift = 0,
+        int nThread = 1, uint32_t nMetricMask = VIDEO_METRIC_ALL, YuvSimdLevel eLevel = GetYuvSimdLevel())
+        : nWidth(nWidth), nHeight(nHeight), bYuv444(bYuv444), nBitDepth(nBitDepth), nShift(nShift), nMetricMask(nMetricMask),
+        runner(nThread) {
+        nMaxValue = (1 << nBitDepth) - 1;
+        eSseLevel = sizeof(T) == 1 || nBitDepth <= 14 ? eLevel : YUV_SIMD_SCALAR;
+        eBlockLevel = sizeof(T) == 1 || nBitDepth <= 12 ? eLevel : YUV_SIMD_SCALAR;
+        vBlockStat.resize((size_t)(nWidth / 4) * (nHeight / 4));
+        if (nMetricMask & VIDEO_METRIC_MS_SSIM) {
+            // Scales 1..4 of both frames
+            for (int i = 1; i < nScale; i++) {
+                vScaleRef[i].resize((size_t)(nWidth >> i) * (nHeight >> i));
+                vScaleDist[i].resize((size_t)(nWidth >> i) * (nHeight >> i));
+            }
+        }
+    }
+
+    /**
+    *  @brief Computes the metrics of a distorted frame against its reference.
+    *  Frames are planar: Y, then U and V. Plane pitch is nPitch for luma and for 4:4:4 chroma,
+    *  nPitch / 2 for 4:2:0 chroma (0 means the frame width). Pitches are in units of T.
+    */
+    void Compute(const T *pRef, const T *pDist, VideoMetricsResult &result, int nRefPitch = 0, int nDistPitch = 0) {
+        const T *apRef[3], *apDist[3];
+        int anRefPitch[3], anDistPitch[3];
+        GetPlanes(pRef, nRefPitch ? nRefPitch : nWidth, apRef, anRefPitch);
+        GetPlanes(pDist, nDistPitch ? nDistPitch : nWidth, apDist, anDistPitch);
+        ComputePlanes(apRef, anRefPitch, apDist, anDistPitch, result);
+    }
+
+    void ComputePlanes(const T *const apRef[3], const int anRefPitch[3], const T *const apDist[3], const int anDistPitch[3],
+        VideoMetricsResult &result) {
+        int64_t nSseTotal = 0, nSampleTotal = 0;
+        double ssimWeighted = 0;
+        for (int i = 0; i < 3; i++) {
+            int w = i && !bYuv444 ? nWidth / 2 : nWidth, h = i && !bYuv444 ? nHeight / 2 : nHeight;
+            result.anSample[i] = (int64_t)w * h;
+            result.anSse[i] = 0;
+            result.adSsim[i] = 0;
+            if (nMetricMask & VIDEO_METRIC_PSNR) {
+                result.anSse[i] = ComputeSse(apRef[i], anRefPitch[i], apDist[i], anDistPitch[i], w, h);
+            }
+            result.adPsnr[i] = VideoMetricsPsnr(result.anSse[i], result.anSample[i], nMaxValue);
+            if (nMetricMask & VIDEO_METRIC_SSIM) {
+                double l, cs;
+                result.adSsim[i] = ComputeSsim(apRef[i], anRefPitch[i], apDist[i], anDistPitch[i], w, h, nShift, nMaxValue, l, cs);
+            }
+            nSseTotal += result.anSse[i];
+            nSampleTotal += result.anSample[i];
+            ssimWeighted += result.adSsim[i] * result.anSample[i];
+        }
+        result.dPsnr = VideoMetricsPsnr(nSseTotal, nSampleTotal, nMaxValue);
+        result.dSsim = ssimWeighted / nSampleTotal;
+        result.dMsSsim = nMetricMask & VIDEO_METRIC_MS_SSIM ? ComputeMsSsim(apRef[0], anRefPitch[0], apDist[0], anDistPitch[0]) : 0;
+    }
+
+    int GetMaxValue() const {
+        return nMaxValue;
+    }
+
+private:
+    void GetPlanes(const T *pFrame, int nPitch, const T *apPlane[3], int anPitch[3]) const {
+        int nChromaPitch = bYuv444 ? nPitch : nPitch / 2;
+        int nChromaHeight = bYuv444 ? nHeight : nHeight / 2;
+        apPlane[0] = pFrame;
+        apPlane[1] = pFrame + (size_t)nPitch * nHeight;
+        apPlane[2] = apPlane[1] + (size_t)nChromaPitch * nChromaHeight;
+        anPitch[0] = nPitch;
+        anPitch[1] = anPitch[2] = nChromaPitch;
+    }
+
+    int64_t SseRow(const T *p0, const T *p1, int n) const {
+        switch (eSseLevel) {
+#if defined(YUV_SIMD_X86)
+        case YUV_SIMD_AVX2: return SseRowAvx2(p0, p1, n, nShift);
+        case YUV_SIMD_SSE2: return SseRowSse2(p0, p1, n, nShift);
+#elif defined(YUV_SIMD_NEON)
+        case YUV_SIMD_NEON: return SseRowNeon(p0, p1, n, nShift);
+#endif
+        default: return SseRowScalar(p0, p1, n, nShift);
+        }
+    }
+
+    void BlockStatRow(const T *p0, int nPitch0, const T *p1, int nPitch1, int nBlock, int nShift, VideoMetricsBlockStat *pStat) const {
+        switch (eBlockLevel) {
+#if defined(YUV_SIMD_X86)
+        case YUV_SIMD_AVX2: BlockStatRowAvx2(p0, nPitch0, p1, nPitch1, nBlock, nShift, pStat); break;
+        case YUV_SIMD_SSE2: BlockStatRowSse2(p0, nPitch0, p1, nPitch1, nBlock, nShift, pStat); break;
+#elif defined(YUV_SIMD_NEON)
+        case YUV_SIMD_NEON: BlockStatRowNeon(p0, nPitch0, p1, nPitch1, nBlock, nShift, pStat); break;
+#endif
+        default: BlockStatRowScalar(p0, nPitch0, p1, nPitch1, 0, nBlock, nShift, pStat); break;
+        }
+    }
+
+    int64_t ComputeSse(const T *p0, int nPitch0, const T *p1, int nPitch1, int w, int h) {
+        int64_t nSse = 0;
+        std::mutex mtxSum;
+        runner.Run(h, [&](int iBegin, int iEnd) {
+            int64_t nBand = 0;
+            for (int y = iBegin; y < iEnd; y++) {
+                nBand += SseRow(p0 + (size_t)y * nPitch0, p1 + (size_t)y * nPitch1, w);
+            }
+            std::lock_guard<std::mutex> lock(mtxSum);
+            nSse += nBand;
+        });
+        return nSse;
+    }
+
+    /**
+    *  @brief Mean SSIM of a plane; l and cs receive the mean luminance and contrast-structure terms.
+    *  Planes smaller than one 8x8 window are reported as identical.
+    */
+    double ComputeSsim(const T *p0, int nPitch0, const T *p1, int nPitch1, int w, int h, int nShift, int nMax, double &l, double &cs) {
+        int nBlockX = w / 4, nBlockY = h / 4;
+        l = cs = 1.0;
+        if (nBlockX < 2 || nBlockY < 2) {
+            return 1.0;
+        }
+        VideoMetricsBlockStat *pStat = vBlockStat.data();
+        runner.Run(nBlockY, [&](int iBegin, int iEnd) {
+            for (int y = iBegin; y < iEnd; y++) {
+                BlockStatRow(p0 + (size_t)y * 4 * nPitch0, nPitch0, p1 + (size_t)y * 4 * nPitch1, nPitch1, nBlockX, nShift, pStat + (size_t)y * nBlockX);
+            }
+        });
+
+        // Constants scaled to sums over 64 samples
+        const double c1 = (0.01 * nMax) * (0.01 * nMax) * 64 * 64, c2 = (0.03 * nMax) * (0.03 * nMax) * 64 * 63;
+        double sumSsim = 0, sumL = 0, sumCs = 0;
+        std::mutex mtxSum;
+        runner.Run(nBlockY - 1, [&](int iBegin, int iEnd) {
+            double bandSsim = 0, bandL = 0, bandCs = 0;
+            for (int y = iBegin; y < iEnd; y++) {
+                const VideoMetricsBlockStat *pRow0 = pStat + (size_t)y * nBlockX, *pRow1 = pRow0 + nBlockX;
+                for (int x = 0; x < nBlockX - 1; x++) {
+                    double s1 = (double)(pRow0[x].s1 + pRow0[x + 1].s1 + pRow1[x].s1 + pRow1[x + 1].s1);
+                    double s2 = (double)(pRow0[x].s2 + pRow0[x + 1].s2 + pRow1[x].s2 + pRow1[x + 1].s2);
+                    double ss = (double)(pRow0[x].ss + pRow0[x + 1].ss + pRow1[x].ss + pRow1[x + 1].ss);
+                    double s12 = (double)(pRow0[x].s12 + pRow0[x + 1].s12 + pRow1[x].s12 + pRow1[x + 1].s12);
+                    double fm = s1 * s2, fsq = s1 * s1 + s2 * s2;
+                    double vars = ss * 64 - fsq, covar = s12 * 64 - fm;
+                    double dL = (2 * fm + c1) / (fsq + c1), dCs = (2 * covar + c2) / (vars + c2);
+                    bandSsim += dL * dCs;
+                    bandL += dL;
+                    bandCs += dCs;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mtxSum);
+            sumSsim += bandSsim;
+            sumL += bandL;
+            sumCs += bandCs;
+        });
+        double nWindow = (double)(nBlockX - 1) * (nBlockY - 1);
+        l = sumL / nWindow;
+        cs = sumCs / nWindow;
+        return sumSsim / nWindow;
+    }
+
+    /** 2x2 box filter; the source is shifted by nSrcShift, the result is not */
+    void Downsample(const T *pSrc, int nSrcPitch, int nSrcShift, T *pDst, int w, int h) {
+        runner.Run(h, [&](int iBegin, int iEnd) {
+            for (int y = iBegin; y < iEnd; y++) {
+                const T *p0 = pSrc + (size_t)y * 2 * nSrcPitch, *p1 = p0 + nSrcPitch;
+                T *pOut = pDst + (size_t)y * w;
+                for (int x = 0; x < w; x++) {
+                    pOut[x] = (T)(((p0[x * 2] >> nSrcShift) + (p0[x * 2 + 1] >> nSrcShift) + (p1[x * 2] >> nSrcShift)
+                        + (p1[x * 2 + 1] >> nSrcShift) + 2) >> 2);
+                }
+            }
+        });
+    }
+
+    double ComputeMsSsim(const T *pRef, int nRefPitch, const T *pDist, int nDistPitch) {
+        static const double adWeight[nScale] = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+        const T *p0 = pRef, *p1 = pDist;
+        int nPitch0 = nRefPitch, nPitch1 = nDistPitch, nSrcShift = nShift;
+        int w = nWidth, h = nHeight;
+        double dMsSsim = 1.0, dWeightSum = 0;
+        for (int i = 0; i < nScale; i++) {
+            double l, cs;
+            double ssim = ComputeSsim(p0, nPitch0, p1, nPitch1, w, h, nSrcShift, nMaxValue, l, cs);
+            bool bLast = i == nScale - 1 || (w >> 1) < 8 || (h >> 1) < 8;
+            // Negative contrast-structure terms (anti-correlated content) count as no similarity
+            dMsSsim *= pow((std::max)(bLast ? ssim : cs, 0.0), adWeight[i]);
+            dWeightSum += adWeight[i];
+            if (bLast) {
+                break;
+            }
+            w >>= 1;
+            h >>= 1;
+            Downsample(p0, nPitch0, nSrcShift, vScaleRef[i + 1].data(), w, h);
+            Downsample(p1, nPitch1, nSrcShift, vScaleDist[i + 1].data(), w, h);
+            p0 = vScaleRef[i + 1].data();
+            p1 = vScaleDist[i + 1].data();
+            nPitch0 = nPitch1 = w;
+            nSrcShift = 0;
+        }
+        // Small frames run out of scales; renormalize so a perfect match is still 1
+        return pow(dMsSsim, 1.0 / dWeightSum);
+    }
+
+    static const int nScale = 5;
+    int nWidth, nHeight;
+    bool bYuv444;
+    int nBitDepth, nShift, nMaxValue;
+    uint32_t nMetricMask;
+    YuvSimdLevel eSseLevel, eBlockLevel;
+    YuvBandRunner runner;
+    std::vector<VideoMetricsBlockStat> vBlockStat;
+    std::vector<T> vScaleRef[nScale], vScaleDist[nScale];
+};
+
+/**
+* @brief Accumulates per-frame results into sequence-level numbers: PSNR from the total
+* squared error (not the mean of per-frame PSNR), mean SSIM and MS-SSIM, and the range of
+* per-frame PSNR.
+*/
+class VideoMetricsSummary {
+public:
+    VideoMetricsSummary(int nMaxValue) : nMaxValue(nMaxValue) {}
+
+    void Add(const VideoMetricsResult &r) {
+        for (int i = 0; i < 3; i++) {
+            anSse[i] += r.anSse[i];
+            anSample[i] += r.anSample[i];
+            adSsim[i] += r.adSsim[i];
+        }
+        dSsim += r.dSsim;
+        dMsSsim += r.dMsSsim;
+        dPsnrMin = nFrame ? (std::min)(dPsnrMin, r.dPsnr) : r.dPsnr;
+        dPsnrMax = nFrame ? (std::max)(dPsnrMax, r.dPsnr) : r.dPsnr;
+        nFrame++;
+    }
+
+    int GetFrameCount() const {
+        return nFrame;
+    }
+    double GetPsnr(int iPlane) const {
+        return VideoMetricsPsnr(anSse[iPlane], anSample[iPlane], nMaxValue);
+    }
+    double GetPsnr() const {
+        return VideoMetricsPsnr(anSse[0] + anSse[1] + anSse[2], anSample[0] + anSample[1] + anSample[2], nMaxValue);
+    }
+    double GetPsnrMin() const {
+        return dPsnrMin;
+    }
+    double GetPsnrMax() const {
+        return dPsnrMax;
+    }
+    double GetSsim(int iPlane) const {
+        return nFrame ? adSsim[iPlane] / nFrame : 0;
+    }
+    double GetSsim() const {
+        return nFrame ? dSsim / nFrame : 0;
+    }
+    double GetMsSsim() const {
+        return nFrame ? dMsSsim / nFrame : 0;
+    }
+
+private:
+    int nMaxValue;
+    int nFrame = 0;
+    int64_t anSse[3] = {0, 0, 0}, anSample[3] = {0, 0, 0};
+    double adSsim[3] = {0, 0, 0};
+    double dSsim = 0, dMsSsim = 0, dPsnrMin = 0, dPsnrMax = 0;
+};
@@ -0,0 +1,458 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Tracer.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define YUV_SIMD_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#define YUV_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(YUV_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define YUV_TARGET_SSE2 __attribute__((target("sse2")))
+#define YUV_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define YUV_TARGET_SSE2
+#define YUV_TARGET_AVX2
+#endif
+
+/**
+* @brief Row kernels that interleave two chroma planes into one UV plane (I420 -> NV12,
+* YUV420P16 -> P016) and back. Each kernel handles n chroma samples per plane; they are
+* available as scalar, SSE2, AVX2 and NEON versions and selected at run time.
+*/
+enum YuvSimdLevel {
+    YUV_SIMD_SCALAR = 0,
+    YUV_SIMD_SSE2,
+    YUV_SIMD_AVX2,
+    YUV_SIMD_NEON,
+};
+
+inline const char *GetYuvSimdLevelName(YuvSimdLevel eLevel) {
+    const char *aszName[] = {"scalar", "sse2", "avx2", "neon"};
+    return aszName[eLevel];
+}
+
+/** Best level supported by both the build and the CPU */
+inline YuvSimdLevel DetectYuvSimdLevel() {
+#if defined(YUV_SIMD_X86)
+#ifdef _MSC_VER
+    int aInfo[4];
+    __cpuid(aInfo, 0);
+    int nIds = aInfo[0];
+    __cpuid(aInfo, 1);
+    bool bSse2 = (aInfo[3] & (1 << 26)) != 0;
+    bool bOsAvx = (aInfo[2] & (1 << 27)) && (aInfo[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    bool bAvx2 = false;
+    if (bOsAvx && nIds >= 7) {
+        __cpuidex(aInfo, 7, 0);
+        bAvx2 = (aInfo[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    bool bSse2 = __builtin_cpu_supports("sse2");
+    bool bAvx2 = __builtin_cpu_supports("avx2");
+#endif
+    return bAvx2 ? YUV_SIMD_AVX2 : bSse2 ? YUV_SIMD_SSE2 : YUV_SIMD_SCALAR;
+#elif defined(YUV_SIMD_NEON)
+    return YUV_SIMD_NEON;
+#else
+    return YUV_SIMD_SCALAR;
+#endif
+}
+
+inline YuvSimdLevel GetYuvSimdLevel() {
+    static const YuvSimdLevel eLevel = DetectYuvSimdLevel();
+    return eLevel;
+}
+
+template<typename T>
+inline void InterleaveRowScalar(const T *pU, const T *pV, T *pUV, int n) {
+    for (int x = 0; x < n; x++) {
+        pUV[x * 2] = pU[x];
+        pUV[x * 2 + 1] = pV[x];
+    }
+}
+
+template<typename T>
+inline void DeinterleaveRowScalar(const T *pUV, T *pU, T *pV, int n) {
+    for (int x = 0; x < n; x++) {
+        pU[x] = pUV[x * 2];
+        pV[x] = pUV[x * 2 + 1];
+    }
+}
+
+#if defined(YUV_SIMD_X86)
+YUV_TARGET_SSE2 inline void InterleaveRowSse2(const uint8_t *pU, const uint8_t *pV, uint8_t *pUV, int n) {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i u = _mm_loadu_si128((const __m128i *)(pU + x)), v = _mm_loadu_si128((const __m128i *)(pV + x));
+        _mm_storeu_si128((__m128i *)(pUV + x * 2), _mm_unpacklo_epi8(u, v));
+        _mm_storeu_si128((__m128i *)(pUV + x * 2 + 16), _mm_unpackhi_epi8(u, v));
+    }
+    InterleaveRowScalar(pU + x, pV + x, pUV + x * 2, n - x);
+}
+
+YUV_TARGET_SSE2 inline void InterleaveRowSse2(const uint16_t *pU, const uint16_t *pV, uint16_t *pUV, int n) {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i u = _mm_loadu_si128((const __m128i *)(pU + x)), v = _mm_loadu_si128((const __m128i *)(pV + x));
+        _mm_storeu_si128((__m128i *)(pUV + x * 2), _mm_unpacklo_epi16(u, v));
+        _mm_storeu_si128((__m128i *)(pUV + x * 2 + 8), _mm_unpackhi_epi16(u, v));
+    }
+    InterleaveRowScalar(pU + x, pV + x, pUV + x * 2, n - x);
+}
+
+YUV_TARGET_SSE2 inline void DeinterleaveRowSse2(const uint8_t *pUV, uint8_t *pU, uint8_t *pV, int n) {
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(pUV + x * 2)), b = _mm_loadu_si128((const __m128i *)(pUV + x * 2 + 16));
+        _mm_storeu_si128((__m128i *)(pU + x), _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128((__m128i *)(pV + x), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    DeinterleaveRowScalar(pUV + x * 2, pU + x, pV + x, n - x);
+}
+
+YUV_TARGET_SSE2 inline void DeinterleaveRowSse2(const uint16_t *pUV, uint16_t *pU, uint16_t *pV, int n) {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(pUV + x * 2)), b = _mm_loadu_si128((const __m128i *)(pUV + x * 2 + 8));
+        // SSE2 only packs with saturation; sign extension keeps every 16-bit value in range
+        __m128i ua = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16), ub = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+        __m128i va = _mm_srai_epi32(a, 16), vb = _mm_srai_epi32(b, 16);
+        _mm_storeu_si128((__m128i *)(pU + x), _mm_packs_epi32(ua, ub));
+        _mm_storeu_si128((__m128i *)(pV + x), _mm_packs_epi32(va, vb));
+    }
+    DeinterleaveRowScalar(pUV + x * 2, pU + x, pV + x, n - x);
+}
+
+YUV_TARGET_AVX2 inline void InterleaveRowAvx2(const uint8_t *pU, const uint8_t *pV, uint8_t *pUV, int n) {
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i u = _mm256_loadu_si256((const __m256i *)(pU + x)), v = _mm256_loadu_si256((const __m256i *)(pV + x));
+        // Unpacking works within 128-bit lanes; reorder the lanes afterwards
+        __m256i lo = _mm256_unpacklo_epi8(u, v), hi = _mm256_unpackhi_epi8(u, v);
+        _mm256_storeu_si256((__m256i *)(pUV + x * 2), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(pUV + x * 2 + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    InterleaveRowSse2(pU + x, pV + x, pUV + x * 2, n - x);
+}
+
+YUV_TARGET_AVX2 inline void InterleaveRowAvx2(const uint16_t *pU, const uint16_t *pV, uint16_t *pUV, int n) {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i u = _mm256_loadu_si256((const __m256i *)(pU + x)), v = _mm256_loadu_si256((const __m256i *)(pV + x));
+        __m256i lo = _mm256_unpacklo_epi16(u, v), hi = _mm256_unpackhi_epi16(u, v);
+        _mm256_storeu_si256((__m256i *)(pUV + x * 2), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(pUV + x * 2 + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    InterleaveRowSse2(pU + x, pV + x, pUV + x * 2, n - x);
+}
+
+YUV_TARGET_AVX2 inline void DeinterleaveRowAvx2(const uint8_t *pUV, uint8_t *pU, uint8_t *pV, int n) {
+    // Per 128-bit lane: even bytes to the low half, odd bytes to the high half
+    const __m256i shuffle = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15,
+        0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(pUV + x * 2)), b = _mm256_loadu_si256((const __m256i *)(pUV + x * 2 + 32));
+        a = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(a, shuffle), 0xd8);
+        b = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(b, shuffle), 0xd8);
+        _mm256_storeu_si256((__m256i *)(pU + x), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(pV + x), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    DeinterleaveRowSse2(pUV + x * 2, pU + x, pV + x, n - x);
+}
+
+YUV_TARGET_AVX2 inline void DeinterleaveRowAvx2(const uint16_t *pUV, uint16_t *pU, uint16_t *pV, int n) {
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+        0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(pUV + x * 2)), b = _mm256_loadu_si256((const __m256i *)(pUV + x * 2 + 16));
+        a = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(a, shuffle), 0xd8);
+        b = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(b, shuffle), 0xd8);
+        _mm256_storeu_si256((__m256i *)(pU + x), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(pV + x), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    DeinterleaveRowSse2(pUV + x * 2, pU + x, pV + x, n - x);
+}
+#endif
+
+#if defined(YUV_SIMD_NEON)
+inline void InterleaveRowNeon(const uint8_t *pU, const uint8_t *pV, uint8_t *pUV, int n) {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        uint8x16x2_t uv = {{vld1q_u8(pU + x), vld1q_u8(pV + x)}};
+        vst2q_u8(pUV + x * 2, uv);
+    }
+    InterleaveRowScalar(pU + x, pV + x, pUV + x * 2, n - x);
+}
+
+inline void InterleaveRowNeon(const uint16_t *pU, const uint16_t *pV, uint16_t *pUV, int n) {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        uint16x8x2_t uv = {{vld1q_u16(pU + x), vld1q_u16(pV + x)}};
+        vst2q_u16(pUV + x * 2, uv);
+    }
+    InterleaveRowScalar(pU + x, pV + x, pUV + x * 2, n - x);
+}
+
+inline void DeinterleaveRowNeon(const uint8_t *pUV, uint8_t *pU, uint8_t *pV, int n) {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        uint8x16x2_t uv = vld2q_u8(pUV + x * 2);
+        vst1q_u8(pU + x, uv.val[0]);
+        vst1q_u8(pV + x, uv.val[1]);
+    }
+    DeinterleaveRowScalar(pUV + x * 2, pU + x, pV + x, n - x);
+}
+
+inline void DeinterleaveRowNeon(const uint16_t *pUV, uint16_t *pU, uint16_t *pV, int n) {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        uint16x8x2_t uv = vld2q_u16(pUV + x * 2);
+        vst1q_u16(pU + x, uv.val[0]);
+        vst1q_u16(pV + x, uv.val[1]);
+    }
+    DeinterleaveRowScalar(pUV + x * 2, pU + x, pV + x, n - x);
+}
+#endif
+
+template<typename T>
+struct YuvRowKernels {
+    void (*Interleave)(const T *pU, const T *pV, T *pUV, int n);
+    void (*Deinterleave)(const T *pUV, T *pU, T *pV, int n);
+
+    /** Falls back to the best level below eLevel that is available in this build */
+    static YuvRowKernels Get(YuvSimdLevel eLevel) {
+        YuvRowKernels k = {InterleaveRowScalar<T>, DeinterleaveRowScalar<T>};
+#if defined(YUV_SIMD_X86)
+        if (eLevel == YUV_SIMD_AVX2) {
+            k.Interleave = InterleaveRowAvx2;
+            k.Deinterleave = DeinterleaveRowAvx2;
+        } else if (eLevel == YUV_SIMD_SSE2) {
+            k.Interleave = InterleaveRowSse2;
+            k.Deinterleave = DeinterleaveRowSse2;
+        }
+#elif defined(YUV_SIMD_NEON)
+        if (eLevel == YUV_SIMD_NEON) {
+            k.Interleave = InterleaveRowNeon;
+            k.Deinterleave = DeinterleaveRowNeon;
+        }
+#endif
+        return k;
+    }
+};
+
+/**
+* @brief Runs a function over row bands of a plane on a fixed set of worker threads.
+* The threads are created once and wait for work, so a Run() call does not allocate.
+* The calling thread processes the first band itself.
+*/
+class YuvBandRunner {
+public:
+    YuvBandRunner(int nThread) : nThread((std::max)(nThread, 1)) {
+        for (int i = 1; i < this->nThread; i++) {
+            vThread.push_back(std::thread(&YuvBandRunner::WorkerProc, this, i));
+        }
+    }
+    ~YuvBandRunner() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            bQuit = true;
+        }
+        cvWork.notify_all();
+        for (std::thread &t : vThread) {
+            t.join();
+        }
+    }
+
+    int GetThreadCount() const {
+        return nThread;
+    }
+
+    /** Calls func(iBegin, iEnd) for nThread disjoint bands covering [0, nRow) and waits for all of them */
+    template<typename Func>
+    void Run(int nRow, const Func &func) {
+        if (nThread == 1 || nRow < nThread * 2) {
+            func(0, nRow);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            // Type-erase by hand; a std::function might allocate for larger captures
+            pContext = &func;
+            pInvoke = [](const void *pContext, int iBegin, int iEnd) { (*(const Func *)pContext)(iBegin, iEnd); };
+            this->nRow = nRow;
+            nPending = nThread - 1;
+            iGeneration++;
+        }
+        cvWork.notify_all();
+        func(0, GetBandStart(1));
+        std::unique_lock<std::mutex> lock(mtx);
+        cvDone.wait(lock, [&] { return nPending == 0; });
+        pContext = NULL;
+    }
+
+private:
+    int GetBandStart(int iBand) const {
+        return (int)((int64_t)nRow * iBand / nThread);
+    }
+
+    void WorkerProc(int iBand) {
+        uint64_t iSeen = 0;
+        while (true) {
+            const void *pWork;
+            void (*pWorkInvoke)(const void *, int, int);
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cvWork.wait(lock, [&] { return bQuit || iGeneration != iSeen; });
+                if (bQuit) {
+                    return;
+                }
+                iSeen = iGeneration;
+                pWork = pContext;
+                pWorkInvoke = pInvoke;
+            }
+            pWorkInvoke(pWork, GetBandStart(iBand), GetBandStart(iBand + 1));
+            std::lock_guard<std::mutex> lock(mtx);
+            if (--nPending == 0) {
+                cvDone.notify_one();
+            }
+        }
+    }
+
+    int nThread;
+    std::vector<std::thread> vThread;
+    std::mutex mtx;
+    std::condition_variable cvWork, cvDone;
+    const void *pContext = NULL;
+    void (*pInvoke)(const void *, int, int) = NULL;
+    int nRow = 0, nPending = 0;
+    uint64_t iGeneration = 0;
+    bool bQuit = false;
+};
+
+/**
+* @brief Converts the chroma of 4:2:0 frames between planar (I420/YUV420P16) and
+* UV-interleaved (NV12/P016) layouts. T is uint8_t for 8-bit and uint16_t for 16-bit samples.
+*
+* The static Interleave()/Deinterleave() functions work between separate buffers with
+* arbitrary pitches and need no scratch memory. The in-place member functions keep the
+* original interface; they copy the chroma into a scratch buffer sized once in the
+* constructor and then interleave/deinterleave back into the frame, so nothing is
+* allocated per frame. With nThread > 1 both steps are split into row bands.
+* Pitches are in units of T.
+*/
+template<typename T>
+class YuvConverter {
+public:
+    YuvConverter(int nWidth, int nHeight, int nThread = 1, YuvSimdLevel eLevel = GetYuvSimdLevel())
+        : nWidth(nWidth), nHeight(nHeight), kernels(YuvRowKernels<T>::Get(eLevel)), runner(nThread) {
+        vScratch.resize((size_t)(nWidth / 2) * (nHeight / 2) * 2);
+    }
+
+    void PlanarToUVInterleaved(T *pFrame, int nPitch = 0) {
+        NVTRACE_SCOPE("Chroma interleave");
+        if (nPitch == 0) {
+            nPitch = nWidth;
+        }
+        int nChromaWidth = nWidth / 2, nChromaHeight = nHeight / 2;
+        T *puv = pFrame + (size_t)nPitch * nHeight;
+        T *pv = puv + (size_t)(nPitch / 2) * nChromaHeight;
+        T *pQuadU = vScratch.data(), *pQuadV = pQuadU + (size_t)nChromaWidth * nChromaHeight;
+        CopyPlane(puv, nPitch / 2, pQuadU, nChromaWidth, nChromaWidth, nChromaHeight);
+        CopyPlane(pv, nPitch / 2, pQuadV, nChromaWidth, nChromaWidth, nChromaHeight);
+        Interleave(kernels, runner, pQuadU, nChromaWidth, pQuadV, nChromaWidth, puv, nPitch, nChromaWidth, nChromaHeight);
+    }
+
+    void UVInterleavedToPlanar(T *pFrame, int nPitch = 0) {
+        NVTRACE_SCOPE("Chroma deinterleave");
+        if (nPitch == 0) {
+            nPitch = nWidth;
+        }
+        int nChromaWidth = nWidth / 2, nChromaHeight = nHeight / 2;
+        T *puv = pFrame + (size_t)nPitch * nHeight;
+        T *pv = puv + (size_t)(nPitch / 2) * nChromaHeight;
+        T *pQuadU = vScratch.data(), *pQuadV = pQuadU + (size_t)nChromaWidth * nChromaHeight;
+        Deinterleave(kernels, runner, puv, nPitch, pQuadU, nChromaWidth, pQuadV, nChromaWidth, nChromaWidth, nChromaHeight);
+        CopyPlane(pQuadU, nChromaWidth, puv, nPitch / 2, nChromaWidth, nChromaHeight);
+        CopyPlane(pQuadV, nChromaWidth, pv, nPitch / 2, nChromaWidth, nChromaHeight);
+    }
+
+    /** pU/pV (nChromaWidth x nChromaHeight each) -> pUV; the buffers must not overlap */
+    static void Interleave(const T *pU, int nUPitch, const T *pV, int nVPitch, T *pUV, int nUVPitch,
+        int nChromaWidth, int nChromaHeight, YuvSimdLevel eLevel = GetYuvSimdLevel()) {
+        YuvRowKernels<T> k = YuvRowKernels<T>::Get(eLevel);
+        for (int y = 0; y < nChromaHeight; y++) {
+            k.Interleave(pU + (size_t)y * nUPitch, pV + (size_t)y * nVPitch, pUV + (size_t)y * nUVPitch, nChromaWidth);
+        }
+    }
+
+    /** pUV -> pU/pV (nChromaWidth x nChromaHeight each); the buffers must not overlap */
+    static void Deinterleave(const T *pUV, int nUVPitch, T *pU, int nUPitch, T *pV, int nVPitch,
+        int nChromaWidth, int nChromaHeight, YuvSimdLevel eLevel = GetYuvSimdLevel()) {
+        YuvRowKernels<T> k = YuvRowKernels<T>::Get(eLevel);
+        for (int y = 0; y < nChromaHeight; y++) {
+            k.Deinterleave(pUV + (size_t)y * nUVPitch, pU + (size_t)y * nUPitch, pV + (size_t)y * nVPitch, nChromaWidth);
+        }
+    }
+
+private:
+    void CopyPlane(const T *pSrc, int nSrcPitch, T *pDst, int nDstPitch, int nRowWidth, int nRow) {
+        runner.Run(nRow, [&](int iBegin, int iEnd) {
+            for (int y = iBegin; y < iEnd; y++) {
+                memcpy(pDst + (size_t)y * nDstPitch, pSrc + (size_t)y * nSrcPitch, nRowWidth * sizeof(T));
+            }
+        });
+    }
+
+    static void Interleave(const YuvRowKernels<T> &k, YuvBandRunner &runner, const T *pU, int nUPitch, const T *pV, int nVPitch,
+        T *pUV, int nUVPitch, int nChromaWidth, int nChromaHeight) {
+        runner.Run(nChromaHeight, [&](int iBegin, int iEnd) {
+            for (int y = iBegin; y < iEnd; y++) {
+                k.Interleave(pU + (size_t)y * nUPitch, pV + (size_t)y * nVPitch, pUV + (size_t)y * nUVPitch, nChromaWidth);
+            }
+        });
+    }
+
+    static void Deinterleave(const YuvRowKernels<T> &k, YuvBandRunner &runner, const T *pUV, int nUVPitch, T *pU, int nUPitch,
+        T *pV, int nVPitch, int nChromaWidth, int nChromaHeight) {
+        runner.Run(nChromaHeight, [&](int iBegin, int iEnd) {
+            for (int y = iBegin; y < iEnd; y++) {
+                k.Deinterleave(pUV + (size_t)y * nUVPitch, pU + (size_t)y * nUPitch, pV + (size_t)y * nVPitch, nChromaWidth);
+            }
+        });
+    }
+
+    int nWidth, nHeight;
+    YuvRowKernels<T> kernels;
+    YuvBandRunner runner;
+    std::vector<T> vScratch;
+};
@@ -0,0 +1,581 @@
+/*
+* Copyright 2017-2018 NVIDIA Corporation.  All rights reserved.
+*
+* Please refer to the NVIDIA end user license agreement (EULA) associated
+* with this source code for terms and conditions that govern your use of
+* this software. Any use, reproduction, disclosure, or distribution of
+* this software and related documentation outside the terms of the EULA
+* is strictly prohibited.
+*
+*/
+
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "YuvConverter.h"
+
+enum YuvScaleFilter {
+    YUV_SCALE_BILINEAR = 0,
+    YUV_SCALE_BICUBIC,
+    YUV_SCALE_LANCZOS,
+};
+
+inline const char *GetYuvScaleFilterName(YuvScaleFilter eFilter) {
+    const char *aszName[] = {"bilinear", "bicubic", "lanczos"};
+    return aszName[eFilter];
+}
+
+/** Filter radius in source samples at scale 1 */
+inline double GetYuvScaleFilterSupport(YuvScaleFilter eFilter) {
+    return eFilter == YUV_SCALE_LANCZOS ? 3.0 : eFilter == YUV_SCALE_BICUBIC ? 2.0 : 1.0;
+}
+
+inline double YuvScaleFilterWeight(YuvScaleFilter eFilter, double x) {
+    const double pi = 3.14159265358979323846;
+    x = fabs(x);
+    switch (eFilter) {
+    case YUV_SCALE_BICUBIC:
+        // Keys cubic with a = -0.5 (Catmull-Rom)
+        if (x < 1.0) {
+            return (1.5 * x - 2.5) * x * x + 1.0;
+        }
+        return x < 2.0 ? ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0 : 0.0;
+    case YUV_SCALE_LANCZOS:
+        if (x < 1e-8) {
+            return 1.0;
+        }
+        return x < 3.0 ? 3.0 * sin(pi * x) * sin(pi * x / 3.0) / (pi * pi * x * x) : 0.0;
+    default:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    }
+}
+
+/**
+* @brief Polyphase coefficients for scaling nSrc samples to nDst samples along one axis.
+*
+* Output sample i is centered at (i + 0.5) * nSrc / nDst - 0.5 in the source. For downscaling
+* the filter is widened by the scale factor so it also low-passes. Each output has nTap
+* weights for consecutive source samples starting at vStart[i]; taps that fall outside the
+* source are folded into the edge samples, so every tap reads a valid sample. nTap is rounded
+* up to nAlign with zero weights, which lets SIMD kernels read whole vectors. With nGroup > 1,
+* vCoefGroup holds the same weights with those of nGroup consecutive outputs interleaved tap by
+* tap, for kernels that accumulate nGroup outputs in one vector.
+*/
+struct YuvScaleFilterTable {
+    int nSrc = 0, nDst = 0, nTap = 0, nGroup = 1;
+    std::vector<int> vStart;
+    std::vector<float> vCoef, vCoefGroup;
+
+    void Build(int nSrc, int nDst, YuvScaleFilter eFilter, int nAlign, int nGroup = 1) {
+        this->nSrc = nSrc;
+        this->nDst = nDst;
+        this->nGroup = nGroup;
+        double scale = (double)nSrc / nDst, filterScale = (std::max)(scale, 1.0);
+        double support = GetYuvScaleFilterSupport(eFilter) * filterScale;
+        int nWindow = (int)ceil(support * 2) + 1;
+        nTap = (nWindow + nAlign - 1) / nAlign * nAlign;
+        vStart.resize(nDst);
+        vCoef.assign((size_t)nDst * nTap, 0.0f);
+        std::vector<double> vWeight(nWindow);
+        for (int i = 0; i < nDst; i++) {
+            double center = (i + 0.5) * scale - 0.5;
+            int iFirst = (int)floor(center - support) + 1;
+            double sum = 0;
+            for (int k = 0; k < nWindow; k++) {
+                vWeight[k] = YuvScaleFilterWeight(eFilter, (iFirst + k - center) / filterScale);
+                sum += vWeight[k];
+            }
+            int iStart = (std::max)((std::min)(iFirst, nSrc - nWindow), 0);
+            vStart[i] = iStart;
+            float *pCoef = &vCoef[(size_t)i * nTap];
+            for (int k = 0; k < nWindow; k++) {
+                int j = (std::max)((std::min)(iFirst + k, nSrc - 1), 0);
+                pCoef[j - iStart] += (float)(vWeight[k] / sum);
+            }
+        }
+        vCoefGroup.clear();
+        if (nGroup > 1) {
+            vCoefGroup.assign((size_t)(nDst + nGroup - 1) / nGroup * nGroup * nTap, 0.0f);
+            for (int i = 0; i < nDst; i++) {
+                for (int k = 0; k < nTap; k++) {
+                    vCoefGroup[((size_t)(i / nGroup) * nTap + k) * nGroup + i % nGroup] = vCoef[(size_t)i * nTap + k];
+                }
+            }
+        }
+    }
+};
+
+/** Converts nWidth samples of each of nChannel interleaved channels to float; channel c goes to pDst + c * nDstPlane */
+template<typename T>
+inline void WidenRowScalar(const T *pSrc, int nChannel, int iBegin, int nWidth, float *pDst, int nDstPlane) {
+    for (int c = 0; c < nChannel; c++) {
+        for (int x = iBegin; x < nWidth; x++) {
+            pDst[(size_t)c * nDstPlane + x] = pSrc[x * nChannel + c];
+        }
+    }
+}
+
+/** nTap weights per output, summed in tap order; pDst is written every nDstStride floats */
+inline void HorizontalScaleRowScalar(const float *pSrc, const YuvScaleFilterTable &t, int iBegin, float *pDst, int nDstStride) {
+    for (int x = iBegin; x < t.nDst; x++) {
+        const float *p = pSrc + t.vStart[x], *pCoef = &t.vCoef[(size_t)x * t.nTap];
+        float sum = 0.0f;
+        for (int k = 0; k < t.nTap; k++) {
+            sum += p[k] * pCoef[k];
+        }
+        pDst[x * nDstStride] = sum;
+    }
+}
+
+template<typename T>
+inline void VerticalScaleRowScalar(const float *const *apRow, const float *pCoef, int nTap, int iBegin, int n, float maxf, T *pDst) {
+    for (int x = iBegin; x < n; x++) {
+        float sum = 0.0f;
+        for (int k = 0; k < nTap; k++) {
+            sum += pCoef[k] * apRow[k][x];
+        }
+        pDst[x] = (T)lrintf(sum < 0.0f ? 0.0f : (sum > maxf ? maxf : sum));
+    }
+}
+
+#if defined(YUV_SIMD_X86)
+/** The SSE2 and AVX2 widening kernels take one channel or two interleaved ones; they return the samples done */
+YUV_TARGET_SSE2 inline int WidenRowSse2(const uint8_t *pSrc, int nChannel, int nWidth, float *pDst, int nDstPlane) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    if (nChannel == 1) {
+        for (; x + 8 <= nWidth; x += 8) {
+            __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(pSrc + x)), zero);
+            _mm_storeu_ps(pDst + x, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+            _mm_storeu_ps(pDst + x + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+        }
+    } else if (nChannel == 2) {
+        // Each pair read as one 16-bit sample and split into its low and high byte
+        const __m128i mask = _mm_set1_epi16(0xff);
+        for (; x + 8 <= nWidth; x += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(pSrc + x * 2));
+            __m128i a = _mm_and_si128(v, mask), b = _mm_srli_epi16(v, 8);
+            _mm_storeu_ps(pDst + x, _mm_cvtepi32_ps(_mm_unpacklo_epi16(a, zero)));
+            _mm_storeu_ps(pDst + x + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(a, zero)));
+            _mm_storeu_ps(pDst + nDstPlane + x, _mm_cvtepi32_ps(_mm_unpacklo_epi16(b, zero)));
+            _mm_storeu_ps(pDst + nDstPlane + x + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(b, zero)));
+        }
+    }
+    return x;
+}
+
+YUV_TARGET_SSE2 inline int WidenRowSse2(const uint16_t *pSrc, int nChannel, int nWidth, float *pDst, int nDstPlane) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    if (nChannel == 1) {
+        for (; x + 8 <= nWidth; x += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(pSrc + x));
+            _mm_storeu_ps(pDst + x, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+            _mm_storeu_ps(pDst + x + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+        }
+    } else if (nChannel == 2) {
+        const __m128i mask = _mm_set1_epi32(0xffff);
+        for (; x + 4 <= nWidth; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(pSrc + x * 2));
+            _mm_storeu_ps(pDst + x, _mm_cvtepi32_ps(_mm_and_si128(v, mask)));
+            _mm_storeu_ps(pDst + nDstPlane + x, _mm_cvtepi32_ps(_mm_srli_epi32(v, 16)));
+        }
+    }
+    return x;
+}
+
+YUV_TARGET_AVX2 inline int WidenRowAvx2(const uint8_t *pSrc, int nChannel, int nWidth, float *pDst, int nDstPlane) {
+    int x = 0;
+    if (nChannel == 1) {
+        for (; x + 8 <= nWidth; x += 8) {
+            __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(pSrc + x)));
+            _mm256_storeu_ps(pDst + x, _mm256_cvtepi32_ps(v));
+        }
+    } else if (nChannel == 2) {
+        const __m256i mask = _mm256_set1_epi32(0xff);
+        for (; x + 8 <= nWidth; x += 8) {
+            __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(pSrc + x * 2)));
+            _mm256_storeu_ps(pDst + x, _mm256_cvtepi32_ps(_mm256_and_si256(v, mask)));
+            _mm256_storeu_ps(pDst + nDstPlane + x, _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 8)));
+        }
+    }
+    return x;
+}
+
+YUV_TARGET_AVX2 inline int WidenRowAvx2(const uint16_t *pSrc, int nChannel, int nWidth, float *pDst, int nDstPlane) {
+    int x = 0;
+    if (nChannel == 1) {
+        for (; x + 8 <= nWidth; x += 8) {
+            __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(pSrc + x)));
+            _mm256_storeu_ps(pDst + x, _mm256_cvtepi32_ps(v));
+        }
+    } else if (nChannel == 2) {
+        const __m256i mask = _mm256_set1_epi32(0xffff);
+        for (; x + 8 <= nWidth; x += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(pSrc + x * 2));
+            _mm256_storeu_ps(pDst + x, _mm256_cvtepi32_ps(_mm256_and_si256(v, mask)));
+            _mm256_storeu_ps(pDst + nDstPlane + x, _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 16)));
+        }
+    }
+    return x;
+}
+
+/** 4 outputs per step, each a dot product of nTap (a multiple of 4) weights; returns the outputs done */
+YUV_TARGET_SSE2 inline int HorizontalScaleRowSse2(const float *pSrc, const YuvScaleFilterTable &t, float *pDst, int nDstStride) {
+    int x = 0;
+    for (; x + 4 <= t.nDst; x += 4) {
+        __m128 acc[4];
+        for (int i = 0; i < 4; i++) {
+            const float *p = pSrc + t.vStart[x + i], *pCoef = &t.vCoef[(size_t)(x + i) * t.nTap];
+            acc[i] = _mm_setzero_ps();
+            for (int k = 0; k < t.nTap; k += 4) {
+                acc[i] = _mm_add_ps(acc[i], _mm_mul_ps(_mm_loadu_ps(p + k), _mm_loadu_ps(pCoef + k)));
+            }
+        }
+        // Transpose the 4 accumulators while adding, so that lane i ends up with the sum of acc[i]
+        __m128 t0 = _mm_add_ps(_mm_unpacklo_ps(acc[0], acc[1]), _mm_unpackhi_ps(acc[0], acc[1]));
+        __m128 t1 = _mm_add_ps(_mm_unpacklo_ps(acc[2], acc[3]), _mm_unpackhi_ps(acc[2], acc[3]));
+        __m128 sum = _mm_add_ps(_mm_movelh_ps(t0, t1), _mm_movehl_ps(t1, t0));
+        if (nDstStride == 1) {
+            _mm_storeu_ps(pDst + x, sum);
+        } else {
+            float a[4];
+            _mm_storeu_ps(a, sum);
+            for (int i = 0; i < 4; i++) {
+                pDst[(x + i) * nDstStride] = a[i];
+            }
+        }
+    }
+    return x;
+}
+
+YUV_TARGET_SSE2 inline __m128i VerticalScaleSse2(const float *const *apRow, const float *pCoef, int nTap, int x, __m128 maxf) {
+    __m128 sum = _mm_setzero_ps();
+    for (int k = 0; k < nTap; k++) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(pCoef[k]), _mm_loadu_ps(apRow[k] + x)));
+    }
+    // Rounds to nearest even like lrintf() in the scalar kernel
+    return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(sum, _mm_setzero_ps()), maxf));
+}
+
+YUV_TARGET_SSE2 inline int VerticalScaleRowSse2(const float *const *apRow, const float *pCoef, int nTap, int n, float maxf, uint8_t *pDst) {
+    const __m128 vmax = _mm_set1_ps(maxf);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v = _mm_packs_epi32(VerticalScaleSse2(apRow, pCoef, nTap, x, vmax), VerticalScaleSse2(apRow, pCoef, nTap, x + 4, vmax));
+        _mm_storel_epi64((__m128i *)(pDst + x), _mm_packus_epi16(v, v));
+    }
+    return x;
+}
+
+YUV_TARGET_SSE2 inline int VerticalScaleRowSse2(const float *const *apRow, const float *pCoef, int nTap, int n, float maxf, uint16_t *pDst) {
+    const __m128 vmax = _mm_set1_ps(maxf);
+    // SSE2 has no unsigned 32 to 16-bit pack, so pack signed around 32768 and flip the top bit back
+    const __m128i bias32 = _mm_set1_epi32(32768), bias16 = _mm_set1_epi16((short)0x8000);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v0 = _mm_sub_epi32(VerticalScaleSse2(apRow, pCoef, nTap, x, vmax), bias32);
+        __m128i v1 = _mm_sub_epi32(VerticalScaleSse2(apRow, pCoef, nTap, x + 4, vmax), bias32);
+        _mm_storeu_si128((__m128i *)(pDst + x), _mm_xor_si128(_mm_packs_epi32(v0, v1), bias16));
+    }
+    return x;
+}
+
+/**
+*  8 outputs per step, accumulated tap by tap in one vector: each tap gathers the sample of every
+*  output and takes the weights from vCoefGroup (nGroup 8), so no horizontal reduction is needed
+*  and the taps are not padded. Returns the outputs done.
+*/
+YUV_TARGET_AVX2 inline int HorizontalScaleRowAvx2(const float *pSrc, const YuvScaleFilterTable &t, float *pDst, int nDstStride) {
+    int x = 0;
+    for (; x + 8 <= t.nDst; x += 8) {
+        __m256i start = _mm256_loadu_si256((const __m256i *)&t.vStart[x]);
+        const float *pCoef = &t.vCoefGroup[(size_t)x * t.nTap];
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < t.nTap; k++) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_i32gather_ps(pSrc + k, start, 4), _mm256_loadu_ps(pCoef + k * 8)));
+        }
+        if (nDstStride == 1) {
+            _mm256_storeu_ps(pDst + x, sum);
+        } else {
+            float a[8];
+            _mm256_storeu_ps(a, sum);
+            for (int i = 0; i < 8; i++) {
+                pDst[(x + i) * nDstStride] = a[i];
+            }
+        }
+    }
+    return x;
+}
+
+YUV_TARGET_AVX2 inline __m256i VerticalScaleAvx2(const float *const *apRow, const float *pCoef, int nTap, int x, __m256 maxf) {
+    __m256 sum = _mm256_setzero_ps();
+    for (int k = 0; k < nTap; k++) {
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(pCoef[k]), _mm256_loadu_ps(apRow[k] + x)));
+    }
+    // Rounds to nearest even like lrintf() in the scalar kernel
+    return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(sum, _mm256_setzero_ps()), maxf));
+}
+
+YUV_TARGET_AVX2 inline int VerticalScaleRowAvx2(const float *const *apRow, const float *pCoef, int nTap, int n, float maxf, uint8_t *pDst) {
+    const __m256 vmax = _mm256_set1_ps(maxf);
+    const __m256i gather = _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i v = VerticalScaleAvx2(apRow, pCoef, nTap, x, vmax);
+        v = _mm256_packus_epi32(v, v);
+        v = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(v, v), gather);
+        _mm_storel_epi64((__m128i *)(pDst + x), _mm256_castsi256_si128(v));
+    }
+    return x;
+}
+
+YUV_TARGET_AVX2 inline int VerticalScaleRowAvx2(const float *const *apRow, const float *pCoef, int nTap, int n, float maxf, uint16_t *pDst) {
+    const __m256 vmax = _mm256_set1_ps(maxf);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i v = VerticalScaleAvx2(apRow, pCoef, nTap, x, vmax);
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+        _mm_storeu_si128((__m128i *)(pDst + x), _mm256_castsi256_si128(v));
+    }
+    return x;
+}
+#endif
+
+#if defined(YUV_SIMD_NEON)
+inline float HorizontalSumNeon(float32x4_t v) {
+    float32x2_t s = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+
+/** One output per step, nTap (a multiple of 4) weights; returns the outputs done */
+inline int HorizontalScaleRowNeon(const float *pSrc, const YuvScaleFilterTable &t, float *pDst, int nDstStride) {
+    for (int x = 0; x < t.nDst; x++) {
+        const float *p = pSrc + t.vStart[x], *pCoef = &t.vCoef[(size_t)x * t.nTap];
+        float32x4_t acc = vdupq_n_f32(0.0f);
+        for (int k = 0; k < t.nTap; k += 4) {
+            acc = vaddq_f32(acc, vmulq_f32(vld1q_f32(p + k), vld1q_f32(pCoef + k)));
+        }
+        pDst[x * nDstStride] = HorizontalSumNeon(acc);
+    }
+    return t.nDst;
+}
+
+inline uint32x4_t VerticalScaleNeon(const float *const *apRow, const float *pCoef, int nTap, int x, float32x4_t maxf) {
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    for (int k = 0; k < nTap; k++) {
+        sum = vaddq_f32(sum, vmulq_n_f32(vld1q_f32(apRow[k] + x), pCoef[k]));
+    }
+    // Round half up instead of to even; differs from the scalar kernel only on exact ties
+    return vcvtq_u32_f32(vaddq_f32(vminq_f32(vmaxq_f32(sum, vdupq_n_f32(0.0f)), maxf), vdupq_n_f32(0.5f)));
+}
+
+inline int VerticalScaleRowNeon(const float *const *apRow, const float *pCoef, int nTap, int n, float maxf, uint8_t *pDst) {
+    const float32x4_t vmax = vdupq_n_f32(maxf);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        uint16x8_t v = vcombine_u16(vmovn_u32(VerticalScaleNeon(apRow, pCoef, nTap, x, vmax)), vmovn_u32(VerticalScaleNeon(apRow, pCoef, nTap, x + 4, vmax)));
+        vst1_u8(pDst + x, vmovn_u16(v));
+    }
+    return x;
+}
+
+inline int VerticalScaleRowNeon(const float *const *apRow, const float *pCoef, int nTap, int n, float maxf, uint16_t *pDst) {
+    const float32x4_t vmax = vdupq_n_f32(maxf);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        vst1q_u16(pDst + x, vcombine_u16(vmovn_u32(VerticalScaleNeon(apRow, pCoef, nTap, x, vmax)), vmovn_u32(VerticalScaleNeon(apRow, pCoef, nTap, x + 4, vmax))));
+    }
+    return x;
+}
+#endif
+
+/**
+* @brief Host counterpart of ResizeNv12/ResizeP016/ScaleYUV420 in Resize.cu, with a choice of
+* separable polyphase filter (bilinear, bicubic, Lanczos-3) instead of the fixed texture
+* bilinear filter. The functions take the same arguments as the CUDA versions, with host
+* pointers; pitches are in bytes.
+*
+* Each plane is scaled horizontally first, one source row at a time, into a small ring of
+* float rows, and each output row is then filtered vertically from that ring. Output rows are
+* split into bands over nThread threads; every band keeps its own ring. Filter tables are
+* built once per (source size, destination size) pair and reused, so a scaler producing a
+* fixed ladder stops allocating after the first frame. The object is not meant to be used
+* from several threads at once.
+*/
+class YuvScaler {
+public:
+    YuvScaler(YuvScaleFilter eFilter = YUV_SCALE_BILINEAR, int nThread = 1, YuvSimdLevel eLevel = GetYuvSimdLevel())
+        : eFilter(eFilter), eLevel(eLevel), runner(nThread) {
+#if defined(YUV_SIMD_X86)
+        nAlign = eLevel == YUV_SIMD_SSE2 ? 4 : 1;
+        nGroup = eLevel == YUV_SIMD_AVX2 ? 8 : 1;
+#elif defined(YUV_SIMD_NEON)
+        nAlign = eLevel == YUV_SIMD_NEON ? 4 : 1;
+#endif
+    }
+
+    void ResizeNv12(unsigned char *pDstNv12, int nDstPitch, int nDstWidth, int nDstHeight, unsigned char *pSrcNv12, int nSrcPitch,
+        int nSrcWidth, int nSrcHeight, unsigned char *pDstNv12UV = nullptr) {
+        Resize<uint8_t>(pDstNv12, nDstPitch, nDstWidth, nDstHeight, pSrcNv12, nSrcPitch, nSrcWidth, nSrcHeight, pDstNv12UV);
+    }
+
+    void ResizeP016(unsigned char *pDstP016, int nDstPitch, int nDstWidth, int nDstHeight, unsigned char *pSrcP016, int nSrcPitch,
+        int nSrcWidth, int nSrcHeight, unsigned char *pDstP016UV = nullptr) {
+        Resize<uint16_t>(pDstP016, nDstPitch, nDstWidth, nDstHeight, pSrcP016, nSrcPitch, nSrcWidth, nSrcHeight, pDstP016UV);
+    }
+
+    /** 8-bit 4:2:0 with separate U and V planes, or interleaved UV in pSrcU/pDstU when bSemiplanar */
+    void ScaleYUV420(unsigned char *pDstY, unsigned char *pDstU, unsigned char *pDstV, int nDstPitch, int nDstChromaPitch, int nDstWidth, int nDstHeight,
+        unsigned char *pSrcY, unsigned char *pSrcU, unsigned char *pSrcV, int nSrcPitch, int nSrcChromaPitch, int nSrcWidth, int nSrcHeight, bool bSemiplanar) {
+        int nDstChromaWidth = (nDstWidth + 1) / 2, nDstChromaHeight = (nDstHeight + 1) / 2;
+        int nSrcChromaWidth = (nSrcWidth + 1) / 2, nSrcChromaHeight = (nSrcHeight + 1) / 2;
+        ScalePlane<uint8_t>(pSrcY, nSrcPitch, nSrcWidth, nSrcHeight, pDstY, nDstPitch, nDstWidth, nDstHeight, 1);
+        if (bSemiplanar) {
+            ScalePlane<uint8_t>(pSrcU, nSrcChromaPitch, nSrcChromaWidth, nSrcChromaHeight, pDstU, nDstChromaPitch, nDstChromaWidth, nDstChromaHeight, 2);
+        } else {
+            ScalePlane<uint8_t>(pSrcU, nSrcChromaPitch, nSrcChromaWidth, nSrcChromaHeight, pDstU, nDstChromaPitch, nDstChromaWidth, nDstChromaHeight, 1);
+            ScalePlane<uint8_t>(pSrcV, nSrcChromaPitch, nSrcChromaWidth, nSrcChromaHeight, pDstV, nDstChromaPitch, nDstChromaWidth, nDstChromaHeight, 1);
+        }
+    }
+
+    /** Scales one plane of nChannel interleaved channels; pitches are in bytes */
+    template<typename T>
+    void ScalePlane(const unsigned char *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight, unsigned char *pDst, int nDstPitch,
+        int nDstWidth, int nDstHeight, int nChannel) {
+        if (nSrcWidth <= 0 || nSrcHeight <= 0 || nDstWidth <= 0 || nDstHeight <= 0) {
+            return;
+        }
+        NVTRACE_SCOPE_ARG("Scale plane", nDstWidth);
+        const YuvScaleFilterTable &th = GetTable(nSrcWidth, nDstWidth, nAlign, nGroup);
+        const YuvScaleFilterTable &tv = GetTable(nSrcHeight, nDstHeight, 1, 1);
+        const float maxf = (float)((1 << (sizeof(T) * 8)) - 1);
+        runner.Run(nDstHeight, [&](int iBegin, int iEnd) {
+            std::unique_ptr<Scratch> pScratch = AcquireScratch();
+            Scratch &s = *pScratch;
+            int nSrcPadded = nSrcWidth + th.nTap, nRow = nDstWidth * nChannel;
+            s.vSrc.assign((size_t)nSrcPadded * nChannel, 0.0f);
+            s.vRing.resize((size_t)tv.nTap * nRow);
+            s.vRingRow.assign(tv.nTap, -1);
+            s.vpRow.resize(tv.nTap);
+            for (int y = iBegin; y < iEnd; y++) {
+                for (int k = 0; k < tv.nTap; k++) {
+                    int iRow = tv.vStart[y] + k, iSlot = iRow % tv.nTap;
+                    if (s.vRingRow[iSlot] != iRow) {
+                        const T *pSrcRow = (const T *)(pSrc + (size_t)(std::min)(iRow, nSrcHeight - 1) * nSrcPitch);
+                        WidenRow(pSrcRow, nChannel, nSrcWidth, s.vSrc.data(), nSrcPadded);
+                        for (int c = 0; c < nChannel; c++) {
+                            HorizontalScaleRow(&s.vSrc[(size_t)c * nSrcPadded], th, &s.vRing[(size_t)iSlot * nRow + c], nChannel);
+                        }
+                        s.vRingRow[iSlot] = iRow;
+                    }
+                    s.vpRow[k] = &s.vRing[(size_t)iSlot * nRow];
+                }
+                VerticalScaleRow(s.vpRow.data(), &tv.vCoef[(size_t)y * tv.nTap], tv.nTap, nRow, maxf, (T *)(pDst + (size_t)y * nDstPitch));
+            }
+            ReleaseScratch(std::move(pScratch));
+        });
+    }
+
+private:
+    struct Scratch {
+        std::vector<float> vSrc, vRing;
+        std::vector<int> vRingRow;
+        std::vector<const float *> vpRow;
+    };
+
+    template<typename T>
+    void Resize(unsigned char *pDst, int nDstPitch, int nDstWidth, int nDstHeight, unsigned char *pSrc, int nSrcPitch,
+        int nSrcWidth, int nSrcHeight, unsigned char *pDstUV) {
+        ScalePlane<T>(pSrc, nSrcPitch, nSrcWidth, nSrcHeight, pDst, nDstPitch, nDstWidth, nDstHeight, 1);
+        ScalePlane<T>(pSrc + (size_t)nSrcPitch * nSrcHeight, nSrcPitch, nSrcWidth / 2, nSrcHeight / 2,
+            pDstUV ? pDstUV : pDst + (size_t)nDstPitch * nDstHeight, nDstPitch, nDstWidth / 2, nDstHeight / 2, 2);
+    }
+
+    const YuvScaleFilterTable &GetTable(int nSrc, int nDst, int nTableAlign, int nTableGroup) {
+        std::unique_ptr<YuvScaleFilterTable> &pTable = mTable[TableKey(nSrc, nDst, nTableAlign, nTableGroup)];
+        if (!pTable) {
+            pTable.reset(new YuvScaleFilterTable);
+            pTable->Build(nSrc, nDst, eFilter, nTableAlign, nTableGroup);
+        }
+        return *pTable;
+    }
+
+    static uint64_t TableKey(int nSrc, int nDst, int nTableAlign, int nTableGroup) {
+        return (uint64_t)nSrc << 40 | (uint64_t)nDst << 16 | (uint64_t)nTableGroup << 8 | (uint64_t)nTableAlign;
+    }
+
+    std::unique_ptr<Scratch> AcquireScratch() {
+        std::lock_guard<std::mutex> lock(mtxScratch);
+        if (vpScratch.empty()) {
+            return std::unique_ptr<Scratch>(new Scratch);
+        }
+        std::unique_ptr<Scratch> p = std::move(vpScratch.back());
+        vpScratch.pop_back();
+        return p;
+    }
+
+    void ReleaseScratch(std::unique_ptr<Scratch> p) {
+        std::lock_guard<std::mutex> lock(mtxScratch);
+        vpScratch.push_back(std::move(p));
+    }
+
+    template<typename T>
+    void WidenRow(const T *pSrc, int nChannel, int nWidth, float *pDst, int nDstPlane) const {
+        int x = 0;
+#if defined(YUV_SIMD_X86)
+        if (eLevel == YUV_SIMD_AVX2) {
+            x = WidenRowAvx2(pSrc, nChannel, nWidth, pDst, nDstPlane);
+        } else if (eLevel == YUV_SIMD_SSE2) {
+            x = WidenRowSse2(pSrc, nChannel, nWidth, pDst, nDstPlane);
+        }
+#endif
+        WidenRowScalar(pSrc, nChannel, x, nWidth, pDst, nDstPlane);
+    }
+
+    void HorizontalScaleRow(const float *pSrc, const YuvScaleFilterTable &t, float *pDst, int nDstStride) const {
+        int x = 0;
+#if defined(YUV_SIMD_X86)
+        if (eLevel == YUV_SIMD_AVX2) {
+            x = HorizontalScaleRowAvx2(pSrc, t, pDst, nDstStride);
+        } else if (eLevel == YUV_SIMD_SSE2) {
+            x = HorizontalScaleRowSse2(pSrc, t, pDst, nDstStride);
+        }
+#elif defined(YUV_SIMD_NEON)
+        if (eLevel == YUV_SIMD_NEON) {
+            x = HorizontalScaleRowNeon(pSrc, t, pDst, nDstStride);
+        }
+#endif
+        HorizontalScaleRowScalar(pSrc, t, x, pDst, nDstStride);
+    }
+
+    template<typename T>
+    void VerticalScaleRow(const float *const *apRow, const float *pCoef, int nTap, int n, float maxf, T *pDst) const {
+        int x = 0;
+#if defined(YUV_SIMD_X86)
+        if (eLevel == YUV_SIMD_AVX2) {
+            x = VerticalScaleRowAvx2(apRow, pCoef, nTap, n, maxf, pDst);
+        } else if (eLevel == YUV_SIMD_SSE2) {
+            x = VerticalScaleRowSse2(apRow, pCoef, nTap, n, maxf, pDst);
+        }
+#elif defined(YUV_SIMD_NEON)
+        if (eLevel == YUV_SIMD_NEON) {
+            x = VerticalScaleRowNeon(apRow, pCoef, nTap, n, maxf, pDst);
+        }
+#endif
+        VerticalScaleRowScalar(apRow, pCoef, nTap, x, n, maxf, pDst);
+    }
+
+    YuvScaleFilter eFilter;
+    YuvSimdLevel eLevel;
+    int nAlign = 1, nGroup = 1;
+    YuvBandRunner runner;
+    std::map<uint64_t, std::unique_ptr<YuvScaleFilterTable>> mTable;
+    std::mutex mtxScratch;
+    std::vector<std::unique_ptr<Scratch>> vpScratch;
+};